@@ -411,7 +411,14 @@ static int do_kvm_destroy_vcpu(CPUState *cpu)
     }
 
     if (cpu->kvm_dirty_gfns) {
-        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_size);
+        void *dirty_gfns = cpu->kvm_dirty_gfns;
+
+        /* The ring can be reaped without the BQL, see kvm_dirty_ring_reap() */
+        kvm_slots_lock();
+        qatomic_set(&cpu->kvm_dirty_gfns, NULL);
+        kvm_slots_unlock();
+
+        ret = munmap(dirty_gfns, s->kvm_dirty_ring_bytes);
         if (ret < 0) {
             goto err;
         }
@@ -494,16 +501,20 @@ int kvm_init_vcpu(CPUState *cpu, Error **errp)
     }
 
     if (s->kvm_dirty_ring_size) {
+        void *dirty_gfns;
+
         /* Use MAP_SHARED to share pages with the kernel */
-        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_size,
-                                   PROT_READ | PROT_WRITE, MAP_SHARED,
-                                   cpu->kvm_fd,
-                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
-        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+        dirty_gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                          PROT_READ | PROT_WRITE, MAP_SHARED,
+                          cpu->kvm_fd,
+                          PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (dirty_gfns == MAP_FAILED) {
             ret = -errno;
             DPRINTF("mmap'ing vcpu dirty gfns failed: %d\n", ret);
             goto err;
         }
+        /* Only publish the ring to the reapers once it is usable */
+        qatomic_set(&cpu->kvm_dirty_gfns, dirty_gfns);
     }
 
     ret = kvm_arch_init_vcpu(cpu);
@@ -627,6 +638,7 @@ static void kvm_slot_sync_dirty_pages(KVMSlot *slot)
 static void kvm_slot_reset_dirty_pages(KVMSlot *slot)
 {
     memset(slot->dirty_bmap, 0, slot->dirty_bmap_size);
+    slot->dirty_ring_pages = 0;
 }
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
@@ -705,16 +717,19 @@ static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
     }
 
     set_bit(offset, mem->dirty_bmap);
+    mem->dirty_ring_pages++;
 }
 
 static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
 {
-    return gfn->flags == KVM_DIRTY_GFN_F_DIRTY;
+    /* Pairs with the kernel publishing slot/offset before the flags */
+    return qatomic_load_acquire(&gfn->flags) == KVM_DIRTY_GFN_F_DIRTY;
 }
 
 static void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
 {
-    gfn->flags = KVM_DIRTY_GFN_F_RESET;
+    /* We must be done with slot/offset before the kernel reuses the entry */
+    qatomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
 }
 
 /*
@@ -723,11 +738,21 @@ static void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
  */
 static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
 {
-    struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
+    struct kvm_dirty_gfn *dirty_gfns = qatomic_read(&cpu->kvm_dirty_gfns);
+    struct kvm_dirty_gfn *cur;
     uint32_t ring_size = s->kvm_dirty_ring_size;
     uint32_t count = 0, fetch = cpu->kvm_fetch_index;
 
-    assert(dirty_gfns && ring_size);
+    assert(ring_size);
+    if (!dirty_gfns) {
+        /* vcpu not created yet, or already destroyed */
+        return 0;
+    }
+
+    /* Most rings are empty, don't bother tracing those */
+    if (!dirty_gfn_is_dirtied(&dirty_gfns[fetch % ring_size])) {
+        return 0;
+    }
     trace_kvm_dirty_ring_reap_vcpu(cpu->cpu_index);
 
     while (true) {
@@ -743,22 +768,32 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
         count++;
     }
     cpu->kvm_fetch_index = fetch;
+    /* Only written with slots_lock held, read by the dirty limit */
+    qatomic_set_u64(&cpu->dirty_pages, cpu->dirty_pages + count);
 
     return count;
 }
 
-/* Must be with slots_lock held */
-static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
+/*
+ * Must be with slots_lock held.  Reaps the ring of @cpu, or the rings
+ * of all the vcpus if @cpu is NULL.
+ */
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState *cpu)
 {
     int ret;
-    CPUState *cpu;
     uint64_t total = 0;
     int64_t stamp;
 
     stamp = get_clock();
 
-    CPU_FOREACH(cpu) {
-        total += kvm_dirty_ring_reap_one(s, cpu);
+    if (cpu) {
+        total = kvm_dirty_ring_reap_one(s, cpu);
+    } else {
+        WITH_RCU_READ_LOCK_GUARD() {
+            CPU_FOREACH(cpu) {
+                total += kvm_dirty_ring_reap_one(s, cpu);
+            }
+        }
     }
 
     if (total) {
@@ -776,10 +811,16 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
 }
 
 /*
- * Currently for simplicity, we must hold BQL before calling this.  We can
- * consider to drop the BQL if we're clear with all the race conditions.
+ * Reap the ring of @cpu, or of all the vcpus if @cpu is NULL.
+ *
+ * This does not need the BQL: the rings are only ever reaped with
+ * slots_lock held, which also keeps the count returned by
+ * KVM_RESET_DIRTY_RINGS consistent with what we collected, and
+ * vcpus publish/unpublish their ring with kvm_dirty_gfns.  A vcpu
+ * whose ring is full can thus reap it from its own thread while the
+ * other vcpus keep running.
  */
-static uint64_t kvm_dirty_ring_reap(KVMState *s)
+static uint64_t kvm_dirty_ring_reap(KVMState *s, CPUState *cpu)
 {
     uint64_t total;
 
@@ -799,54 +840,28 @@ static uint64_t kvm_dirty_ring_reap(KVMState *s)
      *     reset below.
      */
     kvm_slots_lock();
-    total = kvm_dirty_ring_reap_locked(s);
+    total = kvm_dirty_ring_reap_locked(s, cpu);
     kvm_slots_unlock();
 
     return total;
 }
 
-static void do_kvm_cpu_synchronize_kick(CPUState *cpu, run_on_cpu_data arg)
-{
-    /* No need to do anything */
-}
-
 /*
- * Kick all vcpus out in a synchronized way.  When returned, we
- * guarantee that every vcpu has been kicked and at least returned to
- * userspace once.
- */
-static void kvm_cpu_synchronize_kick_all(void)
-{
-    CPUState *cpu;
-
-    CPU_FOREACH(cpu) {
-        run_on_cpu(cpu, do_kvm_cpu_synchronize_kick, RUN_ON_CPU_NULL);
-    }
-}
-
-/*
- * Flush all the existing dirty pages to the KVM slot buffers.  When
- * this call returns, we guarantee that all the touched dirty pages
- * before calling this function have been put into the per-kvmslot
- * dirty bitmap.
+ * Flush the dirty pages found in the rings to the KVM slot buffers.
  *
- * This function must be called with BQL held.
+ * The vcpus are not kicked: dirty GFNs still sitting in the hardware
+ * buffers (PML) of a running vcpu only reach its ring on the next
+ * exit, so they will be collected by a later flush.  That is fine for
+ * the iterative syncs of migration.  The syncs that must see every
+ * dirty page, like the one that completes migration, happen with the
+ * vcpus stopped, and a vcpu always flushes its hardware buffers when
+ * it leaves KVM_RUN.  This avoids a stop-the-world round trip to every
+ * vcpu on each sync, which is what made syncs expensive on big guests.
  */
 static void kvm_dirty_ring_flush(void)
 {
     trace_kvm_dirty_ring_flush(0);
-    /*
-     * The function needs to be serialized.  Since this function
-     * should always be with BQL held, serialization is guaranteed.
-     * However, let's be sure of it.
-     */
-    assert(qemu_mutex_iothread_locked());
-    /*
-     * First make sure to flush the hardware buffers by kicking all
-     * vcpus out in a synchronous way.
-     */
-    kvm_cpu_synchronize_kick_all();
-    kvm_dirty_ring_reap(kvm_state);
+    kvm_dirty_ring_reap(kvm_state, NULL);
     trace_kvm_dirty_ring_flush(1);
 }
 
@@ -1389,7 +1404,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                  * Not easy.  Let's cross the fingers until it's fixed.
                  */
                 if (kvm_state->kvm_dirty_ring_size) {
-                    kvm_dirty_ring_reap_locked(kvm_state);
+                    kvm_dirty_ring_reap_locked(kvm_state, NULL);
                 } else {
                     kvm_slot_get_dirty_log(kvm_state, mem);
                 }
@@ -1399,6 +1414,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             /* unregister the slot */
             g_free(mem->dirty_bmap);
             mem->dirty_bmap = NULL;
+            mem->dirty_ring_pages = 0;
             mem->memory_size = 0;
             mem->flags = 0;
             err = kvm_set_user_memory_region(kml, mem, false);
@@ -1460,9 +1476,7 @@ static void *kvm_dirty_ring_reaper_thread(void *data)
         trace_kvm_dirty_ring_reaper("wakeup");
         r->reaper_state = KVM_DIRTY_RING_REAPER_REAPING;
 
-        qemu_mutex_lock_iothread();
-        kvm_dirty_ring_reap(s);
-        qemu_mutex_unlock_iothread();
+        kvm_dirty_ring_reap(s, NULL);
 
         r->reaper_iteration++;
     }
@@ -1530,7 +1544,13 @@ static void kvm_log_sync_global(MemoryListener *l)
     kvm_slots_lock();
     for (i = 0; i < s->nr_slots; i++) {
         mem = &kml->slots[i];
-        if (mem->memory_size && mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
+        /*
+         * Slots that got nothing from the rings have an empty bitmap,
+         * skip them so that the cost follows the dirty rate rather
+         * than the guest size.
+         */
+        if (mem->memory_size && mem->flags & KVM_MEM_LOG_DIRTY_PAGES &&
+            mem->dirty_ring_pages) {
             kvm_slot_sync_dirty_pages(mem);
             /*
              * This is not needed by KVM_GET_DIRTY_LOG because the
@@ -2914,9 +2934,7 @@ int kvm_cpu_exec(CPUState *cpu)
              * still full.  Got kicked by KVM_RESET_DIRTY_RINGS.
              */
             trace_kvm_dirty_ring_full(cpu->cpu_index);
-            qemu_mutex_lock_iothread();
-            kvm_dirty_ring_reap(kvm_state);
-            qemu_mutex_unlock_iothread();
+            kvm_dirty_ring_reap(kvm_state, cpu);
             ret = 0;
             break;
         case KVM_EXIT_SYSTEM_EVENT:
@@ -3089,6 +3107,11 @@ bool kvm_has_sync_mmu(void)
     return kvm_state->sync_mmu;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state->kvm_dirty_ring_size ? true : false;
+}
+
 int kvm_has_vcpu_events(void)
 {
     return kvm_state->vcpu_events;
@@ -393,6 +393,7 @@ BlockDriverState *bdrv_new(void)
     }
     qemu_co_mutex_init(&bs->reqs_lock);
     qemu_mutex_init(&bs->dirty_bitmap_mutex);
+    qemu_mutex_init(&bs->write_threshold_lock);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -6331,6 +6332,28 @@ bool bdrv_is_inserted(BlockDriverState *bs)
     return true;
 }
 
+/*
+ * Return true if requests for @bs may be submitted concurrently from
+ * several AioContexts, i.e. if @bs and all nodes below it have drivers
+ * that declare supports_multiqueue.  Walks the node graph, so it must be
+ * called with the BQL held.
+ */
+bool bdrv_supports_multiqueue(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvChild *child;
+
+    if (!drv || !drv->supports_multiqueue) {
+        return false;
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (!bdrv_supports_multiqueue(child->bs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /**
  * If eject_flag is TRUE, eject the media. Otherwise, close the tray
  */
@@ -550,6 +550,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->perf = *perf;
 
     block_copy_set_progress_meter(bcs, &job->common.job.progress);
+    block_copy_set_copy_stats(bcs, &job->common.job.copy_stats);
+    job->common.job.has_copy_stats = true;
     block_copy_set_speed(bcs, speed);
 
     /* Required permissions are already taken by backup-top target */
@@ -81,10 +81,26 @@ struct BlockBackend {
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
     QLIST_HEAD(, BlockBackendAioNotifier) aio_notifiers;
 
+    /* Accessed with atomic ops.  */
     int quiesce_counter;
+    /* Protected by queued_requests_lock.  */
+    QemuMutex queued_requests_lock;
     CoQueue queued_requests;
     bool disable_request_queuing;
 
+    /*
+     * If true, AIO requests run in the AioContext of the submitting thread
+     * rather than in blk->ctx, provided the node graph supports it (see
+     * blk_request_aio_context()).
+     */
+    bool multiqueue;
+    /*
+     * Whether multiqueue requests can currently be used.  Computed with the
+     * BQL held by blk_update_multiqueue() when the root node, the node graph
+     * or throttling change, and read with atomics by the request path.
+     */
+    bool multiqueue_active;
+
     VMChangeStateEntry *vmsh;
     bool force_allow_inactivate;
 
@@ -109,6 +125,7 @@ static const AIOCBInfo block_backend_aiocb_info = {
 
 static void drive_info_del(DriveInfo *dinfo);
 static BlockBackend *bdrv_first_blk(BlockDriverState *bs);
+static void blk_update_multiqueue(BlockBackend *blk);
 
 /* All BlockBackends */
 static QTAILQ_HEAD(, BlockBackend) block_backends =
@@ -279,6 +296,7 @@ static void blk_root_attach(BdrvChild *child)
                 notifier->detach_aio_context,
                 notifier->opaque);
     }
+    blk_update_multiqueue(blk);
 }
 
 static void blk_root_detach(BdrvChild *child)
@@ -288,6 +306,7 @@ static void blk_root_detach(BdrvChild *child)
 
     trace_blk_root_detach(child, blk, child->bs);
 
+    qatomic_set(&blk->multiqueue_active, false);
     QLIST_FOREACH(notifier, &blk->aio_notifiers, list) {
         bdrv_remove_aio_context_notifier(child->bs,
                 notifier->attached_aio_context,
@@ -354,6 +373,7 @@ BlockBackend *blk_new(AioContext *ctx, uint64_t perm, uint64_t shared_perm)
 
     block_acct_init(&blk->stats);
 
+    qemu_mutex_init(&blk->queued_requests_lock);
     qemu_co_queue_init(&blk->queued_requests);
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
@@ -470,6 +490,7 @@ static void blk_delete(BlockBackend *blk)
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
     block_acct_cleanup(&blk->stats);
+    qemu_mutex_destroy(&blk->queued_requests_lock);
     g_free(blk);
 }
 
@@ -1152,6 +1173,51 @@ void blk_set_disable_request_queuing(BlockBackend *blk, bool disable)
     blk->disable_request_queuing = disable;
 }
 
+/*
+ * Allow AIO requests to be submitted from any thread that runs an
+ * AioContext.  Requests are then processed and completed in the AioContext
+ * of the submitting thread instead of the BlockBackend's AioContext, as
+ * long as all nodes below @blk support it and I/O throttling is disabled.
+ */
+void blk_set_multiqueue(BlockBackend *blk, bool enable)
+{
+    blk->multiqueue = enable;
+    blk_update_multiqueue(blk);
+}
+
+/*
+ * Recompute blk->multiqueue_active.  Must be called with the BQL held
+ * whenever one of its inputs may have changed.  Graph changes below the
+ * root node are made in drained sections, so blk_root_drained_end()
+ * catches them before queued requests are resumed.
+ */
+static void blk_update_multiqueue(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    qatomic_set(&blk->multiqueue_active,
+                blk->multiqueue && bs &&
+                !blk->public.throttle_group_member.throttle_state &&
+                bdrv_supports_multiqueue(bs));
+}
+
+/*
+ * Return the AioContext in which a request submitted from the current
+ * thread should run.
+ */
+static AioContext *blk_request_aio_context(BlockBackend *blk)
+{
+    AioContext *ctx;
+
+    if (qatomic_read(&blk->multiqueue_active)) {
+        ctx = qemu_get_current_aio_context();
+        if (ctx) {
+            return ctx;
+        }
+    }
+    return blk_get_aio_context(blk);
+}
+
 static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
                                   size_t size)
 {
@@ -1183,16 +1249,33 @@ static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
     return 0;
 }
 
-/* To be called between exactly one pair of blk_inc/dec_in_flight() */
-static void coroutine_fn blk_wait_while_drained(BlockBackend *blk)
+/*
+ * To be called between exactly one pair of blk_inc/dec_in_flight().
+ * Returns true if the request had to wait for a drained section to end.
+ */
+static bool coroutine_fn blk_wait_while_drained(BlockBackend *blk)
 {
+    bool waited = false;
+
     assert(blk->in_flight > 0);
 
-    if (blk->quiesce_counter && !blk->disable_request_queuing) {
-        blk_dec_in_flight(blk);
-        qemu_co_queue_wait(&blk->queued_requests, NULL);
-        blk_inc_in_flight(blk);
+    /*
+     * blk_inc_in_flight() is a full barrier and orders the increment before
+     * this read, pairing with blk_root_drained_begin(): either the drain
+     * sees our request in flight, or we see the quiesce counter.
+     */
+    if (qatomic_read(&blk->quiesce_counter) && !blk->disable_request_queuing) {
+        qemu_mutex_lock(&blk->queued_requests_lock);
+        while (qatomic_read(&blk->quiesce_counter)) {
+            blk_dec_in_flight(blk);
+            qemu_co_queue_wait(&blk->queued_requests,
+                               &blk->queued_requests_lock);
+            blk_inc_in_flight(blk);
+            waited = true;
+        }
+        qemu_mutex_unlock(&blk->queued_requests_lock);
     }
+    return waited;
 }
 
 /* To be called between exactly one pair of blk_inc/dec_in_flight() */
@@ -1404,15 +1487,18 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
 typedef struct BlkAioEmAIOCB {
     BlockAIOCB common;
     BlkRwCo rwco;
+    AioContext *ctx;
     int bytes;
     bool has_returned;
+    /* the request runs in the BlockBackend's AioContext instead of ctx */
+    bool moved;
 } BlkAioEmAIOCB;
 
 static AioContext *blk_aio_em_aiocb_get_aio_context(BlockAIOCB *acb_)
 {
     BlkAioEmAIOCB *acb = container_of(acb_, BlkAioEmAIOCB, common);
 
-    return blk_get_aio_context(acb->rwco.blk);
+    return acb->ctx;
 }
 
 static const AIOCBInfo blk_aio_em_aiocb_info = {
@@ -1436,6 +1522,35 @@ static void blk_aio_complete_bh(void *opaque)
     blk_aio_complete(acb);
 }
 
+/*
+ * Multiqueue requests choose their AioContext on submission.  If the node
+ * graph changed while the request waited for a drained section to end and
+ * no longer supports multiqueue, move the request to the BlockBackend's
+ * AioContext.  The request has yielded, so blk_aio_prwv() has returned.
+ */
+static void coroutine_fn blk_aio_wait_while_drained(BlkAioEmAIOCB *acb)
+{
+    BlockBackend *blk = acb->rwco.blk;
+    AioContext *blk_ctx;
+
+    if (blk_wait_while_drained(blk)) {
+        blk_ctx = blk_get_aio_context(blk);
+        if (acb->ctx != blk_ctx && !qatomic_read(&blk->multiqueue_active)) {
+            acb->moved = true;
+            aio_co_reschedule_self(blk_ctx);
+        }
+    }
+}
+
+/* Complete a request in the AioContext it was submitted from */
+static void coroutine_fn blk_aio_co_complete(BlkAioEmAIOCB *acb)
+{
+    if (acb->moved) {
+        aio_co_reschedule_self(acb->ctx);
+    }
+    blk_aio_complete(acb);
+}
+
 static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
                                 void *iobuf, CoroutineEntry co_entry,
                                 BdrvRequestFlags flags,
@@ -1453,16 +1568,17 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
         .flags  = flags,
         .ret    = NOT_DONE,
     };
+    acb->ctx = blk_request_aio_context(blk);
     acb->bytes = bytes;
     acb->has_returned = false;
+    acb->moved = false;
 
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    aio_co_enter(acb->ctx, co);
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        replay_bh_schedule_oneshot_event(blk_get_aio_context(blk),
-                                         blk_aio_complete_bh, acb);
+        replay_bh_schedule_oneshot_event(acb->ctx, blk_aio_complete_bh, acb);
     }
 
     return &acb->common;
@@ -1475,9 +1591,10 @@ static void blk_aio_read_entry(void *opaque)
     QEMUIOVector *qiov = rwco->iobuf;
 
     assert(qiov->size == acb->bytes);
+    blk_aio_wait_while_drained(acb);
     rwco->ret = blk_do_preadv(rwco->blk, rwco->offset, acb->bytes,
                               qiov, rwco->flags);
-    blk_aio_complete(acb);
+    blk_aio_co_complete(acb);
 }
 
 static void blk_aio_write_entry(void *opaque)
@@ -1487,9 +1604,10 @@ static void blk_aio_write_entry(void *opaque)
     QEMUIOVector *qiov = rwco->iobuf;
 
     assert(!qiov || qiov->size == acb->bytes);
+    blk_aio_wait_while_drained(acb);
     rwco->ret = blk_do_pwritev_part(rwco->blk, rwco->offset, acb->bytes,
                                     qiov, 0, rwco->flags);
-    blk_aio_complete(acb);
+    blk_aio_co_complete(acb);
 }
 
 BlockAIOCB *blk_aio_pwrite_zeroes(BlockBackend *blk, int64_t offset,
@@ -1605,9 +1723,10 @@ static void blk_aio_ioctl_entry(void *opaque)
     BlkAioEmAIOCB *acb = opaque;
     BlkRwCo *rwco = &acb->rwco;
 
+    blk_aio_wait_while_drained(acb);
     rwco->ret = blk_do_ioctl(rwco->blk, rwco->offset, rwco->iobuf);
 
-    blk_aio_complete(acb);
+    blk_aio_co_complete(acb);
 }
 
 BlockAIOCB *blk_aio_ioctl(BlockBackend *blk, unsigned long int req, void *buf,
@@ -1637,8 +1756,9 @@ static void blk_aio_pdiscard_entry(void *opaque)
     BlkAioEmAIOCB *acb = opaque;
     BlkRwCo *rwco = &acb->rwco;
 
+    blk_aio_wait_while_drained(acb);
     rwco->ret = blk_do_pdiscard(rwco->blk, rwco->offset, acb->bytes);
-    blk_aio_complete(acb);
+    blk_aio_co_complete(acb);
 }
 
 BlockAIOCB *blk_aio_pdiscard(BlockBackend *blk,
@@ -1691,8 +1811,9 @@ static void blk_aio_flush_entry(void *opaque)
     BlkAioEmAIOCB *acb = opaque;
     BlkRwCo *rwco = &acb->rwco;
 
+    blk_aio_wait_while_drained(acb);
     rwco->ret = blk_do_flush(rwco->blk);
-    blk_aio_complete(acb);
+    blk_aio_co_complete(acb);
 }
 
 BlockAIOCB *blk_aio_flush(BlockBackend *blk,
@@ -2157,11 +2278,16 @@ void blk_add_insert_bs_notifier(BlockBackend *blk, Notifier *notify)
     notifier_list_add(&blk->insert_bs_notifiers, notify);
 }
 
+/*
+ * Plugging state is per node and refers to the queues of the node's own
+ * AioContext, so it is only used for requests submitted from there.
+ * Multiqueue requests from other threads are submitted unplugged.
+ */
 void blk_io_plug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
-    if (bs) {
+    if (bs && blk_request_aio_context(blk) == blk_get_aio_context(blk)) {
         bdrv_io_plug(bs);
     }
 }
@@ -2170,7 +2296,7 @@ void blk_io_unplug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
-    if (bs) {
+    if (bs && blk_request_aio_context(blk) == blk_get_aio_context(blk)) {
         bdrv_io_unplug(bs);
     }
 }
@@ -2336,6 +2462,7 @@ void blk_io_limits_disable(BlockBackend *blk)
     if (bs) {
         bdrv_drained_end(bs);
     }
+    blk_update_multiqueue(blk);
 }
 
 /* should be called before blk_set_io_limits if a limit is set */
@@ -2344,6 +2471,7 @@ void blk_io_limits_enable(BlockBackend *blk, const char *group)
     assert(!blk->public.throttle_group_member.throttle_state);
     throttle_group_register_tgm(&blk->public.throttle_group_member,
                                 group, blk_get_aio_context(blk));
+    blk_update_multiqueue(blk);
 }
 
 void blk_io_limits_update_group(BlockBackend *blk, const char *group)
@@ -2369,7 +2497,7 @@ static void blk_root_drained_begin(BdrvChild *child)
     BlockBackend *blk = child->opaque;
     ThrottleGroupMember *tgm = &blk->public.throttle_group_member;
 
-    if (++blk->quiesce_counter == 1) {
+    if (qatomic_fetch_inc(&blk->quiesce_counter) == 0) {
         if (blk->dev_ops && blk->dev_ops->drained_begin) {
             blk->dev_ops->drained_begin(blk->dev_opaque);
         }
@@ -2403,13 +2531,21 @@ static void blk_root_drained_end(BdrvChild *child, int *drained_end_counter)
     assert(blk->public.throttle_group_member.io_limits_disabled);
     qatomic_dec(&blk->public.throttle_group_member.io_limits_disabled);
 
-    if (--blk->quiesce_counter == 0) {
+    /* Update before new requests can skip blk_wait_while_drained() */
+    if (qatomic_read(&blk->quiesce_counter) == 1 &&
+        qemu_mutex_iothread_locked()) {
+        blk_update_multiqueue(blk);
+    }
+    if (qatomic_fetch_dec(&blk->quiesce_counter) == 1) {
         if (blk->dev_ops && blk->dev_ops->drained_end) {
             blk->dev_ops->drained_end(blk->dev_opaque);
         }
-        while (qemu_co_enter_next(&blk->queued_requests, NULL)) {
+        qemu_mutex_lock(&blk->queued_requests_lock);
+        while (qemu_co_enter_next(&blk->queued_requests,
+                                  &blk->queued_requests_lock)) {
             /* Resume all queued requests */
         }
+        qemu_mutex_unlock(&blk->queued_requests_lock);
     }
 }
 
@@ -2442,6 +2578,25 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+/*
+ * Like blk_co_copy_range(), but copies from a child of a node instead of a
+ * BlockBackend, for block jobs that read from an intermediate node.
+ */
+int coroutine_fn blk_co_copy_range_from_child(BdrvChild *src, int64_t off_in,
+                                              BlockBackend *blk_out,
+                                              int64_t off_out, int bytes,
+                                              BdrvRequestFlags read_flags,
+                                              BdrvRequestFlags write_flags)
+{
+    int r;
+    r = blk_check_byte_request(blk_out, off_out, bytes);
+    if (r) {
+        return r;
+    }
+    return bdrv_co_copy_range(src, off_in, blk_out->root, off_out,
+                              bytes, read_flags, write_flags);
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     return blk->root;
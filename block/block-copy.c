@@ -23,6 +23,7 @@
 #include "block/aio_task.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
+#define BLOCK_COPY_MAX_COPY_RANGE_FAILURES 16
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
@@ -87,6 +88,13 @@ typedef struct BlockCopyState {
     int64_t in_flight_bytes;
     int64_t cluster_size;
     bool use_copy_range;
+    /*
+     * Once copy_range has worked, a failure only makes block-copy fall back
+     * to read+write for that chunk (e.g. one with compressed qcow2 clusters),
+     * unless copy_range fails too many times in a row.
+     */
+    bool copy_range_works;
+    int copy_range_failures;
     int64_t copy_size;
     uint64_t len;
     QLIST_HEAD(, BlockCopyTask) tasks; /* All tasks from all block-copy calls */
@@ -111,6 +119,7 @@ typedef struct BlockCopyState {
     bool skip_unallocated;
 
     ProgressMeter *progress;
+    JobCopyStats *copy_stats;
 
     SharedResource *mem;
 
@@ -304,6 +313,11 @@ void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm)
     s->progress = pm;
 }
 
+void block_copy_set_copy_stats(BlockCopyState *s, JobCopyStats *stats)
+{
+    s->copy_stats = stats;
+}
+
 /*
  * Takes ownership of @task
  *
@@ -438,11 +452,16 @@ static void block_copy_handle_copy_range_result(BlockCopyState *s,
          * does not respect max_transfer (it's a TODO), so we factor
          * that in here.
          */
+        s->copy_range_works = true;
+        s->copy_range_failures = 0;
         s->copy_size =
                 MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_COPY_RANGE),
                     QEMU_ALIGN_DOWN(block_copy_max_transfer(s->source,
                                                             s->target),
                                     s->cluster_size));
+    } else if (s->copy_range_works &&
+               ++s->copy_range_failures < BLOCK_COPY_MAX_COPY_RANGE_FAILURES) {
+        /* Only this chunk had to be copied through a buffer */
     } else {
         /* Copy-range failed, disable it. */
         s->use_copy_range = false;
@@ -469,6 +488,13 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
         }
     } else {
         progress_work_done(t->s->progress, t->bytes);
+        if (t->s->copy_stats && !t->zeroes) {
+            if (copy_range) {
+                t->s->copy_stats->offloaded += t->bytes;
+            } else {
+                t->s->copy_stats->bounced += t->bytes;
+            }
+        }
     }
     co_put_to_shres(t->s->mem, t->bytes);
     block_copy_task_end(t, ret);
@@ -160,6 +160,7 @@ typedef struct BDRVRawState {
     bool use_linux_io_uring:1;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
+    bool has_clone_range;
     bool needs_alignment;
     bool drop_cache;
     bool check_cache_dropped;
@@ -724,6 +725,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         } else {
             s->discard_zeroes = true;
             s->has_fallocate = true;
+            s->has_clone_range = true;
         }
     } else {
         if (!(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode))) {
@@ -1731,6 +1733,44 @@ static int handle_aiocb_copy_range(void *opaque)
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
 
+#ifdef FICLONERANGE
+    BDRVRawState *s = aiocb->bs->opaque;
+
+    /*
+     * Try to share the extents first, this makes the copy a metadata-only
+     * operation on file systems with reflink support.
+     */
+    if (s->has_clone_range) {
+        struct file_clone_range range = {
+            .src_fd = aiocb->aio_fildes,
+            .src_offset = in_off,
+            .src_length = bytes,
+            .dest_offset = out_off,
+        };
+        int ret = ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range);
+
+        trace_file_clone_range(aiocb->bs, aiocb->aio_fildes, in_off,
+                               aiocb->copy_range.aio_fd2, out_off, bytes,
+                               ret < 0 ? -errno : 0);
+        if (ret == 0) {
+            return 0;
+        }
+        switch (errno) {
+        case EOPNOTSUPP:
+        case ENOTTY:
+        case EXDEV:
+            s->has_clone_range = false;
+            break;
+        default:
+            /*
+             * E.g. EINVAL if the range is not aligned to the file system
+             * block size; copy_file_range() can still handle it.
+             */
+            break;
+        }
+    }
+#endif
+
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
                                       aiocb->copy_range.aio_fd2, &out_off,
@@ -1965,19 +2005,46 @@ out:
     return result;
 }
 
+/*
+ * Requests normally run in the node's AioContext, but those of multiqueue
+ * BlockBackends can be submitted from any thread.  Always use the thread
+ * pool and Linux AIO/io_uring instances of the AioContext the request is
+ * running in, so that completions come back to the submitting thread.
+ */
 static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
                                                ThreadPoolFunc func, void *arg)
 {
-    /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_current_aio_context());
     return thread_pool_submit_co(pool, func, arg);
 }
 
+#ifdef CONFIG_LINUX_AIO
+/* Returns NULL if Linux AIO cannot be set up in the current AioContext */
+static LinuxAioState *raw_get_linux_aio(void)
+{
+    return aio_setup_linux_aio(qemu_get_current_aio_context(), NULL);
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+/* Returns NULL if io_uring cannot be set up in the current AioContext */
+static LuringState *raw_get_linux_io_uring(void)
+{
+    return aio_setup_linux_io_uring(qemu_get_current_aio_context(), NULL);
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *ring;
+#endif
+#ifdef CONFIG_LINUX_AIO
+    LinuxAioState *aio;
+#endif
 
     if (fd_open(bs) < 0)
         return -EIO;
@@ -1991,14 +2058,12 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
     if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
-    } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    } else if (s->use_linux_io_uring && (ring = raw_get_linux_io_uring())) {
         assert(qiov->size == bytes);
-        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        return luring_co_submit(bs, ring, s->fd, offset, qiov, type);
 #endif
 #ifdef CONFIG_LINUX_AIO
-    } else if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+    } else if (s->use_linux_aio && (aio = raw_get_linux_aio())) {
         assert(qiov->size == bytes);
         return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
@@ -2088,8 +2153,10 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        LuringState *ring = raw_get_linux_io_uring();
+        if (ring) {
+            return luring_co_submit(bs, ring, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        }
     }
 #endif
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
@@ -2126,6 +2193,9 @@ static void raw_close(BlockDriverState *bs)
     BDRVRawState *s = bs->opaque;
 
     if (s->fd >= 0) {
+#ifdef CONFIG_LINUX_IO_URING
+        luring_unregister_fd(s->fd);
+#endif
         qemu_close(s->fd);
         s->fd = -1;
     }
@@ -3119,6 +3189,9 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        luring_unregister_fd(s->fd);
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3196,6 +3269,7 @@ BlockDriver bdrv_file = {
     .protocol_name = "file",
     .instance_size = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe = NULL, /* no probe for protocols */
     .bdrv_parse_filename = raw_parse_filename,
     .bdrv_file_open = raw_open,
@@ -3572,6 +3646,7 @@ static BlockDriver bdrv_host_device = {
     .protocol_name        = "host_device",
     .instance_size      = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_parse_filename = hdev_parse_filename,
     .bdrv_file_open     = hdev_open,
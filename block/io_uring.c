@@ -16,12 +16,30 @@
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/units.h"
+#include "exec/ramlist.h"
 #include "qapi/error.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the sparse table of registered files of each ring */
+#define MAX_FIXED_FILES 64
+
+/* The kernel refuses to register buffers larger than 1 GiB */
+#define MAX_FIXED_BUF_SIZE (1 * GiB)
+
+/* Not all liburing versions define these */
+#ifndef IORING_SETUP_ATTACH_WQ
+#define IORING_SETUP_ATTACH_WQ (1U << 5)
+#endif
+#ifndef IORING_FEAT_SQPOLL_NONFIXED
+#define IORING_FEAT_SQPOLL_NONFIXED (1U << 7)
+#endif
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -50,14 +68,54 @@ typedef struct LuringState {
     AioContext *aio_context;
 
     struct io_uring ring;
+    bool sqpoll;
 
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LuringQueue io_q;
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /*
+     * Registered files.  fixed_fds[i] is the file descriptor in slot i of
+     * the ring's file table, or -1 if the slot is free.  Protected by
+     * files_lock because luring_unregister_fd() can run in any thread.
+     */
+    QemuMutex files_lock;
+    bool has_fixed_files;
+    int fixed_fds[MAX_FIXED_FILES];
+
+    /*
+     * Guest RAM registered as fixed buffers, a snapshot of luring_ram taken
+     * when luring_ram_gen was fixed_bufs_gen.  Protected by AioContext lock.
+     */
+    bool use_fixed_buffers;
+    unsigned fixed_bufs_gen;
+    unsigned nr_fixed_bufs;
+    struct iovec *fixed_bufs;
+
+    QLIST_ENTRY(LuringState) next;
 } LuringState;
 
+/* Protects luring_states and the luring_ram* variables */
+static QemuMutex luring_lock;
+static QLIST_HEAD(, LuringState) luring_states =
+    QLIST_HEAD_INITIALIZER(luring_states);
+
+/*
+ * Guest RAM to be registered with rings that use fixed buffers, as an
+ * array of struct iovec of at most MAX_FIXED_BUF_SIZE bytes each.  Rings
+ * notice changes by comparing their fixed_bufs_gen with luring_ram_gen.
+ */
+static GArray *luring_ram;
+static unsigned luring_ram_gen;
+static RAMBlockNotifier luring_ram_notifier;
+
+static void __attribute__((constructor)) luring_lock_init(void)
+{
+    qemu_mutex_init(&luring_lock);
+}
+
 /**
  * luring_resubmit:
  *
@@ -102,6 +160,12 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
                       remaining);
 
+    /* The remaining data is described by an iovec, not a fixed buffer */
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        luringcb->sqeq.opcode = IORING_OP_READV;
+        luringcb->sqeq.buf_index = 0;
+    }
+
     /* Update sqe */
     luringcb->sqeq.off = nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
@@ -312,6 +376,221 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/**
+ * luring_fixed_file:
+ * @s: AIO state
+ * @fd: file descriptor for I/O
+ *
+ * Returns the slot of @fd in the registered file table of the ring,
+ * registering it if needed, or -1 if @fd cannot be registered.  Fixed files
+ * save the kernel an fget()/fput() pair per request.
+ */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i, slot = -1;
+    int ret;
+
+    if (!s->has_fixed_files) {
+        return -1;
+    }
+
+    QEMU_LOCK_GUARD(&s->files_lock);
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == fd) {
+            return i;
+        }
+        if (slot < 0 && s->fixed_fds[i] == -1) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        return -1;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    trace_luring_register_file(s, fd, slot, ret);
+    if (ret != 1) {
+        return -1;
+    }
+    s->fixed_fds[slot] = fd;
+    return slot;
+}
+
+/**
+ * luring_unregister_fd:
+ * @fd: file descriptor that is about to be closed
+ *
+ * Drop @fd from the registered file tables of all rings.  Must be called
+ * before closing a file descriptor that was used with luring_co_submit(),
+ * while no requests for it are pending.
+ */
+void luring_unregister_fd(int fd)
+{
+    LuringState *s;
+    int unused = -1;
+    int i;
+
+    QEMU_LOCK_GUARD(&luring_lock);
+    QLIST_FOREACH(s, &luring_states, next) {
+        qemu_mutex_lock(&s->files_lock);
+        for (i = 0; i < MAX_FIXED_FILES; i++) {
+            if (s->fixed_fds[i] == fd) {
+                io_uring_register_files_update(&s->ring, i, &unused, 1);
+                s->fixed_fds[i] = -1;
+                trace_luring_unregister_file(s, fd, i);
+            }
+        }
+        qemu_mutex_unlock(&s->files_lock);
+    }
+}
+
+static void luring_ram_add(void *host, size_t size)
+{
+    struct iovec iov;
+    size_t len;
+
+    for (; size > 0; host += len, size -= len) {
+        len = MIN(size, MAX_FIXED_BUF_SIZE);
+        iov = (struct iovec) { .iov_base = host, .iov_len = len };
+        g_array_append_val(luring_ram, iov);
+    }
+}
+
+static void luring_ram_remove(void *host, size_t size)
+{
+    int i;
+
+    for (i = luring_ram->len - 1; i >= 0; i--) {
+        struct iovec *iov = &g_array_index(luring_ram, struct iovec, i);
+        if (iov->iov_base >= host && iov->iov_base < host + size) {
+            g_array_remove_index(luring_ram, i);
+        }
+    }
+}
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size, size_t max_size)
+{
+    QEMU_LOCK_GUARD(&luring_lock);
+    luring_ram_add(host, size);
+    qatomic_inc(&luring_ram_gen);
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size, size_t max_size)
+{
+    QEMU_LOCK_GUARD(&luring_lock);
+    luring_ram_remove(host, max_size);
+    qatomic_inc(&luring_ram_gen);
+}
+
+static void luring_ram_block_resized(RAMBlockNotifier *n, void *host,
+                                     size_t old_size, size_t new_size)
+{
+    QEMU_LOCK_GUARD(&luring_lock);
+    luring_ram_remove(host, old_size);
+    luring_ram_add(host, new_size);
+    qatomic_inc(&luring_ram_gen);
+}
+
+/**
+ * luring_track_guest_ram:
+ *
+ * Start tracking guest RAM blocks so that rings with fixed buffers enabled
+ * can register them.  Called with the BQL held.
+ */
+void luring_track_guest_ram(void)
+{
+    if (luring_ram) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&luring_lock) {
+        luring_ram = g_array_new(FALSE, FALSE, sizeof(struct iovec));
+    }
+    luring_ram_notifier.ram_block_added = luring_ram_block_added;
+    luring_ram_notifier.ram_block_removed = luring_ram_block_removed;
+    luring_ram_notifier.ram_block_resized = luring_ram_block_resized;
+    ram_block_notifier_add(&luring_ram_notifier);
+}
+
+/**
+ * luring_fixed_bufs_ready:
+ * @s: AIO state
+ *
+ * Returns true if guest RAM is registered with the ring and up to date.
+ * Registered buffers can only be replaced while no request that may use
+ * them is pending, so after guest RAM changes the ring uses plain iovecs
+ * until it becomes idle and can re-register.
+ */
+static bool luring_fixed_bufs_ready(LuringState *s)
+{
+    unsigned gen = qatomic_read(&luring_ram_gen);
+    int ret;
+
+    if (likely(gen == s->fixed_bufs_gen)) {
+        return s->nr_fixed_bufs > 0;
+    }
+    if (s->io_q.in_flight || s->io_q.in_queue) {
+        return false;
+    }
+
+    if (s->nr_fixed_bufs) {
+        io_uring_unregister_buffers(&s->ring);
+        s->nr_fixed_bufs = 0;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&luring_lock) {
+        g_free(s->fixed_bufs);
+        s->fixed_bufs = g_memdup(luring_ram->data,
+                                 luring_ram->len * sizeof(struct iovec));
+        s->fixed_bufs_gen = luring_ram_gen;
+        s->nr_fixed_bufs = luring_ram->len;
+    }
+    if (!s->nr_fixed_bufs) {
+        return false;
+    }
+
+    ret = io_uring_register_buffers(&s->ring, s->fixed_bufs, s->nr_fixed_bufs);
+    trace_luring_register_buffers(s, s->nr_fixed_bufs, ret);
+    if (ret < 0) {
+        warn_report_once("Unable to register guest RAM with io_uring (%s), "
+                         "check RLIMIT_MEMLOCK", strerror(-ret));
+        s->nr_fixed_bufs = 0;
+        s->use_fixed_buffers = false;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Returns the index of the registered buffer that contains all of @qiov,
+ * or -1 if @qiov cannot be submitted as a fixed buffer.
+ */
+static int luring_fixed_buf(LuringState *s, QEMUIOVector *qiov)
+{
+    void *base;
+    size_t len;
+    unsigned i;
+
+    if (!s->use_fixed_buffers || qiov->niov != 1 ||
+        !luring_fixed_bufs_ready(s)) {
+        return -1;
+    }
+
+    base = qiov->iov[0].iov_base;
+    len = qiov->iov[0].iov_len;
+
+    for (i = 0; i < s->nr_fixed_bufs; i++) {
+        struct iovec *buf = &s->fixed_bufs[i];
+        if (base >= buf->iov_base &&
+            base + len <= buf->iov_base + buf->iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -327,16 +606,31 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type)
 {
     int ret;
+    int buf_index, file_index;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        buf_index = luring_fixed_buf(s, luringcb->qiov);
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                      luringcb->qiov->iov[0].iov_len, offset,
+                                      buf_index);
+        } else {
+            io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                                 luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        buf_index = luring_fixed_buf(s, luringcb->qiov);
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                     luringcb->qiov->iov[0].iov_len, offset,
+                                     buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                                luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -346,6 +640,12 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+
+    file_index = luring_fixed_file(s, fd);
+    if (file_index >= 0) {
+        sqes->fd = file_index;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -402,29 +702,103 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+/* Returns the fd of a SQPOLL ring whose kernel thread can be shared */
+static int luring_find_sqpoll_fd(void)
 {
-    int rc;
+    LuringState *s;
+
+    QLIST_FOREACH(s, &luring_states, next) {
+        if (s->sqpoll) {
+            return s->ring.ring_fd;
+        }
+    }
+    return -1;
+}
+
+/**
+ * luring_init:
+ * @ctx: AioContext whose io_uring options to use
+ * @errp: error object
+ *
+ * Create a ring for @ctx.  Unless it uses SQPOLL, the ring shares the
+ * kernel's async workers with the fd monitoring ring of @ctx.  All SQPOLL
+ * rings share a single kernel submission thread.
+ */
+LuringState *luring_init(AioContext *ctx, Error **errp)
+{
+    int rc, i;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = {};
+    int wq_fd;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    QEMU_LOCK_GUARD(&luring_lock);
+
+    if (ctx->linux_io_uring_sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        wq_fd = luring_find_sqpoll_fd();
+    } else {
+        wq_fd = aio_get_fdmon_io_uring_fd(ctx);
+    }
+    if (wq_fd >= 0) {
+        params.flags |= IORING_SETUP_ATTACH_WQ;
+        params.wq_fd = wq_fd;
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
+    if (rc < 0 && (params.flags & IORING_SETUP_ATTACH_WQ)) {
+        /* Kernels before 5.6 do not know IORING_SETUP_ATTACH_WQ */
+        params = (struct io_uring_params) {
+            .flags = params.flags & ~IORING_SETUP_ATTACH_WQ,
+        };
+        rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
+    }
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+
+    if ((params.flags & IORING_SETUP_SQPOLL) &&
+        !(params.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+        error_setg(errp, "io_uring SQPOLL mode is not supported by this host "
+                   "kernel (Linux 5.11 or newer is needed)");
+        io_uring_queue_exit(ring);
         g_free(s);
         return NULL;
     }
+    s->sqpoll = params.flags & IORING_SETUP_SQPOLL;
+
+    /* A sparse table needs Linux 5.5; older kernels just go without */
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_fds[i] = -1;
+    }
+    s->has_fixed_files =
+        io_uring_register_files(ring, s->fixed_fds, MAX_FIXED_FILES) == 0;
+    qemu_mutex_init(&s->files_lock);
+
+    s->use_fixed_buffers = ctx->linux_io_uring_fixed_buffers && luring_ram;
+
+    trace_luring_init_flags(s, s->sqpoll,
+                            params.flags & IORING_SETUP_ATTACH_WQ,
+                            s->has_fixed_files);
 
     ioq_init(&s->io_q);
+    QLIST_INSERT_HEAD(&luring_states, s, next);
     return s;
 
 }
 
 void luring_cleanup(LuringState *s)
 {
+    WITH_QEMU_LOCK_GUARD(&luring_lock) {
+        QLIST_REMOVE(s, next);
+    }
     io_uring_queue_exit(&s->ring);
+    qemu_mutex_destroy(&s->files_lock);
+    g_free(s->fixed_bufs);
     trace_luring_cleanup_state(s);
     g_free(s);
 }
@@ -15,6 +15,7 @@
 #include "qemu/cutils.h"
 #include "qemu/coroutine.h"
 #include "qemu/range.h"
+#include "qemu/units.h"
 #include "trace.h"
 #include "block/blockjob_int.h"
 #include "block/block_int.h"
@@ -26,10 +27,26 @@
 
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
-#define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
+#define MAX_COPY_RANGE_FAILURES 16
+
+/* Limits for the adaptive request sizing, see mirror_adapt() */
+#define MAX_IN_FLIGHT_LIMIT 64
+#define MIN_IO_BYTES (64 * KiB)
+#define INITIAL_WINDOW (MAX_IN_FLIGHT * MAX_IO_BYTES)
+/* Latency increase over the baseline that is taken as congestion */
+#define MIRROR_CONGESTION_FACTOR 2
+
+/*
+ * Chunks are only carved out of the buffer when the window needs them, so
+ * the default leaves room for the window to grow without costing memory
+ * for jobs whose window stays small.
+ */
+#define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT_LIMIT * MAX_IO_BYTES)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
- * Free chunks are organized in a list.
+ * Free chunks are organized in a list.  The buffer is carved into chunks
+ * lazily, when no freed chunk is available, so that the part of it that is
+ * never needed is not touched.
  */
 typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
@@ -68,8 +85,9 @@ typedef struct MirrorBlockJob {
     BdrvDirtyBitmap *dirty_bitmap;
     BdrvDirtyBitmapIter *dbi;
     uint8_t *buf;
+    size_t buf_carved;  /* bytes at the start of @buf that were ever used */
     QSIMPLEQ_HEAD(, MirrorBuffer) buf_free;
-    int buf_free_count;
+    int buf_free_count; /* includes the chunks that are not carved yet */
 
     uint64_t last_pause_ns;
     unsigned long *in_flight_bitmap;
@@ -84,6 +102,35 @@ typedef struct MirrorBlockJob {
     int in_active_write_counter;
     bool prepared;
     bool in_drain;
+    /*
+     * Try to offload copying to the storage with copy_range.  This is
+     * disabled if the first attempt fails; once it has worked, a failure
+     * only makes the affected request fall back to read+write, unless
+     * copy_range fails MAX_COPY_RANGE_FAILURES times in a row.
+     */
+    bool use_copy_range;
+    bool copy_range_works;
+    int copy_range_failures;
+
+    /*
+     * Adaptive request sizing.  @window is the number of bytes that may be
+     * in flight; @max_io_bytes and @max_in_flight are derived from it by
+     * mirror_set_window().
+     */
+    int64_t window;
+    int64_t max_io_bytes;
+    int max_in_flight;
+    /* The copy requests completed in the current round */
+    int64_t round_start_ns;
+    int64_t round_bytes;
+    int64_t round_latency_ns;
+    int round_ops;
+    bool round_failed;
+    /* Lowest latency seen in a round, in nanoseconds per KiB */
+    int64_t base_latency;
+    /* Statistics of the last round, for query-block-jobs */
+    int64_t last_latency_ns;
+    int64_t last_throughput;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -105,6 +152,8 @@ struct MirrorOp {
     bool is_pseudo_op;
     bool is_active_write;
     bool is_in_flight;
+    /* When the copy request was issued, 0 for other operations */
+    int64_t start_ns;
     CoQueue waiting_requests;
     Coroutine *co;
 
@@ -166,6 +215,85 @@ static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
     }
 }
 
+static void mirror_set_window(MirrorBlockJob *s, int64_t window)
+{
+    int64_t io_bytes;
+
+    s->window = MIN(MAX(window, s->granularity), s->buf_size);
+
+    /*
+     * Keep MAX_IN_FLIGHT requests in flight, but rather have more of them
+     * than requests larger than MAX_IO_BYTES, and fewer of them than
+     * requests smaller than MIN_IO_BYTES.
+     */
+    io_bytes = MIN(s->window / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    io_bytes = MAX(io_bytes, s->window / MAX_IN_FLIGHT_LIMIT);
+    io_bytes = MAX(io_bytes, MIN_IO_BYTES);
+    io_bytes = QEMU_ALIGN_DOWN(io_bytes, s->granularity);
+    s->max_io_bytes = MAX(io_bytes, s->granularity);
+
+    s->max_in_flight = MIN(MAX(s->window / s->max_io_bytes, 1),
+                           MAX_IN_FLIGHT_LIMIT);
+}
+
+/*
+ * Adapt the amount of data in flight to the target with an AIMD controller.
+ * A round ends when a window's worth of copy requests has completed.  If the
+ * average latency per byte of the round did not exceed the baseline by
+ * MIRROR_CONGESTION_FACTOR, the window grows by one request; if it did, or
+ * if a request failed, the window is halved.  The baseline is the lowest
+ * latency seen so far, but slowly decays so that the job can follow a
+ * target that becomes slower.
+ */
+static void mirror_adapt(MirrorBlockJob *s, uint64_t bytes,
+                         int64_t latency_ns, int ret)
+{
+    int64_t now, elapsed, latency;
+    bool congested;
+
+    s->round_bytes += bytes;
+    s->round_latency_ns += latency_ns;
+    s->round_ops++;
+    if (ret < 0) {
+        s->round_failed = true;
+    }
+    if (s->round_bytes < s->window && !s->round_failed) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    elapsed = MAX(now - s->round_start_ns, 1);
+    latency = s->round_latency_ns / MAX(s->round_bytes / KiB, 1);
+
+    s->last_latency_ns = s->round_latency_ns / s->round_ops;
+    s->last_throughput = (double)s->round_bytes * NANOSECONDS_PER_SECOND /
+                         elapsed;
+
+    congested = s->round_failed ||
+                (s->base_latency &&
+                 latency > s->base_latency * MIRROR_CONGESTION_FACTOR);
+    if (!s->base_latency) {
+        s->base_latency = latency;
+    } else {
+        s->base_latency = MIN(latency, s->base_latency +
+                                       s->base_latency / 16 + 1);
+    }
+
+    if (congested) {
+        mirror_set_window(s, s->window / 2);
+    } else {
+        mirror_set_window(s, s->window + s->max_io_bytes);
+    }
+    trace_mirror_adapt(s, s->last_latency_ns, s->last_throughput, congested,
+                       s->window, s->max_io_bytes, s->max_in_flight);
+
+    s->round_start_ns = now;
+    s->round_bytes = 0;
+    s->round_latency_ns = 0;
+    s->round_ops = 0;
+    s->round_failed = false;
+}
+
 static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -175,12 +303,19 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 
     trace_mirror_iteration_done(s, op->offset, op->bytes, ret);
 
+    if (op->start_ns) {
+        mirror_adapt(s, op->bytes,
+                     qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->start_ns,
+                     ret);
+    }
+
     s->in_flight--;
     s->bytes_in_flight -= op->bytes;
     iov = op->qiov.iov;
     for (i = 0; i < op->qiov.niov; i++) {
         MirrorBuffer *buf = (MirrorBuffer *) iov[i].iov_base;
-        QSIMPLEQ_INSERT_TAIL(&s->buf_free, buf, next);
+        /* Reuse recently freed chunks first, they are likely still cached */
+        QSIMPLEQ_INSERT_HEAD(&s->buf_free, buf, next);
         s->buf_free_count++;
     }
 
@@ -238,6 +373,9 @@ static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
     }
 
     ret = blk_co_pwritev(s->target, op->offset, op->qiov.size, &op->qiov, 0);
+    if (ret >= 0) {
+        s->common.job.copy_stats.bounced += op->qiov.size;
+    }
     mirror_write_complete(op, ret);
 }
 
@@ -326,7 +464,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
     int nb_chunks;
-    uint64_t ret;
+    int ret;
     uint64_t max_bytes;
 
     max_bytes = s->granularity * s->max_iov;
@@ -364,7 +502,13 @@ static void coroutine_fn mirror_co_read(void *opaque)
         MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
         size_t remaining = op->bytes - op->qiov.size;
 
-        QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
+        if (buf) {
+            QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
+        } else {
+            assert(s->buf_carved < s->buf_size);
+            buf = (MirrorBuffer *)(s->buf + s->buf_carved);
+            s->buf_carved += s->granularity;
+        }
         s->buf_free_count--;
         qemu_iovec_add(&op->qiov, buf, MIN(s->granularity, remaining));
     }
@@ -374,6 +518,25 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->bytes_in_flight += op->bytes;
     op->is_in_flight = true;
     trace_mirror_one_iteration(s, op->offset, op->bytes);
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (s->use_copy_range) {
+        ret = blk_co_copy_range_from_child(s->mirror_top_bs->backing,
+                                           op->offset, s->target, op->offset,
+                                           op->bytes, 0, 0);
+        if (ret >= 0) {
+            s->copy_range_works = true;
+            s->copy_range_failures = 0;
+            s->common.job.copy_stats.offloaded += op->bytes;
+            mirror_write_complete(op, 0);
+            return;
+        }
+        trace_mirror_copy_range_fallback(s, op->offset, op->bytes, ret);
+        if (!s->copy_range_works ||
+            ++s->copy_range_failures >= MAX_COPY_RANGE_FAILURES) {
+            s->use_copy_range = false;
+        }
+    }
 
     ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
                          &op->qiov, 0);
@@ -464,7 +627,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->max_io_bytes;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -561,7 +724,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -595,19 +758,11 @@ fail:
 
 static void mirror_free_init(MirrorBlockJob *s)
 {
-    int granularity = s->granularity;
-    size_t buf_size = s->buf_size;
-    uint8_t *buf = s->buf;
-
     assert(s->buf_free_count == 0);
+    assert(QEMU_IS_ALIGNED(s->buf_size, s->granularity));
     QSIMPLEQ_INIT(&s->buf_free);
-    while (buf_size != 0) {
-        MirrorBuffer *cur = (MirrorBuffer *)buf;
-        QSIMPLEQ_INSERT_TAIL(&s->buf_free, cur, next);
-        s->buf_free_count++;
-        buf_size -= granularity;
-        buf += granularity;
-    }
+    s->buf_carved = 0;
+    s->buf_free_count = s->buf_size / s->granularity;
 }
 
 /* This is also used for the .pause callback. There is no matching
@@ -821,7 +976,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -962,6 +1117,8 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     }
 
     mirror_free_init(s);
+    mirror_set_window(s, INITIAL_WINDOW);
+    s->round_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     if (!s->is_none_mode) {
@@ -1004,7 +1161,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1188,6 +1345,19 @@ static void mirror_cancel(Job *job, bool force)
     }
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->u.mirror = (BlockJobInfoMirror) {
+        .window         = s->window,
+        .max_in_flight  = s->max_in_flight,
+        .request_size   = s->max_io_bytes,
+        .latency        = s->last_latency_ns,
+        .throughput     = s->last_throughput,
+    };
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(MirrorBlockJob),
@@ -1202,6 +1372,7 @@ static const BlockJobDriver mirror_job_driver = {
         .cancel                 = mirror_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1656,6 +1827,8 @@ static BlockJob *mirror_start_job(
     bdrv_unref(mirror_top_bs);
 
     s->mirror_top_bs = mirror_top_bs;
+    s->use_copy_range = true;
+    s->common.job.has_copy_stats = true;
 
     /* No resize for the target either; while the mirror is still running, a
      * consistent read isn't necessarily possible. We could possibly allow
@@ -1735,6 +1908,7 @@ static BlockJob *mirror_start_job(
     s->base_overlay = bdrv_find_overlay(bs, base);
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
+    mirror_set_window(s, INITIAL_WINDOW);
     s->unmap = unmap;
     if (auto_complete) {
         s->should_complete = true;
@@ -23,25 +23,55 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/seqlock.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found through a hash table indexed by offset, and
+ * replaced with the CLOCK algorithm: the clock hand sweeps over the entries,
+ * giving a second chance to those that were used since its last pass.
+ *
+ * All modifications happen with s->lock held.  In addition, the sequence
+ * counter of an entry is odd whenever the entry is referenced or being
+ * replaced, so that qcow2_cache_read_lockless() can copy data out of clean,
+ * unreferenced tables without taking s->lock.
+ *
+ * qcow2_cache_load_unlocked() reads a table from disk with s->lock dropped,
+ * into an entry that cannot be found by lookups until the read completes.
+ * If anybody loads the same table through qcow2_cache_do_get() in the
+ * meantime, or the table is discarded because its cluster was freed, the
+ * unlocked load is marked as stale and its result dropped.
+ */
 typedef struct Qcow2CachedTable {
-    int64_t  offset;
-    uint64_t lru_counter;
-    int      ref;
-    bool     dirty;
+    int64_t     offset;
+    QemuSeqLock seq;
+    int         next;       /* next entry in the same hash bucket, or -1 */
+    int         ref;
+    bool        dirty;
+    bool        referenced; /* used since the last pass of the clock hand */
+    bool        accessed;   /* used since the last qcow2_cache_clean_unused() */
 } Qcow2CachedTable;
 
+typedef struct Qcow2CacheLoad {
+    int64_t     offset;
+    int         index;      /* entry that the table is read into */
+    bool        stale;
+    CoQueue     waiters;
+    QLIST_ENTRY(Qcow2CacheLoad) next;
+} Qcow2CacheLoad;
+
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
+    int                    *buckets;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     hash_bits;
     int                     table_size;
+    int                     clock_hand;
     bool                    depends_on_flush;
     void                   *table_array;
-    uint64_t                lru_counter;
-    uint64_t                cache_clean_lru_counter;
+    QLIST_HEAD(, Qcow2CacheLoad) loads;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -84,11 +114,69 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 #endif
 }
 
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset / c->table_size) * 0x9e3779b97f4a7c15ULL) >>
+           (64 - c->hash_bits);
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Change the offset of entry @i and move it to the right hash bucket.  The
+ * caller must ensure that the sequence counter of the entry is odd.
+ */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, int64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int *p;
+
+    if (t->offset) {
+        p = &c->buckets[qcow2_cache_hash(c, t->offset)];
+        while (*p != i) {
+            p = &c->entries[*p].next;
+        }
+        qatomic_set(p, t->next);
+    }
+
+    qatomic_set__nocheck(&t->offset, offset);
+
+    if (offset) {
+        p = &c->buckets[qcow2_cache_hash(c, offset)];
+        qatomic_set(&t->next, *p);
+        qatomic_set(p, i);
+    }
+}
+
+/* Forget about an unreferenced entry */
+static void qcow2_cache_invalidate(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+    seqlock_write_begin(&t->seq);
+    qcow2_cache_set_offset(c, i, 0);
+    seqlock_write_end(&t->seq);
+    t->referenced = false;
+    t->accessed = false;
+}
+
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
     return t->ref == 0 && !t->dirty && t->offset != 0 &&
-        t->lru_counter <= c->cache_clean_lru_counter;
+        !qatomic_read(&t->accessed);
 }
 
 void qcow2_cache_clean_unused(Qcow2Cache *c)
@@ -99,13 +187,13 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* Skip the entries that we don't need to clean */
         while (i < c->size && !can_clean_entry(c, i)) {
+            qatomic_set(&c->entries[i].accessed, false);
             i++;
         }
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_invalidate(c, i);
             i++;
             to_clean++;
         }
@@ -114,8 +202,6 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
             qcow2_cache_table_release(c, i - to_clean, to_clean);
         }
     }
-
-    c->cache_clean_lru_counter = c->lru_counter;
 }
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
@@ -123,6 +209,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -132,15 +219,26 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
+    c->hash_bits = MAX(ctz64(pow2ceil(num_tables)), 1);
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, 1 << c->hash_bits);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i < (1 << c->hash_bits); i++) {
+        c->buckets[i] = -1;
+    }
+    for (i = 0; i < num_tables; i++) {
+        seqlock_init(&c->entries[i].seq);
+        c->entries[i].next = -1;
     }
 
     return c;
@@ -155,6 +253,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -304,27 +403,61 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_invalidate(c, i);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
 
-    c->lru_counter = 0;
+    c->clock_hand = 0;
 
     return 0;
 }
 
+/*
+ * Pick an unreferenced entry to be replaced, giving a second chance to the
+ * ones that have been used since the clock hand last passed over them.
+ */
+static int qcow2_cache_evict(Qcow2Cache *c)
+{
+    int n;
+
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
+        }
+        if (t->ref) {
+            continue;
+        }
+        if (t->offset && qatomic_read(&t->referenced)) {
+            qatomic_set(&t->referenced, false);
+            continue;
+        }
+        return i;
+    }
+    return -1;
+}
+
+static void qcow2_cache_mark_loads_stale(Qcow2Cache *c, uint64_t offset,
+                                         uint64_t bytes)
+{
+    Qcow2CacheLoad *load;
+
+    QLIST_FOREACH(load, &c->loads, next) {
+        if (load->offset >= offset && load->offset - offset < bytes) {
+            load->stale = true;
+        }
+    }
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -339,29 +472,22 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        if (c->entries[i].ref == 0) {
+            seqlock_write_begin(&c->entries[i].seq);
         }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    i = qcow2_cache_evict(c);
+    if (i == -1) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -372,7 +498,9 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_mark_loads_stale(c, offset, c->table_size);
+    seqlock_write_begin(&c->entries[i].seq);
+    qcow2_cache_set_offset(c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -382,15 +510,18 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                          qcow2_cache_get_table_addr(c, i),
                          c->table_size);
         if (ret < 0) {
+            seqlock_write_end(&c->entries[i].seq);
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
 
     /* And return the right table */
 found:
     c->entries[i].ref++;
+    qatomic_set(&c->entries[i].referenced, true);
+    qatomic_set(&c->entries[i].accessed, true);
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -411,6 +542,82 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+/*
+ * Make sure that the table at @offset is in the cache, without holding
+ * s->lock while it is read from disk; loads of different tables can thus
+ * proceed in parallel, and concurrent loads of the same table are merged.
+ * Must be called with s->lock held.
+ *
+ * This is only a hint: the table can be evicted again before the caller
+ * gets to use it, so callers still need qcow2_cache_get().
+ */
+int coroutine_fn qcow2_cache_load_unlocked(BlockDriverState *bs,
+                                           Qcow2Cache *c, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CacheLoad load = { .offset = offset };
+    Qcow2CacheLoad *other;
+    Qcow2CachedTable *t;
+    int i, ret;
+
+    if (!offset || !QEMU_IS_ALIGNED(offset, c->table_size) ||
+        qcow2_cache_lookup(c, offset) >= 0) {
+        return 0;
+    }
+
+    QLIST_FOREACH(other, &c->loads, next) {
+        if (other->offset == offset && !other->stale) {
+            qemu_co_queue_wait(&other->waiters, &s->lock);
+            return 0;
+        }
+    }
+
+    i = qcow2_cache_evict(c);
+    if (i == -1) {
+        return 0;
+    }
+
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Pin the entry; lookups cannot find it as long as its offset is 0 */
+    t = &c->entries[i];
+    assert(t->ref == 0);
+    t->ref++;
+    seqlock_write_begin(&t->seq);
+    qcow2_cache_set_offset(c, i, 0);
+
+    load.index = i;
+    qemu_co_queue_init(&load.waiters);
+    QLIST_INSERT_HEAD(&c->loads, &load, next);
+
+    trace_qcow2_cache_load_unlocked(qemu_coroutine_self(),
+                                    c == s->l2_table_cache, offset, i);
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    }
+    ret = bdrv_co_pread(bs->file, offset, c->table_size,
+                        qcow2_cache_get_table_addr(c, i), 0);
+
+    qemu_co_mutex_lock(&s->lock);
+    QLIST_REMOVE(&load, next);
+
+    if (ret >= 0 && !load.stale && qcow2_cache_lookup(c, offset) < 0) {
+        qcow2_cache_set_offset(c, i, offset);
+        t->referenced = true;
+        t->accessed = true;
+    }
+    t->ref--;
+    seqlock_write_end(&t->seq);
+
+    qemu_co_queue_restart_all(&load.waiters);
+    return ret < 0 ? ret : 0;
+}
+
 void qcow2_cache_put(Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(c, *table);
@@ -419,7 +626,7 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
     *table = NULL;
 
     if (c->entries[i].ref == 0) {
-        c->entries[i].lru_counter = ++c->lru_counter;
+        seqlock_write_end(&c->entries[i].seq);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -434,25 +641,58 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = offset ? qcow2_cache_lookup(c, offset) : -1;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return i >= 0 ? qcow2_cache_get_table_addr(c, i) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
-    assert(c->entries[i].ref == 0);
-
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_mark_loads_stale(c, c->entries[i].offset, c->table_size);
+    qcow2_cache_invalidate(c, i);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+/*
+ * Drop the result of any unlocked load of tables in [@offset, @offset +
+ * @bytes), whether or not they are cached yet.  To be called when the
+ * clusters in that range are freed.
+ */
+void qcow2_cache_discard_loads(Qcow2Cache *c, uint64_t offset, uint64_t bytes)
+{
+    qcow2_cache_mark_loads_stale(c, offset, bytes);
+}
+
+bool qcow2_cache_read_lockless(Qcow2Cache *c, uint64_t offset, size_t pos,
+                               void *buf, size_t len)
+{
+    int i, n;
+
+    assert(pos + len <= c->table_size);
+
+    /*
+     * The chains can change under our feet; bound the walk and let the
+     * sequence counter of the entry tell whether what we found is valid.
+     */
+    i = qatomic_read(&c->buckets[qcow2_cache_hash(c, offset)]);
+    for (n = 0; i >= 0 && n < c->size; n++) {
+        Qcow2CachedTable *t = &c->entries[i];
+        unsigned start = seqlock_read_begin(&t->seq);
+
+        if (qatomic_read__nocheck(&t->offset) == offset) {
+            memcpy(buf, (uint8_t *)qcow2_cache_get_table_addr(c, i) + pos, len);
+            if (seqlock_read_retry(&t->seq, start)) {
+                return false;
+            }
+            qatomic_set(&t->referenced, true);
+            qatomic_set(&t->accessed, true);
+            return true;
+        }
+        i = qatomic_read(&t->next);
+    }
+    return false;
+}
@@ -28,13 +28,41 @@
 #include "qapi/error.h"
 #include "qcow2.h"
 #include "qemu/bswap.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 
+/*
+ * Wait until qcow2_co_alloc_l2_table() is not allocating the L2 table for
+ * @l1_index, or any L2 table if @l1_index is -1.  Requests only allocate L2
+ * tables with s->lock dropped in coroutine context, so there is nothing to
+ * wait for outside of it.  Must be called with s->lock held.
+ */
+static void wait_l2_alloc(BlockDriverState *bs, int64_t l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2L2Alloc *alloc;
+
+    if (!qemu_in_coroutine()) {
+        assert(QLIST_EMPTY(&s->l2_allocs));
+        return;
+    }
+
+restart:
+    QLIST_FOREACH(alloc, &s->l2_allocs, next) {
+        if (l1_index < 0 || alloc->l1_index == l1_index) {
+            qemu_co_queue_wait(&alloc->waiters, &s->lock);
+            goto restart;
+        }
+    }
+}
+
 int qcow2_shrink_l1_table(BlockDriverState *bs, uint64_t exact_size)
 {
     BDRVQcow2State *s = bs->opaque;
     int new_l1_size, i, ret;
 
+    wait_l2_alloc(bs, -1);
+
     if (exact_size >= s->l1_size) {
         return 0;
     }
@@ -80,6 +108,45 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2OldL1Table {
+    struct rcu_head rcu;
+    uint64_t *table;
+} Qcow2OldL1Table;
+
+static void qcow2_free_old_l1_table(Qcow2OldL1Table *old)
+{
+    qemu_vfree(old->table);
+    g_free(old);
+}
+
+/*
+ * Switch to a new in-memory L1 table.  The old one is freed after an RCU
+ * grace period, because qcow2_get_host_offset_lockless() may still be
+ * looking at it.
+ */
+void qcow2_replace_l1_table(BDRVQcow2State *s, uint64_t *l1_table,
+                            int l1_size)
+{
+    uint64_t *old_table = s->l1_table;
+
+    /*
+     * Lockless readers load l1_size before l1_table, so make sure they never
+     * see a size that is larger than the table.
+     */
+    if (l1_size < s->l1_size) {
+        qatomic_set(&s->l1_size, l1_size);
+    }
+    qatomic_rcu_set(&s->l1_table, l1_table);
+    qatomic_set(&s->l1_size, l1_size);
+
+    if (old_table) {
+        Qcow2OldL1Table *old = g_new(Qcow2OldL1Table, 1);
+
+        old->table = old_table;
+        call_rcu(old, qcow2_free_old_l1_table, rcu);
+    }
+}
+
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size)
 {
@@ -90,6 +157,9 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     int64_t new_l1_table_offset, new_l1_size;
     uint8_t data[12];
 
+    /* The L1 table must not move while entries are written to it */
+    wait_l2_alloc(bs, -1);
+
     if (min_size <= s->l1_size)
         return 0;
 
@@ -174,12 +244,10 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     if (ret < 0) {
         goto fail;
     }
-    qemu_vfree(s->l1_table);
     old_l1_table_offset = s->l1_table_offset;
     s->l1_table_offset = new_l1_table_offset;
-    s->l1_table = new_l1_table;
     old_l1_size = s->l1_size;
-    s->l1_size = new_l1_size;
+    qcow2_replace_l1_table(s, new_l1_table, new_l1_size);
     qcow2_free_clusters(bs, old_l1_table_offset, old_l1_size * L1E_SIZE,
                         QCOW2_DISCARD_OTHER);
     return 0;
@@ -219,10 +287,18 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
  * Writes an L1 entry to disk (note that depending on the alignment
  * requirements this function may write more that just one entry in
  * order to prevent bdrv_pwrite from performing a read-modify-write)
+ *
+ * If @drop_lock is true, s->lock is held by the caller and dropped while
+ * the entry is written.  In coroutine context, s->l1_write_lock makes sure
+ * that writes covering the same entries reach the disk in the order their
+ * contents were taken from s->l1_table.
  */
-int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
+static int do_write_l1_entry(BlockDriverState *bs, int l1_index,
+                             bool drop_lock)
 {
     BDRVQcow2State *s = bs->opaque;
+    bool in_co = qemu_in_coroutine();
+    int64_t offset;
     int l1_start_index;
     int i, ret;
     int bufsize = MAX(L1E_SIZE,
@@ -230,30 +306,52 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
     int nentries = bufsize / L1E_SIZE;
     g_autofree uint64_t *buf = g_try_new0(uint64_t, nentries);
 
+    assert(in_co || !drop_lock);
+
     if (buf == NULL) {
         return -ENOMEM;
     }
 
+    if (in_co) {
+        qemu_co_mutex_lock(&s->l1_write_lock);
+    }
+
     l1_start_index = QEMU_ALIGN_DOWN(l1_index, nentries);
     for (i = 0; i < MIN(nentries, s->l1_size - l1_start_index); i++) {
         buf[i] = cpu_to_be64(s->l1_table[l1_start_index + i]);
     }
+    offset = s->l1_table_offset + L1E_SIZE * l1_start_index;
 
-    ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L1,
-            s->l1_table_offset + L1E_SIZE * l1_start_index, bufsize, false);
+    ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L1, offset,
+                                        bufsize, false);
     if (ret < 0) {
-        return ret;
+        goto out;
+    }
+
+    if (drop_lock) {
+        qemu_co_mutex_unlock(&s->lock);
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_L1_UPDATE);
-    ret = bdrv_pwrite_sync(bs->file,
-                           s->l1_table_offset + L1E_SIZE * l1_start_index,
-                           buf, bufsize);
-    if (ret < 0) {
-        return ret;
+    ret = bdrv_pwrite_sync(bs->file, offset, buf, bufsize);
+
+    if (drop_lock) {
+        /* Do not wait for s->lock while other writers wait for us */
+        qemu_co_mutex_unlock(&s->l1_write_lock);
+        qemu_co_mutex_lock(&s->lock);
+        return ret < 0 ? ret : 0;
     }
 
-    return 0;
+out:
+    if (in_co) {
+        qemu_co_mutex_unlock(&s->l1_write_lock);
+    }
+    return ret < 0 ? ret : 0;
+}
+
+int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
+{
+    return do_write_l1_entry(bs, l1_index, false);
 }
 
 /*
@@ -728,6 +826,324 @@ fail:
     return ret;
 }
 
+/*
+ * qcow2_get_host_offset_lockless
+ *
+ * Like qcow2_get_host_offset(), but without taking s->lock.  Only succeeds
+ * if the needed part of the L2 table is in the cache and nothing unusual is
+ * found; otherwise it returns false, and the caller should take the lock and
+ * use qcow2_get_host_offset().  Errors are reported by the latter.
+ *
+ * At most QCOW2_LOCKLESS_MAX_CLUSTERS clusters are looked up at a time.
+ */
+bool qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                    unsigned int *bytes, uint64_t *host_offset,
+                                    QCow2SubclusterType *subcluster_type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_buf[QCOW2_LOCKLESS_MAX_CLUSTERS * 2];
+    unsigned int l2_index, sc_index, first = 0;
+    uint64_t l1_index, l2_offset, l2_entry, l2_bitmap, *l1_table;
+    unsigned int offset_in_cluster;
+    uint64_t bytes_available, bytes_needed, nb_clusters;
+    int start_of_slice, l1_size, sc;
+    QCow2SubclusterType type;
+
+    offset_in_cluster = offset_into_cluster(s, offset);
+    bytes_needed = (uint64_t) *bytes + offset_in_cluster;
+    bytes_available =
+        ((uint64_t) (s->l2_slice_size - offset_to_l2_slice_index(s, offset)))
+        << s->cluster_bits;
+    bytes_available = MIN(bytes_available,
+                          (uint64_t) QCOW2_LOCKLESS_MAX_CLUSTERS <<
+                          s->cluster_bits);
+    if (bytes_needed > bytes_available) {
+        bytes_needed = bytes_available;
+    }
+
+    *host_offset = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    l1_index = offset_to_l1_index(s, offset);
+    l1_size = qatomic_read(&s->l1_size);
+    smp_rmb();
+    l1_table = qatomic_rcu_read(&s->l1_table);
+    if (l1_index >= l1_size) {
+        type = QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
+        goto out;
+    }
+
+    l2_offset = qatomic_read_u64(&l1_table[l1_index]) & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        type = QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
+        goto out;
+    }
+    if (offset_into_cluster(s, l2_offset)) {
+        return false;
+    }
+
+    start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    l2_index = offset_to_l2_slice_index(s, offset);
+    sc_index = offset_to_sc_index(s, offset);
+    nb_clusters = size_to_clusters(s, bytes_needed);
+
+    if (!qcow2_cache_read_lockless(s->l2_table_cache,
+                                   l2_offset + start_of_slice,
+                                   l2_index * l2_entry_size(s), l2_buf,
+                                   nb_clusters * l2_entry_size(s))) {
+        return false;
+    }
+
+    l2_entry = get_l2_entry(s, l2_buf, 0);
+    l2_bitmap = get_l2_bitmap(s, l2_buf, 0);
+    type = qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, sc_index);
+    if (s->qcow_version < 3 && (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
+                                type == QCOW2_SUBCLUSTER_ZERO_ALLOC)) {
+        return false;
+    }
+    switch (type) {
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        if (has_data_file(bs)) {
+            return false;
+        }
+        *host_offset = l2_entry & L2E_COMPRESSED_OFFSET_SIZE_MASK;
+        break;
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        break;
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+    case QCOW2_SUBCLUSTER_NORMAL:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC: {
+        uint64_t host_cluster_offset = l2_entry & L2E_OFFSET_MASK;
+        *host_offset = host_cluster_offset + offset_in_cluster;
+        if (offset_into_cluster(s, host_cluster_offset) ||
+            (has_data_file(bs) && *host_offset != offset)) {
+            return false;
+        }
+        break;
+    }
+    default:
+        /* Let qcow2_get_host_offset() report the corruption */
+        return false;
+    }
+
+    sc = count_contiguous_subclusters(bs, nb_clusters, sc_index,
+                                      l2_buf, &first);
+    if (sc < 0) {
+        return false;
+    }
+
+    bytes_available = ((int64_t)sc + sc_index) << s->subcluster_bits;
+
+out:
+    if (bytes_available > bytes_needed) {
+        bytes_available = bytes_needed;
+    }
+
+    *bytes = bytes_available - offset_in_cluster;
+    *subcluster_type = type;
+    return true;
+}
+
+/*
+ * qcow2_co_load_l2_slice
+ *
+ * Bring the L2 slice for @offset into the cache before taking s->lock for
+ * the actual lookup or allocation.  s->lock is dropped while the slice is
+ * read from disk, so that requests touching different L2 slices do not wait
+ * for each other's metadata reads.
+ *
+ * Returns 0 on success, -errno in failure case
+ */
+int coroutine_fn qcow2_co_load_l2_slice(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index = offset_to_l1_index(s, offset);
+    uint64_t l2_offset = 0;
+    int start_of_slice, ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (l1_index < s->l1_size) {
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    }
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        /* Nothing to load, or let the caller report the corruption */
+        qemu_co_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    ret = qcow2_cache_load_unlocked(bs, s->l2_table_cache,
+                                    l2_offset + start_of_slice);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/*
+ * qcow2_co_alloc_l2_table
+ *
+ * Make the L2 table for @offset writable before an allocating write takes
+ * s->lock, and bring the L2 slice for @offset into the cache.
+ *
+ * Unlike l2_allocate(), this only holds s->lock to allocate the cluster and
+ * to update s->l1_table and the cache.  The new table and the L1 entry are
+ * written with s->lock dropped, so that allocating writes to other L2 tables
+ * can go on meanwhile.  Requests that need the same table wait for the
+ * allocation in get_cluster_table(); requests that only read see the old
+ * mapping until the new table has been written.
+ *
+ * Returns 0 on success, -errno in failure case
+ */
+int coroutine_fn qcow2_co_alloc_l2_table(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index = offset_to_l1_index(s, offset);
+    unsigned slice, slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    Qcow2L2Alloc alloc = { .l1_index = l1_index };
+    uint64_t old_l1_entry, old_l2_offset;
+    uint64_t *l2_table, *l2_slice;
+    int64_t l2_offset = 0;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    wait_l2_alloc(bs, l1_index);
+
+    if (l1_index >= s->l1_size ||
+        (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) ||
+        offset_into_cluster(s, s->l1_table[l1_index] & L1E_OFFSET_MASK))
+    {
+        /*
+         * Nothing to allocate, or leave growing the L1 table and reporting
+         * the corruption to get_cluster_table()
+         */
+        qemu_co_mutex_unlock(&s->lock);
+        return qcow2_co_load_l2_slice(bs, offset);
+    }
+
+    old_l1_entry = s->l1_table[l1_index];
+    old_l2_offset = old_l1_entry & L1E_OFFSET_MASK;
+    trace_qcow2_l2_allocate(bs, l1_index);
+
+    l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (l2_table == NULL) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
+    if (l2_offset < 0) {
+        ret = l2_offset;
+        goto fail;
+    }
+
+    /* The offset must fit in the offset field of the L1 table entry */
+    assert((l2_offset & L1E_OFFSET_MASK) == l2_offset);
+
+    /* If we're allocating the table at offset 0 then something is wrong */
+    if (l2_offset == 0) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Preventing invalid "
+                                "allocation of L2 table at offset 0");
+        ret = -EIO;
+        goto fail;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, l2_offset, s->cluster_size,
+                                        false);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /*
+     * Fill the new table, and put it in the cache as clean slices: nothing
+     * looks them up before the L1 entry points to the table, and by then it
+     * is on disk.
+     */
+    for (slice = 0; slice < s->cluster_size / slice_size2; slice++) {
+        void *buf = (uint8_t *)l2_table + slice * slice_size2;
+
+        if (old_l2_offset) {
+            uint64_t *old_slice;
+
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                  old_l2_offset + slice * slice_size2,
+                                  (void **) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
+            memcpy(buf, old_slice, slice_size2);
+            qcow2_cache_put(s->l2_table_cache, (void **) &old_slice);
+        } else {
+            memset(buf, 0, slice_size2);
+        }
+
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void **) &l2_slice);
+        if (ret < 0) {
+            goto fail;
+        }
+        memcpy(l2_slice, buf, slice_size2);
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+
+    qemu_co_queue_init(&alloc.waiters);
+    QLIST_INSERT_HEAD(&s->l2_allocs, &alloc, next);
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
+    trace_qcow2_l2_allocate_write_l2(bs, l1_index);
+    ret = bdrv_co_pwrite(bs->file, l2_offset, s->cluster_size, l2_table, 0);
+    if (ret == 0) {
+        ret = bdrv_co_flush(bs->file->bs);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret == 0) {
+        trace_qcow2_l2_allocate_write_l1(bs, l1_index);
+        s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
+        ret = do_write_l1_entry(bs, l1_index, true);
+    }
+
+    QLIST_REMOVE(&alloc, next);
+    qemu_co_queue_restart_all(&alloc.waiters);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* Then decrease the refcount of the old table */
+    if (old_l2_offset) {
+        qcow2_free_clusters(bs, old_l2_offset, s->cluster_size,
+                            QCOW2_DISCARD_OTHER);
+    }
+
+    trace_qcow2_l2_allocate_done(bs, l1_index, 0);
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_vfree(l2_table);
+    return 0;
+
+fail:
+    trace_qcow2_l2_allocate_done(bs, l1_index, ret);
+    s->l1_table[l1_index] = old_l1_entry;
+    if (l2_offset > 0) {
+        /* This also drops the new slices from the cache */
+        qcow2_free_clusters(bs, l2_offset, s->cluster_size,
+                            QCOW2_DISCARD_ALWAYS);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_vfree(l2_table);
+    return ret;
+}
+
 /*
  * get_cluster_table
  *
@@ -751,6 +1167,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
     /* seek to the l2 offset in the l1 table */
 
     l1_index = offset_to_l1_index(s, offset);
+    wait_l2_alloc(bs, l1_index);
     if (l1_index >= s->l1_size) {
         ret = qcow2_grow_l1_table(bs, l1_index + 1, false);
         if (ret < 0) {
@@ -1011,6 +1428,14 @@ fail:
     return ret;
 }
 
+/*
+ * Point the L2 entries covered by @m to the clusters that were allocated for
+ * it.  Must be called with s->lock held.
+ *
+ * The L2 table was allocated by qcow2_co_alloc_l2_table() before the data
+ * was written, and its slice was loaded again by qcow2_co_load_l2_slice()
+ * if it had been evicted, so the update is normally done in memory.
+ */
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -1581,13 +2006,23 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == INV_OFFSET) {
-        int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+    if (s->reserved_clusters &&
+        (*host_offset == INV_OFFSET || *host_offset == s->reserved_offset)) {
+        /* Take clusters that were already allocated by an earlier request */
+        *nb_clusters = MIN(*nb_clusters, s->reserved_clusters);
+        *host_offset = s->reserved_offset;
+        s->reserved_offset += *nb_clusters << s->cluster_bits;
+        s->reserved_clusters -= *nb_clusters;
+        return 0;
+    } else if (*host_offset == INV_OFFSET) {
+        uint64_t n = MAX(*nb_clusters, s->cluster_reservation);
+        int64_t cluster_offset = qcow2_alloc_clusters(bs, n * s->cluster_size);
         if (cluster_offset < 0) {
             return cluster_offset;
         }
         *host_offset = cluster_offset;
+        s->reserved_offset = cluster_offset + (*nb_clusters << s->cluster_bits);
+        s->reserved_clusters = n - *nb_clusters;
         return 0;
     } else {
         int64_t ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
@@ -1599,6 +2034,22 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     }
 }
 
+/*
+ * Give back the clusters that do_alloc_cluster_offset() has allocated ahead
+ * of time, so that they do not show up as leaks.
+ */
+void qcow2_release_cluster_reservation(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->reserved_clusters) {
+        qcow2_free_clusters(bs, s->reserved_offset,
+                            s->reserved_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        s->reserved_clusters = 0;
+    }
+}
+
 /*
  * Allocates new clusters for an area that is either still unallocated or
  * cannot be overwritten in-place. If *host_offset is not INV_OFFSET,
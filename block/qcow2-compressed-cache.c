@@ -0,0 +1,285 @@
+/*
+ * Cache of decompressed qcow2 clusters
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * A compressed cluster has to be read and decompressed as a whole even if
+ * the guest only reads a few sectors of it, so sequential reads that are
+ * smaller than a cluster would decompress the same cluster over and over.
+ * The last few decompressed clusters are therefore kept in a small cache,
+ * which is also filled by readahead (see qcow2_co_preadv_part()).
+ *
+ * Entries are keyed by the host offset of the compressed data.  Compressed
+ * clusters are never modified in place, but their space can be reused for a
+ * new compressed cluster after it has been freed; freeing a host cluster
+ * therefore invalidates the entries whose data starts in it.
+ *
+ * Readers look up the cluster descriptor in the L2 table before they get
+ * here, and s->lock is not held in between.  The descriptor may thus have
+ * been freed and its space reused by the time the cluster is decompressed.
+ * To keep such data out of the cache, every invalidation bumps a generation
+ * counter; readers sample it before the L2 lookup and only insert into the
+ * cache if it has not changed since.
+ *
+ * A cluster that is being decompressed has an entry with @loading set, and
+ * other readers of the same cluster wait for it instead of decompressing it
+ * a second time.
+ */
+
+#include "qemu/osdep.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2CompressedCacheEntry {
+    uint64_t coffset;       /* Host offset of the compressed data, or 0 */
+    uint8_t *data;          /* Decompressed cluster, allocated on first use */
+    uint64_t lru_counter;
+    bool loading;           /* Being decompressed, @data is not valid yet */
+    bool stale;             /* Invalidated while loading, drop when done */
+    CoQueue waiters;        /* Waiting for the load to finish */
+} Qcow2CompressedCacheEntry;
+
+struct Qcow2CompressedCache {
+    QemuMutex lock;
+    int size;
+    uint64_t lru_counter;
+    uint64_t generation;    /* Bumped by every invalidation */
+    Qcow2CompressedCacheEntry entries[];
+};
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(int num_entries)
+{
+    Qcow2CompressedCache *c;
+    int i;
+
+    c = g_malloc0(sizeof(*c) + num_entries * sizeof(c->entries[0]));
+    qemu_mutex_init(&c->lock);
+    c->size = num_entries;
+    for (i = 0; i < num_entries; i++) {
+        qemu_co_queue_init(&c->entries[i].waiters);
+    }
+
+    return c;
+}
+
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        assert(!c->entries[i].loading);
+        qemu_vfree(c->entries[i].data);
+    }
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+static Qcow2CompressedCacheEntry *
+qcow2_compressed_cache_lookup(Qcow2CompressedCache *c, uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].coffset == coffset) {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* Returns the least recently used entry that is not being loaded, if any */
+static Qcow2CompressedCacheEntry *
+qcow2_compressed_cache_evict(Qcow2CompressedCache *c)
+{
+    Qcow2CompressedCacheEntry *victim = NULL;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CompressedCacheEntry *e = &c->entries[i];
+
+        if (!e->loading &&
+            (!victim || e->lru_counter < victim->lru_counter)) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+/*
+ * Returns the value to pass to qcow2_co_read_compressed_cluster() for
+ * cluster descriptors that are looked up after this call.
+ */
+uint64_t qcow2_compressed_cache_generation(Qcow2CompressedCache *c)
+{
+    return qatomic_load_acquire(&c->generation);
+}
+
+/*
+ * Drop the cached clusters whose compressed data starts in [@offset,
+ * @offset + @bytes).  Must be called when that range is freed.
+ */
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c,
+                                       uint64_t offset, uint64_t bytes)
+{
+    int i;
+
+    qemu_mutex_lock(&c->lock);
+    qatomic_inc(&c->generation);
+    for (i = 0; i < c->size; i++) {
+        Qcow2CompressedCacheEntry *e = &c->entries[i];
+
+        if (e->coffset < offset || e->coffset - offset >= bytes) {
+            continue;
+        }
+        if (e->loading) {
+            e->stale = true;
+        } else {
+            e->coffset = 0;
+            e->lru_counter = 0;
+        }
+    }
+    qemu_mutex_unlock(&c->lock);
+}
+
+static int coroutine_fn
+qcow2_co_decompress_cluster(BlockDriverState *bs, uint64_t cluster_descriptor,
+                            uint8_t *out_buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret = 0, csize, nb_csectors;
+    uint64_t coffset;
+    uint8_t *buf;
+
+    coffset = cluster_descriptor & s->cluster_offset_mask;
+    nb_csectors = ((cluster_descriptor >> s->csize_shift) & s->csize_mask) + 1;
+    csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
+        (coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+
+fail:
+    g_free(buf);
+    return ret;
+}
+
+/*
+ * Copy @bytes bytes at @offset_in_cluster of the compressed cluster
+ * described by @cluster_descriptor into @qiov, decompressing it unless it is
+ * in the cache already.  If @qiov is NULL, only load the cluster into the
+ * cache.  @generation is the result of qcow2_compressed_cache_generation()
+ * before @cluster_descriptor was read from the L2 table.
+ *
+ * Returns 0 on success, -errno in failure case.
+ */
+int coroutine_fn
+qcow2_co_read_compressed_cluster(BlockDriverState *bs,
+                                 uint64_t cluster_descriptor,
+                                 uint64_t generation,
+                                 size_t offset_in_cluster, size_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t coffset = cluster_descriptor & s->cluster_offset_mask;
+    Qcow2CompressedCacheEntry *e;
+    uint8_t *buf;
+    int ret;
+
+    qemu_mutex_lock(&c->lock);
+    while ((e = qcow2_compressed_cache_lookup(c, coffset)) && e->loading) {
+        qemu_co_queue_wait(&e->waiters, &c->lock);
+    }
+
+    if (e) {
+        trace_qcow2_compressed_cache_hit(qemu_coroutine_self(), coffset);
+        e->lru_counter = ++c->lru_counter;
+        if (qiov) {
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                e->data + offset_in_cluster, bytes);
+        }
+        qemu_mutex_unlock(&c->lock);
+        return 0;
+    }
+
+    trace_qcow2_compressed_cache_miss(qemu_coroutine_self(), coffset);
+    if (generation != c->generation) {
+        /* @cluster_descriptor may be stale, do not cache what it points to */
+        e = NULL;
+    } else {
+        e = qcow2_compressed_cache_evict(c);
+    }
+    if (!e) {
+        /* Bypass the cache */
+        qemu_mutex_unlock(&c->lock);
+        if (!qiov) {
+            return 0;
+        }
+        buf = qemu_blockalign(bs, s->cluster_size);
+        ret = qcow2_co_decompress_cluster(bs, cluster_descriptor, buf);
+        if (ret == 0) {
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                buf + offset_in_cluster, bytes);
+        }
+        qemu_vfree(buf);
+        return ret;
+    }
+
+    if (!e->data) {
+        e->data = qemu_blockalign(bs, s->cluster_size);
+    }
+    e->coffset = coffset;
+    e->loading = true;
+    e->stale = false;
+    qemu_mutex_unlock(&c->lock);
+
+    ret = qcow2_co_decompress_cluster(bs, cluster_descriptor, e->data);
+
+    qemu_mutex_lock(&c->lock);
+    e->loading = false;
+    if (ret == 0 && qiov) {
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            e->data + offset_in_cluster, bytes);
+    }
+    if (ret < 0 || e->stale) {
+        e->coffset = 0;
+        e->lru_counter = 0;
+    } else {
+        e->lru_counter = ++c->lru_counter;
+    }
+    qemu_co_queue_restart_all(&e->waiters);
+    qemu_mutex_unlock(&c->lock);
+
+    return ret;
+}
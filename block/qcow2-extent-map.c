@@ -0,0 +1,218 @@
+/*
+ * Extent map for read-only qcow2 images
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The mapping of a read-only image never changes, so it can be walked once
+ * when the image is opened and stored as a sorted array of extents.  Each
+ * extent is a run of subclusters that have the same type and, if they are
+ * allocated, are contiguous in the host file as well.  A lookup is a binary
+ * search in this array and never touches the L2 table cache, so backing
+ * files shared by many overlays do not compete for cache entries.
+ *
+ * Extents start at a subcluster boundary, so the low bits of the guest
+ * offset are free and hold the subcluster type.  The length of an extent is
+ * implied by the start of the next one.  Compressed clusters are never
+ * merged: their host offset is the compressed cluster descriptor.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qcow2.h"
+#include "trace.h"
+
+#define EXTENT_TYPE_MASK ((1 << MIN_CLUSTER_BITS) - 1)
+
+QEMU_BUILD_BUG_ON(QCOW2_SUBCLUSTER_INVALID > EXTENT_TYPE_MASK);
+
+typedef struct Qcow2Extent {
+    uint64_t offset_and_type;
+    uint64_t host_offset;
+} Qcow2Extent;
+
+struct Qcow2ExtentMap {
+    uint64_t size;          /* Guest size covered by the map */
+    size_t nb_extents;
+    Qcow2Extent *extents;
+};
+
+static inline uint64_t extent_offset(Qcow2Extent *e)
+{
+    return e->offset_and_type & ~(uint64_t)EXTENT_TYPE_MASK;
+}
+
+static inline QCow2SubclusterType extent_type(Qcow2Extent *e)
+{
+    return e->offset_and_type & EXTENT_TYPE_MASK;
+}
+
+static bool extent_has_host_offset(QCow2SubclusterType type)
+{
+    return type == QCOW2_SUBCLUSTER_NORMAL ||
+           type == QCOW2_SUBCLUSTER_ZERO_ALLOC ||
+           type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC;
+}
+
+/*
+ * Walk the L2 tables of the active L1 table and store the mapping of the
+ * whole image in *map.  The caller must make sure that there are no
+ * concurrent requests.
+ *
+ * If the map would take more than @max_size bytes, which can happen with
+ * heavily fragmented images, *map is set to NULL and reads keep using the
+ * L2 cache.
+ *
+ * Returns 0 on success, -errno in failure case.
+ */
+int qcow2_build_extent_map(BlockDriverState *bs, uint64_t max_size,
+                           Qcow2ExtentMap **map, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    /* Keeps @offset aligned to a cluster until the end of the image */
+    unsigned int max_bytes = QEMU_ALIGN_DOWN(INT_MAX, s->cluster_size);
+    uint64_t offset = 0;
+    GArray *extents;
+    Qcow2ExtentMap *m;
+    int ret;
+
+    extents = g_array_new(false, false, sizeof(Qcow2Extent));
+
+    while (offset < size) {
+        unsigned int bytes = MIN(size - offset, max_bytes);
+        uint64_t host_offset;
+        QCow2SubclusterType type;
+        Qcow2Extent *last = NULL;
+
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not build the extent map");
+            g_array_free(extents, true);
+            return ret;
+        }
+
+        if (extents->len) {
+            last = &g_array_index(extents, Qcow2Extent, extents->len - 1);
+        }
+
+        if (last && extent_type(last) == type &&
+            type != QCOW2_SUBCLUSTER_COMPRESSED &&
+            (!extent_has_host_offset(type) ||
+             last->host_offset + (offset - extent_offset(last)) ==
+             host_offset))
+        {
+            /* Extends the previous extent */
+        } else {
+            Qcow2Extent e = {
+                .offset_and_type = offset | type,
+                .host_offset = host_offset,
+            };
+            assert(!(offset & EXTENT_TYPE_MASK));
+
+            if (sizeof(Qcow2ExtentMap) +
+                (extents->len + 1) * sizeof(Qcow2Extent) > max_size)
+            {
+                trace_qcow2_extent_map_too_big(bs, max_size);
+                g_array_free(extents, true);
+                *map = NULL;
+                return 0;
+            }
+            g_array_append_val(extents, e);
+        }
+
+        offset += bytes;
+    }
+
+    m = g_new(Qcow2ExtentMap, 1);
+    m->size = size;
+    m->nb_extents = extents->len;
+    m->extents = g_memdup(extents->data, extents->len * sizeof(Qcow2Extent));
+    g_array_free(extents, true);
+
+    trace_qcow2_build_extent_map(bs, m->nb_extents);
+    *map = m;
+    return 0;
+}
+
+void qcow2_free_extent_map(Qcow2ExtentMap *map)
+{
+    if (map) {
+        g_free(map->extents);
+        g_free(map);
+    }
+}
+
+/*
+ * Like qcow2_get_host_offset(), but resolves @offset using @map.  This
+ * cannot fail and does not need s->lock.
+ */
+void qcow2_extent_map_lookup(Qcow2ExtentMap *map, uint64_t offset,
+                             unsigned int *bytes, uint64_t *host_offset,
+                             QCow2SubclusterType *subcluster_type)
+{
+    size_t lo = 0, hi = map->nb_extents;
+    Qcow2Extent *e;
+    uint64_t end;
+
+    assert(offset < map->size);
+
+    /* Find the last extent that starts at or before @offset */
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (extent_offset(&map->extents[mid]) <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    e = &map->extents[lo];
+    end = lo + 1 < map->nb_extents ? extent_offset(&map->extents[lo + 1])
+                                   : map->size;
+
+    *bytes = MIN(*bytes, end - offset);
+    *subcluster_type = extent_type(e);
+
+    switch (*subcluster_type) {
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        *host_offset = e->host_offset;
+        break;
+    case QCOW2_SUBCLUSTER_NORMAL:
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        *host_offset = e->host_offset + (offset - extent_offset(e));
+        break;
+    default:
+        *host_offset = 0;
+        break;
+    }
+}
+
+Qcow2ExtentMapInfo *qcow2_get_extent_map_info(Qcow2ExtentMap *map)
+{
+    Qcow2ExtentMapInfo *info = g_new0(Qcow2ExtentMapInfo, 1);
+
+    info->extents = map->nb_extents;
+    info->memory = sizeof(*map) + map->nb_extents * sizeof(Qcow2Extent);
+
+    return info;
+}
@@ -899,6 +899,17 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            /* The table may be on its way into the cache, too */
+            qcow2_cache_discard_loads(s->l2_table_cache, cluster_offset,
+                                      s->cluster_size);
+
+            /* Compressed clusters starting here can be overwritten now */
+            if (s->compressed_cache) {
+                qcow2_compressed_cache_invalidate(s->compressed_cache,
+                                                  cluster_offset,
+                                                  s->cluster_size);
+            }
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
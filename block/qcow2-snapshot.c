@@ -753,6 +753,151 @@ fail:
     return ret;
 }
 
+/*
+ * Move the VM state saved in the active L1 table into the snapshot @name,
+ * which must not have any VM state yet.  The guest data of the snapshot is
+ * left alone, so it still describes the disk at the time it was taken.
+ */
+int qcow2_snapshot_attach_vmstate(BlockDriverState *bs, const char *name,
+                                  uint64_t vm_state_size, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCowSnapshot *sn, old_sn;
+    uint64_t *l1_table = NULL;
+    int64_t l1_table_offset;
+    int i, l1_size, snapshot_index, ret;
+
+    if (has_data_file(bs)) {
+        error_setg(errp, "Internal snapshots are not supported with an "
+                   "external data file");
+        return -ENOTSUP;
+    }
+
+    snapshot_index = find_snapshot_by_id_and_name(bs, NULL, name);
+    if (snapshot_index < 0) {
+        error_setg(errp, "Can't find the snapshot");
+        return -ENOENT;
+    }
+    sn = &s->snapshots[snapshot_index];
+
+    if (sn->vm_state_size) {
+        error_setg(errp, "Snapshot '%s' already contains VM state", name);
+        return -EEXIST;
+    }
+
+    ret = qcow2_validate_table(bs, sn->l1_table_offset, sn->l1_size,
+                               L1E_SIZE, QCOW_MAX_L1_SIZE,
+                               "Snapshot L1 table", errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /*
+     * The new L1 table of the snapshot takes the guest data part from the
+     * old one and the VM state part from the active L1 table.
+     */
+    l1_size = MAX(sn->l1_size, s->l1_size);
+    l1_table = g_try_new0(uint64_t, l1_size);
+    if (l1_size && l1_table == NULL) {
+        error_setg(errp, "Failed to allocate the snapshot L1 table");
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    ret = bdrv_pread(bs->file, sn->l1_table_offset, l1_table,
+                     sn->l1_size * L1E_SIZE);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read the snapshot L1 table");
+        goto fail;
+    }
+
+    for (i = s->l1_vm_state_index; i < l1_size; i++) {
+        l1_table[i] = i < s->l1_size ? cpu_to_be64(s->l1_table[i]) : 0;
+    }
+
+    l1_table_offset = qcow2_alloc_clusters(bs, l1_size * L1E_SIZE);
+    if (l1_table_offset < 0) {
+        ret = l1_table_offset;
+        error_setg_errno(errp, -ret, "Failed to allocate the snapshot L1 "
+                         "table");
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, l1_table_offset,
+                                        l1_size * L1E_SIZE, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write the snapshot L1 table");
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, l1_table_offset, l1_table,
+                      l1_size * L1E_SIZE);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write the snapshot L1 table");
+        goto fail;
+    }
+
+    g_free(l1_table);
+    l1_table = NULL;
+
+    /*
+     * As in qcow2_snapshot_create(), take the references of the new L1 table
+     * before the snapshot table points to it.  A failure up to the update of
+     * the snapshot table only leaks clusters.
+     */
+    ret = qcow2_update_snapshot_refcount(bs, l1_table_offset, l1_size, 1);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update the refcounts");
+        goto fail;
+    }
+
+    old_sn = *sn;
+    sn->l1_table_offset = l1_table_offset;
+    sn->l1_size = l1_size;
+    sn->vm_state_size = vm_state_size;
+
+    ret = qcow2_write_snapshots(bs);
+    if (ret < 0) {
+        *sn = old_sn;
+        error_setg_errno(errp, -ret, "Failed to update the snapshot table");
+        goto fail;
+    }
+
+    /* Drop the old L1 table of the snapshot, as qcow2_snapshot_delete() */
+    ret = qcow2_update_snapshot_refcount(bs, old_sn.l1_table_offset,
+                                         old_sn.l1_size, -1);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to free the old L1 table");
+        return ret;
+    }
+    qcow2_free_clusters(bs, old_sn.l1_table_offset,
+                        old_sn.l1_size * L1E_SIZE, QCOW2_DISCARD_SNAPSHOT);
+
+    /* The VM state is now owned by the snapshot only */
+    qcow2_cluster_discard(bs, qcow2_vm_state_offset(s),
+                          ROUND_UP(vm_state_size, s->cluster_size),
+                          QCOW2_DISCARD_NEVER, false);
+
+    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret,
+                         "Failed to update snapshot status in disk");
+        return ret;
+    }
+
+#ifdef DEBUG_ALLOC
+    {
+        BdrvCheckResult result = {0};
+        qcow2_check_refcounts(bs, &result, 0);
+    }
+#endif
+    return 0;
+
+fail:
+    g_free(l1_table);
+    return ret;
+}
+
 /* copy the snapshot 'snapshot_name' into the current disk image */
 int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
 {
@@ -1058,16 +1203,15 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
         return ret;
     }
 
-    /* Switch the L1 table */
-    qemu_vfree(s->l1_table);
+    for (i = 0; i < sn->l1_size; i++) {
+        be64_to_cpus(&new_l1_table[i]);
+    }
 
-    s->l1_size = sn->l1_size;
+    /* Switch the L1 table; the extent map describes the old one */
+    qcow2_free_extent_map(s->extent_map);
+    s->extent_map = NULL;
     s->l1_table_offset = sn->l1_table_offset;
-    s->l1_table = new_l1_table;
-
-    for(i = 0;i < s->l1_size; i++) {
-        be64_to_cpus(&s->l1_table[i]);
-    }
+    qcow2_replace_l1_table(s, new_l1_table, sn->l1_size);
 
     return 0;
 }
@@ -75,6 +75,7 @@ typedef struct {
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t cluster_descriptor,
+                           uint64_t compressed_gen,
                            uint64_t offset,
                            uint64_t bytes,
                            QEMUIOVector *qiov,
@@ -611,6 +612,9 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
     memset(result, 0, sizeof(*result));
 
+    /* Reserved clusters would be reported as leaks */
+    qcow2_release_cluster_reservation(bs);
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -697,6 +701,10 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_CLUSTER_RESERVATION,
+    QCOW2_OPT_EXTENT_MAP,
+    QCOW2_OPT_EXTENT_MAP_SIZE,
+    QCOW2_OPT_COMPRESSED_READAHEAD,
     NULL
 };
 
@@ -808,6 +816,28 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_CLUSTER_RESERVATION,
+            .type = QEMU_OPT_SIZE,
+            .help = "Allocate host clusters for data in chunks of this size",
+        },
+        {
+            .name = QCOW2_OPT_EXTENT_MAP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Map the whole image in memory if it is read-only",
+        },
+        {
+            .name = QCOW2_OPT_EXTENT_MAP_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the extent map (in bytes); larger maps "
+                    "are not built",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_READAHEAD,
+            .type = QEMU_OPT_SIZE,
+            .help = "Decompress this many bytes ahead of sequential reads "
+                    "of compressed clusters",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -969,6 +999,13 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t cluster_reservation;
+    bool use_extent_map;
+    uint64_t extent_map_max_size;
+    Qcow2ExtentMap *extent_map;
+    bool extent_map_built;
+    Qcow2CompressedCache *compressed_cache;
+    int compressed_readahead;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -982,6 +1019,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t compressed_readahead;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1070,6 +1108,33 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->cluster_reservation =
+        qemu_opt_get_size(opts, QCOW2_OPT_CLUSTER_RESERVATION, 0) /
+        s->cluster_size;
+    if (r->cluster_reservation > INT_MAX) {
+        error_setg(errp, "Cluster reservation too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->use_extent_map = qemu_opt_get_bool(opts, QCOW2_OPT_EXTENT_MAP, false);
+    r->extent_map_max_size = qemu_opt_get_size(opts, QCOW2_OPT_EXTENT_MAP_SIZE,
+                                               DEFAULT_EXTENT_MAP_MAX_SIZE);
+
+    compressed_readahead =
+        qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_READAHEAD, 0);
+    if (compressed_readahead > QCOW2_MAX_COMPRESSED_READAHEAD) {
+        error_setg(errp, "Compressed readahead too big "
+                   "(at most %" PRId64 " MiB)",
+                   QCOW2_MAX_COMPRESSED_READAHEAD / MiB);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->compressed_readahead = DIV_ROUND_UP(compressed_readahead,
+                                           s->cluster_size);
+    r->compressed_cache = qcow2_compressed_cache_create(
+        QCOW2_COMPRESSED_CACHE_MIN_ENTRIES + r->compressed_readahead);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1214,6 +1279,15 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
+    s->cluster_reservation = r->cluster_reservation;
+    s->use_extent_map = r->use_extent_map;
+    s->extent_map_max_size = r->extent_map_max_size;
+
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_destroy(s->compressed_cache);
+    }
+    s->compressed_cache = r->compressed_cache;
+    s->compressed_readahead = r->compressed_readahead;
 
     for (i = 0; i < QCOW2_DISCARD_MAX; i++) {
         s->discard_passthrough[i] = r->discard_passthrough[i];
@@ -1238,6 +1312,10 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    if (r->compressed_cache) {
+        qcow2_compressed_cache_destroy(r->compressed_cache);
+    }
+    qcow2_free_extent_map(r->extent_map);
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1604,6 +1682,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     }
 
     QLIST_INIT(&s->cluster_allocs);
+    QLIST_INIT(&s->l2_allocs);
     QTAILQ_INIT(&s->discards);
 
     /* read qcow2 extensions */
@@ -1832,6 +1911,14 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+    if (s->use_extent_map && !(flags & BDRV_O_RDWR)) {
+        ret = qcow2_build_extent_map(bs, s->extent_map_max_size,
+                                     &s->extent_map, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     qemu_co_queue_init(&s->thread_task_queue);
 
     return ret;
@@ -1856,6 +1943,9 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_destroy(s->compressed_cache);
+    }
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -1899,6 +1989,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_mutex_init(&s->l1_write_lock);
 
     if (qemu_in_coroutine()) {
         /* From bdrv_co_create.  */
@@ -1926,6 +2017,7 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
+    BDRVQcow2State *s = state->bs->opaque;
     Qcow2ReopenState *r;
     int ret;
 
@@ -1945,6 +2037,8 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
             goto fail;
         }
 
+        qcow2_release_cluster_reservation(state->bs);
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -1954,6 +2048,18 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
         if (ret < 0) {
             goto fail;
         }
+
+        if (r->use_extent_map &&
+            (!s->extent_map ||
+             r->extent_map_max_size != s->extent_map_max_size))
+        {
+            ret = qcow2_build_extent_map(state->bs, r->extent_map_max_size,
+                                         &r->extent_map, errp);
+            if (ret < 0) {
+                goto fail;
+            }
+            r->extent_map_built = true;
+        }
     }
 
     return 0;
@@ -1966,8 +2072,23 @@ fail:
 
 static void qcow2_reopen_commit(BDRVReopenState *state)
 {
-    qcow2_update_options_commit(state->bs, state->opaque);
-    g_free(state->opaque);
+    BDRVQcow2State *s = state->bs->opaque;
+    Qcow2ReopenState *r = state->opaque;
+
+    qcow2_update_options_commit(state->bs, r);
+
+    /*
+     * The map is only valid as long as nothing can write to the image.  A
+     * new map replaces the old one even if it was too big to be built.
+     */
+    if (r->extent_map_built || (state->flags & BDRV_O_RDWR) ||
+        !s->use_extent_map)
+    {
+        qcow2_free_extent_map(s->extent_map);
+        s->extent_map = r->extent_map;
+    }
+
+    g_free(r);
 }
 
 static void qcow2_reopen_commit_post(BDRVReopenState *state)
@@ -2061,7 +2182,13 @@ static int coroutine_fn qcow2_co_block_status(BlockDriverState *bs,
     }
 
     bytes = MIN(INT_MAX, count);
-    ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
+    if (s->extent_map) {
+        qcow2_extent_map_lookup(s->extent_map, offset, &bytes,
+                                &host_offset, &type);
+        ret = 0;
+    } else {
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
+    }
     qemu_co_mutex_unlock(&s->lock);
     if (ret < 0) {
         return ret;
@@ -2181,10 +2308,16 @@ typedef struct Qcow2AioTask {
     uint64_t bytes;
     QEMUIOVector *qiov;
     uint64_t qiov_offset;
+    uint64_t compressed_gen; /* only for read, see qcow2_add_task() */
     QCowL2Meta *l2meta; /* only for write */
 } Qcow2AioTask;
 
 static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task);
+
+/*
+ * For reads of compressed clusters, @compressed_gen is the generation of the
+ * compressed cache from before @host_offset was looked up.
+ */
 static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
                                        AioTaskPool *pool,
                                        AioTaskFunc func,
@@ -2194,6 +2327,7 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
                                        uint64_t bytes,
                                        QEMUIOVector *qiov,
                                        size_t qiov_offset,
+                                       uint64_t compressed_gen,
                                        QCowL2Meta *l2meta)
 {
     Qcow2AioTask local_task;
@@ -2208,6 +2342,7 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
         .offset = offset,
         .bytes = bytes,
         .qiov_offset = qiov_offset,
+        .compressed_gen = compressed_gen,
         .l2meta = l2meta,
     };
 
@@ -2230,7 +2365,8 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
                                              uint64_t host_offset,
                                              uint64_t offset, uint64_t bytes,
                                              QEMUIOVector *qiov,
-                                             size_t qiov_offset)
+                                             size_t qiov_offset,
+                                             uint64_t compressed_gen)
 {
     BDRVQcow2State *s = bs->opaque;
 
@@ -2249,7 +2385,7 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
                                    qiov, qiov_offset, 0);
 
     case QCOW2_SUBCLUSTER_COMPRESSED:
-        return qcow2_co_preadv_compressed(bs, host_offset,
+        return qcow2_co_preadv_compressed(bs, host_offset, compressed_gen,
                                           offset, bytes, qiov, qiov_offset);
 
     case QCOW2_SUBCLUSTER_NORMAL:
@@ -2277,7 +2413,105 @@ static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task)
 
     return qcow2_co_preadv_task(t->bs, t->subcluster_type,
                                 t->host_offset, t->offset, t->bytes,
-                                t->qiov, t->qiov_offset);
+                                t->qiov, t->qiov_offset, t->compressed_gen);
+}
+
+typedef struct Qcow2CompressedReadahead {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+} Qcow2CompressedReadahead;
+
+static void coroutine_fn qcow2_compressed_readahead_entry(void *opaque)
+{
+    Qcow2CompressedReadahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    AioTaskPool *aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    uint64_t offset = ra->offset;
+    uint64_t bytes = ra->bytes;
+    uint64_t gen = qcow2_compressed_cache_generation(s->compressed_cache);
+    int ret = 0;
+
+    while (bytes != 0 && ret == 0 && aio_task_pool_status(aio) == 0) {
+        unsigned int cur_bytes = MIN(bytes, INT_MAX);
+        uint64_t host_offset;
+        QCow2SubclusterType type;
+
+        if (s->extent_map) {
+            qcow2_extent_map_lookup(s->extent_map, offset, &cur_bytes,
+                                    &host_offset, &type);
+        } else {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        if (type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            break;
+        }
+
+        /* A NULL qiov only loads the cluster into the compressed cache */
+        ret = qcow2_add_task(bs, aio, qcow2_co_preadv_task_entry, type,
+                             host_offset, offset, cur_bytes, NULL, 0, gen,
+                             NULL);
+        bytes -= cur_bytes;
+        offset += cur_bytes;
+    }
+
+    /* Errors are reported when the guest actually reads the data */
+    aio_task_pool_wait_all(aio);
+    g_free(aio);
+    g_free(ra);
+
+    s->compressed_readahead_busy = false;
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Called after a read of compressed clusters from @start to @end.  If it
+ * continues the previous one, decompress the next clusters in the
+ * background so that they are in the cache when the guest gets there.
+ */
+static void qcow2_compressed_readahead(BlockDriverState *bs,
+                                       uint64_t start, uint64_t end)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedReadahead *ra;
+    uint64_t ra_start, ra_end;
+    Coroutine *co;
+
+    if (start != s->compressed_next_offset) {
+        s->compressed_next_offset = end;
+        s->compressed_readahead_end = 0;
+        return;
+    }
+    s->compressed_next_offset = end;
+
+    end = ROUND_UP(end, s->cluster_size);
+    ra_start = MAX(end, s->compressed_readahead_end);
+    ra_end = MIN(end + ((uint64_t) s->compressed_readahead << s->cluster_bits),
+                 bs->total_sectors * BDRV_SECTOR_SIZE);
+    if (ra_start >= ra_end || s->compressed_readahead_busy) {
+        return;
+    }
+
+    ra = g_new(Qcow2CompressedReadahead, 1);
+    *ra = (Qcow2CompressedReadahead) {
+        .bs = bs,
+        .offset = ra_start,
+        .bytes = ra_end - ra_start,
+    };
+    s->compressed_readahead_end = ra_end;
+    s->compressed_readahead_busy = true;
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_compressed_readahead_entry, ra);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
 }
 
 static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
@@ -2289,6 +2523,9 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
     int ret = 0;
     unsigned int cur_bytes; /* number of bytes in current iteration */
     uint64_t host_offset = 0;
+    uint64_t start_offset = offset;
+    uint64_t gen = qcow2_compressed_cache_generation(s->compressed_cache);
+    bool compressed = false;
     QCow2SubclusterType type;
     AioTaskPool *aio = NULL;
 
@@ -2300,12 +2537,23 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+        if (s->extent_map) {
+            qcow2_extent_map_lookup(s->extent_map, offset, &cur_bytes,
                                     &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
-        if (ret < 0) {
-            goto out;
+        } else if (!qcow2_get_host_offset_lockless(bs, offset, &cur_bytes,
+                                                   &host_offset, &type)) {
+            ret = qcow2_co_load_l2_slice(bs, offset);
+            if (ret < 0) {
+                goto out;
+            }
+
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
         }
 
         if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
@@ -2315,15 +2563,20 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
         {
             qemu_iovec_memset(qiov, qiov_offset, 0, cur_bytes);
         } else {
+            /*
+             * Compressed clusters are returned one at a time, so each of
+             * them is decompressed by a separate task
+             */
             if (!aio && cur_bytes != bytes) {
                 aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
             }
             ret = qcow2_add_task(bs, aio, qcow2_co_preadv_task_entry, type,
                                  host_offset, offset, cur_bytes,
-                                 qiov, qiov_offset, NULL);
+                                 qiov, qiov_offset, gen, NULL);
             if (ret < 0) {
                 goto out;
             }
+            compressed |= type == QCOW2_SUBCLUSTER_COMPRESSED;
         }
 
         bytes -= cur_bytes;
@@ -2340,6 +2593,10 @@ out:
         g_free(aio);
     }
 
+    if (ret == 0 && compressed && s->compressed_readahead) {
+        qcow2_compressed_readahead(bs, start_offset, offset);
+    }
+
     return ret;
 }
 
@@ -2495,6 +2752,7 @@ static coroutine_fn int qcow2_co_pwritev_task(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
     void *crypt_buf = NULL;
     QEMUIOVector encrypted_qiov;
+    QCowL2Meta *m;
 
     if (bs->encrypted) {
         assert(s->crypto);
@@ -2538,6 +2796,18 @@ static coroutine_fn int qcow2_co_pwritev_task(BlockDriverState *bs,
         }
     }
 
+    /*
+     * The L2 slices may have been evicted while the data was written; read
+     * them back before taking s->lock, so that linking them in does not
+     * stall every other request on the image.
+     */
+    for (m = l2meta; m != NULL; m = m->next) {
+        ret = qcow2_co_load_l2_slice(bs, m->offset);
+        if (ret < 0) {
+            goto out_unlocked;
+        }
+    }
+
     qemu_co_mutex_lock(&s->lock);
 
     ret = qcow2_handle_l2meta(bs, &l2meta, true);
@@ -2593,6 +2863,11 @@ static coroutine_fn int qcow2_co_pwritev_part(
                             - offset_in_cluster);
         }
 
+        ret = qcow2_co_alloc_l2_table(bs, offset);
+        if (ret < 0) {
+            goto fail_nometa;
+        }
+
         qemu_co_mutex_lock(&s->lock);
 
         ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
@@ -2614,7 +2889,7 @@ static coroutine_fn int qcow2_co_pwritev_part(
         }
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_task_entry, 0,
                              host_offset, offset,
-                             cur_bytes, qiov, qiov_offset, l2meta);
+                             cur_bytes, qiov, qiov_offset, 0, l2meta);
         l2meta = NULL; /* l2meta is consumed by qcow2_co_pwritev_task() */
         if (ret < 0) {
             goto fail_nometa;
@@ -2654,6 +2929,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_release_cluster_reservation(bs);
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2686,6 +2963,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+    qcow2_free_extent_map(s->extent_map);
+    s->extent_map = NULL;
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -2697,6 +2976,7 @@ static void qcow2_close(BlockDriverState *bs)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_compressed_cache_destroy(s->compressed_cache);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4170,6 +4450,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
     }
 
     qemu_co_mutex_lock(&s->lock);
+    qcow2_release_cluster_reservation(bs);
 
     /*
      * Even though we store snapshot size for all images, it was not
@@ -4642,7 +4923,8 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
+                             0, 0, offset, chunk_size, qiov, qiov_offset, 0,
+                             NULL);
         if (ret < 0) {
             break;
         }
@@ -4665,47 +4947,18 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t cluster_descriptor,
+                           uint64_t compressed_gen,
                            uint64_t offset,
                            uint64_t bytes,
                            QEMUIOVector *qiov,
                            size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize, nb_csectors;
-    uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
-
-    coffset = cluster_descriptor & s->cluster_offset_mask;
-    nb_csectors = ((cluster_descriptor >> s->csize_shift) & s->csize_mask) + 1;
-    csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
-        (coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
-
-    buf = g_try_malloc(csize);
-    if (!buf) {
-        return -ENOMEM;
-    }
-
-    out_buf = qemu_blockalign(bs, s->cluster_size);
-
-    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
-    if (ret < 0) {
-        goto fail;
-    }
 
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
-        ret = -EIO;
-        goto fail;
-    }
-
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
-fail:
-    qemu_vfree(out_buf);
-    g_free(buf);
-
-    return ret;
+    return qcow2_co_read_compressed_cluster(bs, cluster_descriptor,
+                                            compressed_gen,
+                                            offset_into_cluster(s, offset),
+                                            bytes, qiov, qiov_offset);
 }
 
 static int make_completely_empty(BlockDriverState *bs)
@@ -4866,6 +5119,8 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int step = QEMU_ALIGN_DOWN(INT_MAX, s->cluster_size);
     int l1_clusters, ret = 0;
 
+    qcow2_release_cluster_reservation(bs);
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
@@ -5148,6 +5403,12 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
         assert(false);
     }
 
+    if (s->extent_map) {
+        spec_info->u.qcow2.data->has_extent_map = true;
+        spec_info->u.qcow2.data->extent_map =
+            qcow2_get_extent_map_info(s->extent_map);
+    }
+
     if (encrypt_info) {
         ImageInfoSpecificQCow2Encryption *qencrypt =
             g_new(ImageInfoSpecificQCow2Encryption, 1);
@@ -5934,6 +6195,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_make_empty        = qcow2_make_empty,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
+    .bdrv_snapshot_attach_vmstate = qcow2_snapshot_attach_vmstate,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
     .bdrv_snapshot_delete   = qcow2_snapshot_delete,
     .bdrv_snapshot_list     = qcow2_snapshot_list,
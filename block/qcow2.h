@@ -43,6 +43,9 @@
 #define QCOW_MAX_CRYPT_CLUSTERS 32
 #define QCOW_MAX_SNAPSHOTS 65536
 
+/* Clusters looked up at a time by qcow2_get_host_offset_lockless() */
+#define QCOW2_LOCKLESS_MAX_CLUSTERS 16
+
 /* Field widths in qcow2 mean normal cluster offsets cannot reach
  * 64PB; depending on cluster size, compressed clusters can have a
  * smaller limit (64PB for up to 16k clusters, then ramps down to
@@ -71,6 +74,18 @@
 /* Maximum of parallel sub-request per guest request */
 #define QCOW2_MAX_WORKERS 8
 
+/*
+ * Maximum number of bytes of compressed clusters that are read ahead; each
+ * of them takes up a whole cluster in the cache of decompressed clusters
+ */
+#define QCOW2_MAX_COMPRESSED_READAHEAD (32 * MiB)
+
+/*
+ * Default maximum size of the extent map of a read-only image; enough for
+ * two million extents
+ */
+#define DEFAULT_EXTENT_MAP_MAX_SIZE (32 * MiB)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -150,6 +165,10 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_CLUSTER_RESERVATION "cluster-reservation"
+#define QCOW2_OPT_EXTENT_MAP "extent-map"
+#define QCOW2_OPT_EXTENT_MAP_SIZE "extent-map-size"
+#define QCOW2_OPT_COMPRESSED_READAHEAD "compressed-readahead"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -231,6 +250,12 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2ExtentMap Qcow2ExtentMap;
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
+
+/* Decompressed clusters that are cached in addition to the readahead */
+#define QCOW2_COMPRESSED_CACHE_MIN_ENTRIES 4
+
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
     uint64_t length;
@@ -349,6 +374,31 @@ typedef struct BDRVQcow2State {
     unsigned cache_clean_interval;
 
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
+    QLIST_HEAD(, Qcow2L2Alloc) l2_allocs;
+
+    /*
+     * Host clusters that have been allocated ahead of time, so that most
+     * allocating writes do not need to update refcounts.  They are returned
+     * to the free pool when the image is closed or checked.
+     */
+    uint64_t cluster_reservation; /* clusters to reserve at a time, or 0 */
+    uint64_t reserved_offset;
+    uint64_t reserved_clusters;
+
+    /*
+     * Guest to host mapping of the whole image, only built for read-only
+     * nodes.  If set, it is used instead of the L2 tables for reads.  It
+     * is not built if it would take more than extent_map_max_size bytes.
+     */
+    bool use_extent_map;
+    uint64_t extent_map_max_size;
+    Qcow2ExtentMap *extent_map;
+
+    Qcow2CompressedCache *compressed_cache;
+    int compressed_readahead;         /* in clusters, 0 if disabled */
+    uint64_t compressed_next_offset;  /* where a sequential read continues */
+    uint64_t compressed_readahead_end;
+    bool compressed_readahead_busy;
 
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
@@ -358,6 +408,8 @@ typedef struct BDRVQcow2State {
     uint64_t free_byte_offset;
 
     CoMutex lock;
+    /* Keeps writes of the same L1 table sector in order */
+    CoMutex l1_write_lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
@@ -500,6 +552,19 @@ typedef struct QCowL2Meta
     QLIST_ENTRY(QCowL2Meta) next_in_flight;
 } QCowL2Meta;
 
+/**
+ * An L2 table that qcow2_co_alloc_l2_table() allocates with s->lock dropped
+ */
+typedef struct Qcow2L2Alloc {
+    /** L1 index of the table */
+    uint64_t l1_index;
+
+    /** Requests that need the table and wait for the allocation to end */
+    CoQueue waiters;
+
+    QLIST_ENTRY(Qcow2L2Alloc) next;
+} Qcow2L2Alloc;
+
 /*
  * In images with standard L2 entries all clusters are treated as if
  * they had one subcluster so QCow2ClusterType and QCow2SubclusterType
@@ -900,6 +965,8 @@ int qcow2_detect_metadata_preallocation(BlockDriverState *bs);
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_shrink_l1_table(BlockDriverState *bs, uint64_t max_size);
+void qcow2_replace_l1_table(BDRVQcow2State *s, uint64_t *l1_table,
+                            int l1_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *buf, int nb_sectors, bool enc, Error **errp);
@@ -907,6 +974,9 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
 int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           unsigned int *bytes, uint64_t *host_offset,
                           QCow2SubclusterType *subcluster_type);
+bool qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                    unsigned int *bytes, uint64_t *host_offset,
+                                    QCow2SubclusterType *subcluster_type);
 int qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                             unsigned int *bytes, uint64_t *host_offset,
                             QCowL2Meta **m);
@@ -917,6 +987,11 @@ int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 void qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m);
+void qcow2_release_cluster_reservation(BlockDriverState *bs);
+int coroutine_fn qcow2_co_load_l2_slice(BlockDriverState *bs,
+                                        uint64_t offset);
+int coroutine_fn qcow2_co_alloc_l2_table(BlockDriverState *bs,
+                                         uint64_t offset);
 int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, enum qcow2_discard_type type,
                           bool full_discard);
@@ -929,6 +1004,8 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs,
 
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
+int qcow2_snapshot_attach_vmstate(BlockDriverState *bs, const char *name,
+                                  uint64_t vm_state_size, Error **errp);
 int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id);
 int qcow2_snapshot_delete(BlockDriverState *bs,
                           const char *snapshot_id,
@@ -971,8 +1048,36 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(Qcow2Cache *c, void **table);
+int coroutine_fn qcow2_cache_load_unlocked(BlockDriverState *bs,
+                                           Qcow2Cache *c, uint64_t offset);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+void qcow2_cache_discard_loads(Qcow2Cache *c, uint64_t offset,
+                               uint64_t bytes);
+bool qcow2_cache_read_lockless(Qcow2Cache *c, uint64_t offset, size_t pos,
+                               void *buf, size_t len);
+
+/* qcow2-extent-map.c functions */
+int qcow2_build_extent_map(BlockDriverState *bs, uint64_t max_size,
+                           Qcow2ExtentMap **map, Error **errp);
+void qcow2_free_extent_map(Qcow2ExtentMap *map);
+void qcow2_extent_map_lookup(Qcow2ExtentMap *map, uint64_t offset,
+                             unsigned int *bytes, uint64_t *host_offset,
+                             QCow2SubclusterType *subcluster_type);
+Qcow2ExtentMapInfo *qcow2_get_extent_map_info(Qcow2ExtentMap *map);
+
+/* qcow2-compressed-cache.c functions */
+Qcow2CompressedCache *qcow2_compressed_cache_create(int num_entries);
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c);
+uint64_t qcow2_compressed_cache_generation(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c,
+                                       uint64_t offset, uint64_t bytes);
+int coroutine_fn
+qcow2_co_read_compressed_cluster(BlockDriverState *bs,
+                                 uint64_t cluster_descriptor,
+                                 uint64_t generation,
+                                 size_t offset_in_cluster, size_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset);
 
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
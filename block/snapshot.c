@@ -232,6 +232,44 @@ int bdrv_snapshot_create(BlockDriverState *bs,
     return -ENOTSUP;
 }
 
+/*
+ * Store the VM state that was saved with bdrv_save_vmstate() since the
+ * snapshot @name was taken in that snapshot.  The snapshot must have been
+ * created without VM state.
+ */
+int bdrv_snapshot_attach_vmstate(BlockDriverState *bs,
+                                 const char *name,
+                                 uint64_t vm_state_size,
+                                 Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverState *fallback_bs = bdrv_snapshot_fallback(bs);
+    int ret;
+
+    if (!drv) {
+        error_setg(errp, QERR_DEVICE_HAS_NO_MEDIUM, bdrv_get_device_name(bs));
+        return -ENOMEDIUM;
+    }
+
+    bdrv_drained_begin(bs);
+
+    if (drv->bdrv_snapshot_attach_vmstate) {
+        ret = drv->bdrv_snapshot_attach_vmstate(bs, name, vm_state_size,
+                                                errp);
+    } else if (fallback_bs) {
+        ret = bdrv_snapshot_attach_vmstate(fallback_bs, name, vm_state_size,
+                                           errp);
+    } else {
+        error_setg(errp, "Block format '%s' used by device '%s' "
+                   "does not support adding VM state to a snapshot",
+                   drv->format_name, bdrv_get_device_name(bs));
+        ret = -ENOTSUP;
+    }
+
+    bdrv_drained_end(bs);
+    return ret;
+}
+
 int bdrv_snapshot_goto(BlockDriverState *bs,
                        const char *snapshot_id,
                        Error **errp)
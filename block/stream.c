@@ -176,6 +176,8 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
         /* Publish progress */
         job_progress_update(&s->common.job, n);
         if (copy) {
+            /* Copy-on-read always copies through a buffer */
+            s->common.job.copy_stats.bounced += n;
             delay_ns = block_job_ratelimit_get_delay(&s->common, n);
         } else {
             delay_ns = 0;
@@ -297,6 +299,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     if (!s) {
         goto fail;
     }
+    s->common.job.has_copy_stats = true;
 
     /*
      * Prevent concurrent jobs trying to modify the graph structure here, we
@@ -19,12 +19,14 @@
 
 uint64_t bdrv_write_threshold_get(const BlockDriverState *bs)
 {
-    return bs->write_threshold_offset;
+    return qatomic_read_u64(&bs->write_threshold_offset);
 }
 
 void bdrv_write_threshold_set(BlockDriverState *bs, uint64_t threshold_bytes)
 {
-    bs->write_threshold_offset = threshold_bytes;
+    qemu_mutex_lock(&bs->write_threshold_lock);
+    qatomic_set_u64(&bs->write_threshold_offset, threshold_bytes);
+    qemu_mutex_unlock(&bs->write_threshold_lock);
 }
 
 void qmp_block_set_write_threshold(const char *node_name,
@@ -52,12 +54,26 @@ void bdrv_write_threshold_check_write(BlockDriverState *bs, int64_t offset,
                                       int64_t bytes)
 {
     int64_t end = offset + bytes;
-    uint64_t wtr = bs->write_threshold_offset;
+    uint64_t wtr = qatomic_read_u64(&bs->write_threshold_offset);
 
-    if (wtr > 0 && end > wtr) {
-        qapi_event_send_block_write_threshold(bs->node_name, end - wtr, wtr);
+    if (wtr == 0 || end <= wtr) {
+        return;
+    }
 
-        /* autodisable to avoid flooding the monitor */
-        bdrv_write_threshold_set(bs, 0);
+    /*
+     * Requests can come from several AioContexts at once; re-check under
+     * the lock so that only one of them sends the event.
+     */
+    qemu_mutex_lock(&bs->write_threshold_lock);
+    wtr = qatomic_read_u64(&bs->write_threshold_offset);
+    if (wtr == 0 || end <= wtr) {
+        qemu_mutex_unlock(&bs->write_threshold_lock);
+        return;
     }
+
+    /* autodisable to avoid flooding the monitor */
+    qatomic_set_u64(&bs->write_threshold_offset, 0);
+    qemu_mutex_unlock(&bs->write_threshold_lock);
+
+    qapi_event_send_block_write_threshold(bs->node_name, end - wtr, wtr);
 }
@@ -309,6 +309,7 @@ int64_t block_job_ratelimit_get_delay(BlockJob *job, uint64_t n)
 
 BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
 {
+    const BlockJobDriver *drv = block_job_driver(job);
     BlockJobInfo *info;
 
     if (block_job_is_internal(job)) {
@@ -316,7 +317,7 @@ BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
         return NULL;
     }
     info = g_new0(BlockJobInfo, 1);
-    info->type      = g_strdup(job_type_str(&job->job));
+    info->type      = job_type(&job->job);
     info->device    = g_strdup(job->job.id);
     info->busy      = qatomic_read(&job->job.busy);
     info->paused    = job->job.pause_count > 0;
@@ -334,6 +335,9 @@ BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
                         g_strdup(error_get_pretty(job->job.err)) :
                         g_strdup(strerror(-job->job.ret));
     }
+    if (drv->query) {
+        drv->query(job, info);
+    }
     return info;
 }
 
@@ -1730,16 +1730,20 @@ ERST
     },
 
 SRST
-``calc_dirty_rate`` *second*
+``calc_dirty_rate`` [-r | -b] *second*
   Start a round of dirty rate measurement with the period specified in *second*.
   The result of the dirty rate measurement may be observed with ``info
-  dirty_rate`` command.
+  dirty_rate`` command.  By default the rate is estimated by sampling guest
+  pages; ``-r`` measures the rate of each vCPU with the KVM dirty ring, and
+  ``-b`` measures the rate of each RAMBlock with the dirty bitmap.
 ERST
 
     {
         .name       = "calc_dirty_rate",
-        .args_type  = "second:l,sample_pages_per_GB:l?",
-        .params     = "second [sample_pages_per_GB]",
-        .help       = "start a round of guest dirty rate measurement",
+        .args_type  = "dirty_ring:-r,dirty_bitmap:-b,second:l,sample_pages_per_GB:l?",
+        .params     = "[-r] [-b] second [sample_pages_per_GB]",
+        .help       = "start a round of guest dirty rate measurement (using -r to"
+                      "\n\t\t\t specify dirty ring as the method of calculation and"
+                      "\n\t\t\t -b to specify dirty bitmap as method of calculation)",
         .cmd        = hmp_calc_dirty_rate,
     },
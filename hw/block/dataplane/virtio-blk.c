@@ -19,6 +19,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/thread.h"
 #include "qemu/error-report.h"
+#include "qemu/cutils.h"
 #include "hw/virtio/virtio-access.h"
 #include "hw/virtio/virtio-blk.h"
 #include "virtio-blk.h"
@@ -43,6 +44,18 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /*
+     * The IOThread and AioContext that handle each virtqueue.  The
+     * BlockBackend stays in ctx, the AioContext of the first virtqueue.
+     * If the virtqueues are handled by several IOThreads, the BlockBackend
+     * is switched to multiqueue mode: each IOThread submits and completes
+     * the requests of its virtqueues in its own AioContext, and only takes
+     * the locks of these virtqueues (see VirtIOBlock.vq_lock).
+     */
+    IOThread **vq_iothread;
+    AioContext **vq_aio_context;
+    bool multiqueue;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -80,6 +93,86 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/*
+ * Assign the virtqueues to IOThreads as described by the iothread-vq-mapping
+ * property: a list of IOThread ids separated by ':', each optionally followed
+ * by '@' and the virtqueue or range of virtqueues that it handles, like
+ * "iothread0@0-3:iothread1@4-7".  Without virtqueue ranges the virtqueues
+ * are spread round-robin over the IOThreads.
+ */
+static bool apply_iothread_vq_mapping(const char *mapping,
+                                      IOThread **vq_iothread,
+                                      uint16_t num_queues, Error **errp)
+{
+    g_auto(GStrv) entries = g_strsplit(mapping, ":", -1);
+    unsigned num_entries = g_strv_length(entries);
+    bool with_vqs = false;
+    unsigned i, vq;
+
+    if (!num_entries) {
+        error_setg(errp, "iothread-vq-mapping must not be empty");
+        return false;
+    }
+
+    for (i = 0; i < num_entries; i++) {
+        char *vqs = strchr(entries[i], '@');
+        unsigned first = 0, last;
+        const char *end;
+        IOThread *iothread;
+        bool ok;
+
+        if (vqs) {
+            *vqs++ = '\0';
+        }
+        if (i && !vqs != !with_vqs) {
+            error_setg(errp, "iothread-vq-mapping must give the virtqueues "
+                       "of all IOThreads or of none");
+            return false;
+        }
+        with_vqs = vqs;
+
+        iothread = iothread_by_id(entries[i]);
+        if (!iothread) {
+            error_setg(errp, "IOThread '%s' not found", entries[i]);
+            return false;
+        }
+
+        if (!vqs) {
+            for (vq = i; vq < num_queues; vq += num_entries) {
+                vq_iothread[vq] = iothread;
+            }
+            continue;
+        }
+
+        ok = qemu_strtoui(vqs, &end, 10, &first) == 0;
+        last = first;
+        if (ok && *end == '-') {
+            ok = qemu_strtoui(end + 1, &end, 10, &last) == 0;
+        }
+        if (!ok || *end || first > last || last >= num_queues) {
+            error_setg(errp, "invalid virtqueue range '%s' for IOThread '%s'",
+                       vqs, entries[i]);
+            return false;
+        }
+        for (vq = first; vq <= last; vq++) {
+            if (vq_iothread[vq]) {
+                error_setg(errp, "virtqueue %u is assigned to more than one "
+                           "IOThread", vq);
+                return false;
+            }
+            vq_iothread[vq] = iothread;
+        }
+    }
+
+    for (vq = 0; vq < num_queues; vq++) {
+        if (!vq_iothread[vq]) {
+            error_setg(errp, "virtqueue %u is not assigned to an IOThread", vq);
+            return false;
+        }
+    }
+    return true;
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -88,10 +181,18 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    g_autofree IOThread **vq_iothread = g_new0(IOThread *, conf->num_queues);
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread_vq_mapping &&
+        !apply_iothread_vq_mapping(conf->iothread_vq_mapping, vq_iothread,
+                                   conf->num_queues, errp)) {
+        return false;
+    }
+
+    if (conf->iothread || conf->iothread_vq_mapping) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -120,13 +221,36 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
-    if (conf->iothread) {
+    if (conf->iothread_vq_mapping) {
+        s->iothread = vq_iothread[0];
+    } else if (conf->iothread) {
         s->iothread = conf->iothread;
+    }
+    if (s->iothread) {
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
     } else {
         s->ctx = qemu_get_aio_context();
     }
+
+    s->vq_iothread = g_new0(IOThread *, conf->num_queues);
+    s->vq_aio_context = g_new(AioContext *, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        s->vq_iothread[i] = vq_iothread[i] ?: s->iothread;
+        if (s->vq_iothread[i]) {
+            object_ref(OBJECT(s->vq_iothread[i]));
+            s->vq_aio_context[i] = iothread_get_aio_context(s->vq_iothread[i]);
+        } else {
+            s->vq_aio_context[i] = s->ctx;
+        }
+    }
+
+    for (i = 1; i < conf->num_queues; i++) {
+        if (s->vq_aio_context[i] != s->ctx) {
+            s->multiqueue = true;
+        }
+    }
+
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
@@ -135,10 +259,17 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     return true;
 }
 
+/* Whether the virtqueues are handled by more than one IOThread */
+bool virtio_blk_data_plane_is_multiqueue(VirtIOBlockDataPlane *s)
+{
+    return s->multiqueue;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -148,6 +279,13 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
+    for (i = 0; i < s->conf->num_queues; i++) {
+        if (s->vq_iothread[i]) {
+            object_unref(OBJECT(s->vq_iothread[i]));
+        }
+    }
+    g_free(s->vq_iothread);
+    g_free(s->vq_aio_context);
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
@@ -184,7 +322,12 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
     s->starting = true;
 
-    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    /*
+     * The batched notifications are sent from ctx, which must not touch
+     * the virtqueues of the other IOThreads.
+     */
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX) &&
+        !s->multiqueue) {
         s->batch_notifications = true;
     } else {
         s->batch_notifications = false;
@@ -234,6 +377,9 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
         error_report_err(local_err);
         goto fail_aio_context;
     }
+    if (s->multiqueue) {
+        blk_set_multiqueue(s->conf->conf.blk, true);
+    }
 
     /* Process queued requests before the ones in vring */
     virtio_blk_process_queued_requests(vblk, false);
@@ -246,14 +392,21 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        /*
+         * Let the request and coroutine pools of the AioContext hold as
+         * many objects as the guest can have requests in flight.
+         */
+        aio_context_reserve_pools(ctx, virtio_queue_get_num(s->vdev, i));
+
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_aio_context:
@@ -282,19 +435,56 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     return -ENOSYS;
 }
 
+typedef struct {
+    VirtIOBlockDataPlane *s;
+    AioContext *ctx;
+} VirtIOBlockDataPlaneStop;
+
 /* Stop notifications for new requests from guest.
  *
  * Context: BH in IOThread
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneStop *stop = opaque;
+    VirtIOBlockDataPlane *s = stop->s;
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (s->vq_aio_context[i] == stop->ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, stop->ctx, NULL);
+        }
+    }
+}
+
+/*
+ * Stop the virtqueues of the IOThreads other than the one of the
+ * BlockBackend.
+ *
+ * Context: QEMU global mutex held
+ */
+static void virtio_blk_data_plane_stop_vqs(VirtIOBlockDataPlane *s)
+{
+    VirtIOBlockDataPlaneStop stop = { .s = s };
+    unsigned i, j;
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        stop.ctx = s->vq_aio_context[i];
+        if (stop.ctx == s->ctx) {
+            continue;
+        }
+        for (j = 0; j < i && s->vq_aio_context[j] != stop.ctx; j++) {
+            /* nothing */
+        }
+        if (j < i) {
+            /* already stopped */
+            continue;
+        }
+        aio_context_acquire(stop.ctx);
+        aio_wait_bh_oneshot(stop.ctx, virtio_blk_data_plane_stop_bh, &stop);
+        aio_context_release(stop.ctx);
     }
 }
 
@@ -305,6 +495,7 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     VirtIOBlockDataPlane *s = vblk->dataplane;
     BusState *qbus = qdev_get_parent_bus(DEVICE(vblk));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOBlockDataPlaneStop stop = { .s = s, .ctx = s->ctx };
     unsigned i;
     unsigned nvqs = s->conf->num_queues;
 
@@ -321,8 +512,19 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    virtio_blk_data_plane_stop_vqs(s);
+
+    for (i = 0; i < nvqs; i++) {
+        aio_context_reserve_pools(s->vq_aio_context[i],
+                                  -virtio_queue_get_num(s->vdev, i));
+    }
+
     aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
+    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, &stop);
+
+    if (s->multiqueue) {
+        blk_set_multiqueue(s->conf->conf.blk, false);
+    }
 
     /* Drain and try to switch bs back to the QEMU main loop. If other users
      * keep the BlockBackend in the iothread, that's ok */
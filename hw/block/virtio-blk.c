@@ -17,6 +17,8 @@
 #include "qemu/module.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "qemu/lockable.h"
+#include "block/aio.h"
 #include "trace.h"
 #include "hw/block/block.h"
 #include "hw/qdev-properties.h"
@@ -69,7 +71,34 @@ static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
 
 static void virtio_blk_free_request(VirtIOBlockReq *req)
 {
-    g_free(req);
+    if (req->pooled) {
+        aio_pool_free(req);
+    } else {
+        g_free(req);
+    }
+}
+
+/*
+ * Take the lock that protects @vq and the requests popped from it: its own
+ * lock with iothread-vq-mapping over several IOThreads, the AioContext lock
+ * of the BlockBackend otherwise.
+ */
+static void virtio_blk_lock_vq(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->vq_lock) {
+        qemu_mutex_lock(&s->vq_lock[virtio_get_queue_index(vq)]);
+    } else {
+        aio_context_acquire(blk_get_aio_context(s->blk));
+    }
+}
+
+static void virtio_blk_unlock_vq(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->vq_lock) {
+        qemu_mutex_unlock(&s->vq_lock[virtio_get_queue_index(vq)]);
+    } else {
+        aio_context_release(blk_get_aio_context(s->blk));
+    }
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -100,8 +129,10 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
         /* Break the link as the next request is going to be parsed from the
          * ring again. Otherwise we may end up doing a double completion! */
         req->mr_next = NULL;
-        req->next = s->rq;
-        s->rq = req;
+        WITH_QEMU_LOCK_GUARD(&s->rq_lock) {
+            req->next = s->rq;
+            s->rq = req;
+        }
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         if (acct_failed) {
@@ -120,9 +151,12 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIOBlock *s = next->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
     while (next) {
         VirtIOBlockReq *req = next;
+        VirtQueue *vq = req->vq;
+
+        /* Requests resubmitted after an error may come from several vqs */
+        virtio_blk_lock_vq(s, vq);
         next = req->mr_next;
         trace_virtio_blk_rw_complete(vdev, req, ret);
 
@@ -145,6 +179,7 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
              * happen on the other side of the migration).
              */
             if (virtio_blk_handle_rw_error(req, -ret, is_read, true)) {
+                virtio_blk_unlock_vq(s, vq);
                 continue;
             }
         }
@@ -152,16 +187,17 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
         virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
         block_acct_done(blk_get_stats(s->blk), &req->acct);
         virtio_blk_free_request(req);
+        virtio_blk_unlock_vq(s, vq);
     }
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
     VirtIOBlock *s = req->dev;
+    VirtQueue *vq = req->vq;
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_lock_vq(s, vq);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, 0, true)) {
             goto out;
@@ -173,17 +209,18 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_unlock_vq(s, vq);
 }
 
 static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
     VirtIOBlock *s = req->dev;
+    VirtQueue *vq = req->vq;
     bool is_write_zeroes = (virtio_ldl_p(VIRTIO_DEVICE(s), &req->out.type) &
                             ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_WRITE_ZEROES;
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_lock_vq(s, vq);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, false, is_write_zeroes)) {
             goto out;
@@ -197,7 +234,7 @@ static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_unlock_vq(s, vq);
 }
 
 #ifdef __linux__
@@ -212,6 +249,7 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     VirtIOBlockIoctlReq *ioctl_req = opaque;
     VirtIOBlockReq *req = ioctl_req->req;
     VirtIOBlock *s = req->dev;
+    VirtQueue *vq = req->vq;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
     struct virtio_scsi_inhdr *scsi;
     struct sg_io_hdr *hdr;
@@ -244,10 +282,10 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     virtio_stl_p(vdev, &scsi->data_len, hdr->dxfer_len);
 
 out:
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_lock_vq(s, vq);
     virtio_blk_req_complete(req, status);
     virtio_blk_free_request(req);
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_unlock_vq(s, vq);
     g_free(ioctl_req);
 }
 
@@ -255,10 +293,11 @@ out:
 
 static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
+    VirtIOBlockReq *req = virtqueue_pop_pooled(vq, sizeof(VirtIOBlockReq));
 
     if (req) {
         virtio_blk_init_request(s, vq, req);
+        req->pooled = true;
     }
     return req;
 }
@@ -774,7 +813,7 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     bool suppress_notifications = virtio_queue_get_notification(vq);
     bool progress = false;
 
-    aio_context_acquire(blk_get_aio_context(s->blk));
+    virtio_blk_lock_vq(s, vq);
     blk_io_plug(s->blk);
 
     do {
@@ -801,7 +840,7 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     }
 
     blk_io_unplug(s->blk);
-    aio_context_release(blk_get_aio_context(s->blk));
+    virtio_blk_unlock_vq(s, vq);
     return progress;
 }
 
@@ -828,22 +867,42 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 
 void virtio_blk_process_queued_requests(VirtIOBlock *s, bool is_bh)
 {
-    VirtIOBlockReq *req = s->rq;
+    VirtIOBlockReq *req;
     MultiReqBuffer mrb = {};
 
-    s->rq = NULL;
+    WITH_QEMU_LOCK_GUARD(&s->rq_lock) {
+        req = s->rq;
+        s->rq = NULL;
+    }
 
     aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
     while (req) {
         VirtIOBlockReq *next = req->next;
-        if (virtio_blk_handle_request(req, &mrb)) {
+        VirtQueue *vq = req->vq;
+        bool broken;
+
+        if (s->vq_lock) {
+            virtio_blk_lock_vq(s, vq);
+        }
+        broken = virtio_blk_handle_request(req, &mrb);
+        if (s->vq_lock) {
+            virtio_blk_unlock_vq(s, vq);
+        }
+        if (broken) {
             /* Device is now broken and won't do any processing until it gets
              * reset. Already queued requests will be lost: let's purge them.
              */
             while (req) {
                 next = req->next;
-                virtqueue_detach_element(req->vq, &req->elem, 0);
+                vq = req->vq;
+                if (s->vq_lock) {
+                    virtio_blk_lock_vq(s, vq);
+                }
+                virtqueue_detach_element(vq, &req->elem, 0);
                 virtio_blk_free_request(req);
+                if (s->vq_lock) {
+                    virtio_blk_unlock_vq(s, vq);
+                }
                 req = next;
             }
             break;
@@ -905,11 +964,13 @@ static void virtio_blk_reset(VirtIODevice *vdev)
 
     /* We drop queued requests after blk_drain() because blk_drain() itself can
      * produce them. */
-    while (s->rq) {
-        req = s->rq;
-        s->rq = req->next;
-        virtqueue_detach_element(req->vq, &req->elem, 0);
-        virtio_blk_free_request(req);
+    WITH_QEMU_LOCK_GUARD(&s->rq_lock) {
+        while (s->rq) {
+            req = s->rq;
+            s->rq = req->next;
+            virtqueue_detach_element(req->vq, &req->elem, 0);
+            virtio_blk_free_request(req);
+        }
     }
 
     aio_context_release(ctx);
@@ -1074,9 +1135,10 @@ static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
 static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
 {
     VirtIOBlock *s = VIRTIO_BLK(vdev);
-    VirtIOBlockReq *req = s->rq;
+    VirtIOBlockReq *req;
 
-    while (req) {
+    QEMU_LOCK_GUARD(&s->rq_lock);
+    for (req = s->rq; req; req = req->next) {
         qemu_put_sbyte(f, 1);
 
         if (s->conf.num_queues > 1) {
@@ -1084,7 +1146,6 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
         }
 
         qemu_put_virtqueue_element(vdev, f, &req->elem);
-        req = req->next;
     }
     qemu_put_sbyte(f, 0);
 }
@@ -1111,8 +1172,11 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
 
         req = qemu_get_virtqueue_element(vdev, f, sizeof(VirtIOBlockReq));
         virtio_blk_init_request(s, virtio_get_queue(vdev, vq_idx), req);
-        req->next = s->rq;
-        s->rq = req;
+        req->pooled = false;
+        WITH_QEMU_LOCK_GUARD(&s->rq_lock) {
+            req->next = s->rq;
+            s->rq = req;
+        }
     }
 
     return 0;
@@ -1165,6 +1229,11 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "num-queues property must be larger than 0");
         return;
     }
+    if (conf->iothread && conf->iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping properties "
+                   "cannot be set at the same time");
+        return;
+    }
     if (conf->queue_size <= 2) {
         error_setg(errp, "invalid queue-size property (%" PRIu16 "), "
                    "must be > 2", conf->queue_size);
@@ -1216,6 +1285,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK, s->config_size);
 
     s->blk = conf->conf.blk;
+    qemu_mutex_init(&s->rq_lock);
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
@@ -1228,9 +1298,16 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         for (i = 0; i < conf->num_queues; i++) {
             virtio_del_queue(vdev, i);
         }
+        qemu_mutex_destroy(&s->rq_lock);
         virtio_cleanup(vdev);
         return;
     }
+    if (s->dataplane && virtio_blk_data_plane_is_multiqueue(s->dataplane)) {
+        s->vq_lock = g_new(QemuMutex, conf->num_queues);
+        for (i = 0; i < conf->num_queues; i++) {
+            qemu_mutex_init(&s->vq_lock[i]);
+        }
+    }
 
     s->change = qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     blk_set_dev_ops(s->blk, &virtio_block_ops, s);
@@ -1257,7 +1334,13 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
     s->dataplane = NULL;
     for (i = 0; i < conf->num_queues; i++) {
         virtio_del_queue(vdev, i);
+        if (s->vq_lock) {
+            qemu_mutex_destroy(&s->vq_lock[i]);
+        }
     }
+    g_free(s->vq_lock);
+    s->vq_lock = NULL;
+    qemu_mutex_destroy(&s->rq_lock);
     qemu_del_vm_change_state_handler(s->change);
     blockdev_mark_auto_del(s->blk);
     virtio_cleanup(vdev);
@@ -1301,6 +1384,8 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BOOL("seg-max-adjust", VirtIOBlock, conf.seg_max_adjust, true),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_STRING("iothread-vq-mapping", VirtIOBlock,
+                       conf.iothread_vq_mapping),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BOOL("report-discard-granularity", VirtIOBlock,
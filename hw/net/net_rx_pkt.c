@@ -19,6 +19,7 @@
 #include "trace.h"
 #include "net_rx_pkt.h"
 #include "net/checksum.h"
+#include "qemu/toeplitz.h"
 #include "net/tap.h"
 
 struct NetRxPkt {
@@ -321,79 +322,91 @@ _net_rx_rss_prepare_udp(uint8_t *rss_input,
                           &udphdr->uh_dport, sizeof(uint16_t));
 }
 
-uint32_t
-net_rx_pkt_calc_rss_hash(struct NetRxPkt *pkt,
+size_t
+net_rx_pkt_get_rss_input(struct NetRxPkt *pkt,
                          NetRxPktRssType type,
-                         uint8_t *key)
+                         uint8_t *input)
 {
-    uint8_t rss_input[36];
     size_t rss_length = 0;
-    uint32_t rss_hash = 0;
-    net_toeplitz_key key_data;
 
     switch (type) {
     case NetPktRssIpV4:
         assert(pkt->isip4);
         trace_net_rx_pkt_rss_ip4();
-        _net_rx_rss_prepare_ip4(&rss_input[0], pkt, &rss_length);
+        _net_rx_rss_prepare_ip4(input, pkt, &rss_length);
         break;
     case NetPktRssIpV4Tcp:
         assert(pkt->isip4);
         assert(pkt->istcp);
         trace_net_rx_pkt_rss_ip4_tcp();
-        _net_rx_rss_prepare_ip4(&rss_input[0], pkt, &rss_length);
-        _net_rx_rss_prepare_tcp(&rss_input[0], pkt, &rss_length);
+        _net_rx_rss_prepare_ip4(input, pkt, &rss_length);
+        _net_rx_rss_prepare_tcp(input, pkt, &rss_length);
         break;
     case NetPktRssIpV6Tcp:
         assert(pkt->isip6);
         assert(pkt->istcp);
         trace_net_rx_pkt_rss_ip6_tcp();
-        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, false, &rss_length);
-        _net_rx_rss_prepare_tcp(&rss_input[0], pkt, &rss_length);
+        _net_rx_rss_prepare_ip6(input, pkt, false, &rss_length);
+        _net_rx_rss_prepare_tcp(input, pkt, &rss_length);
         break;
     case NetPktRssIpV6:
         assert(pkt->isip6);
         trace_net_rx_pkt_rss_ip6();
-        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, false, &rss_length);
+        _net_rx_rss_prepare_ip6(input, pkt, false, &rss_length);
         break;
     case NetPktRssIpV6Ex:
         assert(pkt->isip6);
         trace_net_rx_pkt_rss_ip6_ex();
-        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, true, &rss_length);
+        _net_rx_rss_prepare_ip6(input, pkt, true, &rss_length);
         break;
     case NetPktRssIpV6TcpEx:
         assert(pkt->isip6);
         assert(pkt->istcp);
         trace_net_rx_pkt_rss_ip6_ex_tcp();
-        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, true, &rss_length);
-        _net_rx_rss_prepare_tcp(&rss_input[0], pkt, &rss_length);
+        _net_rx_rss_prepare_ip6(input, pkt, true, &rss_length);
+        _net_rx_rss_prepare_tcp(input, pkt, &rss_length);
         break;
     case NetPktRssIpV4Udp:
         assert(pkt->isip4);
         assert(pkt->isudp);
         trace_net_rx_pkt_rss_ip4_udp();
-        _net_rx_rss_prepare_ip4(&rss_input[0], pkt, &rss_length);
-        _net_rx_rss_prepare_udp(&rss_input[0], pkt, &rss_length);
+        _net_rx_rss_prepare_ip4(input, pkt, &rss_length);
+        _net_rx_rss_prepare_udp(input, pkt, &rss_length);
         break;
     case NetPktRssIpV6Udp:
         assert(pkt->isip6);
         assert(pkt->isudp);
         trace_net_rx_pkt_rss_ip6_udp();
-        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, false, &rss_length);
-        _net_rx_rss_prepare_udp(&rss_input[0], pkt, &rss_length);
+        _net_rx_rss_prepare_ip6(input, pkt, false, &rss_length);
+        _net_rx_rss_prepare_udp(input, pkt, &rss_length);
         break;
     case NetPktRssIpV6UdpEx:
         assert(pkt->isip6);
         assert(pkt->isudp);
         trace_net_rx_pkt_rss_ip6_ex_udp();
-        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, true, &rss_length);
-        _net_rx_rss_prepare_udp(&rss_input[0], pkt, &rss_length);
+        _net_rx_rss_prepare_ip6(input, pkt, true, &rss_length);
+        _net_rx_rss_prepare_udp(input, pkt, &rss_length);
         break;
     default:
         assert(false);
         break;
     }
 
+    return rss_length;
+}
+
+uint32_t
+net_rx_pkt_calc_rss_hash(struct NetRxPkt *pkt,
+                         NetRxPktRssType type,
+                         uint8_t *key)
+{
+    uint8_t rss_input[TOEPLITZ_MAX_INPUT];
+    size_t rss_length;
+    uint32_t rss_hash = 0;
+    net_toeplitz_key key_data;
+
+    rss_length = net_rx_pkt_get_rss_input(pkt, type, rss_input);
+
     net_toeplitz_key_init(&key_data, key);
     net_toeplitz_add(&rss_hash, rss_input, rss_length, &key_data);
 
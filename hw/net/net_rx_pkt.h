@@ -140,6 +140,21 @@ typedef enum {
     NetPktRssIpV6UdpEx,
 } NetRxPktRssType;
 
+/**
+* builds the input of the RSS hash for packet
+*
+* @pkt:            packet
+* @type:           RSS hash type
+* @input:          buffer of TOEPLITZ_MAX_INPUT bytes for the input
+*
+* Return:  length of the input, a multiple of 4.
+*
+*/
+size_t
+net_rx_pkt_get_rss_input(struct NetRxPkt *pkt,
+                         NetRxPktRssType type,
+                         uint8_t *input);
+
 /**
 * calculates RSS hash for packet
 *
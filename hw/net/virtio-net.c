@@ -16,6 +16,7 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/toeplitz.h"
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
@@ -32,6 +33,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/error.h"
 #include "qapi/qapi-events-net.h"
+#include "qapi/qapi-visit-net.h"
 #include "hw/qdev-properties.h"
 #include "qapi/qapi-types-migration.h"
 #include "qapi/qapi-events-migration.h"
@@ -79,6 +81,9 @@
    tso/gso/gro 'off'. */
 #define VIRTIO_NET_RSC_DEFAULT_INTERVAL 300000
 
+/* Flows of one IP version that can have a packet held back for coalescing */
+#define VIRTIO_NET_RSC_MAX_FLOWS 64
+
 #define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
                                          VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
                                          VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
@@ -89,6 +94,26 @@
                                          VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
                                          VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
 
+/* Maximum number of packets that are passed to the peer in one call */
+#define VIRTIO_NET_TX_BATCH 64
+
+/*
+ * Packets popped from a TX virtqueue and not sent yet.  Entries from
+ * @start to @count are pending; a packet whose @pkts entry has a NULL iov
+ * is dropped.  Rewritten iovecs, e.g. to strip or byteswap the header, are
+ * stored in @iov; a single packet never needs more than VIRTQUEUE_MAX_SIZE
+ * of them.
+ */
+typedef struct VirtIONetTxBatch {
+    int start;
+    int count;
+    unsigned int niov;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    NetPacketIOV pkts[VIRTIO_NET_TX_BATCH];
+    struct virtio_net_hdr_mrg_rxbuf hdrs[VIRTIO_NET_TX_BATCH];
+    struct iovec iov[2 * VIRTQUEUE_MAX_SIZE];
+} VirtIONetTxBatch;
+
 static const VirtIOFeature feature_sizes[] = {
     {.flags = 1ULL << VIRTIO_NET_F_MAC,
      .end = endof(struct virtio_net_config, mac)},
@@ -527,6 +552,24 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+/* Give up the packets that are left in the TX batch, e.g. on reset */
+static void virtio_net_tx_batch_discard(VirtIONetQueue *q)
+{
+    VirtIONetTxBatch *b = q->tx_batch;
+    int i;
+
+    if (!b) {
+        return;
+    }
+
+    for (i = b->start; i < b->count; i++) {
+        virtqueue_detach_element(q->tx_vq, b->elems[i], 0);
+        g_free(b->elems[i]);
+    }
+    b->start = b->count = 0;
+    b->niov = 0;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -563,6 +606,7 @@ static void virtio_net_reset(VirtIODevice *vdev)
             qemu_flush_or_purge_queued_packets(nc->peer, true);
             assert(!virtio_net_get_subqueue(nc)->async_tx.elem);
         }
+        virtio_net_tx_batch_discard(virtio_net_get_subqueue(nc));
     }
 }
 
@@ -885,6 +929,26 @@ static void failover_add_primary(VirtIONet *n, Error **errp)
     error_propagate(errp, err);
 }
 
+/*
+ * TCP segments are coalesced for Windows guests that negotiated RSC_EXT,
+ * whose driver reads the RSC fields of the header, and, if rx_gro is set,
+ * for any guest that accepts TSO packets.  The latter needs the backend to
+ * pass the header through, so that the checksum state of each packet is
+ * known.
+ */
+static void virtio_net_update_rsc(VirtIONet *n, uint64_t offloads)
+{
+    bool rsc_ext = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT);
+    bool enable = rsc_ext ||
+                  (n->rx_gro && n->host_hdr_len == n->guest_hdr_len);
+
+    n->rsc_gso = !rsc_ext;
+    n->rsc4_enabled = enable &&
+        virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO4);
+    n->rsc6_enabled = enable &&
+        virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO6);
+}
+
 static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -908,10 +972,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_HASH_REPORT));
 
-    n->rsc4_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
-        virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4);
-    n->rsc6_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
-        virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6);
+    virtio_net_update_rsc(n, features);
     n->rss_data.redirect = virtio_has_feature(features, VIRTIO_NET_F_RSS);
 
     if (n->has_vnet_hdr) {
@@ -1003,10 +1064,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
             return VIRTIO_NET_ERR;
         }
 
-        n->rsc4_enabled = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) &&
-            virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO4);
-        n->rsc6_enabled = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) &&
-            virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO6);
+        virtio_net_update_rsc(n, offloads);
         virtio_clear_feature(&offloads, VIRTIO_NET_F_RSC_EXT);
 
         supported_offloads = virtio_net_supported_guest_offloads(n);
@@ -1164,6 +1222,55 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/*
+ * Without eBPF, the RSS hash of every received packet is computed here.
+ * Most packets belong to a few flows, so the hash of recently seen flows
+ * is kept in a small direct-mapped cache that is looked up by the hash
+ * input.  The hash only depends on the input and on the key, so the cache
+ * only has to be flushed when the key changes.
+ */
+#define VIRTIO_NET_RSS_FLOWS 256
+
+typedef struct VirtioNetRssFlow {
+    uint8_t input[TOEPLITZ_MAX_INPUT];
+    uint32_t len;                   /* Length of @input, 0 if unused */
+    uint32_t hash;
+} VirtioNetRssFlow;
+
+static void virtio_net_rss_init_software(VirtIONet *n)
+{
+    if (!n->rss_data.toeplitz_key) {
+        n->rss_data.toeplitz_key = g_new(ToeplitzKey, 1);
+        n->rss_data.flows = g_new(VirtioNetRssFlow, VIRTIO_NET_RSS_FLOWS);
+    }
+
+    QEMU_BUILD_BUG_ON(VIRTIO_NET_RSS_MAX_KEY_SIZE < TOEPLITZ_KEY_SIZE);
+    toeplitz_key_init(n->rss_data.toeplitz_key, n->rss_data.key);
+    memset(n->rss_data.flows, 0,
+           VIRTIO_NET_RSS_FLOWS * sizeof(VirtioNetRssFlow));
+}
+
+static uint32_t virtio_net_rss_hash(VirtIONet *n, const uint8_t *input,
+                                    size_t len)
+{
+    VirtioNetRssFlow *flow;
+    uint32_t fold = 0;
+    size_t i;
+
+    for (i = 0; i < len; i += 4) {
+        fold = rol32(fold, 5) ^ ldl_he_p(input + i);
+    }
+    flow = &n->rss_data.flows[(fold * 0x9e3779b1) >> 24];
+
+    if (flow->len != len || memcmp(flow->input, input, len)) {
+        flow->hash = toeplitz_hash(n->rss_data.toeplitz_key, input, len);
+        memcpy(flow->input, input, len);
+        flow->len = len;
+        trace_virtio_net_rss_flow_miss(n, flow->hash);
+    }
+    return flow->hash;
+}
+
 static void virtio_net_detach_epbf_rss(VirtIONet *n);
 
 static void virtio_net_disable_rss(VirtIONet *n)
@@ -1369,6 +1476,9 @@ static uint16_t virtio_net_handle_rss(VirtIONet *n,
         virtio_net_detach_epbf_rss(n);
         n->rss_data.enabled_software_rss = true;
     }
+    if (n->rss_data.enabled_software_rss) {
+        virtio_net_rss_init_software(n);
+    }
 
     trace_virtio_net_rss_enable(n->rss_data.hash_types,
                                 n->rss_data.indirections_len,
@@ -1694,6 +1804,8 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
     unsigned int index = nc->queue_index, new_index = index;
     struct NetRxPkt *pkt = n->rx_pkt;
     uint8_t net_hash_type;
+    uint8_t input[TOEPLITZ_MAX_INPUT];
+    size_t len;
     uint32_t hash;
     bool isip4, isip6, isudp, istcp;
     static const uint8_t reports[NetPktRssIpV6UdpEx + 1] = {
@@ -1726,7 +1838,8 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
         return n->rss_data.redirect ? n->rss_data.default_queue : -1;
     }
 
-    hash = net_rx_pkt_calc_rss_hash(pkt, net_hash_type, n->rss_data.key);
+    len = net_rx_pkt_get_rss_input(pkt, net_hash_type, input);
+    hash = virtio_net_rss_hash(n, input, len);
 
     if (n->rss_data.populate_hash) {
         virtio_set_packet_hash(buf, reports[net_hash_type], hash);
@@ -1852,7 +1965,11 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (n->rx_batch) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_notify(vdev, q->rx_vq);
+    }
 
     return size;
 }
@@ -1901,6 +2018,46 @@ static void virtio_net_rsc_extract_unit6(VirtioNetRscChain *chain,
     unit->payload = htons(*unit->ip_plen) - unit->tcp_hdrlen;
 }
 
+/*
+ * Describe a coalesced packet as a TSO packet whose TCP checksum is still
+ * to be computed, like Linux GRO does.  The checksum of every packet that
+ * was merged into it has been verified by the backend, see
+ * virtio_net_rsc_csum_check().
+ */
+static void virtio_net_rsc_set_gso(VirtioNetRscChain *chain,
+                                   VirtioNetRscSeg *seg)
+{
+    struct virtio_net_hdr *h = seg->buf;
+    VirtioNetRscUnit *unit = &seg->unit;
+    uint8_t *eth = (uint8_t *)seg->buf + chain->n->guest_hdr_len;
+    uint16_t csum_start = (uint8_t *)unit->tcp - eth;
+    uint16_t l4_len = unit->tcp_hdrlen + unit->payload;
+    uint32_t cntr, cso;
+
+    if (chain->proto == ETH_P_IP) {
+        cntr = eth_calc_ip4_pseudo_hdr_csum(unit->ip, l4_len, &cso);
+    } else {
+        cntr = eth_calc_ip6_pseudo_hdr_csum(unit->ip, l4_len,
+                                            IP_PROTO_TCP, &cso);
+    }
+    unit->tcp->th_sum = cpu_to_be16(~net_checksum_finish(cntr));
+
+    h->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    h->csum_start = csum_start;
+    h->csum_offset = offsetof(struct tcp_header, th_sum);
+
+    /* A window update can be merged into a single packet */
+    if (unit->payload > seg->gso_size) {
+        h->gso_type = chain->gso_type;
+        h->gso_size = seg->gso_size;
+        h->hdr_len = csum_start + unit->tcp_hdrlen;
+    } else {
+        h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+        h->gso_size = 0;
+        h->hdr_len = 0;
+    }
+}
+
 static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
                                        VirtioNetRscSeg *seg)
 {
@@ -1908,39 +2065,56 @@ static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
     struct virtio_net_hdr_v1 *h;
 
     h = (struct virtio_net_hdr_v1 *)seg->buf;
-    h->flags = 0;
-    h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
-
-    if (seg->is_coalesced) {
-        h->rsc.segments = seg->packets;
-        h->rsc.dup_acks = seg->dup_ack;
-        h->flags = VIRTIO_NET_HDR_F_RSC_INFO;
-        if (chain->proto == ETH_P_IP) {
-            h->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
-        } else {
-            h->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+    if (chain->n->rsc_gso) {
+        /* Packets that were not coalesced keep the header of the backend */
+        if (seg->is_coalesced) {
+            virtio_net_rsc_set_gso(chain, seg);
+        }
+    } else {
+        h->flags = 0;
+        h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+        if (seg->is_coalesced) {
+            h->rsc.segments = seg->packets;
+            h->rsc.dup_acks = seg->dup_ack;
+            h->flags = VIRTIO_NET_HDR_F_RSC_INFO;
+            if (chain->proto == ETH_P_IP) {
+                h->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            } else {
+                h->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+            }
         }
     }
 
+    if (seg->is_coalesced && chain->proto == ETH_P_IP) {
+        eth_fix_ip4_checksum(seg->unit.ip, sizeof(struct ip_header));
+    }
+
     ret = virtio_net_do_receive(seg->nc, seg->buf, seg->size);
     QTAILQ_REMOVE(&chain->buffers, seg, next);
+    chain->nb_flows--;
     g_free(seg->buf);
     g_free(seg);
 
     return ret;
 }
 
-static void virtio_net_rsc_purge(void *opq)
+static void virtio_net_rsc_drain_chain(VirtioNetRscChain *chain)
 {
     VirtioNetRscSeg *seg, *rn;
-    VirtioNetRscChain *chain = (VirtioNetRscChain *)opq;
 
     QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, rn) {
         if (virtio_net_rsc_drain_seg(chain, seg) == 0) {
             chain->stat.purge_failed++;
-            continue;
         }
     }
+}
+
+static void virtio_net_rsc_purge(void *opq)
+{
+    VirtioNetRscChain *chain = (VirtioNetRscChain *)opq;
+
+    virtio_net_rsc_drain_chain(chain);
 
     chain->stat.timer++;
     if (!QTAILQ_EMPTY(&chain->buffers)) {
@@ -1967,6 +2141,22 @@ static void virtio_net_rsc_cleanup(VirtIONet *n)
     }
 }
 
+/*
+ * Deliver the packets held back by all chains, so that packets are not
+ * delayed past the end of a batch from the backend.
+ */
+static void virtio_net_rsc_flush(VirtIONet *n)
+{
+    VirtioNetRscChain *chain;
+
+    QTAILQ_FOREACH(chain, &n->rsc_chains, next) {
+        if (!QTAILQ_EMPTY(&chain->buffers)) {
+            virtio_net_rsc_drain_chain(chain);
+            timer_del(chain->drain_timer);
+        }
+    }
+}
+
 static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
                                      NetClientState *nc,
                                      const uint8_t *buf, size_t size)
@@ -1974,6 +2164,15 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     uint16_t hdr_len;
     VirtioNetRscSeg *seg;
 
+    if (chain->nb_flows >= VIRTIO_NET_RSC_MAX_FLOWS) {
+        /* The flow table is full, deliver the oldest held back packet */
+        chain->stat.evicted++;
+        if (virtio_net_rsc_drain_seg(chain,
+                                     QTAILQ_FIRST(&chain->buffers)) == 0) {
+            chain->stat.drain_failed++;
+        }
+    }
+
     hdr_len = chain->n->guest_hdr_len;
     seg = g_malloc(sizeof(VirtioNetRscSeg));
     seg->buf = g_malloc(hdr_len + sizeof(struct eth_header)
@@ -1986,6 +2185,8 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     seg->nc = nc;
 
     QTAILQ_INSERT_TAIL(&chain->buffers, seg, next);
+    chain->nb_flows++;
+    chain->stat.max_flows = MAX(chain->stat.max_flows, chain->nb_flows);
     chain->stat.cache++;
 
     switch (chain->proto) {
@@ -1998,6 +2199,7 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     default:
         g_assert_not_reached();
     }
+    seg->gso_size = seg->unit.payload;
 }
 
 static int32_t virtio_net_rsc_handle_ack(VirtioNetRscChain *chain,
@@ -2096,6 +2298,7 @@ coalesce:
         memmove(seg->buf + seg->size, data, n_unit->payload);
         seg->size += n_unit->payload;
         seg->packets++;
+        seg->gso_size = MAX(seg->gso_size, n_unit->payload);
         chain->stat.coalesced++;
         return RSC_COALESCE;
     }
@@ -2169,6 +2372,30 @@ static int virtio_net_rsc_tcp_ctrl_check(VirtioNetRscChain *chain,
     return RSC_CANDIDATE;
 }
 
+/*
+ * In the TSO format the guest trusts the checksum of coalesced packets, so
+ * only coalesce packets whose checksum was verified by the backend, or is
+ * still to be computed.  GSO packets from the backend are passed as is.
+ */
+static int virtio_net_rsc_csum_check(VirtioNetRscChain *chain,
+                                     const uint8_t *buf)
+{
+    const struct virtio_net_hdr *h = (const struct virtio_net_hdr *)buf;
+
+    if (!chain->n->rsc_gso) {
+        return RSC_CANDIDATE;
+    }
+
+    if (h->gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+        !(h->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM |
+                      VIRTIO_NET_HDR_F_DATA_VALID))) {
+        chain->stat.csum_unverified++;
+        return RSC_FINAL;
+    }
+
+    return RSC_CANDIDATE;
+}
+
 static size_t virtio_net_rsc_do_coalesce(VirtioNetRscChain *chain,
                                          NetClientState *nc,
                                          const uint8_t *buf, size_t size,
@@ -2311,6 +2538,9 @@ static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
     }
 
     ret = virtio_net_rsc_tcp_ctrl_check(chain, unit.tcp);
+    if (ret == RSC_CANDIDATE) {
+        ret = virtio_net_rsc_csum_check(chain, buf);
+    }
     if (ret == RSC_BYPASS) {
         return virtio_net_do_receive(nc, buf, size);
     } else if (ret == RSC_FINAL) {
@@ -2380,6 +2610,9 @@ static size_t virtio_net_rsc_receive6(void *opq, NetClientState *nc,
     }
 
     ret = virtio_net_rsc_tcp_ctrl_check(chain, unit.tcp);
+    if (ret == RSC_CANDIDATE) {
+        ret = virtio_net_rsc_csum_check(chain, buf);
+    }
     if (ret == RSC_BYPASS) {
         return virtio_net_do_receive(nc, buf, size);
     } else if (ret == RSC_FINAL) {
@@ -2470,6 +2703,81 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
 }
 
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
+static void virtio_net_tx_complete(NetClientState *nc, ssize_t len);
+
+/*
+ * Pass the pending packets of the TX batch to the peer and complete their
+ * elements with a single guest notification.  Returns -EBUSY if the peer
+ * queued one of them: its element is completed by virtio_net_tx_complete(),
+ * and the packets after it stay in the batch until then.
+ */
+static int virtio_net_tx_batch_send(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    VirtIONetTxBatch *b = q->tx_batch;
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(n->nic, queue_index);
+    int i, end, sent, done = 0;
+
+    while (b->start < b->count) {
+        if (b->pkts[b->start].iov) {
+            for (end = b->start; end < b->count && b->pkts[end].iov; end++) {
+                /* nothing */
+            }
+            sent = qemu_sendv_batch_async(nc, &b->pkts[b->start],
+                                          end - b->start,
+                                          virtio_net_tx_complete);
+        } else {
+            end = b->start + 1;
+            sent = 1;
+        }
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            for (i = 0; i < sent; i++) {
+                virtqueue_fill(q->tx_vq, b->elems[b->start + i], 0, i);
+                g_free(b->elems[b->start + i]);
+            }
+            virtqueue_flush(q->tx_vq, sent);
+        }
+        b->start += sent;
+        done += sent;
+
+        if (b->start < end) {
+            /* The peer queued this packet */
+            q->async_tx.elem = b->elems[b->start++];
+            virtio_queue_set_notification(q->tx_vq, 0);
+            break;
+        }
+    }
+
+    if (done) {
+        virtio_notify(VIRTIO_DEVICE(n), q->tx_vq);
+    }
+    if (q->async_tx.elem) {
+        return -EBUSY;
+    }
+
+    b->start = b->count = 0;
+    b->niov = 0;
+    return 0;
+}
+
+static void virtio_net_tx_batch_add(VirtIONetTxBatch *b,
+                                    VirtQueueElement *elem,
+                                    struct iovec *out_sg, unsigned int out_num)
+{
+    NetPacketIOV *pkt = &b->pkts[b->count];
+
+    if (out_sg && out_sg != elem->out_sg) {
+        memcpy(&b->iov[b->niov], out_sg, out_num * sizeof(*out_sg));
+        out_sg = &b->iov[b->niov];
+        b->niov += out_num;
+    }
+
+    b->elems[b->count++] = elem;
+    pkt->iov = out_sg;
+    pkt->iovcnt = out_num;
+}
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
@@ -2493,8 +2801,10 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elem;
+    VirtIONetTxBatch *b;
     int32_t num_packets = 0;
-    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    int ret;
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -2504,11 +2814,21 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
+    if (!q->tx_batch) {
+        q->tx_batch = g_new0(VirtIONetTxBatch, 1);
+    }
+    b = q->tx_batch;
+
+    /* Packets that were behind the last queued one go first */
+    ret = virtio_net_tx_batch_send(q);
+    if (ret < 0) {
+        return ret;
+    }
+
     for (;;) {
-        ssize_t ret;
         unsigned int out_num;
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
+        struct virtio_net_hdr_mrg_rxbuf *mhdr = &b->hdrs[b->count];
 
         elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -2521,26 +2841,30 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
             g_free(elem);
+            virtio_net_tx_batch_send(q);
             return -EINVAL;
         }
 
         if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            if (iov_to_buf(out_sg, out_num, 0, mhdr, n->guest_hdr_len) <
                 n->guest_hdr_len) {
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
                 g_free(elem);
+                virtio_net_tx_batch_send(q);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
+                virtio_net_hdr_swap(vdev, (void *) mhdr);
+                sg2[0].iov_base = mhdr;
                 sg2[0].iov_len = n->guest_hdr_len;
                 out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
                                    out_sg, out_num,
                                    n->guest_hdr_len, -1);
                 if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
+                    /* Drop the packet */
+                    virtio_net_tx_batch_add(b, elem, NULL, 0);
+                    goto next;
                 }
                 out_num += 1;
                 out_sg = sg2;
@@ -2563,22 +2887,24 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_sg = sg;
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            return -EBUSY;
-        }
-
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        virtio_net_tx_batch_add(b, elem, out_sg, out_num);
 
+next:
         if (++num_packets >= n->tx_burst) {
             break;
         }
+        if (b->count == VIRTIO_NET_TX_BATCH ||
+            ARRAY_SIZE(b->iov) - b->niov < VIRTQUEUE_MAX_SIZE) {
+            ret = virtio_net_tx_batch_send(q);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    ret = virtio_net_tx_batch_send(q);
+    if (ret < 0) {
+        return ret;
     }
     return num_packets;
 }
@@ -2739,7 +3065,16 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     VirtIONetQueue *q = &n->vqs[index];
     NetClientState *nc = qemu_get_subqueue(n->nic, index);
 
+    /*
+     * Purging the queued packet completes its element, and the packets
+     * held behind it must not be sent from there to a dying queue.
+     * Completing it can pop and hold new ones, so drop those again.
+     */
+    virtio_net_tx_batch_discard(q);
     qemu_purge_queued_packets(nc);
+    virtio_net_tx_batch_discard(q);
+    g_free(q->tx_batch);
+    q->tx_batch = NULL;
 
     virtio_del_queue(vdev, index * 2);
     if (q->tx_timer) {
@@ -2871,6 +3206,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
                 }
             }
         }
+        if (n->rss_data.enabled_software_rss) {
+            virtio_net_rss_init_software(n);
+        }
 
         trace_virtio_net_rss_enable(n->rss_data.hash_types,
                                     n->rss_data.indirections_len,
@@ -3137,11 +3475,50 @@ static const VMStateDescription vmstate_virtio_net_device = {
     }
 };
 
+static void virtio_net_begin_batch(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+
+    n->rx_batch++;
+}
+
+static void virtio_net_end_batch(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int i;
+
+    assert(n->rx_batch > 0);
+    if (n->rx_batch == 1 && n->rsc_gso &&
+        (n->rsc4_enabled || n->rsc6_enabled)) {
+        /*
+         * Do not hold packets past the batch, like GRO at the end of a NAPI
+         * poll.  They are still covered by the notification below.
+         */
+        virtio_net_rsc_flush(n);
+    }
+    if (--n->rx_batch) {
+        return;
+    }
+
+    /* With RSS, packets of a batch can end up in any queue */
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_notify_pending) {
+            q->rx_notify_pending = false;
+            virtio_notify(vdev, q->rx_vq);
+        }
+    }
+}
+
 static NetClientInfo net_virtio_info = {
     .type = NET_CLIENT_DRIVER_NIC,
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .begin_batch = virtio_net_begin_batch,
+    .end_batch = virtio_net_end_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3495,10 +3872,41 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
+    g_free(n->rss_data.toeplitz_key);
+    g_free(n->rss_data.flows);
     net_rx_pkt_uninit(n->rx_pkt);
     virtio_cleanup(vdev);
 }
 
+static void virtio_net_get_rx_gro_stats(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    VirtIONet *n = VIRTIO_NET(obj);
+    RxGroStats stats = {}, *p = &stats;
+    VirtioNetRscChain *chain;
+
+    QTAILQ_FOREACH(chain, &n->rsc_chains, next) {
+        VirtioNetRscStat *s = &chain->stat;
+
+        stats.received += s->received;
+        stats.coalesced += s->coalesced;
+        stats.bypassed += s->bypass_not_tcp + s->ip_option + s->ip_frag +
+                          s->ip_ecn + s->ip_hacked + s->tcp_syn +
+                          s->tcp_ctrl_drain + s->tcp_all_opt +
+                          s->csum_unverified;
+        stats.out_of_order += s->data_out_of_order + s->data_out_of_win +
+                              s->ack_out_of_win;
+        stats.flows += chain->nb_flows;
+        stats.max_flows = MAX(stats.max_flows, s->max_flows);
+        stats.evicted += s->evicted;
+        stats.timer_flushes += s->timer;
+        stats.failed += s->purge_failed + s->drain_failed + s->final_failed;
+    }
+
+    visit_type_RxGroStats(v, name, &p, errp);
+}
+
 static void virtio_net_instance_init(Object *obj)
 {
     VirtIONet *n = VIRTIO_NET(obj);
@@ -3511,6 +3919,8 @@ static void virtio_net_instance_init(Object *obj)
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n));
+    object_property_add(obj, "rx-gro-stats", "RxGroStats",
+                        virtio_net_get_rx_gro_stats, NULL, NULL, NULL);
 
     ebpf_rss_init(&n->ebpf_rss);
 }
@@ -3609,6 +4019,7 @@ static Property virtio_net_properties[] = {
                     VIRTIO_NET_F_RSC_EXT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
                        VIRTIO_NET_RSC_DEFAULT_INTERVAL),
+    DEFINE_PROP_BOOL("rx_gro", VirtIONet, rx_gro, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
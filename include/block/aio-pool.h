@@ -0,0 +1,128 @@
+/*
+ * Per-AioContext object pools
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_AIO_POOL_H
+#define QEMU_AIO_POOL_H
+
+#include "qemu/queue.h"
+
+/*
+ * Each AioContext keeps free lists of coroutines and of small heap objects
+ * such as AIOCBs and device request structures, so that the request path
+ * does not need to call malloc/free in steady state.
+ *
+ * Objects always go back to the pool of the AioContext they were taken
+ * from.  The free list proper is only touched by the thread that runs the
+ * AioContext (or by threads holding the BQL, for the main loop AioContext);
+ * objects released by other threads are pushed atomically on a separate
+ * list that the owner takes over when its free list runs empty.  This keeps
+ * objects from migrating between threads when requests complete in a
+ * different thread than the one that submitted them.
+ *
+ * Objects must be released before their AioContext is destroyed.
+ */
+
+typedef struct AioPoolLink {
+    QSLIST_ENTRY(AioPoolLink) next;
+} AioPoolLink;
+
+typedef struct AioPool {
+    /* Only accessed by the AioContext's thread */
+    QSLIST_HEAD(, AioPoolLink) local;
+    unsigned int local_count;
+
+    /*
+     * Objects released by other threads.  Accessed with atomic ops.  The
+     * count lags behind the list while aio_pool_put() runs, so it can
+     * briefly be negative.
+     */
+    QSLIST_HEAD(, AioPoolLink) remote;
+    int remote_count;
+
+    /* Written by the AioContext's thread, read with atomic ops */
+    unsigned long hits;
+    unsigned long misses;
+} AioPool;
+
+enum {
+    AIO_POOL_COROUTINE,
+    AIO_POOL_128,           /* heap objects of up to 128 bytes */
+    AIO_POOL_256,
+    AIO_POOL_512,
+    AIO_POOL_1024,
+    AIO_POOL_2048,
+    AIO_POOL_COUNT,
+};
+
+/* Number of objects each pool keeps without aio_context_reserve_pools() */
+#define AIO_POOL_DEFAULT_SIZE 64
+
+/**
+ * aio_pool_get:
+ * @ctx: the AioContext that owns @pool
+ * @pool: the pool
+ *
+ * Take an object from @pool.  Must be called from @ctx's thread.  Returns
+ * NULL, and counts a miss, if the pool is empty.
+ */
+AioPoolLink *aio_pool_get(AioContext *ctx, AioPool *pool);
+
+/**
+ * aio_pool_put:
+ * @ctx: the AioContext that owns @pool
+ * @pool: the pool
+ * @link: the object to release
+ *
+ * Return an object to @pool.  Can be called from any thread.  Returns false
+ * if the pool is full, in which case the caller must free the object.
+ */
+bool aio_pool_put(AioContext *ctx, AioPool *pool, AioPoolLink *link);
+
+/**
+ * aio_pool_drain:
+ * @pool: the pool
+ * @free_fn: function that frees one object
+ *
+ * Free all objects in @pool.  Only used when destroying an AioContext.
+ */
+void aio_pool_drain(AioPool *pool, void (*free_fn)(AioPoolLink *link));
+
+/**
+ * aio_pool_alloc:
+ * @size: number of bytes
+ *
+ * Allocate @size bytes, using a pool of the current AioContext if there is
+ * one and @size is small enough.  Free with aio_pool_free(), never
+ * g_free().
+ */
+void *aio_pool_alloc(size_t size);
+
+/**
+ * aio_pool_alloc0:
+ * @size: number of bytes
+ *
+ * Like aio_pool_alloc(), but the memory is zeroed.
+ */
+void *aio_pool_alloc0(size_t size);
+
+/**
+ * aio_pool_free:
+ * @p: memory returned by aio_pool_alloc(), or NULL
+ *
+ * Release @p to the pool it was taken from.  Can be called from any thread.
+ */
+void aio_pool_free(void *p);
+
+/**
+ * aio_pool_name:
+ * @i: pool index, less than AIO_POOL_COUNT
+ *
+ * Return the name under which pool statistics are reported.
+ */
+const char *aio_pool_name(int i);
+
+#endif
@@ -22,6 +22,7 @@
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
+#include "block/aio-pool.h"
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
@@ -211,6 +212,13 @@ struct AioContext {
      */
     struct LuringState *linux_io_uring;
 
+    /*
+     * Options for linux_io_uring, applied when it is created.  See
+     * aio_context_set_io_uring_params().
+     */
+    bool linux_io_uring_sqpoll;
+    bool linux_io_uring_fixed_buffers;
+
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
@@ -247,6 +255,12 @@ struct AioContext {
     int epollfd;
 
     const FDMonOps *fdmon_ops;
+
+    /* Free lists for coroutines and small heap objects, see aio-pool.h */
+    AioPool pools[AIO_POOL_COUNT];
+
+    /* Objects each pool keeps beyond AIO_POOL_DEFAULT_SIZE */
+    int pool_reserved;
 };
 
 /**
@@ -492,6 +506,12 @@ struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+/*
+ * Return the file descriptor of the io_uring used for file descriptor
+ * monitoring by this AioContext, or -1 if it does not use io_uring.
+ */
+int aio_get_fdmon_io_uring_fd(AioContext *ctx);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -717,6 +737,20 @@ void aio_context_destroy(AioContext *ctx);
 /* Used internally, do not call outside AioContext code */
 void aio_context_use_g_source(AioContext *ctx);
 
+/* Used internally, do not call outside AioContext code */
+void aio_context_free_heap_pools(AioContext *ctx);
+
+/**
+ * aio_context_reserve_pools:
+ * @ctx: the aio context
+ * @n: number of objects, can be negative to undo an earlier reservation
+ *
+ * Let the object pools of @ctx keep @n more free objects each.  Devices
+ * call this with their total queue depth when they start processing
+ * requests in @ctx, so that a full queue can be served from the pools.
+ */
+void aio_context_reserve_pools(AioContext *ctx, int n);
+
 /**
  * aio_context_set_poll_params:
  * @ctx: the aio context
@@ -730,4 +764,16 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_io_uring_params:
+ * @ctx: the aio context
+ * @sqpoll: submit requests through a kernel polling thread
+ * @fixed_buffers: register guest RAM with the ring
+ *
+ * Configure the Linux io_uring instance used by block drivers in @ctx.
+ * The parameters cannot be changed once the instance has been created.
+ */
+void aio_context_set_io_uring_params(AioContext *ctx, bool sqpoll,
+                                     bool fixed_buffers, Error **errp);
+
 #endif
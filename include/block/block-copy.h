@@ -28,6 +28,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      Error **errp);
 
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm);
+void block_copy_set_copy_stats(BlockCopyState *s, JobCopyStats *stats);
 
 void block_copy_state_free(BlockCopyState *s);
 
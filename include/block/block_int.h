@@ -120,6 +120,14 @@ struct BlockDriver {
      * on those children.
      */
     bool is_format;
+    /*
+     * Set to true if the driver's I/O callbacks may be entered concurrently
+     * from coroutines running in different AioContexts, without holding the
+     * AioContext lock of the node.  Such drivers must keep their per-request
+     * state in the coroutine or in the calling AioContext and protect any
+     * per-node state with atomics or fine-grained locks.
+     */
+    bool supports_multiqueue;
     /*
      * Return true if @to_replace can be replaced by a BDS with the
      * same data as @bs without it affecting @bs's behavior (that is,
@@ -431,6 +439,10 @@ struct BlockDriver {
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
+    int (*bdrv_snapshot_attach_vmstate)(BlockDriverState *bs,
+                                        const char *name,
+                                        uint64_t vm_state_size,
+                                        Error **errp);
     int (*bdrv_snapshot_goto)(BlockDriverState *bs,
                               const char *snapshot_id);
     int (*bdrv_snapshot_delete)(BlockDriverState *bs,
@@ -953,9 +965,6 @@ struct BlockDriverState {
      */
     int64_t total_sectors;
 
-    /* threshold limit for writes, in bytes. "High water mark". */
-    uint64_t write_threshold_offset;
-
     /* Writing to the list requires the BQL _and_ the dirty_bitmap_mutex.
      * Reading from the list can be done with either the BQL or the
      * dirty_bitmap_mutex.  Modifying a bitmap only requires
@@ -966,6 +975,13 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /* threshold limit for writes, in bytes. "High water mark".
+     * Read with qatomic_read_u64(); updates are serialized by
+     * write_threshold_lock so that only one request fires the event.
+     */
+    uint64_t write_threshold_offset;
+    QemuMutex write_threshold_lock;
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
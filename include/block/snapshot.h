@@ -55,6 +55,10 @@ bool bdrv_snapshot_find_by_id_and_name(BlockDriverState *bs,
 int bdrv_can_snapshot(BlockDriverState *bs);
 int bdrv_snapshot_create(BlockDriverState *bs,
                          QEMUSnapshotInfo *sn_info);
+int bdrv_snapshot_attach_vmstate(BlockDriverState *bs,
+                                 const char *name,
+                                 uint64_t vm_state_size,
+                                 Error **errp);
 int bdrv_snapshot_goto(BlockDriverState *bs,
                        const char *snapshot_id,
                        Error **errp);
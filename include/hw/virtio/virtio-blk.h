@@ -36,6 +36,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothread_vq_mapping;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -53,7 +54,14 @@ struct VirtIOBlockReq;
 struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
-    void *rq;
+    QemuMutex rq_lock;
+    void *rq; /* protected by rq_lock */
+    /*
+     * With iothread-vq-mapping over several IOThreads, each virtqueue has
+     * its own lock instead of the AioContext lock of the BlockBackend, so
+     * that the IOThreads do not serialize each other.  NULL otherwise.
+     */
+    QemuMutex *vq_lock;
     QEMUBH *bh;
     VirtIOBlkConf conf;
     unsigned short sector_mask;
@@ -80,6 +88,7 @@ typedef struct VirtIOBlockReq {
     struct VirtIOBlockReq *next;
     struct VirtIOBlockReq *mr_next;
     BlockAcctCookie acct;
+    bool pooled;        /* allocated with virtqueue_pop_pooled() */
 } VirtIOBlockReq;
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
@@ -87,6 +87,9 @@ typedef struct VirtioNetRscStat {
     uint32_t purge_failed;
     uint32_t drain_failed;
     uint32_t final_failed;
+    uint32_t csum_unverified;
+    uint32_t evicted;
+    uint32_t max_flows;
     int64_t  timer;
 } VirtioNetRscStat;
 
@@ -106,6 +109,7 @@ typedef struct VirtioNetRscSeg {
     size_t size;
     uint16_t packets;
     uint16_t dup_ack;
+    uint16_t gso_size;      /* largest payload of the coalesced packets */
     bool is_coalesced;      /* need recal ipv4 header checksum, mark here */
     VirtioNetRscUnit unit;
     NetClientState *nc;
@@ -121,6 +125,7 @@ typedef struct VirtioNetRscChain {
     uint16_t max_payload;
     QEMUTimer *drain_timer;
     QTAILQ_HEAD(, VirtioNetRscSeg) buffers;
+    uint32_t nb_flows;                       /* number of buffers */
     VirtioNetRscStat stat;
 } VirtioNetRscChain;
 
@@ -140,6 +145,9 @@ typedef struct VirtioNetRssData {
     uint16_t indirections_len;
     uint16_t *indirections_table;
     uint16_t default_queue;
+    /* Expanded key and flow cache, used by software RSS */
+    struct ToeplitzKey *toeplitz_key;
+    struct VirtioNetRssFlow *flows;
 } VirtioNetRssData;
 
 typedef struct VirtIONetQueue {
@@ -151,6 +159,10 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* Packets popped from tx_vq and not sent yet, allocated on first use */
+    struct VirtIONetTxBatch *tx_batch;
+    /* Packets were received during a batch and the guest not notified */
+    bool rx_notify_pending;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -161,6 +173,8 @@ struct VirtIONet {
     VirtIONetQueue *vqs;
     VirtQueue *ctrl_vq;
     NICState *nic;
+    /* Nesting level of the receive batches of all queues */
+    int rx_batch;
     /* RSC Chains - temporary storage of coalesced data,
        all these data are lost in case of migration */
     QTAILQ_HEAD(, VirtioNetRscChain) rsc_chains;
@@ -173,6 +187,9 @@ struct VirtIONet {
     uint32_t rsc_timeout;
     uint8_t rsc4_enabled;
     uint8_t rsc6_enabled;
+    /* Coalesced packets use the TSO header format instead of RSC_EXT */
+    uint8_t rsc_gso;
+    bool rx_gro;
     uint8_t has_ufo;
     uint32_t mergeable_rx_bufs;
     uint8_t promisc;
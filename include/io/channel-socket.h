@@ -47,6 +47,9 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* number of MSG_ZEROCOPY sendmsg() calls issued and completed */
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
 };
 
 
@@ -93,6 +96,20 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
                                     SocketAddress *addr,
                                     Error **errp);
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the connected socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Enable SO_ZEROCOPY on the socket, so that writes with
+ * QIO_CHANNEL_WRITE_FLAG_ZERO_COPY are accepted.  On success
+ * the channel gains QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY.
+ *
+ * Returns: 0 on success, -1 if the host does not support it
+ */
+int qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc,
+                                        Error **errp);
+
 /**
  * qio_channel_socket_connect_async:
  * @ioc: the socket channel object
@@ -62,6 +62,15 @@ typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
 typedef bool (SetSteeringEBPF)(NetClientState *, int);
+typedef void (NetBatch)(NetClientState *);
+
+/* One packet of a batch, see qemu_sendv_batch_async() */
+typedef struct NetPacketIOV {
+    const struct iovec *iov;
+    int iovcnt;
+} NetPacketIOV;
+
+typedef int (NetReceiveBatch)(NetClientState *, const NetPacketIOV *, int);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -69,6 +78,13 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    /*
+     * Receive several packets at once.  Returns how many of them were
+     * sent or dropped; if that is fewer than requested, the next one could
+     * not be sent now and the client calls qemu_flush_queued_packets() when
+     * it can send again, like when receive_iov returns 0.
+     */
+    NetReceiveBatch *receive_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -84,6 +100,14 @@ typedef struct NetClientInfo {
     SetVnetBE *set_vnet_be;
     NetAnnounce *announce;
     SetSteeringEBPF *set_steering_ebpf;
+    /*
+     * Called around a batch of packets that the peer sends in a row, see
+     * qemu_send_batch_begin().  The receiver can defer work that is only
+     * needed once per batch, such as notifying the guest, until
+     * end_batch.
+     */
+    NetBatch *begin_batch;
+    NetBatch *end_batch;
 } NetClientInfo;
 
 struct NetClientState {
@@ -161,6 +185,10 @@ ssize_t qemu_receive_packet_iov(NetClientState *nc,
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_sendv_batch_async(NetClientState *sender, const NetPacketIOV *pkts,
+                           int count, NetPacketSent *sent_cb);
+void qemu_send_batch_begin(NetClientState *nc);
+void qemu_send_batch_end(NetClientState *nc);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge);
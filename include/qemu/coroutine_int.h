@@ -27,6 +27,7 @@
 
 #include "qemu/queue.h"
 #include "qemu/coroutine.h"
+#include "block/aio-pool.h"
 
 #ifdef CONFIG_SAFESTACK
 /* Pointer to the unsafe stack, defined by the compiler */
@@ -48,6 +49,10 @@ struct Coroutine {
 
     /* Only used when the coroutine has terminated.  */
     QSLIST_ENTRY(Coroutine) pool_next;
+    AioPoolLink pool_link;
+
+    /* AioContext whose pool the coroutine returns to, or NULL */
+    AioContext *pool_ctx;
 
     size_t locks_held;
 
@@ -71,6 +76,7 @@ struct Coroutine {
 
 Coroutine *qemu_coroutine_new(void);
 void qemu_coroutine_delete(Coroutine *co);
+void qemu_coroutine_pool_drain(AioContext *ctx);
 CoroutineAction qemu_coroutine_switch(Coroutine *from, Coroutine *to,
                                       CoroutineAction action);
 
@@ -120,6 +120,13 @@ typedef struct Job {
 
     ProgressMeter progress;
 
+    /**
+     * Bytes copied with and without copy offloading.  Only reported if
+     * @has_copy_stats is set by the job driver.
+     */
+    bool has_copy_stats;
+    JobCopyStats copy_stats;
+
     /**
      * Return code from @run and/or @prepare callback(s).
      * Not final until the job has reached the CONCLUDED status.
@@ -0,0 +1,48 @@
+/*
+ * Toeplitz hash, as used for receive side scaling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_TOEPLITZ_H
+#define QEMU_TOEPLITZ_H
+
+/* Longest RSS input: IPv6 source and destination addresses and ports */
+#define TOEPLITZ_MAX_INPUT  36
+
+/* Key bytes needed to hash TOEPLITZ_MAX_INPUT bytes of input */
+#define TOEPLITZ_KEY_SIZE   (TOEPLITZ_MAX_INPUT + 4)
+
+/*
+ * A key expanded for hashing.  It is large (about 36 KiB), so allocate it
+ * on the heap and prepare it once whenever the key changes.
+ */
+typedef struct ToeplitzKey {
+    /* Bit-reversed 64-bit key window for each 32-bit word of input */
+    uint64_t rev_windows[TOEPLITZ_MAX_INPUT / 4];
+    /* Contribution of each value of each input byte to the hash */
+    uint32_t table[TOEPLITZ_MAX_INPUT][256];
+} ToeplitzKey;
+
+/**
+ * toeplitz_key_init:
+ * @k: the expanded key
+ * @key: TOEPLITZ_KEY_SIZE bytes of secret key
+ */
+void toeplitz_key_init(ToeplitzKey *k, const uint8_t *key);
+
+/**
+ * toeplitz_hash:
+ * @k: the expanded key
+ * @input: data to hash
+ * @len: length of @input, a multiple of 4 and at most TOEPLITZ_MAX_INPUT
+ *
+ * Returns the Toeplitz hash of @input, the same value as computing it
+ * bit by bit with net_toeplitz_add() and the unexpanded key.
+ */
+uint32_t toeplitz_hash(const ToeplitzKey *k, const uint8_t *input, size_t len);
+
+bool test_toeplitz_hash_next_accel(void);
+
+#endif
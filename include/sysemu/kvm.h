@@ -213,6 +213,7 @@ typedef struct Notifier Notifier;
 
 bool kvm_has_free_slot(MachineState *ms);
 bool kvm_has_sync_mmu(void);
+bool kvm_dirty_ring_enabled(void);
 int kvm_has_vcpu_events(void);
 int kvm_has_robust_singlestep(void);
 int kvm_has_debugregs(void);
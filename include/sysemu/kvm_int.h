@@ -24,6 +24,8 @@ typedef struct KVMSlot
     /* Dirty bitmap cache for the slot */
     unsigned long *dirty_bmap;
     unsigned long dirty_bmap_size;
+    /* Pages set in dirty_bmap from the dirty ring since the last sync */
+    uint64_t dirty_ring_pages;
     /* Cache of the address space ID */
     int as_id;
     /* Cache of the offset in ram address space */
@@ -183,6 +183,17 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    aio_context_set_io_uring_params(iothread->ctx,
+                                    iothread->io_uring_sqpoll,
+                                    iothread->io_uring_fixed_buffers,
+                                    &local_error);
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     /* This assumes we are called from a thread with useful CPU affinity for us
      * to inherit.
      */
@@ -252,6 +263,51 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static void iothread_set_io_uring_params(IOThread *iothread, bool sqpoll,
+                                         bool fixed_buffers, Error **errp)
+{
+    if (iothread->ctx) {
+        Error *local_err = NULL;
+
+        aio_context_set_io_uring_params(iothread->ctx, sqpoll, fixed_buffers,
+                                        &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+    iothread->io_uring_sqpoll = sqpoll;
+    iothread->io_uring_fixed_buffers = fixed_buffers;
+}
+
+static bool iothread_get_io_uring_sqpoll(Object *obj, Error **errp)
+{
+    return IOTHREAD(obj)->io_uring_sqpoll;
+}
+
+static void iothread_set_io_uring_sqpoll(Object *obj, bool value,
+                                         Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread_set_io_uring_params(iothread, value,
+                                 iothread->io_uring_fixed_buffers, errp);
+}
+
+static bool iothread_get_io_uring_fixed_buffers(Object *obj, Error **errp)
+{
+    return IOTHREAD(obj)->io_uring_fixed_buffers;
+}
+
+static void iothread_set_io_uring_fixed_buffers(Object *obj, bool value,
+                                                Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread_set_io_uring_params(iothread, iothread->io_uring_sqpoll,
+                                 value, errp);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -269,6 +325,12 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add_bool(klass, "io-uring-sqpoll",
+                                   iothread_get_io_uring_sqpoll,
+                                   iothread_set_io_uring_sqpoll);
+    object_class_property_add_bool(klass, "io-uring-fixed-buffers",
+                                   iothread_get_io_uring_fixed_buffers,
+                                   iothread_set_io_uring_fixed_buffers);
 }
 
 static const TypeInfo iothread_info = {
@@ -301,6 +363,25 @@ AioContext *iothread_get_aio_context(IOThread *iothread)
     return iothread->ctx;
 }
 
+static AioPoolInfoList *query_aio_pools(AioContext *ctx)
+{
+    AioPoolInfoList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < AIO_POOL_COUNT; i++) {
+        AioPool *pool = &ctx->pools[i];
+        AioPoolInfo *info = g_new0(AioPoolInfo, 1);
+
+        info->name = g_strdup(aio_pool_name(i));
+        info->hits = qatomic_read(&pool->hits);
+        info->misses = qatomic_read(&pool->misses);
+        info->free = qatomic_read(&pool->local_count) +
+                     MAX(qatomic_read(&pool->remote_count), 0);
+        QAPI_LIST_APPEND(tail, info);
+    }
+    return head;
+}
+
 static int query_one_iothread(Object *object, void *opaque)
 {
     IOThreadInfoList ***tail = opaque;
@@ -318,6 +399,9 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    if (iothread->ctx) {
+        info->pools = query_aio_pools(iothread->ctx);
+    }
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
@@ -157,6 +157,10 @@ static JobInfo *job_query_single(Job *job, Error **errp)
         .has_error          = !!job->err,
         .error              = job->err ? \
                               g_strdup(error_get_pretty(job->err)) : NULL,
+        .has_copy_stats     = job->has_copy_stats,
+        .copy_stats         = job->has_copy_stats ?
+                              g_memdup(&job->copy_stats,
+                                       sizeof(job->copy_stats)) : NULL,
     };
 
     return info;
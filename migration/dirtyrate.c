@@ -15,8 +15,15 @@
 #include "qapi/error.h"
 #include "cpu.h"
 #include "exec/ramblock.h"
+#include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/main-loop.h"
+#include "qapi/clone-visitor.h"
 #include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-visit-migration.h"
+#include "hw/boards.h"
+#include "migration/blocker.h"
+#include "sysemu/kvm.h"
 #include "ram.h"
 #include "trace.h"
 #include "dirtyrate.h"
@@ -26,6 +33,8 @@
 
 static int CalculatingState = DIRTY_RATE_STATUS_UNSTARTED;
 static struct DirtyRateStat DirtyStat;
+/* Blocks migration while the dirty bitmap is used for the measurement */
+static Error *dirtyrate_blocker;
 
 static int64_t set_sample_page_period(int64_t msec, int64_t initial_time)
 {
@@ -73,15 +82,28 @@ static struct DirtyRateInfo *query_dirty_rate_info(void)
     int64_t dirty_rate = DirtyStat.dirty_rate;
     struct DirtyRateInfo *info = g_malloc0(sizeof(DirtyRateInfo));
 
-    if (qatomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURED) {
+    if (qatomic_load_acquire(&CalculatingState) ==
+        DIRTY_RATE_STATUS_MEASURED) {
         info->has_dirty_rate = true;
         info->dirty_rate = dirty_rate;
+        if (DirtyStat.vcpu_dirty_rate) {
+            info->has_vcpu_dirty_rate = true;
+            info->vcpu_dirty_rate = QAPI_CLONE(DirtyRateVcpuList,
+                                               DirtyStat.vcpu_dirty_rate);
+        }
+        if (DirtyStat.ramblock_dirty_rate) {
+            info->has_ramblock_dirty_rate = true;
+            info->ramblock_dirty_rate =
+                QAPI_CLONE(DirtyRateRamBlockList,
+                           DirtyStat.ramblock_dirty_rate);
+        }
     }
 
     info->status = CalculatingState;
     info->start_time = DirtyStat.start_time;
     info->calc_time = DirtyStat.calc_time;
     info->sample_pages = DirtyStat.sample_pages;
+    info->mode = DirtyStat.mode;
 
     trace_query_dirty_rate_info(DirtyRateStatus_str(CalculatingState));
 
@@ -89,7 +111,8 @@ static struct DirtyRateInfo *query_dirty_rate_info(void)
 }
 
 static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time,
-                                uint64_t sample_pages)
+                                uint64_t sample_pages,
+                                DirtyRateMeasureMode mode)
 {
     DirtyStat.total_dirty_samples = 0;
     DirtyStat.total_sample_count = 0;
@@ -98,6 +121,25 @@ static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time,
     DirtyStat.start_time = start_time;
     DirtyStat.calc_time = calc_time;
     DirtyStat.sample_pages = sample_pages;
+    DirtyStat.mode = mode;
+}
+
+/*
+ * Drop the per vcpu and per ramblock results of the previous measurement.
+ * Called with the BQL held, like query_dirty_rate_info.
+ */
+static void free_dirtyrate_breakdown(void)
+{
+    qapi_free_DirtyRateVcpuList(DirtyStat.vcpu_dirty_rate);
+    DirtyStat.vcpu_dirty_rate = NULL;
+    qapi_free_DirtyRateRamBlockList(DirtyStat.ramblock_dirty_rate);
+    DirtyStat.ramblock_dirty_rate = NULL;
+}
+
+/* Converts a count of pages dirtied during @msec into MB/s */
+static int64_t dirty_pages_to_rate(uint64_t pages, int64_t msec)
+{
+    return (pages * TARGET_PAGE_SIZE * 1000 / msec) >> 20;
 }
 
 static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
@@ -310,10 +352,12 @@ find_block_matched(RAMBlock *block, int count,
 }
 
 static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
-                                  int block_count)
+                                  int block_count, int64_t msec)
 {
+    DirtyRateRamBlockList **tail = &DirtyStat.ramblock_dirty_rate;
     struct RamblockDirtyInfo *block_dinfo = NULL;
     RAMBlock *block = NULL;
+    DirtyRateRamBlock *rate;
 
     RAMBLOCK_FOREACH_MIGRATABLE(block) {
         if (skip_sample_ramblock(block)) {
@@ -325,6 +369,17 @@ static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
         }
         calc_page_dirty_rate(block_dinfo);
         update_dirtyrate_stat(block_dinfo);
+
+        if (!block_dinfo->sample_pages_count) {
+            continue;
+        }
+        rate = g_new0(DirtyRateRamBlock, 1);
+        rate->id = g_strdup(block_dinfo->idstr);
+        rate->dirty_rate = block_dinfo->sample_dirty_count *
+                           ((block_dinfo->ramblock_pages *
+                             TARGET_PAGE_SIZE) >> 20) * 1000 /
+                           (block_dinfo->sample_pages_count * msec);
+        QAPI_LIST_APPEND(tail, rate);
     }
 
     if (DirtyStat.total_sample_count == 0) {
@@ -334,14 +389,13 @@ static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
     return true;
 }
 
-static void calculate_dirtyrate(struct DirtyRateConfig config)
+static void calculate_dirtyrate_sample_vm(struct DirtyRateConfig config)
 {
     struct RamblockDirtyInfo *block_dinfo = NULL;
     int block_count = 0;
     int64_t msec = 0;
     int64_t initial_time;
 
-    rcu_register_thread();
     rcu_read_lock();
     initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     if (!record_ramblock_hash_info(&block_dinfo, config, &block_count)) {
@@ -355,7 +409,7 @@ static void calculate_dirtyrate(struct DirtyRateConfig config)
     DirtyStat.calc_time = msec / 1000;
 
     rcu_read_lock();
-    if (!compare_page_hash_info(block_dinfo, block_count)) {
+    if (!compare_page_hash_info(block_dinfo, block_count, msec)) {
         goto out;
     }
 
@@ -364,6 +418,145 @@ static void calculate_dirtyrate(struct DirtyRateConfig config)
 out:
     rcu_read_unlock();
     free_ramblock_dirty_info(block_dinfo, block_count);
+}
+
+/*
+ * Measure the dirty rate of each vcpu from the number of pages harvested
+ * from its KVM dirty ring.  The guest keeps running, the rings are only
+ * reaped at the start and at the end of the period.
+ */
+static void calculate_dirtyrate_dirty_ring(struct DirtyRateConfig config)
+{
+    DirtyRateVcpuList **tail = &DirtyStat.vcpu_dirty_rate;
+    int max_cpus = current_machine->smp.max_cpus;
+    uint64_t *start_pages = g_new0(uint64_t, max_cpus);
+    uint64_t total_pages = 0;
+    int64_t msec, initial_time;
+    CPUState *cpu;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+    /* Only count the pages dirtied from now on */
+    memory_global_dirty_log_sync();
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    CPU_FOREACH(cpu) {
+        start_pages[cpu->cpu_index] = qatomic_read_u64(&cpu->dirty_pages);
+    }
+    qemu_mutex_unlock_iothread();
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, initial_time);
+    DirtyStat.start_time = initial_time / 1000;
+    DirtyStat.calc_time = msec / 1000;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    CPU_FOREACH(cpu) {
+        uint64_t pages = qatomic_read_u64(&cpu->dirty_pages) -
+                         start_pages[cpu->cpu_index];
+        DirtyRateVcpu *rate = g_new0(DirtyRateVcpu, 1);
+
+        rate->id = cpu->cpu_index;
+        rate->dirty_rate = dirty_pages_to_rate(pages, msec);
+        trace_dirtyrate_vcpu(cpu->cpu_index, pages);
+        QAPI_LIST_APPEND(tail, rate);
+        total_pages += pages;
+    }
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+    qemu_mutex_unlock_iothread();
+
+    DirtyStat.dirty_rate = dirty_pages_to_rate(total_pages, msec);
+    g_free(start_pages);
+}
+
+/*
+ * Returns the number of pages of @block that are set in the migration
+ * dirty bitmap, and clears them.
+ */
+static uint64_t ramblock_count_and_clear_dirty(RAMBlock *block)
+{
+    ram_addr_t length = qemu_ram_get_used_length(block);
+    DirtyBitmapSnapshot *snap;
+    uint64_t pages;
+
+    snap = cpu_physical_memory_snapshot_and_clear_dirty(block->mr, 0, length,
+                                                        DIRTY_MEMORY_MIGRATION);
+    pages = cpu_physical_memory_snapshot_count_dirty(snap, block->offset,
+                                                     length);
+    g_free(snap);
+    return pages;
+}
+
+/*
+ * Measure the dirty rate of each ramblock with the dirty bitmap.  This
+ * consumes the migration dirty bitmap, so migration is blocked until the
+ * measurement is complete.
+ */
+static void calculate_dirtyrate_dirty_bitmap(struct DirtyRateConfig config)
+{
+    DirtyRateRamBlockList **tail = &DirtyStat.ramblock_dirty_rate;
+    uint64_t total_pages = 0;
+    int64_t msec, initial_time;
+    RAMBlock *block;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+    /* Only count the pages dirtied from now on */
+    memory_global_dirty_log_sync();
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            ramblock_count_and_clear_dirty(block);
+        }
+    }
+    qemu_mutex_unlock_iothread();
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, initial_time);
+    DirtyStat.start_time = initial_time / 1000;
+    DirtyStat.calc_time = msec / 1000;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            uint64_t pages = ramblock_count_and_clear_dirty(block);
+            DirtyRateRamBlock *rate = g_new0(DirtyRateRamBlock, 1);
+
+            rate->id = g_strdup(qemu_ram_get_idstr(block));
+            rate->dirty_rate = dirty_pages_to_rate(pages, msec);
+            trace_dirtyrate_ramblock(rate->id, pages);
+            QAPI_LIST_APPEND(tail, rate);
+            total_pages += pages;
+        }
+    }
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+    migrate_del_blocker(dirtyrate_blocker);
+    error_free(dirtyrate_blocker);
+    dirtyrate_blocker = NULL;
+    qemu_mutex_unlock_iothread();
+
+    DirtyStat.dirty_rate = dirty_pages_to_rate(total_pages, msec);
+}
+
+static void calculate_dirtyrate(struct DirtyRateConfig config)
+{
+    rcu_register_thread();
+
+    switch (config.mode) {
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_RING:
+        calculate_dirtyrate_dirty_ring(config);
+        break;
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP:
+        calculate_dirtyrate_dirty_bitmap(config);
+        break;
+    default:
+        calculate_dirtyrate_sample_vm(config);
+        break;
+    }
+
+    trace_dirtyrate_calculate(DirtyRateMeasureMode_str(config.mode),
+                              DirtyStat.dirty_rate);
     rcu_unregister_thread();
 }
 
@@ -385,7 +578,7 @@ void *get_dirtyrate_thread(void *arg)
     start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
     calc_time = config.sample_period_seconds;
     sample_pages = config.sample_pages_per_gigabytes;
-    init_dirtyrate_stat(start_time, calc_time, sample_pages);
+    init_dirtyrate_stat(start_time, calc_time, sample_pages, config.mode);
 
     calculate_dirtyrate(config);
 
@@ -398,7 +591,8 @@ void *get_dirtyrate_thread(void *arg)
 }
 
 void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
-                         int64_t sample_pages, Error **errp)
+                         int64_t sample_pages, bool has_mode,
+                         DirtyRateMeasureMode mode, Error **errp)
 {
     static struct DirtyRateConfig config;
     QemuThread thread;
@@ -419,7 +613,25 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
         return;
     }
 
-    if (has_sample_pages) {
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+
+    if (has_sample_pages && mode != DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        error_setg(errp, "sample-pages is only valid in page-sampling mode.");
+        return;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING &&
+        (!kvm_enabled() || !kvm_dirty_ring_enabled())) {
+        error_setg(errp, "dirty-ring mode requires KVM with the "
+                   "dirty-ring-size accelerator property set.");
+        return;
+    }
+
+    if (mode != DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        sample_pages = 0;
+    } else if (has_sample_pages) {
         if (!is_sample_pages_valid(sample_pages)) {
             error_setg(errp, "sample-pages is out of range[%d, %d].",
                             MIN_SAMPLE_PAGE_COUNT,
@@ -439,9 +651,25 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
         error_setg(errp, "init dirty rate calculation state failed.");
         return;
     }
+    free_dirtyrate_breakdown();
+
+    /*
+     * Migration syncs and clears the dirty bitmap too, so neither can run
+     * while the other is using it.
+     */
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+        error_setg(&dirtyrate_blocker, "The dirty page rate is being "
+                   "measured with the dirty bitmap");
+        if (migrate_add_blocker(dirtyrate_blocker, errp) < 0) {
+            error_free(dirtyrate_blocker);
+            dirtyrate_blocker = NULL;
+            return;
+        }
+    }
 
     config.sample_period_seconds = calc_time;
     config.sample_pages_per_gigabytes = sample_pages;
+    config.mode = mode;
     qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
                        (void *)&config, QEMU_THREAD_DETACHED);
 }
@@ -457,6 +685,8 @@ void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
 
     monitor_printf(mon, "Status: %s\n",
                    DirtyRateStatus_str(info->status));
+    monitor_printf(mon, "Mode: %s\n",
+                   DirtyRateMeasureMode_str(info->mode));
     monitor_printf(mon, "Start Time: %"PRIi64" (ms)\n",
                    info->start_time);
     monitor_printf(mon, "Sample Pages: %"PRIu64" (per GB)\n",
@@ -469,7 +699,27 @@ void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
     } else {
         monitor_printf(mon, "(not ready)\n");
     }
-    g_free(info);
+
+    if (info->has_vcpu_dirty_rate) {
+        DirtyRateVcpuList *rate;
+
+        monitor_printf(mon, "vCPU dirty rates:\n");
+        for (rate = info->vcpu_dirty_rate; rate; rate = rate->next) {
+            monitor_printf(mon, "  vCPU %"PRIi64": %"PRIi64" (MB/s)\n",
+                           rate->value->id, rate->value->dirty_rate);
+        }
+    }
+
+    if (info->has_ramblock_dirty_rate) {
+        DirtyRateRamBlockList *rate;
+
+        monitor_printf(mon, "RAMBlock dirty rates:\n");
+        for (rate = info->ramblock_dirty_rate; rate; rate = rate->next) {
+            monitor_printf(mon, "  %s: %"PRIi64" (MB/s)\n",
+                           rate->value->id, rate->value->dirty_rate);
+        }
+    }
+    qapi_free_DirtyRateInfo(info);
 }
 
 void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
@@ -477,6 +727,9 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
     int64_t sec = qdict_get_try_int(qdict, "second", 0);
     int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages_per_GB", -1);
     bool has_sample_pages = (sample_pages != -1);
+    bool dirty_ring = qdict_get_try_bool(qdict, "dirty_ring", false);
+    bool dirty_bitmap = qdict_get_try_bool(qdict, "dirty_bitmap", false);
+    DirtyRateMeasureMode mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
     Error *err = NULL;
 
     if (!sec) {
@@ -484,7 +737,20 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
         return;
     }
 
-    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, &err);
+    if (dirty_ring && dirty_bitmap) {
+        monitor_printf(mon, "Either dirty ring or dirty bitmap "
+                       "can be specified!\n");
+        return;
+    }
+
+    if (dirty_ring) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_RING;
+    } else if (dirty_bitmap) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP;
+    }
+
+    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, true, mode,
+                        &err);
     if (err) {
         hmp_handle_error(mon, err);
         return;
@@ -13,6 +13,8 @@
 #ifndef QEMU_MIGRATION_DIRTYRATE_H
 #define QEMU_MIGRATION_DIRTYRATE_H
 
+#include "qapi/qapi-types-migration.h"
+
 /*
  * Sample 512 pages per GB as default.
  */
@@ -43,6 +45,7 @@
 struct DirtyRateConfig {
     uint64_t sample_pages_per_gigabytes; /* sample pages per GB */
     int64_t sample_period_seconds; /* time duration between two sampling */
+    DirtyRateMeasureMode mode; /* mechanism of the measurement */
 };
 
 /*
@@ -69,6 +72,9 @@ struct DirtyRateStat {
     int64_t start_time; /* calculation start time in units of second */
     int64_t calc_time; /* time duration of two sampling in units of second */
     uint64_t sample_pages; /* sample pages per GB */
+    DirtyRateMeasureMode mode; /* mechanism of the measurement */
+    DirtyRateVcpuList *vcpu_dirty_rate; /* dirty rate of each vcpu */
+    DirtyRateRamBlockList *ramblock_dirty_rate; /* dirty rate of each block */
 };
 
 void *get_dirtyrate_thread(void *arg);
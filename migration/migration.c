@@ -99,6 +99,8 @@
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+/* 0: means fast LZ4, 1 ... 12: LZ4 HC, 12 is best compress ratio */
+#define DEFAULT_MIGRATE_MULTIFD_LZ4_LEVEL 0
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -276,6 +278,10 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -720,9 +726,19 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd and postcopy-preempt need more than one
+         * channel, we wait.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migrate_use_multifd() &&
+                          !migrate_postcopy_preempt();
+    } else if (migrate_postcopy_preempt()) {
+        /* The second connection is the postcopy-preempt channel */
+        if (mis->postcopy_qemufile_dst) {
+            error_setg(errp, "Unexpected connection for postcopy-preempt");
+            return;
+        }
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        start_migration = true;
     } else {
         /* Multiple connections */
         assert(migrate_use_multifd());
@@ -751,6 +767,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -896,6 +916,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->multifd_zlib_level = s->parameters.multifd_zlib_level;
     params->has_multifd_zstd_level = true;
     params->multifd_zstd_level = s->parameters.multifd_zstd_level;
+    params->has_multifd_lz4_level = true;
+    params->multifd_lz4_level = s->parameters.multifd_lz4_level;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
     params->has_max_postcopy_bandwidth = true;
@@ -1016,6 +1038,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->dirty_sync_missed_zero_copy =
+        ram_counters.dirty_sync_missed_zero_copy;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -1219,6 +1243,42 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        /*
+         * The destination tells the preempt channel apart from the main
+         * one only by the order of the connections, and compressed pages
+         * are written to the main stream by the compression threads.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Postcopy preempt is not compatible with "
+                       "multifd or compress");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+        MigrationState *s = migrate_get_current();
+
+#ifndef CONFIG_LINUX
+        error_setg(errp, "Zero copy send is only supported on Linux");
+        return false;
+#endif
+        if (!cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            s->parameters.multifd_compression != MULTIFD_COMPRESSION_NONE ||
+            (s->parameters.tls_creds && *s->parameters.tls_creds)) {
+            error_setg(errp, "Zero copy send is only available for "
+                       "non-compressed non-TLS multifd migration");
+            return false;
+        }
+    }
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1255,6 +1315,43 @@ static bool migrate_caps_check(bool *cap_list,
     return true;
 }
 
+/**
+ * @migrate_live_snapshot_check - check that a live snapshot can save RAM
+ *
+ * Live snapshots use the same write tracking as background snapshots,
+ * so they have the same requirements.
+ *
+ * @errp - [out] The reason why RAM can't be saved with write tracking
+ */
+bool migrate_live_snapshot_check(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    WriteTrackingSupport wt_support;
+    int idx;
+
+    wt_support = migrate_query_write_tracking();
+    if (wt_support < WT_SUPPORT_AVAILABLE) {
+        error_setg(errp, "Live snapshots are not supported by host kernel");
+        return false;
+    }
+    if (wt_support < WT_SUPPORT_COMPATIBLE) {
+        error_setg(errp, "Live snapshots are not compatible "
+                   "with guest memory configuration");
+        return false;
+    }
+
+    for (idx = 0; idx < check_caps_background_snapshot.size; idx++) {
+        int incomp_cap = check_caps_background_snapshot.caps[idx];
+        if (s->enabled_capabilities[incomp_cap]) {
+            error_setg(errp, "Live snapshots are not compatible with %s",
+                       MigrationCapability_str(incomp_cap));
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static void fill_destination_migration_info(MigrationInfo *info)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
@@ -1413,6 +1510,22 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_multifd_lz4_level &&
+        (params->multifd_lz4_level > 12)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_lz4_level",
+                   "a value between 0 and 12");
+        return false;
+    }
+
+    if (migrate_use_zero_copy_send() &&
+        ((params->has_multifd_compression &&
+          params->multifd_compression != MULTIFD_COMPRESSION_NONE) ||
+         (params->tls_creds && *params->tls_creds))) {
+        error_setg(errp, "Zero copy send is only available for "
+                   "non-compressed non-TLS multifd migration");
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1540,6 +1653,9 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_multifd_compression) {
         dest->multifd_compression = params->multifd_compression;
     }
+    if (params->has_multifd_lz4_level) {
+        dest->multifd_lz4_level = params->multifd_lz4_level;
+    }
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
@@ -1652,6 +1768,9 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_multifd_compression) {
         s->parameters.multifd_compression = params->multifd_compression;
     }
+    if (params->has_multifd_lz4_level) {
+        s->parameters.multifd_lz4_level = params->multifd_lz4_level;
+    }
     if (params->has_xbzrle_cache_size) {
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
@@ -1819,6 +1938,16 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_fclose(tmp);
     }
 
+    if (s->postcopy_qemufile_src) {
+        QEMUFile *tmp;
+
+        qemu_mutex_lock(&s->qemu_file_lock);
+        tmp = s->postcopy_qemufile_src;
+        s->postcopy_qemufile_src = NULL;
+        qemu_mutex_unlock(&s->qemu_file_lock);
+        qemu_fclose(tmp);
+    }
+
     assert(!migration_is_active(s));
 
     if (s->state == MIGRATION_STATUS_CANCELLING) {
@@ -1902,6 +2031,13 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING) {
+        qemu_mutex_lock(&s->qemu_file_lock);
+        if (s->postcopy_qemufile_src) {
+            qemu_file_shutdown(s->postcopy_qemufile_src);
+        }
+        qemu_mutex_unlock(&s->qemu_file_lock);
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -2132,6 +2268,7 @@ void qmp_migrate_pause(Error **errp)
         if (ret) {
             error_setg(errp, "Failed to pause source migration");
         }
+        multifd_send_postcopy_pause();
         return;
     }
 
@@ -2336,6 +2473,15 @@ bool migrate_postcopy_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
 bool migrate_postcopy(void)
 {
     return migrate_postcopy_ram() || migrate_dirty_bitmaps();
@@ -2458,6 +2604,24 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_use_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2504,6 +2668,15 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+int migrate_multifd_lz4_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_lz4_level;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -2564,7 +2737,8 @@ bool migrate_background_snapshot(void)
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] ||
+           s->live_snapshot;
 }
 
 /* migration thread support */
@@ -2887,6 +3061,15 @@ static int postcopy_start(MigrationState *ms)
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    if (migrate_postcopy_preempt() && postcopy_preempt_wait_channel(ms)) {
+        error_report("%s: postcopy-preempt channel is not connected",
+                     __func__);
+        migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+        return -1;
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -3138,6 +3321,9 @@ static void migration_completion(MigrationState *s)
         trace_migration_completion_postcopy_end();
 
         qemu_savevm_state_complete_postcopy(s->to_dst_file);
+        if (migrate_postcopy_preempt()) {
+            postcopy_preempt_shutdown_file(s);
+        }
         trace_migration_completion_postcopy_end_after_complete();
     } else if (s->state == MIGRATION_STATUS_CANCELLING) {
         goto fail;
@@ -3319,6 +3505,9 @@ static MigThrError postcopy_pause(MigrationState *s)
         qemu_file_shutdown(file);
         qemu_fclose(file);
 
+        /* The multifd channels are not reconnected on recovery */
+        multifd_send_postcopy_pause();
+
         migrate_set_state(&s->state, s->state,
                           MIGRATION_STATUS_POSTCOPY_PAUSED);
 
@@ -3387,11 +3576,12 @@ static MigThrError migration_detect_error(MigrationState *s)
         error_free(local_error);
     }
 
-    if (state == MIGRATION_STATUS_POSTCOPY_ACTIVE && ret == -EIO) {
+    if (state == MIGRATION_STATUS_POSTCOPY_ACTIVE && ret == -EIO &&
+        !migrate_postcopy_preempt()) {
         /*
          * For postcopy, we allow the network to be down for a
          * while. After that, it can be continued by a
-         * recovery phase.
+         * recovery phase.  The preempt channel can't be recovered.
          */
         return postcopy_pause(s);
     } else {
@@ -4003,6 +4193,14 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         return;
     }
 
+    if (migrate_postcopy_preempt() && postcopy_preempt_setup(s, &local_err)) {
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     if (migrate_background_snapshot()) {
         qemu_thread_create(&s->thread, "bg_snapshot",
                 bg_migration_thread, s, QEMU_THREAD_JOINABLE);
@@ -4090,6 +4288,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-zstd-level", MigrationState,
                       parameters.multifd_zstd_level,
                       DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL),
+    DEFINE_PROP_UINT8("multifd-lz4-level", MigrationState,
+                      parameters.multifd_lz4_level,
+                      DEFAULT_MIGRATE_MULTIFD_LZ4_LEVEL),
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
@@ -4127,6 +4328,12 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
     DEFINE_PROP_MIG_CAP("x-background-snapshot",
             MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-multifd-zero-page",
+            MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE),
+    DEFINE_PROP_MIG_CAP("x-zero-copy-send",
+            MIGRATION_CAPABILITY_ZERO_COPY_SEND),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -4152,6 +4359,7 @@ static void migration_instance_finalize(Object *obj)
     qemu_sem_destroy(&ms->rate_limit_sem);
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
     error_free(ms->error);
@@ -4187,6 +4395,7 @@ static void migration_instance_init(Object *obj)
     params->has_multifd_compression = true;
     params->has_multifd_zlib_level = true;
     params->has_multifd_zstd_level = true;
+    params->has_multifd_lz4_level = true;
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
@@ -4196,6 +4405,7 @@ static void migration_instance_init(Object *obj)
     params->has_announce_step = true;
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
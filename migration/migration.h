@@ -45,6 +45,16 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * Streams that RAM pages arrive on.  With postcopy-preempt the pages
+ * requested by the destination have a channel of their own.
+ */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -81,7 +91,8 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Temporary host pages, one for each channel pages are loaded from */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
@@ -126,6 +137,14 @@ struct MigrationIncomingState {
      * contains valid information.
      */
     QemuMutex page_request_mutex;
+
+    /* Last RAMBlock seen on each channel, for RAM_SAVE_FLAG_CONTINUE */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
+
+    /* Channel for the urgent pages with postcopy-preempt */
+    QEMUFile *postcopy_qemufile_dst;
+    bool have_preempt_thread;
+    QemuThread postcopy_prio_thread;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -216,6 +235,12 @@ struct MigrationState {
      */
     bool vm_was_running;
 
+    /*
+     * Set while a live snapshot saves RAM with write tracking, as
+     * background snapshots do, see save_snapshot_live_start()
+     */
+    bool live_snapshot;
+
     /* Flag set once the migration has been asked to enter postcopy */
     bool start_postcopy;
     /* Flag set after postcopy has sent the device state */
@@ -262,6 +287,14 @@ struct MigrationState {
     /* Whether we send section footer during migration */
     bool send_section_footer;
 
+    /*
+     * Channel for the pages the destination requests in postcopy with
+     * postcopy-preempt; the semaphore is posted once the connection
+     * attempt has finished, successfully or not.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    QemuSemaphore postcopy_qemufile_src_sem;
+
     /* Needed by postcopy-pause state */
     QemuSemaphore postcopy_pause_sem;
     QemuSemaphore postcopy_pause_rp_sem;
@@ -317,6 +350,7 @@ bool migrate_postcopy(void);
 
 bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
+bool migrate_postcopy_preempt(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
@@ -324,11 +358,14 @@ bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_use_multifd_zero_page(void);
+bool migrate_use_zero_copy_send(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
 int migrate_multifd_zlib_level(void);
 int migrate_multifd_zstd_level(void);
+int migrate_multifd_lz4_level(void);
 
 int migrate_use_xbzrle(void);
 uint64_t migrate_xbzrle_cache_size(void);
@@ -349,6 +386,7 @@ int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
 bool migrate_background_snapshot(void);
+bool migrate_live_snapshot_check(Error **errp);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
@@ -0,0 +1,363 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include <lz4hc.h>
+#include "qemu/units.h"
+#include "qemu/rcu.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Each page is compressed as one lz4 block, and the blocks of a
+ * channel form a single lz4 stream that is kept across packets, so
+ * that the pages sent before act as a dictionary for the following
+ * ones.
+ *
+ * lz4 references the dictionary in place, but guest pages can change
+ * under our feet, so each page is first copied into a ring buffer.
+ * The receive side decompresses into a ring buffer of the same size,
+ * wrapping at the same positions, and copies the page out of it.
+ *
+ * On the wire, each page is a big endian 32 bit compressed size
+ * followed by the compressed data.
+ */
+
+/* lz4 can reference up to 64KiB of history */
+#define LZ4_DICT_SIZE (64 * KiB)
+
+struct lz4_data {
+    /* stream for compression with the fast compressor */
+    LZ4_stream_t *stream;
+    /* stream for compression with the HC compressor */
+    LZ4_streamHC_t *stream_hc;
+    /* stream for decompression */
+    LZ4_streamDecode_t *stream_decode;
+    /* ring buffer that holds the dictionary */
+    uint8_t *ring;
+    /* size of the ring buffer */
+    uint32_t ring_len;
+    /* where the next page goes in the ring buffer */
+    uint32_t ring_pos;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+static void lz4_data_free(struct lz4_data *z)
+{
+    if (z->stream) {
+        LZ4_freeStream(z->stream);
+    }
+    if (z->stream_hc) {
+        LZ4_freeStreamHC(z->stream_hc);
+    }
+    if (z->stream_decode) {
+        LZ4_freeStreamDecode(z->stream_decode);
+    }
+    g_free(z->ring);
+    g_free(z->zbuff);
+    g_free(z);
+}
+
+/**
+ * lz4_data_new: allocate the buffers common to both sides
+ *
+ * Returns the new lz4 data or NULL on failure
+ */
+static struct lz4_data *lz4_data_new(void)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_size = qemu_target_page_size();
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->ring_len = LZ4_DICT_SIZE + page_size;
+    z->ring = g_try_malloc(z->ring_len);
+    /* We will never have more than page_count pages */
+    z->zbuff_len = page_count * (sizeof(uint32_t) +
+                                 LZ4_COMPRESSBOUND(page_size));
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->ring || !z->zbuff) {
+        lz4_data_free(z);
+        return NULL;
+    }
+    return z;
+}
+
+/*
+ * Returns the place in the ring buffer for the next page.  Both sides
+ * need to wrap at exactly the same positions.
+ */
+static uint8_t *lz4_ring_next(struct lz4_data *z)
+{
+    uint32_t page_size = qemu_target_page_size();
+    uint8_t *ptr;
+
+    if (z->ring_pos + page_size > z->ring_len) {
+        z->ring_pos = 0;
+    }
+    ptr = z->ring + z->ring_pos;
+    z->ring_pos += page_size;
+    return ptr;
+}
+
+/* Multifd lz4 compression */
+
+/**
+ * lz4_send_setup: setup send side
+ *
+ * Setup each channel with lz4 compression.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    int level = migrate_multifd_lz4_level();
+    struct lz4_data *z = lz4_data_new();
+
+    if (!z) {
+        error_setg(errp, "multifd %d: out of memory for lz4 buffers", p->id);
+        return -1;
+    }
+
+    if (level) {
+        z->stream_hc = LZ4_createStreamHC();
+        if (z->stream_hc) {
+            LZ4_resetStreamHC_fast(z->stream_hc, level);
+        }
+    } else {
+        z->stream = LZ4_createStream();
+    }
+    if (!z->stream && !z->stream_hc) {
+        lz4_data_free(z);
+        error_setg(errp, "multifd %d: lz4 createStream failed", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    lz4_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_send_prepare: prepare date to be able to send
+ *
+ * Create a compressed buffer with all the pages that we are going to
+ * send.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ */
+static int lz4_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct iovec *iov = p->pages->iov;
+    struct lz4_data *z = p->data;
+    uint32_t page_size = qemu_target_page_size();
+    uint32_t out_pos = 0;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        uint8_t *src = lz4_ring_next(z);
+        char *dst = (char *)z->zbuff + out_pos + sizeof(uint32_t);
+        int capacity = z->zbuff_len - out_pos - sizeof(uint32_t);
+        int ret;
+
+        memcpy(src, iov[i].iov_base, page_size);
+        if (z->stream_hc) {
+            ret = LZ4_compress_HC_continue(z->stream_hc, (char *)src, dst,
+                                           page_size, capacity);
+        } else {
+            ret = LZ4_compress_fast_continue(z->stream, (char *)src, dst,
+                                             page_size, capacity, 1);
+        }
+        if (ret <= 0) {
+            error_setg(errp, "multifd %d: lz4 compression failed", p->id);
+            return -1;
+        }
+        stl_be_p(z->zbuff + out_pos, ret);
+        out_pos += sizeof(uint32_t) + ret;
+    }
+    p->next_packet_size = out_pos;
+    p->flags |= MULTIFD_FLAG_LZ4;
+
+    return 0;
+}
+
+/**
+ * lz4_send_write: do the actual write of the data
+ *
+ * Do the actual write of the comprresed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int lz4_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct lz4_data *z = p->data;
+
+    return qio_channel_write_all(p->c, (void *)z->zbuff, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * lz4_recv_setup: setup receive side
+ *
+ * Create the decompression stream and buffers.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = lz4_data_new();
+
+    if (!z) {
+        error_setg(errp, "multifd %d: out of memory for lz4 buffers", p->id);
+        return -1;
+    }
+
+    z->stream_decode = LZ4_createStreamDecode();
+    if (!z->stream_decode) {
+        lz4_data_free(z);
+        error_setg(errp, "multifd %d: lz4 createStreamDecode failed", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_recv_cleanup: cleanup receive side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    lz4_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it into the actual
+ * pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int lz4_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t page_size = qemu_target_page_size();
+    struct lz4_data *z = p->data;
+    uint32_t in_pos = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %d: packet size received %d is bigger "
+                   "than the maximum %d", p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        uint8_t *dst = lz4_ring_next(z);
+        uint32_t block_size;
+
+        if (in_size - in_pos < sizeof(uint32_t)) {
+            error_setg(errp, "multifd %d: truncated lz4 packet", p->id);
+            return -1;
+        }
+        block_size = ldl_be_p(z->zbuff + in_pos);
+        in_pos += sizeof(uint32_t);
+        if (block_size > in_size - in_pos) {
+            error_setg(errp, "multifd %d: truncated lz4 packet", p->id);
+            return -1;
+        }
+
+        ret = LZ4_decompress_safe_continue(z->stream_decode,
+                                           (char *)z->zbuff + in_pos,
+                                           (char *)dst, block_size,
+                                           page_size);
+        if (ret != (int)page_size) {
+            error_setg(errp, "multifd %d: lz4 decompression failed with %d",
+                       p->id, ret);
+            return -1;
+        }
+        memcpy(iov->iov_base, dst, page_size);
+        in_pos += block_size;
+    }
+    if (in_pos != in_size) {
+        error_setg(errp, "multifd %d: packet size received %d size used %d",
+                   p->id, in_size, in_pos);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .send_write = lz4_send_write,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv_pages = lz4_recv_pages
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
@@ -11,6 +11,8 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/bitmap.h"
 #include "qemu/rcu.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
@@ -19,6 +21,7 @@
 #include "qapi/error.h"
 #include "ram.h"
 #include "migration.h"
+#include "postcopy-ram.h"
 #include "socket.h"
 #include "tls.h"
 #include "qemu-file.h"
@@ -105,7 +108,8 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
  */
 static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+    return qio_channel_writev_full_all(p->c, p->pages->iov, used, NULL, 0,
+                                       p->write_flags, errp);
 }
 
 /**
@@ -246,6 +250,7 @@ static MultiFDPages_t *multifd_pages_init(size_t size)
     pages->allocated = size;
     pages->iov = g_new0(struct iovec, size);
     pages->offset = g_new0(ram_addr_t, size);
+    pages->zero = bitmap_new(size);
 
     return pages;
 }
@@ -254,15 +259,159 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
 {
     pages->used = 0;
     pages->allocated = 0;
+    pages->normal_num = 0;
     pages->packet_num = 0;
     pages->block = NULL;
     g_free(pages->iov);
     pages->iov = NULL;
     g_free(pages->offset);
     pages->offset = NULL;
+    g_free(pages->zero);
+    pages->zero = NULL;
     g_free(pages);
 }
 
+/* Size on the wire of the zero page bitmap for @pages_alloc pages */
+static size_t multifd_zero_bitmap_size(uint32_t pages_alloc)
+{
+    return ROUND_UP(pages_alloc, 64) / 8;
+}
+
+/* The zero page bitmap follows the offset array of the packet */
+static unsigned long *multifd_packet_zero_bitmap(MultiFDPacket_t *packet,
+                                                 uint32_t pages_alloc)
+{
+    return (void *)((uint8_t *)packet + sizeof(MultiFDPacket_t) +
+                    sizeof(uint64_t) * pages_alloc);
+}
+
+static uint32_t multifd_packet_len(uint32_t page_count)
+{
+    uint32_t len = sizeof(MultiFDPacket_t) + sizeof(uint64_t) * page_count;
+
+    if (migrate_use_multifd_zero_page()) {
+        len += multifd_zero_bitmap_size(page_count);
+    }
+    return len;
+}
+
+/**
+ * multifd_send_zero_page_detect: look for zero pages in a packet
+ *
+ * Zero pages are marked in the zero bitmap of the pages, and the iov
+ * array is compacted so that its first normal_num entries are the
+ * pages whose contents have to be sent.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i;
+
+    bitmap_zero(pages->zero, pages->allocated);
+
+    if (!migrate_use_multifd_zero_page()) {
+        pages->normal_num = pages->used;
+        return;
+    }
+
+    pages->normal_num = 0;
+    for (i = 0; i < pages->used; i++) {
+        if (buffer_is_zero(pages->iov[i].iov_base, page_size)) {
+            set_bit(i, pages->zero);
+        } else {
+            pages->iov[pages->normal_num++] = pages->iov[i];
+        }
+    }
+}
+
+/**
+ * multifd_recv_zero_pages: clear the zero pages of a received packet
+ *
+ * In postcopy the guest pages can't be touched before they are placed,
+ * so the zero pages are cleared in the postcopy buffer instead.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    unsigned long i;
+
+    for (i = find_first_bit(pages->zero, pages->used);
+         i < pages->used;
+         i = find_next_bit(pages->zero, pages->used, i + 1)) {
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            memset(p->postcopy_buf + i * page_size, 0, page_size);
+        } else {
+            ram_handle_compressed(pages->block->host + pages->offset[i], 0,
+                                  page_size);
+        }
+    }
+}
+
+/**
+ * multifd_recv_postcopy_place: place the pages of a postcopy packet
+ *
+ * The source only sends whole host pages in a postcopy packet, so the
+ * target pages of each host page are consecutive in the packet and in
+ * the postcopy buffer, and the host page can be placed in one go.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_recv_postcopy_place(MultiFDRecvParams *p, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    MultiFDPages_t *pages = p->pages;
+    RAMBlock *block = pages->block;
+    size_t page_size = qemu_target_page_size();
+    uint32_t host_pages = block->page_size / page_size;
+    uint32_t i, j;
+    int ret;
+
+    for (i = 0; i < pages->used; i += host_pages) {
+        ram_addr_t offset = pages->offset[i];
+        bool all_zero = true;
+
+        if (i + host_pages > pages->used ||
+            !QEMU_IS_ALIGNED(offset, block->page_size)) {
+            error_setg(errp, "multifd %d: partial host page at "
+                       RAM_ADDR_FMT " in postcopy", p->id, offset);
+            return -1;
+        }
+        for (j = 0; j < host_pages; j++) {
+            if (pages->offset[i + j] != offset + j * page_size) {
+                error_setg(errp, "multifd %d: partial host page at "
+                           RAM_ADDR_FMT " in postcopy", p->id, offset);
+                return -1;
+            }
+            all_zero &= test_bit(i + j, pages->zero);
+        }
+
+        trace_multifd_recv_postcopy_place(p->id, block->idstr, offset,
+                                          all_zero);
+        if (all_zero) {
+            ret = postcopy_place_page_zero(mis, block->host + offset, block);
+        } else {
+            ret = postcopy_place_page(mis, block->host + offset,
+                                      p->postcopy_buf + i * page_size, block);
+        }
+        if (ret) {
+            error_setg(errp, "multifd %d: failed to place page at "
+                       RAM_ADDR_FMT, p->id, offset);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static void multifd_send_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
@@ -284,6 +433,11 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
         packet->offset[i] = cpu_to_be64(temp);
     }
+
+    if (migrate_use_multifd_zero_page()) {
+        bitmap_to_le(multifd_packet_zero_bitmap(packet, p->pages->allocated),
+                     p->pages->zero, p->pages->allocated);
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -341,11 +495,21 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
+    p->pages->normal_num = 0;
 
     if (p->pages->used == 0) {
         return 0;
     }
 
+    if ((p->flags & MULTIFD_FLAG_POSTCOPY) &&
+        p->postcopy_buf_pages < p->pages->allocated) {
+        qemu_vfree(p->postcopy_buf);
+        p->postcopy_buf = qemu_memalign(qemu_real_host_page_size,
+                                        (size_t)p->pages->allocated *
+                                        qemu_target_page_size());
+        p->postcopy_buf_pages = p->pages->allocated;
+    }
+
     /* make sure that ramblock is 0 terminated */
     packet->ramblock[255] = 0;
     block = qemu_ram_block_by_name(packet->ramblock);
@@ -354,9 +518,26 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                    packet->ramblock);
         return -1;
     }
+    p->pages->block = block;
+
+    if (migrate_use_multifd_zero_page()) {
+        unsigned long *zero = multifd_packet_zero_bitmap(packet,
+                                                         packet->pages_alloc);
+
+        if ((uint8_t *)zero + multifd_zero_bitmap_size(packet->pages_alloc) >
+            (uint8_t *)packet + p->packet_len) {
+            error_setg(errp, "multifd: zero page bitmap for %d pages "
+                       "does not fit in the packet", packet->pages_alloc);
+            return -1;
+        }
+        bitmap_from_le(p->pages->zero, zero, packet->pages_alloc);
+    } else {
+        bitmap_zero(p->pages->zero, p->pages->allocated);
+    }
 
     for (i = 0; i < p->pages->used; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
+        uint32_t n = p->pages->normal_num;
 
         if (offset > (block->used_length - qemu_target_page_size())) {
             error_setg(errp, "multifd: offset too long %" PRIu64
@@ -364,8 +545,18 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->used_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
-        p->pages->iov[i].iov_len = qemu_target_page_size();
+        p->pages->offset[i] = offset;
+        if (test_bit(i, p->pages->zero)) {
+            continue;
+        }
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            p->pages->iov[n].iov_base = p->postcopy_buf +
+                                        i * qemu_target_page_size();
+        } else {
+            p->pages->iov[n].iov_base = block->host + offset;
+        }
+        p->pages->iov[n].iov_len = qemu_target_page_size();
+        p->pages->normal_num++;
     }
 
     return 0;
@@ -407,6 +598,25 @@ struct {
  * false.
  */
 
+/*
+ * Zero pages and the compressed size of the pages are only known by
+ * the channel threads, after the migration thread has already
+ * accounted the pages as normal pages of full size.  Fix up the
+ * counters with what the channel has found since the last call.
+ * Must be called with p->mutex held.
+ */
+static void multifd_send_account_pending(MultiFDSendParams *p)
+{
+    ram_counters.normal -= p->zero_pages_pending;
+    ram_counters.duplicate += p->zero_pages_pending;
+    ram_counters.multifd_bytes -= p->unsent_bytes_pending;
+    ram_counters.transferred -= p->unsent_bytes_pending;
+    ram_counters.dirty_sync_missed_zero_copy += p->zero_copy_missed_pending;
+    p->zero_pages_pending = 0;
+    p->unsent_bytes_pending = 0;
+    p->zero_copy_missed_pending = 0;
+}
+
 static int multifd_send_pages(QEMUFile *f)
 {
     int i;
@@ -445,7 +655,11 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->used);
     assert(!p->pages->block);
 
+    multifd_send_account_pending(p);
     p->packet_num = multifd_send_state->packet_num++;
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    }
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->used) * qemu_target_page_size()
@@ -504,6 +718,16 @@ static void multifd_send_terminate_threads(Error *err)
             s->state == MIGRATION_STATUS_ACTIVE) {
             migrate_set_state(&s->state, s->state,
                               MIGRATION_STATUS_FAILED);
+        } else if (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+            /*
+             * Pause postcopy through the main channel, the pages lost
+             * on the multifd channels are sent again after recovery.
+             */
+            qemu_mutex_lock(&s->qemu_file_lock);
+            if (s->to_dst_file) {
+                qemu_file_shutdown(s->to_dst_file);
+            }
+            qemu_mutex_unlock(&s->qemu_file_lock);
         }
     }
 
@@ -527,6 +751,46 @@ static void multifd_send_terminate_threads(Error *err)
     }
 }
 
+/*
+ * Whether pages can still be queued on the multifd channels.  They stop
+ * being used for the rest of the migration once postcopy pauses.
+ */
+bool multifd_send_active(void)
+{
+    return migrate_use_multifd() && multifd_send_state &&
+           !qatomic_read(&multifd_send_state->exiting);
+}
+
+/**
+ * multifd_send_postcopy_pause: stop using the multifd channels
+ *
+ * Postcopy recovery only reconnects the main channel, so the multifd
+ * channels are shut down when postcopy pauses and the remaining pages
+ * are sent on the main channel.  The pages that were in flight are sent
+ * again, as they are missing from the received bitmap of the
+ * destination.
+ */
+void multifd_send_postcopy_pause(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+
+    trace_multifd_send_postcopy_pause();
+    multifd_send_terminate_threads(NULL);
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+}
+
 void multifd_save_cleanup(void)
 {
     int i;
@@ -579,7 +843,8 @@ void multifd_send_sync_main(QEMUFile *f)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    /* A failed channel has already reported the error */
+    if (!multifd_send_active()) {
         return;
     }
     if (multifd_send_state->pages->used) {
@@ -615,6 +880,10 @@ void multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        WITH_QEMU_LOCK_GUARD(&p->mutex) {
+            multifd_send_account_pending(p);
+        }
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
@@ -647,25 +916,36 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint32_t used = p->pages->used;
             uint64_t packet_num = p->packet_num;
+            uint32_t normal, zero;
             flags = p->flags;
 
-            if (used) {
-                ret = multifd_send_state->ops->send_prepare(p, used,
+            multifd_send_zero_page_detect(p);
+            normal = p->pages->normal_num;
+            zero = used - normal;
+
+            if (normal) {
+                ret = multifd_send_state->ops->send_prepare(p, normal,
                                                             &local_err);
                 if (ret != 0) {
                     qemu_mutex_unlock(&p->mutex);
                     break;
                 }
+            } else {
+                p->next_packet_size = 0;
             }
             multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
+            p->num_zero_pages += zero;
+            p->zero_pages_pending += zero;
+            p->unsent_bytes_pending += (int64_t)used * qemu_target_page_size()
+                                       - (normal ? p->next_packet_size : 0);
             p->pages->used = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
+            trace_multifd_send(p->id, packet_num, normal, zero, flags,
                                p->next_packet_size);
 
             ret = qio_channel_write_all(p->c, (void *)p->packet,
@@ -674,13 +954,33 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
-            if (used) {
-                ret = multifd_send_state->ops->send_write(p, used, &local_err);
+            if (normal) {
+                ret = multifd_send_state->ops->send_write(p, normal,
+                                                          &local_err);
                 if (ret != 0) {
                     break;
                 }
             }
 
+            /*
+             * With zero copy, guest pages written before the sync may
+             * still be queued in the kernel; they need to be on the
+             * wire before the next round resends newer versions.
+             */
+            if ((flags & MULTIFD_FLAG_SYNC) &&
+                (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY)) {
+                ret = qio_channel_flush(p->c, &local_err);
+                if (ret < 0) {
+                    break;
+                }
+                if (ret == 1) {
+                    qemu_mutex_lock(&p->mutex);
+                    p->zero_copy_missed_pending++;
+                    qemu_mutex_unlock(&p->mutex);
+                }
+                ret = 0;
+            }
+
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
@@ -719,7 +1019,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -853,6 +1154,12 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     } else {
         p->c = QIO_CHANNEL(sioc);
         qio_channel_set_delay(p->c, false);
+        if (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY &&
+            qio_channel_socket_enable_zero_copy(QIO_CHANNEL_SOCKET(sioc),
+                                                &local_err) < 0) {
+            error_prepend(&local_err, "multifd %d: ", p->id);
+            goto cleanup;
+        }
         p->running = true;
         if (!multifd_channel_connect(p, sioc, local_err)) {
             goto cleanup;
@@ -893,13 +1200,14 @@ int multifd_save_setup(Error **errp)
         p->pending_job = 0;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(uint64_t) * page_count;
+        p->packet_len = multifd_packet_len(page_count);
         p->packet = g_malloc0(p->packet_len);
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
         p->packet->version = cpu_to_be32(MULTIFD_VERSION);
         p->name = g_strdup_printf("multifdsend_%d", i);
         p->tls_hostname = g_strdup(s->hostname);
+        p->write_flags = migrate_use_zero_copy_send() ?
+                         QIO_CHANNEL_WRITE_FLAG_ZERO_COPY : 0;
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
 
@@ -925,6 +1233,12 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* set once the channel threads are told to quit, see send side */
+    int exiting;
+    /* set when postcopy pauses, the channels are no longer used */
+    bool postcopy_paused;
+    /* set when postcopy listens, and pages can be placed */
+    QemuEvent postcopy_listen;
     /* multifd ops */
     MultiFDMethods *ops;
 } *multifd_recv_state;
@@ -935,6 +1249,10 @@ static void multifd_recv_terminate_threads(Error *err)
 
     trace_multifd_recv_terminate_threads(err != NULL);
 
+    qatomic_set(&multifd_recv_state->exiting, 1);
+    /* Channels waiting to place postcopy pages must see quit */
+    qemu_event_set(&multifd_recv_state->postcopy_listen);
+
     if (err) {
         MigrationState *s = migrate_get_current();
         migrate_set_error(s, err);
@@ -1006,9 +1324,13 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        qemu_vfree(p->postcopy_buf);
+        p->postcopy_buf = NULL;
+        p->postcopy_buf_pages = 0;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_event_destroy(&multifd_recv_state->postcopy_listen);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
@@ -1017,18 +1339,29 @@ int multifd_load_cleanup(Error **errp)
     return 0;
 }
 
-void multifd_recv_sync_main(void)
+/**
+ * multifd_recv_sync_main: wait for the channels to reach the sync point
+ *
+ * Returns 0 for success, or -1 if a channel has failed and its pages
+ * may be missing.
+ */
+int multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
-        return;
+    if (!migrate_use_multifd() || multifd_recv_state->postcopy_paused) {
+        return 0;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
         trace_multifd_recv_sync_main_wait(p->id);
         qemu_sem_wait(&multifd_recv_state->sem_sync);
+        /* Channel threads that quit post sem_sync so we don't hang */
+        if (qatomic_read(&multifd_recv_state->exiting)) {
+            error_report("%s: multifd channel has quit", __func__);
+            return -1;
+        }
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
@@ -1042,6 +1375,36 @@ void multifd_recv_sync_main(void)
         qemu_sem_post(&p->sem_sync);
     }
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
+    return 0;
+}
+
+/* Called once postcopy_ram_incoming_setup() can take placed pages */
+void multifd_recv_postcopy_listen(void)
+{
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    qemu_event_set(&multifd_recv_state->postcopy_listen);
+}
+
+/*
+ * The source stops using the multifd channels when postcopy pauses, see
+ * multifd_send_postcopy_pause().
+ */
+void multifd_recv_postcopy_pause(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    trace_multifd_recv_postcopy_pause();
+    multifd_recv_state->postcopy_paused = true;
+    multifd_recv_terminate_threads(NULL);
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        /* Wake up the channels waiting for a sync that won't come */
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
 }
 
 static void *multifd_recv_thread(void *opaque)
@@ -1054,7 +1417,7 @@ static void *multifd_recv_thread(void *opaque)
     rcu_register_thread();
 
     while (true) {
-        uint32_t used;
+        uint32_t used, normal;
         uint32_t flags;
 
         if (p->quit) {
@@ -1078,22 +1441,49 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        normal = p->pages->normal_num;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, normal, used - normal, flags,
                            p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
+        p->num_zero_pages += used - normal;
         qemu_mutex_unlock(&p->mutex);
 
-        if (used) {
-            ret = multifd_recv_state->ops->recv_pages(p, used, &local_err);
+        if (normal) {
+            ret = multifd_recv_state->ops->recv_pages(p, normal, &local_err);
             if (ret != 0) {
                 break;
             }
         }
 
+        if (used != normal) {
+            multifd_recv_zero_pages(p);
+        }
+
+        if (used && (flags & MULTIFD_FLAG_POSTCOPY)) {
+            /* UFFDIO_COPY needs the destination to be listening */
+            qemu_event_wait(&multifd_recv_state->postcopy_listen);
+            if (p->quit) {
+                break;
+            }
+            ret = multifd_recv_postcopy_place(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        } else {
+            uint32_t i;
+
+            /* Postcopy recovery asks for the pages that didn't arrive */
+            for (i = 0; i < used; i++) {
+                ramblock_recv_bitmap_set(p->pages->block,
+                                         p->pages->block->host +
+                                         p->pages->offset[i]);
+            }
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -1103,13 +1493,19 @@ static void *multifd_recv_thread(void *opaque)
     if (local_err) {
         multifd_recv_terminate_threads(local_err);
         error_free(local_err);
+    } else {
+        qatomic_set(&multifd_recv_state->exiting, 1);
     }
+    /* Don't leave the main thread waiting in multifd_recv_sync_main() */
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+
     qemu_mutex_lock(&p->mutex);
     p->running = false;
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -1128,6 +1524,7 @@ int multifd_load_setup(Error **errp)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     qatomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_event_init(&multifd_recv_state->postcopy_listen, false);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
@@ -1138,8 +1535,7 @@ int multifd_load_setup(Error **errp)
         p->quit = false;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(uint64_t) * page_count;
+        p->packet_len = multifd_packet_len(page_count);
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
     }
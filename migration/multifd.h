@@ -19,9 +19,13 @@ int multifd_load_setup(Error **errp);
 int multifd_load_cleanup(Error **errp);
 bool multifd_recv_all_channels_created(void);
 bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
-void multifd_recv_sync_main(void);
+int multifd_recv_sync_main(void);
 void multifd_send_sync_main(QEMUFile *f);
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
+bool multifd_send_active(void);
+void multifd_send_postcopy_pause(void);
+void multifd_recv_postcopy_listen(void);
+void multifd_recv_postcopy_pause(void);
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -32,6 +36,13 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_LZ4 (3 << 1)
+
+/*
+ * The pages of the packet were sent in postcopy, and have to be placed
+ * atomically a host page at a time.
+ */
+#define MULTIFD_FLAG_POSTCOPY (1 << 4)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -48,6 +59,13 @@ typedef struct {
     uint64_t packet_num;
     uint64_t unused[4];    /* Reserved for future use */
     char ramblock[256];
+    /*
+     * Offsets of all used pages.  When the multifd-zero-page capability
+     * is enabled, the offset array (sized for pages_alloc entries) is
+     * followed by a little endian bitmap of pages_alloc bits, rounded up
+     * to a multiple of 64.  A set bit means that the page at the same
+     * index is all zeros and its contents are not sent.
+     */
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
@@ -56,12 +74,16 @@ typedef struct {
     uint32_t used;
     /* number of allocated pages */
     uint32_t allocated;
+    /* number of pages whose contents are sent (i.e. not zero pages) */
+    uint32_t normal_num;
     /* global number of generated multifd packets */
     uint64_t packet_num;
     /* offset of each page */
     ram_addr_t *offset;
-    /* pointer to each page */
+    /* pointer to each page that is sent, the first normal_num are valid */
     struct iovec *iov;
+    /* bitmap of the used pages that are zero pages */
+    unsigned long *zero;
     RAMBlock *block;
 } MultiFDPages_t;
 
@@ -104,6 +126,22 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages found through this channel */
+    uint64_t num_zero_pages;
+    /* zero pages not yet accounted in ram_counters, protected by mutex */
+    uint64_t zero_pages_pending;
+    /*
+     * bytes accounted by the migration thread that were not written
+     * because of zero pages or compression, protected by mutex
+     */
+    int64_t unsent_bytes_pending;
+    /* QIO_CHANNEL_WRITE_FLAG_* used to write the pages */
+    int write_flags;
+    /*
+     * syncs where zero copy had to fall back to copying the pages,
+     * not yet accounted in ram_counters, protected by mutex
+     */
+    uint64_t zero_copy_missed_pending;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for compression methods */
@@ -143,6 +181,14 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages received through this channel */
+    uint64_t num_zero_pages;
+    /*
+     * pages of postcopy packets are read here, and then placed with
+     * UFFDIO_COPY; the buffer has room for postcopy_buf_pages pages
+     */
+    uint8_t *postcopy_buf;
+    uint32_t postcopy_buf_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for de-compression methods */
@@ -32,6 +32,10 @@
 #include "trace.h"
 #include "hw/boards.h"
 #include "exec/ramblock.h"
+#include "socket.h"
+#include "qemu-file-channel.h"
+#include "yank_functions.h"
+#include "qemu/yank.h"
 
 /* Arbitrary limit on size of each discard command,
  * keeps them around ~200 bytes
@@ -530,8 +534,22 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /*
+         * The source closes the preempt channel once it has sent the
+         * last page on it; only kick the thread if that won't happen.
+         */
+        if (mis->from_src_file && qemu_file_get_error(mis->from_src_file)) {
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
+        qemu_thread_join(&mis->postcopy_prio_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -566,9 +584,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -1062,8 +1082,41 @@ retry:
     return NULL;
 }
 
+/*
+ * Loads the pages sent on the postcopy-preempt channel.  The source ends
+ * each batch of requested pages with RAM_SAVE_FLAG_EOS, so that the RCU
+ * read lock is only held while pages are loaded, and closes the channel
+ * once postcopy has finished.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret = 0;
+
+    rcu_register_thread();
+    trace_postcopy_preempt_thread_entry();
+
+    while (!ret) {
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = ram_load_postcopy(mis->postcopy_qemufile_dst,
+                                    RAM_CHANNEL_POSTCOPY);
+        }
+    }
+
+    /* -EIO is the source closing the channel */
+    if (ret != -EIO) {
+        error_report("%s: Failed to load page: %s", __func__, strerror(-ret));
+    }
+
+    trace_postcopy_preempt_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
+    int i;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1102,14 +1155,16 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                                  PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                                  MAP_ANONYMOUS, -1, 0);
-    if (mis->postcopy_tmp_page == MAP_FAILED) {
-        mis->postcopy_tmp_page = NULL;
-        error_report("%s: Failed to map postcopy_tmp_page %s",
-                     __func__, strerror(errno));
-        return -1;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        void *page = mmap(NULL, mis->largest_page_size,
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                          MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED) {
+            error_report("%s: Failed to map postcopy_tmp_page %s",
+                         __func__, strerror(errno));
+            return -1;
+        }
+        mis->postcopy_tmp_pages[i] = page;
     }
 
     /*
@@ -1128,6 +1183,14 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     }
     memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
 
+    if (mis->postcopy_qemufile_dst) {
+        /* The thread uses the temporary page of its channel right away */
+        qemu_thread_create(&mis->postcopy_prio_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
@@ -1312,6 +1375,101 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Postcopy preemption: the pages the destination asks for while postcopy
+ * runs are sent on a channel of their own, so a page fault waits for the
+ * network round trip rather than for the background stream queued in
+ * front of the page.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    /* Read by the preempt thread, not the incoming coroutine */
+    qemu_file_set_blocking(file, true);
+    mis->postcopy_qemufile_dst = file;
+    trace_postcopy_preempt_new_channel();
+}
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+        /*
+         * The destination waits for the channel before loading anything,
+         * so fail the main stream instead of letting it stall.
+         */
+        qemu_mutex_lock(&s->qemu_file_lock);
+        if (s->to_dst_file) {
+            qemu_file_shutdown(s->to_dst_file);
+        }
+        qemu_mutex_unlock(&s->qemu_file_lock);
+    } else if (migration_is_setup_or_active(s->state)) {
+        QEMUFile *f;
+
+        qio_channel_set_delay(ioc, false);
+        yank_register_function(MIGRATION_YANK_INSTANCE,
+                               migration_yank_iochannel, ioc);
+        f = qemu_fopen_channel_output(ioc);
+        qemu_mutex_lock(&s->qemu_file_lock);
+        s->postcopy_qemufile_src = f;
+        qemu_mutex_unlock(&s->qemu_file_lock);
+    }
+
+    trace_postcopy_preempt_send_channel_new(s->postcopy_qemufile_src != NULL);
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+    object_unref(OBJECT(ioc));
+    object_unref(OBJECT(s));
+}
+
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    if (!socket_send_channel_available()) {
+        error_setg(errp, "postcopy-preempt needs a socket migration");
+        return -1;
+    }
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "postcopy-preempt does not support TLS");
+        return -1;
+    }
+
+    /* Forget about a channel of an earlier migration that never used it */
+    while (!qemu_sem_timedwait(&s->postcopy_qemufile_src_sem, 0)) {
+        /* nothing */
+    }
+
+    /* postcopy_start() waits for the connection */
+    object_ref(OBJECT(s));
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+    return 0;
+}
+
+int postcopy_preempt_wait_channel(MigrationState *s)
+{
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+    /* Leave it posted for anyone waiting later */
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+
+    return s->postcopy_qemufile_src ? 0 : -1;
+}
+
+void postcopy_preempt_shutdown_file(MigrationState *s)
+{
+    /*
+     * Everything on the channel has been sent, closing it lets the
+     * destination's preempt thread finish.
+     */
+    qemu_mutex_lock(&s->qemu_file_lock);
+    if (s->postcopy_qemufile_src) {
+        qemu_fflush(s->postcopy_qemufile_src);
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
+    qemu_mutex_unlock(&s->qemu_file_lock);
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
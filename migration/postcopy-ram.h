@@ -41,6 +41,17 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
  */
 int postcopy_ram_prepare_discard(MigrationIncomingState *mis);
 
+/*
+ * The postcopy-preempt channel carries the pages requested by the
+ * destination.  The source connects it with postcopy_preempt_setup() and
+ * waits for it before postcopy starts; the destination gets it as its
+ * second incoming connection.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+int postcopy_preempt_wait_channel(MigrationState *s);
+void postcopy_preempt_shutdown_file(MigrationState *s);
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+
 /*
  * Called at the start of each RAMBlock by the bitmap code.
  */
@@ -307,6 +307,10 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Same as last_sent_block, for the postcopy-preempt channel */
+    RAMBlock *preempt_last_sent_block;
+    /* Set while requested pages are saved on the postcopy-preempt channel */
+    bool preempt_sending;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -397,6 +401,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* Whether the destination asked for this page */
+    bool         postcopy_requested;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -1656,6 +1662,17 @@ fail:
     return -1;
 }
 
+/**
+ * ram_write_tracking_fault_pending: check for a write fault waiting for its
+ *   page to be saved
+ *
+ * Returns true if a fault is pending, false otherwise
+ */
+bool ram_write_tracking_fault_pending(void)
+{
+    return uffd_poll_events(ram_state->uffdio_fd, 0);
+}
+
 /**
  * ram_write_tracking_stop: stop UFFD-WP memory tracking and remove protection
  */
@@ -1726,6 +1743,11 @@ int ram_write_tracking_start(void)
     return -1;
 }
 
+bool ram_write_tracking_fault_pending(void)
+{
+    return false;
+}
+
 void ram_write_tracking_stop(void)
 {
     assert(0);
@@ -1951,6 +1973,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    bool use_multifd;
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
@@ -1961,6 +1984,40 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
+    /*
+     * Do not use multifd for compression as the first page in the new
+     * block should be posted out before sending the compressed page
+     */
+    use_multifd = !save_page_use_compression(rs) && migrate_use_multifd();
+
+    if (use_multifd && migration_in_postcopy()) {
+        /*
+         * In postcopy one whole host page must be placed at once, so
+         * background pages only go through multifd when the host page
+         * fits in a packet.  Zero pages are not looked for here, so that
+         * the host page isn't split between the streams; the channel
+         * only detects them if multifd-zero-page is enabled, otherwise
+         * they are sent as normal pages.
+         * Pages the destination is waiting for are sent on the main
+         * channel, and the main channel takes over for good once
+         * postcopy has been paused.
+         */
+        if (!pss->postcopy_requested && multifd_send_active() &&
+            qemu_ram_pagesize(block) <= MULTIFD_PACKET_SIZE &&
+            QEMU_IS_ALIGNED(block->used_length, qemu_ram_pagesize(block))) {
+            return ram_save_multifd_page(rs, block, offset);
+        }
+        use_multifd = false;
+    }
+
+    /*
+     * With multifd-zero-page the multifd channel threads look for zero
+     * pages, so don't scan the page in the migration thread.
+     */
+    if (use_multifd && migrate_use_multifd_zero_page()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -1975,14 +2032,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
-    /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -2036,7 +2086,7 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
              * Allow rate limiting to happen in the middle of huge pages if
              * something is sent in the current iteration.
              */
-            if (pagesize_bits > 1 && tmppages > 0) {
+            if (pagesize_bits > 1 && tmppages > 0 && !rs->preempt_sending) {
                 migration_rate_limit();
             }
         }
@@ -2051,6 +2101,48 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     return (res < 0 ? res : pages);
 }
 
+/**
+ * ram_save_host_page_preempt: save a requested host page on the
+ *   postcopy-preempt channel
+ *
+ * The page doesn't wait behind what is queued on the main stream.  The
+ * main stream is only ever switched away from at host page boundaries,
+ * since the destination places host pages atomically from one channel.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_host_page_preempt(RAMState *rs, PageSearchStatus *pss,
+                                      bool last_stage)
+{
+    QEMUFile *main_f = rs->f;
+    RAMBlock *main_last_sent_block = rs->last_sent_block;
+    int pages, ret;
+
+    rs->f = migrate_get_current()->postcopy_qemufile_src;
+    rs->last_sent_block = rs->preempt_last_sent_block;
+    rs->preempt_sending = true;
+
+    pages = ram_save_host_page(rs, pss, last_stage);
+    /* Lets the destination drop the RCU read lock between requests */
+    qemu_put_be64(rs->f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(rs->f);
+    ret = qemu_file_get_error(rs->f);
+
+    rs->preempt_sending = false;
+    rs->preempt_last_sent_block = rs->last_sent_block;
+    rs->last_sent_block = main_last_sent_block;
+    rs->f = main_f;
+
+    if (ret < 0) {
+        return ret;
+    }
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2070,7 +2162,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
     int pages = 0;
-    bool again, found;
+    bool again, found, requested;
 
     /* No dirty page as there is zero RAM */
     if (!ram_bytes_total()) {
@@ -2087,7 +2179,8 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 
     do {
         again = true;
-        found = get_queued_page(rs, &pss);
+        found = requested = get_queued_page(rs, &pss);
+        pss.postcopy_requested = requested;
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
@@ -2095,7 +2188,12 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         }
 
         if (found) {
-            pages = ram_save_host_page(rs, &pss, last_stage);
+            if (requested && migrate_postcopy_preempt() &&
+                migration_in_postcopy()) {
+                pages = ram_save_host_page_preempt(rs, &pss, last_stage);
+            } else {
+                pages = ram_save_host_page(rs, &pss, last_stage);
+            }
         }
     } while (!pages && again);
 
@@ -2190,7 +2288,7 @@ static void ram_save_cleanup(void *opaque)
         /* caller have hold iothread lock or is in a bh, so there is
          * no writing race against the migration bitmap
          */
-        memory_global_dirty_log_stop();
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -2209,6 +2307,7 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->preempt_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->xbzrle_enabled = false;
@@ -2652,7 +2751,7 @@ static void ram_init_bitmaps(RAMState *rs)
         ram_list_init_bitmaps();
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
-            memory_global_dirty_log_start();
+            memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
             migration_bitmap_sync_precopy(rs);
         }
     }
@@ -3042,10 +3141,14 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel the page was read from, each one has its own
+ *           previous block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                             int channel)
 {
-    static RAMBlock *block;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3062,6 +3165,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
     id[len] = 0;
 
     block = qemu_ram_block_by_name(id);
+    mis->last_recv_block[channel] = block;
     if (!block) {
         error_report("Can't find block %s", id);
         return NULL;
@@ -3392,7 +3496,7 @@ void colo_incoming_start_dirty_log(void)
             /* Discard this dirty bitmap record */
             bitmap_zero(block->bmap, block->max_length >> TARGET_PAGE_BITS);
         }
-        memory_global_dirty_log_start();
+        memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
     }
     ram_state->migration_dirty_pages = 0;
     qemu_mutex_unlock_ramlist();
@@ -3404,7 +3508,7 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
-    memory_global_dirty_log_stop();
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
@@ -3481,19 +3585,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy-preempt
+ * thread for the pages on its channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: RAM_CHANNEL_* that @f is
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = mis->postcopy_tmp_pages[channel];
     void *host_page = NULL;
     bool all_zero = true;
     int target_pages = 0;
@@ -3523,7 +3629,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
             if (!block) {
                 ret = -EINVAL;
                 break;
@@ -3622,7 +3728,9 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (multifd_recv_sync_main()) {
+                ret = -EIO;
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: 0x%x"
@@ -3762,7 +3870,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3892,7 +4001,9 @@ static int ram_load_precopy(QEMUFile *f)
             break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (multifd_recv_sync_main()) {
+                ret = -EIO;
+            }
             break;
         default:
             if (flags & RAM_SAVE_FLAG_HOOK) {
@@ -3939,7 +4050,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -40,6 +40,7 @@
 #include "qemu-file.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
+#include "multifd.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-migration.h"
 #include "qapi/qmp/json-writer.h"
@@ -55,6 +56,7 @@
 #include "qemu/main-loop.h"
 #include "block/snapshot.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
 #include "sysemu/replay.h"
@@ -1971,6 +1973,8 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
             postcopy_ram_incoming_cleanup(mis);
             return -1;
         }
+        /* The multifd channels can place pages from now on */
+        multifd_recv_postcopy_listen();
     }
 
     if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_LISTEN, &local_err)) {
@@ -2573,6 +2577,9 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
     qemu_fclose(mis->from_src_file);
     mis->from_src_file = NULL;
 
+    /* The source won't send more pages on the multifd channels */
+    multifd_recv_postcopy_pause();
+
     assert(mis->to_src_file);
     qemu_file_shutdown(mis->to_src_file);
     qemu_mutex_lock(&mis->rp_mutex);
@@ -2659,12 +2666,13 @@ out:
          * during which we're still receiving device states and we
          * still haven't yet started the VM on destination.
          *
-         * Only RAM postcopy supports recovery. Still, if RAM postcopy is
-         * enabled, canceled bitmaps postcopy will not affect RAM postcopy
-         * recovering.
+         * Only RAM postcopy supports recovery, and only without the
+         * preempt channel. Still, if RAM postcopy is enabled, canceled
+         * bitmaps postcopy will not affect RAM postcopy recovering.
          */
         if (postcopy_state_get() == POSTCOPY_INCOMING_RUNNING &&
-            migrate_postcopy_ram() && postcopy_pause_incoming(mis)) {
+            migrate_postcopy_ram() && !migrate_postcopy_preempt() &&
+            postcopy_pause_incoming(mis)) {
             /* Reset f to point to the newly created channel */
             f = mis->from_src_file;
             goto retry;
@@ -2766,30 +2774,33 @@ int qemu_load_device_state(QEMUFile *f)
     return 0;
 }
 
-bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
-                  bool has_devices, strList *devices, Error **errp)
+/*
+ * Checks that a snapshot can be taken and deletes the old snapshots of
+ * the same name if @overwrite is set.
+ *
+ * Returns the node to save the vmstate to, or NULL with @errp set.
+ */
+static BlockDriverState *save_snapshot_prepare(const char *name,
+                                               bool overwrite,
+                                               const char *vmstate,
+                                               bool has_devices,
+                                               strList *devices,
+                                               Error **errp)
 {
-    BlockDriverState *bs;
-    QEMUSnapshotInfo sn1, *sn = &sn1;
-    int ret = -1, ret2;
-    QEMUFile *f;
-    int saved_vm_running;
-    uint64_t vm_state_size;
-    g_autoptr(GDateTime) now = g_date_time_new_now_local();
-    AioContext *aio_context;
+    int ret;
 
     if (migration_is_blocked(errp)) {
-        return false;
+        return NULL;
     }
 
     if (!replay_can_snapshot()) {
         error_setg(errp, "Record/replay does not allow making snapshot "
                    "right now. Try once more later.");
-        return false;
+        return NULL;
     }
 
     if (!bdrv_all_can_snapshot(has_devices, devices, errp)) {
-        return false;
+        return NULL;
     }
 
     /* Delete old snapshots of the same name */
@@ -2797,44 +2808,32 @@ bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
         if (overwrite) {
             if (bdrv_all_delete_snapshot(name, has_devices,
                                          devices, errp) < 0) {
-                return false;
+                return NULL;
             }
         } else {
-            ret2 = bdrv_all_has_snapshot(name, has_devices, devices, errp);
-            if (ret2 < 0) {
-                return false;
+            ret = bdrv_all_has_snapshot(name, has_devices, devices, errp);
+            if (ret < 0) {
+                return NULL;
             }
-            if (ret2 == 1) {
+            if (ret == 1) {
                 error_setg(errp,
                            "Snapshot '%s' already exists in one or more devices",
                            name);
-                return false;
+                return NULL;
             }
         }
     }
 
-    bs = bdrv_all_find_vmstate_bs(vmstate, has_devices, devices, errp);
-    if (bs == NULL) {
-        return false;
-    }
-    aio_context = bdrv_get_aio_context(bs);
-
-    saved_vm_running = runstate_is_running();
-
-    ret = global_state_store();
-    if (ret) {
-        error_setg(errp, "Error saving global state");
-        return false;
-    }
-    vm_stop(RUN_STATE_SAVE_VM);
-
-    bdrv_drain_all_begin();
+    return bdrv_all_find_vmstate_bs(vmstate, has_devices, devices, errp);
+}
 
-    aio_context_acquire(aio_context);
+/* Fills the auxiliary fields of @sn, with the VM stopped */
+static void save_snapshot_fill_info(QEMUSnapshotInfo *sn, const char *name)
+{
+    g_autoptr(GDateTime) now = g_date_time_new_now_local();
 
     memset(sn, 0, sizeof(*sn));
 
-    /* fill auxiliary fields */
     sn->date_sec = g_date_time_to_unix(now);
     sn->date_nsec = g_date_time_get_microsecond(now) * 1000;
     sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
@@ -2850,6 +2849,40 @@ bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
         g_autofree char *autoname = g_date_time_format(now,  "vm-%Y%m%d%H%M%S");
         pstrcpy(sn->name, sizeof(sn->name), autoname);
     }
+}
+
+bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
+                  bool has_devices, strList *devices, Error **errp)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
+    int ret = -1, ret2;
+    QEMUFile *f;
+    int saved_vm_running;
+    uint64_t vm_state_size;
+    AioContext *aio_context;
+
+    bs = save_snapshot_prepare(name, overwrite, vmstate,
+                               has_devices, devices, errp);
+    if (bs == NULL) {
+        return false;
+    }
+    aio_context = bdrv_get_aio_context(bs);
+
+    saved_vm_running = runstate_is_running();
+
+    ret = global_state_store();
+    if (ret) {
+        error_setg(errp, "Error saving global state");
+        return false;
+    }
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    bdrv_drain_all_begin();
+
+    aio_context_acquire(aio_context);
+
+    save_snapshot_fill_info(sn, name);
 
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
@@ -2898,6 +2931,446 @@ bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
     return ret == 0;
 }
 
+/*
+ * Live snapshots
+ *
+ * The device state is saved with the VM stopped, then RAM is saved by a
+ * thread while the guest runs, using the userfaultfd write protection of
+ * background snapshots: a page is saved before the guest is allowed to
+ * modify it, so RAM matches the moment the VM was stopped.  The disk
+ * snapshots are taken in the same stop, without VM state.  Once RAM has
+ * been written to the active image of the vmstate node, it is moved into
+ * the snapshot with bdrv_snapshot_attach_vmstate().
+ *
+ * The vmstate can only be written from the main loop, which may itself
+ * wait for a write-protected page to be saved.  So the thread copies the
+ * stream into a queue of buffers, and the snapshot job writes them out
+ * from its coroutine.
+ */
+
+/* The thread waits once this much data waits to be written */
+#define LIVE_SNAPSHOT_QUEUE_MAX (16 * MiB)
+/*
+ * The writer coroutine cannot run while the main loop waits for a guest
+ * page to be saved.  So the thread checks for such faults at this period
+ * and may then use some extra space to save the page.
+ */
+#define LIVE_SNAPSHOT_QUEUE_WAIT_MS 10
+#define LIVE_SNAPSHOT_QUEUE_RESERVE (4 * MiB)
+/* The snapshot fails if nothing could be written for this long */
+#define LIVE_SNAPSHOT_QUEUE_TIMEOUT_MS (60 * 1000)
+
+typedef struct LiveSnapshotBuffer {
+    int64_t pos;
+    size_t size;
+    QSIMPLEQ_ENTRY(LiveSnapshotBuffer) next;
+    uint8_t data[];
+} LiveSnapshotBuffer;
+
+typedef struct LiveSnapshot {
+    /* these fields are not changed once the thread is created */
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    bool has_devices;
+    /* owned by the caller, must stay valid until the snapshot ends */
+    strList *devices;
+    bool vm_was_running;
+    /* vmstate stream written by the thread */
+    QEMUFile *f;
+    /* device state saved while the VM was stopped */
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    QemuThread thread;
+    /* size of the vmstate, set by the thread before it sets done */
+    int64_t vm_state_size;
+    /* this mutex protects the following parameters */
+    QemuMutex lock;
+    /* signalled when a buffer has been written */
+    QemuCond written_cond;
+    QSIMPLEQ_HEAD(, LiveSnapshotBuffer) queue;
+    /* bytes in the queue */
+    size_t queued;
+    /* first error, negative errno */
+    int ret;
+    /* the thread has queued the whole vmstate */
+    bool done;
+    /* writer coroutine, set while it waits for buffers */
+    Coroutine *co;
+} LiveSnapshot;
+
+static void live_snapshot_wake_writer_locked(LiveSnapshot *ls)
+{
+    Coroutine *co = ls->co;
+
+    if (co) {
+        ls->co = NULL;
+        aio_co_wake(co);
+    }
+}
+
+static ssize_t live_snapshot_writev_buffer(void *opaque, struct iovec *iov,
+                                           int iovcnt, int64_t pos,
+                                           Error **errp)
+{
+    LiveSnapshot *ls = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    LiveSnapshotBuffer *buf = g_malloc(sizeof(*buf) + size);
+    int waited_ms = 0;
+    int ret;
+
+    /* Guest pages are only referenced by iov, copy them before unprotecting */
+    buf->pos = pos;
+    buf->size = size;
+    iov_to_buf(iov, iovcnt, 0, buf->data, size);
+
+    qemu_mutex_lock(&ls->lock);
+    while (!ls->ret && ls->queued &&
+           ls->queued + size > LIVE_SNAPSHOT_QUEUE_MAX) {
+        if (qemu_cond_timedwait(&ls->written_cond, &ls->lock,
+                                LIVE_SNAPSHOT_QUEUE_WAIT_MS)) {
+            waited_ms = 0;
+            continue;
+        }
+        if (ls->queued + size <= LIVE_SNAPSHOT_QUEUE_MAX +
+                                 LIVE_SNAPSHOT_QUEUE_RESERVE &&
+            ram_write_tracking_fault_pending()) {
+            break;
+        }
+        waited_ms += LIVE_SNAPSHOT_QUEUE_WAIT_MS;
+        if (waited_ms >= LIVE_SNAPSHOT_QUEUE_TIMEOUT_MS) {
+            ls->ret = -ETIMEDOUT;
+        }
+    }
+    ret = ls->ret;
+    if (!ret) {
+        QSIMPLEQ_INSERT_TAIL(&ls->queue, buf, next);
+        ls->queued += size;
+        live_snapshot_wake_writer_locked(ls);
+    }
+    qemu_mutex_unlock(&ls->lock);
+
+    if (ret < 0) {
+        g_free(buf);
+        return ret;
+    }
+    return size;
+}
+
+static const QEMUFileOps live_snapshot_write_ops = {
+    .writev_buffer  = live_snapshot_writev_buffer,
+};
+
+static void *live_snapshot_thread(void *opaque)
+{
+    LiveSnapshot *ls = opaque;
+    int ret;
+
+    rcu_register_thread();
+
+    while (qemu_file_get_error(ls->f) == 0) {
+        if (qemu_savevm_state_iterate(ls->f, false) > 0) {
+            break;
+        }
+    }
+
+    /* Un-protect memory and wake up the threads waiting for a page */
+    ram_write_tracking_stop();
+
+    /* The device state goes after RAM, as for background snapshots */
+    qemu_put_buffer(ls->f, ls->bioc->data, ls->bioc->usage);
+    ls->vm_state_size = qemu_ftell(ls->f);
+    ret = qemu_file_get_error(ls->f);
+
+    qemu_mutex_lock(&ls->lock);
+    if (ret < 0 && !ls->ret) {
+        ls->ret = ret;
+    }
+    ls->done = true;
+    live_snapshot_wake_writer_locked(ls);
+    qemu_mutex_unlock(&ls->lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void live_snapshot_free(LiveSnapshot *ls)
+{
+    LiveSnapshotBuffer *buf, *next;
+
+    QSIMPLEQ_FOREACH_SAFE(buf, &ls->queue, next, next) {
+        g_free(buf);
+    }
+    if (ls->fb) {
+        qemu_fclose(ls->fb);
+    }
+    if (ls->f) {
+        qemu_fclose(ls->f);
+    }
+    qemu_cond_destroy(&ls->written_cond);
+    qemu_mutex_destroy(&ls->lock);
+    g_free(ls);
+}
+
+/**
+ * save_snapshot_live_start: start a live snapshot
+ *
+ * Saves the device state and takes the disk snapshots with the VM stopped,
+ * then restarts the VM and starts saving RAM in the background.  Must be
+ * called from the main loop, with the BQL held and outside coroutine
+ * context.
+ *
+ * Returns the live snapshot to pass to save_snapshot_live_write() and
+ * save_snapshot_live_finish(), or NULL with @errp set.
+ *
+ * @name: name of the snapshot
+ * @vmstate: node name to save the vmstate to
+ * @has_devices: whether @devices is set
+ * @devices: nodes to take a snapshot of, must stay valid until
+ *           save_snapshot_live_finish() returns
+ * @errp: pointer to an error
+ */
+static LiveSnapshot *save_snapshot_live_start(const char *name,
+                                              const char *vmstate,
+                                              bool has_devices,
+                                              strList *devices,
+                                              Error **errp)
+{
+    MigrationState *ms = migrate_get_current();
+    BlockDriverState *bs;
+    LiveSnapshot *ls;
+    int ret;
+
+    if (migration_is_running(ms->state)) {
+        error_setg(errp, QERR_MIGRATION_ACTIVE);
+        return NULL;
+    }
+
+    if (migrate_use_block()) {
+        error_setg(errp, "Block migration and snapshots are incompatible");
+        return NULL;
+    }
+
+    if (!migrate_live_snapshot_check(errp)) {
+        return NULL;
+    }
+
+    bs = save_snapshot_prepare(name, false, vmstate, has_devices, devices,
+                               errp);
+    if (bs == NULL) {
+        return NULL;
+    }
+
+    if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+        error_setg(errp, "Live snapshots need the vmstate node '%s' "
+                   "in the main AioContext", bdrv_get_node_name(bs));
+        return NULL;
+    }
+
+    if (global_state_store()) {
+        error_setg(errp, "Error saving global state");
+        return NULL;
+    }
+
+    ls = g_new0(LiveSnapshot, 1);
+    ls->bs = bs;
+    ls->has_devices = has_devices;
+    ls->devices = devices;
+    ls->vm_was_running = runstate_is_running();
+    qemu_mutex_init(&ls->lock);
+    qemu_cond_init(&ls->written_cond);
+    QSIMPLEQ_INIT(&ls->queue);
+    ls->f = qemu_fopen_ops(ls, &live_snapshot_write_ops);
+
+    migrate_init(ms);
+    memset(&ram_counters, 0, sizeof(ram_counters));
+    ms->to_dst_file = ls->f;
+    ms->live_snapshot = true;
+
+    qemu_mutex_unlock_iothread();
+    /* Populate RAM so that all of it can be write-protected */
+    ram_write_tracking_prepare();
+    qemu_savevm_state_header(ls->f);
+    qemu_savevm_state_setup(ls->f);
+    qemu_mutex_lock_iothread();
+
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    save_snapshot_fill_info(&ls->sn, name);
+
+    ls->bioc = qio_channel_buffer_new(512 * KiB);
+    qio_channel_set_name(QIO_CHANNEL(ls->bioc), "vmstate-buffer");
+    ls->fb = qemu_fopen_channel_output(QIO_CHANNEL(ls->bioc));
+    object_unref(OBJECT(ls->bioc));
+
+    cpu_synchronize_all_states();
+    ret = qemu_savevm_state_complete_precopy_non_iterable(ls->fb, false,
+                                                          false);
+    qemu_fflush(ls->fb);
+    if (!ret) {
+        ret = qemu_file_get_error(ls->fb);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Error while saving device state");
+        goto fail;
+    }
+
+    bdrv_drain_all_begin();
+    ret = bdrv_all_create_snapshot(&ls->sn, bs, 0, has_devices, devices,
+                                   errp);
+    if (ret < 0) {
+        bdrv_all_delete_snapshot(name, has_devices, devices, NULL);
+    }
+    bdrv_drain_all_end();
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (ram_write_tracking_start()) {
+        error_setg(errp, "Failed to write-protect guest memory");
+        bdrv_all_delete_snapshot(name, has_devices, devices, NULL);
+        goto fail;
+    }
+
+    qemu_thread_create(&ls->thread, "live-snapshot", live_snapshot_thread,
+                       ls, QEMU_THREAD_JOINABLE);
+
+    /*
+     * Guest memory is write-protected from here, so the main loop may wait
+     * for the thread, e.g. when the VM state change notifiers touch virtio
+     * rings.
+     */
+    if (ls->vm_was_running) {
+        vm_start();
+    }
+    return ls;
+
+fail:
+    qemu_savevm_state_cleanup();
+    ms->live_snapshot = false;
+    ms->to_dst_file = NULL;
+    migrate_set_state(&ms->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_FAILED);
+    if (ls->vm_was_running) {
+        vm_start();
+    }
+    live_snapshot_free(ls);
+    return NULL;
+}
+
+/**
+ * save_snapshot_live_write: write the vmstate of a live snapshot
+ *
+ * Writes the stream queued by the thread to the vmstate node, until the
+ * whole RAM has been saved.  Must run in a coroutine in the main loop.
+ *
+ * @ls: the live snapshot
+ */
+static void coroutine_fn save_snapshot_live_write(LiveSnapshot *ls)
+{
+    LiveSnapshotBuffer *buf;
+    bool failed;
+    int ret;
+
+    for (;;) {
+        qemu_mutex_lock(&ls->lock);
+        buf = QSIMPLEQ_FIRST(&ls->queue);
+        if (!buf) {
+            if (ls->done) {
+                qemu_mutex_unlock(&ls->lock);
+                break;
+            }
+            ls->co = qemu_coroutine_self();
+            qemu_mutex_unlock(&ls->lock);
+            qemu_coroutine_yield();
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&ls->queue, next);
+        failed = ls->ret < 0;
+        qemu_mutex_unlock(&ls->lock);
+
+        ret = 0;
+        if (!failed) {
+            ret = bdrv_save_vmstate(ls->bs, buf->data, buf->pos, buf->size);
+        }
+
+        qemu_mutex_lock(&ls->lock);
+        ls->queued -= buf->size;
+        if (ret < 0 && !ls->ret) {
+            ls->ret = ret;
+        }
+        qemu_cond_signal(&ls->written_cond);
+        qemu_mutex_unlock(&ls->lock);
+        g_free(buf);
+    }
+}
+
+/**
+ * save_snapshot_live_cancel: stop a live snapshot early
+ *
+ * The thread and save_snapshot_live_write() stop as soon as possible.  The
+ * snapshot then fails in save_snapshot_live_finish(), which must still be
+ * called to free @ls.
+ *
+ * @ls: the live snapshot
+ */
+static void save_snapshot_live_cancel(LiveSnapshot *ls)
+{
+    qemu_mutex_lock(&ls->lock);
+    if (!ls->ret) {
+        ls->ret = -ECANCELED;
+    }
+    qemu_cond_signal(&ls->written_cond);
+    live_snapshot_wake_writer_locked(ls);
+    qemu_mutex_unlock(&ls->lock);
+}
+
+/**
+ * save_snapshot_live_finish: complete a live snapshot
+ *
+ * Called once save_snapshot_live_write() has returned, from the main loop
+ * with the BQL held and outside coroutine context.  Stores the vmstate in
+ * the snapshot of the vmstate node, or deletes the disk snapshots if the
+ * vmstate could not be saved.  Frees @ls.
+ *
+ * Returns true on success, false with @errp set on failure.
+ *
+ * @ls: the live snapshot
+ * @errp: pointer to an error
+ */
+static bool save_snapshot_live_finish(LiveSnapshot *ls, Error **errp)
+{
+    MigrationState *ms = migrate_get_current();
+    int ret;
+
+    qemu_thread_join(&ls->thread);
+    qemu_savevm_state_cleanup();
+    ms->live_snapshot = false;
+    ms->to_dst_file = NULL;
+
+    ret = ls->ret;
+    if (!ret) {
+        ret = bdrv_flush(ls->bs);
+    }
+    if (ret == -ECANCELED) {
+        error_setg(errp, "Live snapshot was cancelled");
+    } else if (ret < 0) {
+        error_setg_errno(errp, -ret, "Error while writing VM state");
+    } else {
+        ret = bdrv_snapshot_attach_vmstate(ls->bs, ls->sn.name,
+                                           ls->vm_state_size, errp);
+    }
+    if (ret < 0) {
+        bdrv_all_delete_snapshot(ls->sn.name, ls->has_devices, ls->devices,
+                                 NULL);
+    }
+
+    migrate_set_state(&ms->state, MIGRATION_STATUS_SETUP,
+                      ret < 0 ? MIGRATION_STATUS_FAILED :
+                      MIGRATION_STATUS_COMPLETED);
+    live_snapshot_free(ls);
+    return ret == 0;
+}
+
 void qmp_xen_save_devices_state(const char *filename, bool has_live, bool live,
                                 Error **errp)
 {
@@ -3115,6 +3588,8 @@ typedef struct SnapshotJob {
     char *tag;
     char *vmstate;
     strList *devices;
+    bool live;
+    LiveSnapshot *ls;
     Coroutine *co;
     Error **errp;
     bool ret;
@@ -3164,6 +3639,29 @@ static void snapshot_save_job_bh(void *opaque)
     aio_co_wake(s->co);
 }
 
+static void snapshot_save_live_start_bh(void *opaque)
+{
+    Job *job = opaque;
+    SnapshotJob *s = container_of(job, SnapshotJob, common);
+
+    s->ls = save_snapshot_live_start(s->tag, s->vmstate,
+                                     true, s->devices, s->errp);
+    if (s->ls && job_is_cancelled(&s->common)) {
+        save_snapshot_live_cancel(s->ls);
+    }
+    aio_co_wake(s->co);
+}
+
+static void snapshot_save_live_finish_bh(void *opaque)
+{
+    Job *job = opaque;
+    SnapshotJob *s = container_of(job, SnapshotJob, common);
+
+    s->ret = save_snapshot_live_finish(s->ls, s->errp);
+    s->ls = NULL;
+    aio_co_wake(s->co);
+}
+
 static void snapshot_delete_job_bh(void *opaque)
 {
     Job *job = opaque;
@@ -3177,11 +3675,49 @@ static void snapshot_delete_job_bh(void *opaque)
     aio_co_wake(s->co);
 }
 
+/*
+ * Live snapshots save the device state and start the RAM thread from a
+ * BH, then the job coroutine writes the vmstate while the guest runs.
+ */
+static int coroutine_fn snapshot_save_live_job_run(SnapshotJob *s)
+{
+    job_progress_set_remaining(&s->common, 1);
+
+    aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                            snapshot_save_live_start_bh, &s->common);
+    qemu_coroutine_yield();
+
+    if (s->ls) {
+        save_snapshot_live_write(s->ls);
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                snapshot_save_live_finish_bh, &s->common);
+        qemu_coroutine_yield();
+    } else {
+        s->ret = false;
+    }
+
+    job_progress_update(&s->common, 1);
+    qmp_snapshot_job_free(s);
+    return s->ret ? 0 : -1;
+}
+
+static void snapshot_save_job_cancel(Job *job, bool force)
+{
+    SnapshotJob *s = container_of(job, SnapshotJob, common);
+
+    if (s->ls) {
+        save_snapshot_live_cancel(s->ls);
+    }
+}
+
 static int coroutine_fn snapshot_save_job_run(Job *job, Error **errp)
 {
     SnapshotJob *s = container_of(job, SnapshotJob, common);
     s->errp = errp;
     s->co = qemu_coroutine_self();
+    if (s->live) {
+        return snapshot_save_live_job_run(s);
+    }
     aio_bh_schedule_oneshot(qemu_get_aio_context(),
                             snapshot_save_job_bh, job);
     qemu_coroutine_yield();
@@ -3221,6 +3757,7 @@ static const JobDriver snapshot_save_job_driver = {
     .instance_size = sizeof(SnapshotJob),
     .job_type      = JOB_TYPE_SNAPSHOT_SAVE,
     .run           = snapshot_save_job_run,
+    .cancel        = snapshot_save_job_cancel,
 };
 
 static const JobDriver snapshot_delete_job_driver = {
@@ -3234,6 +3771,7 @@ void qmp_snapshot_save(const char *job_id,
                        const char *tag,
                        const char *vmstate,
                        strList *devices,
+                       bool has_live, bool live,
                        Error **errp)
 {
     SnapshotJob *s;
@@ -3248,6 +3786,7 @@ void qmp_snapshot_save(const char *job_id,
     s->tag = g_strdup(tag);
     s->vmstate = g_strdup(vmstate);
     s->devices = QAPI_CLONE(strList, devices);
+    s->live = has_live && live;
 
     job_start(&s->common);
 }
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,17 +25,14 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
     long res;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
@@ -126,6 +124,276 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+/*
+ * The vector versions only differ in how they find the end of a run:
+ * each one returns the length of the run of equal (zrun) or different
+ * (nzrun) bytes that starts at @i, which is never empty.  The runs, and
+ * the overflow checks, are the same as in xbzrle_encode_buffer_int() so
+ * that the output is byte for byte identical.
+ */
+typedef int (*xbzrle_run_fn)(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int i, int slen);
+
+static inline int QEMU_ALWAYS_INLINE
+xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                   uint8_t *dst, int dlen,
+                   xbzrle_run_fn zrun, xbzrle_run_fn nzrun)
+{
+    int d = 0, i = 0;
+    int zrun_len, nzrun_len;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        zrun_len = zrun(old_buf, new_buf, i, slen);
+        i += zrun_len;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        nzrun_len = nzrun(old_buf, new_buf, i, slen);
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i += nzrun_len;
+    }
+
+    return d;
+}
+
+/* Finish a run that ends in the last, partial, vector */
+static inline int xbzrle_run_tail(const uint8_t *old_buf,
+                                  const uint8_t *new_buf,
+                                  int start, int i, int slen, bool equal)
+{
+    while (i < slen && (old_buf[i] == new_buf[i]) == equal) {
+        i++;
+    }
+    return i - start;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Bit n of the result is set if byte n of both vectors is equal */
+static inline uint32_t xbzrle_eq_avx2(const uint8_t *old_buf,
+                                      const uint8_t *new_buf, int i)
+{
+    __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+    __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+}
+
+static int xbzrle_zrun_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen)
+{
+    int start = i;
+
+    for (; i + 32 <= slen; i += 32) {
+        uint32_t ne = ~xbzrle_eq_avx2(old_buf, new_buf, i);
+
+        if (ne) {
+            return i + ctz32(ne) - start;
+        }
+    }
+    return xbzrle_run_tail(old_buf, new_buf, start, i, slen, true);
+}
+
+static int xbzrle_nzrun_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int i, int slen)
+{
+    int start = i;
+
+    for (; i + 32 <= slen; i += 32) {
+        uint32_t eq = xbzrle_eq_avx2(old_buf, new_buf, i);
+
+        if (eq) {
+            return i + ctz32(eq) - start;
+        }
+    }
+    return xbzrle_run_tail(old_buf, new_buf, start, i, slen, false);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_avx2, xbzrle_nzrun_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+/* Bit n of the result is set if byte n of both vectors is equal */
+static inline uint64_t xbzrle_eq_avx512(const uint8_t *old_buf,
+                                        const uint8_t *new_buf, int i)
+{
+    __m512i o = _mm512_loadu_si512(old_buf + i);
+    __m512i n = _mm512_loadu_si512(new_buf + i);
+
+    return _mm512_cmpeq_epi8_mask(o, n);
+}
+
+static int xbzrle_zrun_avx512(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    int start = i;
+
+    for (; i + 64 <= slen; i += 64) {
+        uint64_t ne = ~xbzrle_eq_avx512(old_buf, new_buf, i);
+
+        if (ne) {
+            return i + ctz64(ne) - start;
+        }
+    }
+    return xbzrle_run_tail(old_buf, new_buf, start, i, slen, true);
+}
+
+static int xbzrle_nzrun_avx512(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    int start = i;
+
+    for (; i + 64 <= slen; i += 64) {
+        uint64_t eq = xbzrle_eq_avx512(old_buf, new_buf, i);
+
+        if (eq) {
+            return i + ctz64(eq) - start;
+        }
+    }
+    return xbzrle_run_tail(old_buf, new_buf, start, i, slen, false);
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_avx512, xbzrle_nzrun_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+static unsigned cpuid_cache;
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    xbzrle_encode_buffer_int;
+static const char *encode_accel_name = "int";
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+    const char *name = "int";
+
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+        name = "avx2";
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512;
+        name = "avx512bw";
+    }
+#endif
+    encode_accel = fn;
+    encode_accel_name = name;
+}
+
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* The OS must save the opmask and ZMM state, see bufferiszero.c */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+const char *xbzrle_encode_accel_name(void)
+{
+    return encode_accel_name;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -18,4 +18,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/* Used by the unit test and the benchmark to go through all the encoders */
+bool test_xbzrle_encode_next_accel(void);
+const char *xbzrle_encode_accel_name(void);
 #endif
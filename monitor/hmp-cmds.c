@@ -293,6 +293,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
                            info->ram->postcopy_requests);
         }
+        if (info->ram->dirty_sync_missed_zero_copy) {
+            monitor_printf(mon,
+                           "zero-copy-send fallbacks happened: %" PRIu64
+                           " times\n",
+                           info->ram->dirty_sync_missed_zero_copy);
+        }
     }
 
     if (info->has_disk) {
@@ -1364,6 +1370,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_zstd_level = true;
         visit_type_uint8(v, param, &p->multifd_zstd_level, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_LZ4_LEVEL:
+        p->has_multifd_lz4_level = true;
+        visit_type_uint8(v, param, &p->multifd_lz4_level, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         if (!visit_type_size(v, param, &cache_size, &err)) {
@@ -1885,6 +1895,7 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info_list = qmp_query_iothreads(NULL);
     IOThreadInfoList *info;
     IOThreadInfo *value;
+    AioPoolInfoList *pool;
 
     for (info = info_list; info; info = info->next) {
         value = info->value;
@@ -1893,6 +1904,15 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
         monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        for (pool = value->pools; pool; pool = pool->next) {
+            AioPoolInfo *p = pool->value;
+            int64_t total = p->hits + p->misses;
+
+            monitor_printf(mon, "  pool %s: hits=%" PRId64 " misses=%" PRId64
+                           " free=%" PRId64 " hit-rate=%" PRId64 "%%\n",
+                           p->name, p->hits, p->misses, p->free,
+                           total ? p->hits * 100 / total : 0);
+        }
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -0,0 +1,467 @@
+/*
+ * AF_XDP network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Each queue of the netdev is an AF_XDP socket bound to one queue of the
+ * host interface.  Packets are exchanged through a UMEM area that is
+ * registered with the kernel: the fill ring hands free frames to the kernel
+ * for reception, the rx ring returns them filled, the tx ring submits frames
+ * for transmission and the completion ring returns them once they are sent.
+ * Frames that are owned by QEMU are kept in a LIFO pool.
+ *
+ * Unless XDP_COPY is requested, the kernel binds the socket in zero-copy
+ * mode if the driver supports it and silently falls back to copy mode
+ * otherwise, so that e.g. veth interfaces can be used for testing.
+ */
+
+#include "qemu/osdep.h"
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <xdp/xsk.h>
+
+#include "clients.h"
+#include "monitor/monitor.h"
+#include "net/net.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+
+typedef struct AFXDPState {
+    NetClientState       nc;
+
+    struct xsk_socket    *xsk;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_ring_cons cq;
+    struct xsk_ring_prod fq;
+
+    char                 ifname[IFNAMSIZ];
+    bool                 read_poll;
+    bool                 write_poll;
+    uint32_t             outstanding_tx;
+
+    uint64_t             *pool;     /* Addresses of the frames QEMU owns */
+    uint32_t             n_pool;
+    char                 *buffer;
+    struct xsk_umem      *umem;
+} AFXDPState;
+
+/* Maximum number of packets taken from the rx ring in one go */
+#define AF_XDP_BATCH_SIZE 64
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    qemu_set_fd_handler(xsk_socket__fd(s->xsk),
+                        s->read_poll ? af_xdp_send : NULL,
+                        s->write_poll ? af_xdp_writable : NULL,
+                        s);
+}
+
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->read_poll = enable;
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Take back the frames that the kernel has finished transmitting */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t i, done, idx = 0;
+
+    done = xsk_ring_cons__peek(&s->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
+
+    for (i = 0; i < done; i++) {
+        s->pool[s->n_pool++] = *xsk_ring_cons__comp_addr(&s->cq, idx++);
+    }
+    s->outstanding_tx -= done;
+
+    if (done) {
+        xsk_ring_cons__release(&s->cq, done);
+    }
+}
+
+/* Kick the kernel if it waits for a syscall to process the tx ring */
+static void af_xdp_kick_tx(AFXDPState *s)
+{
+    if (xsk_ring_prod__needs_wakeup(&s->tx)) {
+        /*
+         * EAGAIN, EBUSY and ENOBUFS only mean that the kernel is still
+         * busy with previous frames; it picks up the new ones later.
+         */
+        sendto(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+}
+
+/*
+ * The fd_write() callback, invoked if the fd is marked as writable
+ * after a poll.
+ */
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_complete_tx(s);
+
+    /* Keep polling only while waiting for frames to come back */
+    if (s->n_pool || !s->outstanding_tx) {
+        af_xdp_write_poll(s, false);
+    }
+
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    struct xdp_desc *desc;
+    uint32_t idx;
+
+    af_xdp_complete_tx(s);
+
+    if (size > XSK_UMEM__DEFAULT_FRAME_SIZE) {
+        /* Drop the packet, it does not fit in a frame */
+        return size;
+    }
+
+    if (!s->n_pool || !xsk_ring_prod__reserve(&s->tx, 1, &idx)) {
+        /*
+         * Out of frames or out of space in the tx ring.  Queue the packet
+         * and retry once the kernel has completed some transmissions.
+         */
+        af_xdp_kick_tx(s);
+        af_xdp_write_poll(s, true);
+        return 0;
+    }
+
+    desc = xsk_ring_prod__tx_desc(&s->tx, idx);
+    desc->addr = s->pool[--s->n_pool];
+    desc->len = size;
+    memcpy(xsk_umem__get_data(s->buffer, desc->addr), buf, size);
+
+    xsk_ring_prod__submit(&s->tx, 1);
+    s->outstanding_tx++;
+    af_xdp_kick_tx(s);
+
+    return size;
+}
+
+/* Give up to @n frames of the pool to the kernel for reception */
+static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
+{
+    uint32_t i, idx = 0;
+
+    /* Keep one frame for transmission */
+    n = MIN(n, s->n_pool ? s->n_pool - 1 : 0);
+
+    if (!n || !xsk_ring_prod__reserve(&s->fq, n, &idx)) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
+    }
+    xsk_ring_prod__submit(&s->fq, n);
+}
+
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+    uint32_t i, n_rx, idx = 0;
+
+    n_rx = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
+    if (!n_rx) {
+        return;
+    }
+
+    qemu_send_batch_begin(&s->nc);
+    for (i = 0; i < n_rx; i++) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&s->rx, idx++);
+        ssize_t ret;
+
+        ret = qemu_send_packet_async(&s->nc,
+                                     xsk_umem__get_data(s->buffer, desc->addr),
+                                     desc->len, af_xdp_send_completed);
+
+        /* The packet was either delivered or copied into the queue */
+        s->pool[s->n_pool++] = desc->addr;
+
+        if (ret == 0) {
+            /*
+             * The peer cannot receive anymore; stop reading until
+             * af_xdp_send_completed() and leave the remaining descriptors
+             * in the ring.
+             */
+            af_xdp_read_poll(s, false);
+            xsk_ring_cons__cancel(&s->rx, n_rx - i - 1);
+            n_rx = i + 1;
+            break;
+        }
+    }
+    qemu_send_batch_end(&s->nc);
+
+    xsk_ring_cons__release(&s->rx, n_rx);
+    af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
+}
+
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->xsk) {
+        af_xdp_poll(nc, false);
+        /* The XDP program is removed with its last socket */
+        xsk_socket__delete(s->xsk);
+        s->xsk = NULL;
+    }
+    xsk_umem__delete(s->umem);
+    s->umem = NULL;
+    qemu_vfree(s->buffer);
+    s->buffer = NULL;
+    g_free(s->pool);
+    s->pool = NULL;
+}
+
+static int af_xdp_umem_create(AFXDPState *s, int sock_fd, Error **errp)
+{
+    struct xsk_umem_config config = {
+        .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+        .frame_headroom = 0,
+    };
+    uint64_t n_frames, size, i;
+    int ret;
+
+    /* Enough frames to fill all four rings */
+    n_frames = (XSK_RING_PROD__DEFAULT_NUM_DESCS +
+                XSK_RING_CONS__DEFAULT_NUM_DESCS) * 2;
+    size = n_frames * XSK_UMEM__DEFAULT_FRAME_SIZE;
+
+    s->buffer = qemu_memalign(qemu_real_host_page_size, size);
+    memset(s->buffer, 0, size);
+
+    if (sock_fd < 0) {
+        ret = xsk_umem__create(&s->umem, s->buffer, size,
+                               &s->fq, &s->cq, &config);
+    } else {
+        ret = xsk_umem__create_with_fd(&s->umem, sock_fd, s->buffer, size,
+                                       &s->fq, &s->cq, &config);
+    }
+    if (ret) {
+        error_setg_errno(errp, -ret, "Failed to create UMEM for %s queue %d",
+                         s->ifname, s->nc.queue_index);
+        return -1;
+    }
+
+    s->pool = g_new(uint64_t, n_frames);
+    /* The pool is a stack, push the frames in reverse order */
+    for (i = 0; i < n_frames; i++) {
+        s->pool[i] = (n_frames - 1 - i) * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    }
+    s->n_pool = n_frames;
+
+    af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    return 0;
+}
+
+static int af_xdp_socket_create(AFXDPState *s,
+                                const NetdevAFXDPOptions *opts, Error **errp)
+{
+    struct xsk_socket_config cfg = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .bind_flags = XDP_USE_NEED_WAKEUP,
+    };
+    static const uint32_t mode_flags[] = {
+        [AFXDP_MODE_NATIVE] = XDP_FLAGS_DRV_MODE,
+        [AFXDP_MODE_SKB] = XDP_FLAGS_SKB_MODE,
+    };
+    int first_mode, last_mode, mode, queue_id;
+    int ret = -EINVAL;
+
+    if (opts->has_inhibit && opts->inhibit) {
+        cfg.libxdp_flags |= XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD;
+    }
+    if (opts->has_force_copy && opts->force_copy) {
+        cfg.bind_flags |= XDP_COPY;
+    }
+
+    queue_id = s->nc.queue_index;
+    if (opts->has_start_queue) {
+        queue_id += opts->start_queue;
+    }
+
+    /* Without an explicit mode, prefer the driver's native XDP support */
+    if (opts->has_mode) {
+        first_mode = last_mode = opts->mode;
+    } else {
+        first_mode = AFXDP_MODE_NATIVE;
+        last_mode = AFXDP_MODE_SKB;
+    }
+
+    for (mode = first_mode; mode <= last_mode; mode++) {
+        cfg.xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST | mode_flags[mode];
+        ret = xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                                 s->umem, &s->rx, &s->tx, &cfg);
+        if (!ret) {
+            break;
+        }
+        s->xsk = NULL;
+    }
+    if (ret) {
+        error_setg_errno(errp, -ret,
+                         "Failed to create AF_XDP socket for %s queue %d",
+                         s->ifname, queue_id);
+        return -1;
+    }
+
+    snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+             "ifname=%s,queue=%d,mode=%s", s->ifname, queue_id,
+             AFXDPMode_str(mode));
+    return 0;
+}
+
+/* NetClientInfo methods */
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_DRIVER_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+};
+
+static int *af_xdp_parse_sock_fds(const char *str, int64_t n_expected,
+                                  Error **errp)
+{
+    gchar **fds = g_strsplit(str, ":", -1);
+    int64_t i, n = g_strv_length(fds);
+    int *sock_fds = NULL;
+
+    if (n != n_expected) {
+        error_setg(errp, "Expected %" PRIi64 " socket fds, got %" PRIi64,
+                   n_expected, n);
+        goto out;
+    }
+
+    sock_fds = g_new(int, n);
+    for (i = 0; i < n; i++) {
+        sock_fds[i] = monitor_fd_param(monitor_cur(), fds[i], errp);
+        if (sock_fds[i] < 0) {
+            g_free(sock_fds);
+            sock_fds = NULL;
+            goto out;
+        }
+    }
+
+out:
+    g_strfreev(fds);
+    return sock_fds;
+}
+
+/* The exported init function
+ *
+ * ... -netdev af-xdp,ifname="..."
+ */
+int net_init_af_xdp(const Netdev *netdev,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
+    NetClientState *nc, *nc0 = NULL;
+    int64_t i, queues;
+    int *sock_fds = NULL;
+    AFXDPState *s;
+
+    if (!if_nametoindex(opts->ifname)) {
+        error_setg_errno(errp, errno, "Cannot find interface '%s'",
+                         opts->ifname);
+        return -1;
+    }
+
+    queues = opts->has_queues ? opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "Invalid number of queues (%" PRIi64 ") for '%s'",
+                   queues, opts->ifname);
+        return -1;
+    }
+    if (opts->has_start_queue && opts->start_queue < 0) {
+        error_setg(errp, "Invalid start queue (%" PRIi64 ") for '%s'",
+                   opts->start_queue, opts->ifname);
+        return -1;
+    }
+
+    if ((opts->has_inhibit && opts->inhibit) != opts->has_sock_fds) {
+        error_setg(errp, "'inhibit=on' requires 'sock-fds' and vice versa");
+        return -1;
+    }
+
+    if (opts->has_sock_fds) {
+        sock_fds = af_xdp_parse_sock_fds(opts->sock_fds, queues, errp);
+        if (!sock_fds) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        nc->queue_index = i;
+        if (!nc0) {
+            nc0 = nc;
+        }
+
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
+
+        if (af_xdp_umem_create(s, sock_fds ? sock_fds[i] : -1, errp) ||
+            af_xdp_socket_create(s, opts, errp)) {
+            /* Deletes all the queues created so far */
+            qemu_del_net_client(nc0);
+            g_free(sock_fds);
+            return -1;
+        }
+
+        af_xdp_read_poll(s, true);
+    }
+
+    g_free(sock_fds);
+    return 0;
+}
@@ -125,6 +125,30 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
     return net_hub_receive_iov(port->hub, port, iov, iovcnt);
 }
 
+static void net_hub_port_begin_batch(NetClientState *nc)
+{
+    NetHubPort *source_port = DO_UPCAST(NetHubPort, nc, nc);
+    NetHubPort *port;
+
+    QLIST_FOREACH(port, &source_port->hub->ports, next) {
+        if (port != source_port) {
+            qemu_send_batch_begin(&port->nc);
+        }
+    }
+}
+
+static void net_hub_port_end_batch(NetClientState *nc)
+{
+    NetHubPort *source_port = DO_UPCAST(NetHubPort, nc, nc);
+    NetHubPort *port;
+
+    QLIST_FOREACH(port, &source_port->hub->ports, next) {
+        if (port != source_port) {
+            qemu_send_batch_end(&port->nc);
+        }
+    }
+}
+
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
@@ -138,6 +162,8 @@ static NetClientInfo net_hub_port_info = {
     .can_receive = net_hub_port_can_receive,
     .receive = net_hub_port_receive,
     .receive_iov = net_hub_port_receive_iov,
+    .begin_batch = net_hub_port_begin_batch,
+    .end_batch = net_hub_port_end_batch,
     .cleanup = net_hub_port_cleanup,
 };
 
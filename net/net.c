@@ -684,6 +684,72 @@ ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
     return qemu_send_packet_async(nc, buf, size, NULL);
 }
 
+/*
+ * Send @count packets to the peer of @sender.  If the peer has a
+ * receive_batch callback and the packets do not need to be handled one at
+ * a time by filters or the queue, they are passed to it with a single
+ * call; otherwise they are sent one by one.
+ *
+ * Returns the number of packets that were sent or dropped.  If it is less
+ * than @count, the next packet was queued: the caller must not send more
+ * packets until @sent_cb is called for it, and the packets after it were
+ * not looked at.
+ */
+int qemu_sendv_batch_async(NetClientState *sender, const NetPacketIOV *pkts,
+                           int count, NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int i = 0, n;
+
+    if (peer && peer->info->receive_batch &&
+        !sender->link_down && !peer->link_down &&
+        QTAILQ_EMPTY(&sender->filters) && QTAILQ_EMPTY(&peer->filters) &&
+        qemu_can_send_packet(sender) &&
+        qemu_net_queue_idle(peer->incoming_queue)) {
+        /* Oversized packets are dropped by qemu_sendv_packet_async() */
+        for (n = 0; n < count; n++) {
+            if (iov_size(pkts[n].iov, pkts[n].iovcnt) > NET_BUFSIZE) {
+                break;
+            }
+        }
+        if (n) {
+            i = peer->info->receive_batch(peer, pkts, n);
+            assert(i >= 0 && i <= n);
+        }
+    }
+
+    for (; i < count; i++) {
+        if (!qemu_sendv_packet_async(sender, pkts[i].iov, pkts[i].iovcnt,
+                                     sent_cb)) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Tell the peer of @nc that several packets are about to be sent in a
+ * row, for example because a backend read them in one wakeup.  Must be
+ * paired with qemu_send_batch_end() before returning to the main loop.
+ */
+void qemu_send_batch_begin(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->info->begin_batch) {
+        peer->info->begin_batch(peer);
+    }
+}
+
+void qemu_send_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->info->end_batch) {
+        peer->info->end_batch(peer);
+    }
+}
+
 ssize_t qemu_receive_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     if (!qemu_can_receive_packet(nc)) {
@@ -988,6 +1054,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1081,6 +1150,9 @@ void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
@@ -270,6 +270,15 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
     }
 }
 
+/*
+ * Returns true if no packet is queued or being delivered, so that a new
+ * packet can be passed to the delivery handler without reordering.
+ */
+bool qemu_net_queue_idle(NetQueue *queue)
+{
+    return !queue->delivering && QTAILQ_EMPTY(&queue->packets);
+}
+
 bool qemu_net_queue_flush(NetQueue *queue)
 {
     if (queue->delivering)
@@ -34,6 +34,9 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 
+/* Maximum number of packets that receive_batch sends with one system call */
+#define NET_SOCKET_BATCH 64
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
@@ -113,6 +116,70 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+/*
+ * Frame the packets with their length like net_socket_receive() and send
+ * as many of them as possible with one writev.
+ */
+static int net_socket_receive_batch(NetClientState *nc,
+                                    const NetPacketIOV *pkts, int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    uint32_t len[NET_SOCKET_BATCH];
+    size_t size[NET_SOCKET_BATCH];
+    struct iovec iov[IOV_MAX];
+    int done = 0;
+
+    /* A partially sent packet is finished by net_socket_receive() */
+    if (s->send_index) {
+        return 0;
+    }
+
+    while (done < count) {
+        size_t total = 0;
+        ssize_t ret;
+        int i, n = 0, iovcnt = 0;
+
+        while (done + n < count && n < NET_SOCKET_BATCH &&
+               iovcnt + 1 + pkts[done + n].iovcnt <= IOV_MAX) {
+            const NetPacketIOV *p = &pkts[done + n];
+
+            size[n] = iov_size(p->iov, p->iovcnt);
+            len[n] = htonl(size[n]);
+            iov[iovcnt].iov_base = &len[n];
+            iov[iovcnt].iov_len = sizeof(len[n]);
+            memcpy(&iov[iovcnt + 1], p->iov, p->iovcnt * sizeof(*iov));
+            iovcnt += 1 + p->iovcnt;
+            total += sizeof(len[n]) + size[n];
+            n++;
+        }
+        if (!n) {
+            /* Too many fragments, leave the packet to net_socket_receive() */
+            break;
+        }
+
+        ret = iov_send(s->fd, iov, iovcnt, 0, total);
+        if (ret == -1 && errno == EAGAIN) {
+            ret = 0;
+        }
+        if (ret == -1) {
+            /* Like net_socket_receive(), drop the packets */
+            done += n;
+            continue;
+        }
+
+        for (i = 0; i < n && (size_t)ret >= sizeof(len[i]) + size[i]; i++) {
+            ret -= sizeof(len[i]) + size[i];
+        }
+        done += i;
+        if (i < n) {
+            s->send_index = ret;
+            net_socket_write_poll(s, true);
+            break;
+        }
+    }
+    return done;
+}
+
 static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -135,6 +202,45 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+#ifdef CONFIG_SENDMMSG
+static int net_socket_receive_batch_dgram(NetClientState *nc,
+                                          const NetPacketIOV *pkts, int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct mmsghdr msgs[NET_SOCKET_BATCH];
+    int done = 0;
+
+    while (done < count) {
+        int i, n = MIN(count - done, NET_SOCKET_BATCH);
+        int ret;
+
+        memset(msgs, 0, n * sizeof(msgs[0]));
+        for (i = 0; i < n; i++) {
+            struct msghdr *msg = &msgs[i].msg_hdr;
+
+            if (s->dgram_dst.sin_family != AF_UNIX) {
+                msg->msg_name = &s->dgram_dst;
+                msg->msg_namelen = sizeof(s->dgram_dst);
+            }
+            msg->msg_iov = (struct iovec *)pkts[done + i].iov;
+            msg->msg_iovlen = pkts[done + i].iovcnt;
+        }
+
+        do {
+            ret = sendmmsg(s->fd, msgs, n, 0);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == -1 && errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            break;
+        }
+        /* Like net_socket_receive_dgram(), drop a packet that fails */
+        done += MAX(ret, 1);
+    }
+    return done;
+}
+#endif
+
 static void net_socket_send_completed(NetClientState *nc, ssize_t len)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -326,6 +432,9 @@ static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_DRIVER_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_SENDMMSG
+    .receive_batch = net_socket_receive_batch_dgram,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -418,6 +527,7 @@ static NetClientInfo net_socket_info = {
     .type = NET_CLIENT_DRIVER_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
+    .receive_batch = net_socket_receive_batch,
     .cleanup = net_socket_cleanup,
 };
 
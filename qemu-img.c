@@ -82,6 +82,7 @@ enum {
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
+    OPTION_RANDOM = 277,
 };
 
 typedef enum OutputFormat {
@@ -4180,6 +4181,7 @@ typedef struct BenchData {
     int n;
     int flush_interval;
     bool drain_on_flush;
+    bool random;
     uint8_t *buf;
     QEMUIOVector *qiov;
 
@@ -4247,8 +4249,16 @@ static void bench_cb(void *opaque, int ret)
          * and b->offset is ready for the next submission.
          */
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
+        if (b->random) {
+            uint64_t slots = (b->image_size - b->offset - b->bufsize) /
+                             b->step + 1;
+            uint64_t r = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+            offset = b->offset + r % slots * b->step;
+        } else {
+            b->offset += b->step;
+            b->offset %= b->image_size;
+        }
         if (b->write) {
             acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
         } else {
@@ -4276,6 +4286,7 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    bool random = false;
     int64_t image_size;
     BlockBackend *blk = NULL;
     BenchData data = {};
@@ -4293,6 +4304,7 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"random", no_argument, 0, OPTION_RANDOM},
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
@@ -4424,6 +4436,9 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_RANDOM:
+            random = true;
+            break;
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
@@ -4458,6 +4473,12 @@ static int img_bench(int argc, char **argv)
         ret = image_size;
         goto out;
     }
+    if (random && offset + bufsize > image_size) {
+        error_report("Image too small for random requests starting at "
+                     "offset %" PRId64, offset);
+        ret = -1;
+        goto out;
+    }
 
     data = (BenchData) {
         .blk            = blk,
@@ -4470,10 +4491,12 @@ static int img_bench(int argc, char **argv)
         .write          = is_write,
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
+        .random         = random,
     };
     printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
+           "(%s offset %" PRId64 ", step size %d)\n",
            data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
+           data.random ? "random from" : "starting at",
            data.offset, data.step);
     if (flush_interval) {
         printf("Sending flush every %d requests\n", flush_interval);
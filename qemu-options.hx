@@ -1174,6 +1174,27 @@ SRST
             supporting platforms, and 0 on other platforms. Setting it
             to 0 disables this feature.
 
+        ``cluster-reservation``
+            Allocate host clusters for guest data in chunks of this
+            many bytes, so that concurrent allocating writes rarely
+            need to update refcounts (default: 0, which disables the
+            reservation). Clusters that are still unused after a crash
+            are reported as leaks by ``qemu-img check``.
+
+        ``extent-map``
+            If the image is opened read-only, read all L2 tables when
+            the image is opened and resolve guest offsets with an
+            in-memory map of contiguous extents instead of the L2 table
+            cache (on/off; default: off). The size of the map is shown
+            by ``query-named-block-nodes``.
+
+        ``compressed-readahead``
+            When compressed clusters are read sequentially, decompress
+            up to this many bytes after the end of each request in the
+            background, so that the following requests find the data
+            in the cache of decompressed clusters (at most 32M;
+            default: 0, which disables readahead)
+
         ``pass-discard-request``
             Whether discard requests to the qcow2 device should be
             forwarded to the data source (on/off; default: on if
@@ -2575,6 +2596,16 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]\n"
+    "                attach to the existing network interface 'name' with AF_XDP, using\n"
+    "                its queues 'm' to 'm + n - 1' ('m' defaults to 0, 'n' to 1)\n"
+    "                use 'mode=native|skb' to force the XDP attach mode\n"
+    "                use 'force-copy=on' to disable zero-copy\n"
+    "                use 'inhibit=on' with 'sock-fds' to use sockets that are bound\n"
+    "                to an externally loaded XDP program\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -2599,6 +2630,9 @@ DEF("nic", HAS_ARG, QEMU_OPTION_nic,
 #ifdef CONFIG_NETMAP
     "netmap|"
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
+#endif
 #ifdef CONFIG_POSIX
     "vhost-user|"
 #endif
@@ -2628,7 +2662,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                old way to initialize a host network interface\n"
     "                (use the -netdev option if possible instead)\n", QEMU_ARCH_ALL)
 SRST
-``-nic [tap|bridge|user|l2tpv3|vde|netmap|vhost-user|socket][,...][,mac=macaddr][,model=mn]``
+``-nic [tap|bridge|user|l2tpv3|vde|netmap|af-xdp|vhost-user|socket][,...][,mac=macaddr][,model=mn]``
     This option is a shortcut for configuring both the on-board
     (default) guest NIC hardware and the host network backend in one go.
     The host backend options are the same as with the corresponding
@@ -3042,6 +3076,44 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
+``-netdev af-xdp,id=id,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]``
+    Configure an AF_XDP backend attached to the existing host network
+    interface name. Packets are exchanged with the interface through
+    shared memory rings, bypassing the host network stack. The
+    interface is used exclusively by QEMU: packets received on the
+    bound queues are not seen by the host anymore. This option is
+    only available if QEMU has been compiled with libxdp.
+
+    ``mode=native|skb``
+        Attach the XDP program in the driver (``native``) or after the
+        kernel has built an skb (``skb``, supported by every interface).
+        By default native mode is tried first.
+
+    ``force-copy=on|off``
+        Copy the packets between the kernel and the UMEM even if the
+        driver supports zero-copy.
+
+    ``queues=n``; \ ``start-queue=m``
+        Bind the queues m to m + n - 1 of the interface, one per queue
+        of the netdev. The traffic must be steered to these queues on
+        the host, for example with ``ethtool -N``.
+
+    ``inhibit=on``; \ ``sock-fds=x:y:...:z``
+        Do not load the default XDP program and use the given AF_XDP
+        sockets, one per queue, instead of creating them. This lets
+        an unprivileged QEMU use sockets that a privileged process has
+        created and inserted into the XSKMAP of its own XDP program.
+
+    Example (copy mode on a veth pair):
+
+    .. parsed-literal::
+
+        ip link add qemu-xdp0 type veth peer name qemu-xdp1
+        ip link set qemu-xdp0 up
+        ip link set qemu-xdp1 up
+        |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
+            -netdev af-xdp,id=n1,ifname=qemu-xdp0,mode=skb
+
 ``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
@@ -5232,7 +5304,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,io-uring-sqpoll=on|off,io-uring-fixed-buffers=on|off``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -5275,6 +5347,16 @@ SRST
         ::
 
             (qemu) qom-set /objects/iothread1 poll-max-ns 100000
+
+        The ``io-uring-sqpoll`` and ``io-uring-fixed-buffers`` parameters
+        configure the io_uring instance used by ``aio=io_uring`` block
+        nodes in the IOThread. ``io-uring-sqpoll=on`` lets a kernel
+        thread, shared by all IOThreads that enable it, poll for new
+        requests so that submitting them needs no system call.
+        ``io-uring-fixed-buffers=on`` registers guest RAM with the kernel
+        once instead of mapping guest pages for every request; guest RAM
+        then counts against the locked memory limit. These parameters
+        cannot be changed once the IOThread has started using io_uring.
 ERST
 
 
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+#
+# Benchmark aio=io_uring in an iothread against the other aio modes, reading
+# raw images
+#
+# A backup job in an iothread copies an image to a null-co node, so that the
+# result is the read throughput of the file node.  The image is opened with
+# cache.direct=on.  io_uring is run with its registered file table (always
+# used when the host kernel supports it) and with a SQPOLL ring
+# (io-uring-sqpoll=on).  The backup job reads into bounce buffers, so
+# io-uring-fixed-buffers does not apply here: it only registers guest RAM.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys
+import os
+import socket
+import json
+
+import simplebench
+from results_to_text import results_to_text
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'python'))
+from qemu.machine import QEMUMachine
+from qemu.qmp import QMPConnectError
+
+
+def bench_func(env, case):
+    """Back up case['image'] to null-co in iothread0"""
+    source = {
+        'node-name': 'source',
+        'driver': 'file',
+        'filename': case['image'],
+        'cache': {'direct': True},
+        'aio': env['aio']
+    }
+    target = {
+        'node-name': 'target',
+        'driver': 'null-co',
+        'size': case['size']
+    }
+
+    vm = QEMUMachine(env['qemu-binary'], args=[
+        '-nodefaults', '-display', 'none',
+        '-object', 'iothread,id=iothread0' + env['iothread-opts'],
+        '-blockdev', json.dumps(source),
+        '-blockdev', json.dumps(target)])
+
+    try:
+        vm.launch()
+    except OSError as e:
+        return {'error': 'popen failed: ' + str(e)}
+    except (QMPConnectError, socket.timeout):
+        return {'error': 'qemu failed: ' + str(vm.get_log())}
+
+    try:
+        for node in ('source', 'target'):
+            res = vm.qmp('x-blockdev-set-iothread', node_name=node,
+                         iothread='iothread0')
+            if res != {'return': {}}:
+                return {'error': 'x-blockdev-set-iothread failed: ' +
+                        str(res)}
+
+        res = vm.qmp('blockdev-backup', job_id='job0', device='source',
+                     target='target', sync='full', x_perf={'max-workers': 64})
+        if res != {'return': {}}:
+            return {'error': 'blockdev-backup failed: ' + str(res)}
+
+        e = vm.event_wait('JOB_STATUS_CHANGE')
+        assert e['data']['status'] == 'created'
+        start_us = e['timestamp']['seconds'] * 1000000 + \
+            e['timestamp']['microseconds']
+
+        e = vm.events_wait((('BLOCK_JOB_COMPLETED', None),
+                            ('BLOCK_JOB_FAILED', None)), timeout=True)
+        if e['event'] != 'BLOCK_JOB_COMPLETED' or 'error' in e['data']:
+            return {'error': 'block-job failed: ' + str(e)}
+        end_us = e['timestamp']['seconds'] * 1000000 + \
+            e['timestamp']['microseconds']
+    finally:
+        vm.shutdown()
+
+    return {'seconds': (end_us - start_us) / 1000000.0}
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        print(f'USAGE: {sys.argv[0]} <qemu binary> IMAGE...')
+        exit(1)
+
+    qemu = sys.argv[1]
+
+    envs = [
+        {
+            'id': env_id,
+            'qemu-binary': qemu,
+            'aio': aio,
+            'iothread-opts': opts
+        } for env_id, aio, opts in [
+            ('aio=threads', 'threads', ''),
+            ('aio=native', 'native', ''),
+            ('aio=io_uring', 'io_uring', ''),
+            ('aio=io_uring, sqpoll', 'io_uring', ',io-uring-sqpoll=on'),
+        ]
+    ]
+
+    cases = [
+        {
+            'id': os.path.basename(image),
+            'image': image,
+            'size': os.path.getsize(image)
+        } for image in sys.argv[2:]
+    ]
+
+    result = simplebench.bench(bench_func, envs, cases, count=3)
+    print(results_to_text(result))
+    with open('results.json', 'w') as f:
+        json.dump(result, f, indent=4)
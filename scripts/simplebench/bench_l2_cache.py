@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+#
+# Benchmark random reads on a qcow2 image with different L2 cache sizes
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys
+import os
+import subprocess
+import re
+import json
+
+import simplebench
+from results_to_text import results_to_text
+
+
+def qemu_img_bench(args):
+    p = subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                       universal_newlines=True)
+
+    if p.returncode == 0:
+        try:
+            m = re.search(r'Run completed in (\d+.\d+) seconds.', p.stdout)
+            return {'seconds': float(m.group(1))}
+        except Exception:
+            return {'error': f'failed to parse qemu-img output: {p.stdout}'}
+    else:
+        return {'error': f'qemu-img failed: {p.returncode}: {p.stdout}'}
+
+
+def bench_func(env, case):
+    """Random 4k reads over the whole image, all clusters allocated"""
+    count = 200000
+    args = [env['qemu-img-binary'], 'bench', '--random', '-c', str(count),
+            '-d', '64', '-s', '4k', '--image-opts',
+            f"driver=qcow2,l2-cache-size={env['l2-cache-size']},"
+            f"file.driver=file,file.filename={case['image']}"]
+
+    res = qemu_img_bench(args)
+    if 'seconds' in res:
+        res['iops'] = count / res['seconds']
+    return res
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        print(f'USAGE: {sys.argv[0]} <qemu-img binary> DIR_PATH '
+              'IMAGE_SIZE...')
+        exit(1)
+
+    qemu_img = sys.argv[1]
+    path = sys.argv[2]
+
+    envs = [
+        {
+            'id': f'l2-cache-size={size}',
+            'qemu-img-binary': qemu_img,
+            'l2-cache-size': size
+        } for size in ['1M', '8M', '64M', '512M']
+    ]
+
+    cases = []
+    for size in sys.argv[3:]:
+        fname = os.path.join(path, f'l2-cache-test-{size}.qcow2')
+        subprocess.run([qemu_img, 'create', '-f', 'qcow2', '-o',
+                        'preallocation=metadata', fname, size],
+                       stdout=subprocess.DEVNULL, check=True)
+        cases.append({
+            'id': f'{size} image, random 4k reads',
+            'image': fname
+        })
+
+    try:
+        result = simplebench.bench(bench_func, envs, cases, count=3)
+    finally:
+        for case in cases:
+            os.remove(case['image'])
+
+    print(results_to_text(result))
+    with open('results.json', 'w') as f:
+        json.dump(result, f, indent=4)
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+#
+# Benchmark the receive path of a virtio-net NIC with a tap backend
+#
+# A guest with a virtio-net NIC is started from the given image, with its
+# NIC connected to a tap interface on the host.  Once the guest has brought
+# the NIC up, packets are injected into the tap on the host; QEMU reads them
+# and puts them into the receive queue of the guest.  The guest needs to do
+# nothing with them, any image whose OS brings up its network interface on
+# boot (e.g. a cloud image) will do.
+#
+# vhost is disabled, so that the packets go through QEMU.  Because QEMU
+# stops reading from the tap when the receive queue of the guest is full,
+# the number of packets that QEMU read from the tap is the number of packets
+# that the guest received.  The result is that number per second (reported
+# as iops).  Needs root to create the tap device.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys
+import os
+import socket
+import subprocess
+import time
+import json
+from multiprocessing import Process
+
+import simplebench
+from results_to_text import results_to_text
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'python'))
+from qemu.machine import QEMUMachine
+from qemu.qmp import QMPConnectError
+
+
+TAP = 'qbench-rx'
+SENDERS = 4
+DURATION = 10
+BOOT_TIMEOUT = 300
+
+
+def ip(*args):
+    subprocess.run(['ip'] + list(args), check=True)
+
+
+def read_packets(ifname):
+    """Number of packets that the user of the tap device has read"""
+    # For a tap, the host transmits what the process reading the tap reads
+    with open(f'/sys/class/net/{ifname}/statistics/tx_packets') as f:
+        return int(f.read())
+
+
+def make_frame(frame_size):
+    """A broadcast frame of frame_size bytes with a local experimental type"""
+    frame = b'\xff' * 6 + b'\x02\x00\x00\x00\x00\x01' + b'\x88\xb5'
+    return frame + bytes(frame_size - len(frame))
+
+
+def flood(ifname, frame_size, seconds):
+    """Send broadcast frames of frame_size bytes on ifname"""
+    s = socket.socket(socket.AF_PACKET, socket.SOCK_RAW)
+    s.bind((ifname, 0))
+    frame = make_frame(frame_size)
+    end = time.monotonic() + seconds
+    while time.monotonic() < end:
+        for _ in range(1000):
+            try:
+                s.send(frame)
+            except OSError:
+                # The tap queue is full, the guest is not keeping up
+                pass
+
+
+def wait_for_guest_rx(ifname):
+    """Wait until the guest has brought up its NIC and receives packets"""
+    s = socket.socket(socket.AF_PACKET, socket.SOCK_RAW)
+    s.bind((ifname, 0))
+    frame = make_frame(64)
+    end = time.monotonic() + BOOT_TIMEOUT
+    while time.monotonic() < end:
+        start_packets = read_packets(ifname)
+        for _ in range(10):
+            try:
+                s.send(frame)
+            except OSError:
+                pass
+        time.sleep(1)
+        # Until the guest posts receive buffers, QEMU reads at most one
+        # packet, which it then keeps queued
+        if read_packets(ifname) > start_packets + 1:
+            return True
+    return False
+
+
+def bench_func(env, case):
+    """Send packets to the guest through TAP for DURATION seconds"""
+    vm = QEMUMachine(env['qemu-binary'], args=[
+        '-accel', 'kvm', '-m', '1G', '-smp', '2', '-nodefaults',
+        '-display', 'none', '-snapshot',
+        '-drive', f'file={env["image"]},if=virtio',
+        '-netdev', f'tap,id=net0,ifname={TAP},script=no,downscript=no,'
+                   'vhost=off',
+        '-device', 'virtio-net-pci,netdev=net0'])
+
+    try:
+        vm.launch()
+    except OSError as e:
+        return {'error': 'popen failed: ' + str(e)}
+    except (QMPConnectError, socket.timeout):
+        return {'error': 'qemu failed: ' + str(vm.get_log())}
+
+    try:
+        ip('link', 'set', TAP, 'up')
+        if not wait_for_guest_rx(TAP):
+            return {'error': 'the guest did not bring up its NIC'}
+
+        senders = [Process(target=flood,
+                           args=(TAP, case['frame-size'], DURATION))
+                   for _ in range(SENDERS)]
+        start_packets = read_packets(TAP)
+        start = time.monotonic()
+        for p in senders:
+            p.start()
+        for p in senders:
+            p.join()
+        seconds = time.monotonic() - start
+        packets = read_packets(TAP) - start_packets
+    finally:
+        vm.shutdown()
+
+    return {'seconds': seconds, 'iops': packets / seconds}
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        print(f'USAGE: {sys.argv[0]} <guest image> <qemu binary>...')
+        exit(1)
+
+    if os.geteuid() != 0:
+        print('This benchmark needs root to create a tap device')
+        exit(1)
+
+    envs = [
+        {
+            'id': f'qemu-{i}' if len(sys.argv) > 3 else 'qemu',
+            'qemu-binary': qemu,
+            'image': sys.argv[1]
+        } for i, qemu in enumerate(sys.argv[2:])
+    ]
+
+    cases = [
+        {
+            'id': f'{size}-byte frames',
+            'frame-size': size
+        } for size in [64, 1500]
+    ]
+
+    ip('tuntap', 'add', 'dev', TAP, 'mode', 'tap')
+    try:
+        result = simplebench.bench(bench_func, envs, cases, count=3)
+    finally:
+        ip('tuntap', 'del', 'dev', TAP, 'mode', 'tap')
+
+    print(results_to_text(result))
+    with open('results.json', 'w') as f:
+        json.dump(result, f, indent=4)
@@ -25,33 +25,84 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/units.h"
 #include "hw/core/cpu.h"
+#include "hw/boards.h"
 #include "qemu/main-loop.h"
+#include "exec/memory.h"
+#include "exec/target_page.h"
 #include "sysemu/cpus.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/kvm.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qmp/qerror.h"
+#include "trace.h"
 
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
+/* period of throttle_timer, protected by the BQL */
+static int64_t throttle_period_ns;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
 #define CPU_THROTTLE_TIMESLICE_NS 10000000
 
+/* vcpu dirty page rate limit controls, protected by the BQL */
+#define DIRTY_LIMIT_PERIOD_MS 1000
+
+typedef struct DirtyLimitVcpu {
+    /* upper limit of the dirty page rate in MB/s, 0 if not limited */
+    uint64_t quota;
+    /* dirty page rate measured over the last period, in MB/s */
+    uint64_t rate;
+    /* value of CPUState::dirty_pages at the end of the last period */
+    uint64_t last_pages;
+    /* throttle percentage needed to stay below the quota */
+    int pct;
+} DirtyLimitVcpu;
+
+/* indexed by cpu_index, allocated when the first limit is set */
+static DirtyLimitVcpu *dirty_limit_vcpus;
+static int dirty_limit_max_cpus;
+/* number of vcpus with a quota */
+static int dirty_limit_nvcpus;
+static QEMUTimer *dirty_limit_timer;
+static int64_t dirty_limit_last_ms;
+
+/*
+ * Returns the throttle percentage that applies to @cpu: the highest of
+ * the global one and the one needed to enforce its dirty page rate limit.
+ */
+static int cpu_throttle_vcpu_percentage(CPUState *cpu)
+{
+    int pct = cpu_throttle_get_percentage();
+
+    if (dirty_limit_nvcpus && cpu->cpu_index < dirty_limit_max_cpus) {
+        pct = MAX(pct, dirty_limit_vcpus[cpu->cpu_index].pct);
+    }
+    return pct;
+}
+
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
     double pct;
-    double throttle_ratio;
     int64_t sleeptime_ns, endtime_ns;
+    int vcpu_pct = cpu_throttle_vcpu_percentage(cpu);
 
-    if (!cpu_throttle_get_percentage()) {
+    if (!vcpu_pct) {
+        qatomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage() / 100;
-    throttle_ratio = pct / (1 - pct);
+    /*
+     * Sleep for our share of the timer period, which is the whole
+     * period minus one timeslice for the most throttled vcpu.
+     */
+    pct = (double)vcpu_pct / 100;
     /* Add 1ns to fix double's rounding error (like 0.9999999...) */
-    sleeptime_ns = (int64_t)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS + 1);
+    sleeptime_ns = (int64_t)(pct * throttle_period_ns + 1);
     endtime_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + sleeptime_ns;
     while (sleeptime_ns > 0 && !cpu->stop) {
         if (sleeptime_ns > SCALE_MS) {
@@ -71,21 +122,30 @@ static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
     double pct;
+    int max_pct = 0;
 
-    /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
-        return;
-    }
     CPU_FOREACH(cpu) {
+        int vcpu_pct = cpu_throttle_vcpu_percentage(cpu);
+
+        if (!vcpu_pct) {
+            continue;
+        }
+        max_pct = MAX(max_pct, vcpu_pct);
         if (!qatomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
                              RUN_ON_CPU_NULL);
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage() / 100;
+    /* Stop the timer if needed */
+    if (!max_pct) {
+        return;
+    }
+
+    pct = (double)max_pct / 100;
+    throttle_period_ns = CPU_THROTTLE_TIMESLICE_NS / (1 - pct);
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+                                   throttle_period_ns);
 }
 
 void cpu_throttle_set(int new_throttle_pct)
@@ -122,8 +182,221 @@ int cpu_throttle_get_percentage(void)
     return qatomic_read(&throttle_percentage);
 }
 
+/*
+ * Computes the throttle percentage that brings the dirty page rate of
+ * @v below its quota, assuming that the rate is proportional to the
+ * time the vcpu is allowed to run.
+ */
+static int dirty_limit_throttle_pct(DirtyLimitVcpu *v)
+{
+    /* share of the time the vcpu ran during the last period */
+    double run = 1 - (double)v->pct / 100;
+    double target;
+    int pct;
+
+    if (v->rate > v->quota) {
+        run = run * v->quota / v->rate;
+    } else if (v->pct) {
+        /* Only go halfway when relaxing, so that we don't oscillate */
+        target = v->rate ? run * v->quota / v->rate : 1;
+        run = (run + MIN(target, 1)) / 2;
+    }
+
+    pct = 100 - (int)(run * 100);
+    if (pct < CPU_THROTTLE_PCT_MIN) {
+        return 0;
+    }
+    return MIN(pct, CPU_THROTTLE_PCT_MAX);
+}
+
+static void dirty_limit_timer_tick(void *opaque)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t period = MAX(now - dirty_limit_last_ms, 1);
+    bool throttling = false;
+    CPUState *cpu;
+
+    /* Collect the pages dirtied since the last tick from the dirty rings */
+    memory_global_dirty_log_sync();
+
+    CPU_FOREACH(cpu) {
+        DirtyLimitVcpu *v;
+        uint64_t pages;
+
+        if (cpu->cpu_index >= dirty_limit_max_cpus) {
+            continue;
+        }
+        v = &dirty_limit_vcpus[cpu->cpu_index];
+        pages = qatomic_read_u64(&cpu->dirty_pages);
+        v->rate = (pages - v->last_pages) * qemu_target_page_size() *
+                  1000 / period / MiB;
+        v->last_pages = pages;
+        if (!v->quota) {
+            continue;
+        }
+        v->pct = dirty_limit_throttle_pct(v);
+        throttling |= v->pct != 0;
+        trace_dirty_limit_vcpu_throttle(cpu->cpu_index, v->quota,
+                                        v->rate, v->pct);
+    }
+    dirty_limit_last_ms = now;
+
+    if (throttling && !timer_pending(throttle_timer)) {
+        cpu_throttle_timer_tick(NULL);
+    }
+    timer_mod(dirty_limit_timer, now + DIRTY_LIMIT_PERIOD_MS);
+}
+
+static void dirty_limit_start(void)
+{
+    CPUState *cpu;
+
+    memory_global_dirty_log_start(GLOBAL_DIRTY_LIMIT);
+
+    /* Only count the pages dirtied from now on */
+    memory_global_dirty_log_sync();
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index < dirty_limit_max_cpus) {
+            dirty_limit_vcpus[cpu->cpu_index].last_pages =
+                qatomic_read_u64(&cpu->dirty_pages);
+        }
+    }
+    dirty_limit_last_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    timer_mod(dirty_limit_timer, dirty_limit_last_ms + DIRTY_LIMIT_PERIOD_MS);
+}
+
+static void dirty_limit_stop(void)
+{
+    timer_del(dirty_limit_timer);
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_LIMIT);
+}
+
+static void dirty_limit_vcpu_set(int cpu_index, uint64_t quota)
+{
+    DirtyLimitVcpu *v = &dirty_limit_vcpus[cpu_index];
+
+    if (quota && !v->quota) {
+        dirty_limit_nvcpus++;
+    } else if (!quota && v->quota) {
+        dirty_limit_nvcpus--;
+        v->pct = 0;
+    }
+    v->quota = quota;
+    trace_dirty_limit_vcpu_set(cpu_index, quota);
+}
+
+/*
+ * Checks that dirty limits can be used and that @cpu_index, if present,
+ * is a valid vcpu.  Returns false and sets @errp otherwise.
+ */
+static bool dirty_limit_check(bool has_cpu_index, int64_t cpu_index,
+                              Error **errp)
+{
+    if (!kvm_enabled() || !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "Dirty page limit requires KVM with the "
+                   "dirty-ring-size accelerator property set");
+        return false;
+    }
+
+    if (!dirty_limit_vcpus) {
+        dirty_limit_max_cpus = current_machine->smp.max_cpus;
+        dirty_limit_vcpus = g_new0(DirtyLimitVcpu, dirty_limit_max_cpus);
+    }
+
+    if (has_cpu_index && (cpu_index < 0 || cpu_index >= dirty_limit_max_cpus ||
+                          !qemu_get_cpu(cpu_index))) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cpu-index",
+                   "an existing vCPU index");
+        return false;
+    }
+    return true;
+}
+
+void qmp_set_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                              uint64_t dirty_rate, Error **errp)
+{
+    int nvcpus = dirty_limit_nvcpus;
+    CPUState *cpu;
+
+    if (!dirty_limit_check(has_cpu_index, cpu_index, errp)) {
+        return;
+    }
+    if (!dirty_rate) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "dirty-rate",
+                   "a value greater than 0");
+        return;
+    }
+
+    if (has_cpu_index) {
+        dirty_limit_vcpu_set(cpu_index, dirty_rate);
+    } else {
+        CPU_FOREACH(cpu) {
+            dirty_limit_vcpu_set(cpu->cpu_index, dirty_rate);
+        }
+    }
+
+    if (!nvcpus && dirty_limit_nvcpus) {
+        dirty_limit_start();
+    }
+}
+
+void qmp_cancel_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                                 Error **errp)
+{
+    int nvcpus = dirty_limit_nvcpus;
+    CPUState *cpu;
+
+    if (!dirty_limit_check(has_cpu_index, cpu_index, errp)) {
+        return;
+    }
+
+    if (has_cpu_index) {
+        dirty_limit_vcpu_set(cpu_index, 0);
+    } else {
+        CPU_FOREACH(cpu) {
+            dirty_limit_vcpu_set(cpu->cpu_index, 0);
+        }
+    }
+
+    if (nvcpus && !dirty_limit_nvcpus) {
+        dirty_limit_stop();
+    }
+}
+
+DirtyLimitInfoList *qmp_query_vcpu_dirty_limit(Error **errp)
+{
+    DirtyLimitInfoList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    if (!dirty_limit_nvcpus) {
+        return NULL;
+    }
+
+    CPU_FOREACH(cpu) {
+        DirtyLimitVcpu *v;
+        DirtyLimitInfo *info;
+
+        if (cpu->cpu_index >= dirty_limit_max_cpus) {
+            continue;
+        }
+        v = &dirty_limit_vcpus[cpu->cpu_index];
+        if (!v->quota) {
+            continue;
+        }
+        info = g_new0(DirtyLimitInfo, 1);
+        info->cpu_index = cpu->cpu_index;
+        info->limit_rate = v->quota;
+        info->current_rate = v->rate;
+        info->throttle_percentage = v->pct;
+        QAPI_LIST_APPEND(tail, info);
+    }
+    return head;
+}
+
 void cpu_throttle_init(void)
 {
     throttle_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
                                   cpu_throttle_timer_tick, NULL);
+    dirty_limit_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                     dirty_limit_timer_tick, NULL);
 }
@@ -1139,6 +1139,22 @@ bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
     return false;
 }
 
+/* Returns the number of dirty pages in [start, start + length) */
+uint64_t cpu_physical_memory_snapshot_count_dirty(DirtyBitmapSnapshot *snap,
+                                                  ram_addr_t start,
+                                                  ram_addr_t length)
+{
+    unsigned long page, end;
+
+    assert(start >= snap->start);
+    assert(start + length <= snap->end);
+
+    end = TARGET_PAGE_ALIGN(start + length - snap->start) >> TARGET_PAGE_BITS;
+    page = (start - snap->start) >> TARGET_PAGE_BITS;
+
+    return bitmap_count_one_with_offset(snap->dirty, page, end - page);
+}
+
 /* Called from RCU critical section */
 hwaddr memory_region_section_get_iotlb(CPUState *cpu,
                                        MemoryRegionSection *section)
@@ -0,0 +1,80 @@
+/*
+ * Xor Based Zero Run Length Encoding speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define XBZRLE_PAGE_SIZE 4096
+
+typedef struct XbzrleBenchOpts {
+    const char *name;
+    /* one changed run of @run_len bytes every @stride bytes */
+    int stride;
+    int run_len;
+} XbzrleBenchOpts;
+
+static const XbzrleBenchOpts bench_opts[] = {
+    { .name = "unchanged", .stride = XBZRLE_PAGE_SIZE, .run_len = 0 },
+    { .name = "sparse", .stride = 512, .run_len = 1 },
+    { .name = "runs", .stride = 256, .run_len = 64 },
+    { .name = "dense", .stride = 16, .run_len = 4 },
+};
+
+static void encode_speed(const XbzrleBenchOpts *opts)
+{
+    uint8_t *old_buf = qemu_memalign(64, XBZRLE_PAGE_SIZE);
+    uint8_t *new_buf = qemu_memalign(64, XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    const size_t total = 4 * GiB;
+    size_t remain;
+    int i, j;
+
+    for (i = 0; i < XBZRLE_PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, XBZRLE_PAGE_SIZE);
+    for (i = 0; i < XBZRLE_PAGE_SIZE; i += opts->stride) {
+        for (j = i; j < i + opts->run_len && j < XBZRLE_PAGE_SIZE; j++) {
+            new_buf[j] = ~old_buf[j];
+        }
+    }
+
+    g_test_timer_start();
+    for (remain = total; remain; remain -= XBZRLE_PAGE_SIZE) {
+        xbzrle_encode_buffer(old_buf, new_buf, XBZRLE_PAGE_SIZE,
+                             compressed, XBZRLE_PAGE_SIZE);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("xbzrle encode(%s): %s %.2f GB/sec",
+                   xbzrle_encode_accel_name(), opts->name,
+                   total / g_test_timer_last() / GiB);
+
+    g_free(compressed);
+    qemu_vfree(new_buf);
+    qemu_vfree(old_buf);
+}
+
+/* The encoders can't be selected again, so go through them only once */
+static void test_encode_speed(void)
+{
+    int i;
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(bench_opts); i++) {
+            encode_speed(&bench_opts[i]);
+        }
+    } while (test_xbzrle_encode_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/benchmark/encode", test_encode_speed);
+
+    return g_test_run();
+}
@@ -0,0 +1,206 @@
+/*
+ * QTest testcase for the af-xdp network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqos/libqtest.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qjson.h"
+#include "qemu/bswap.h"
+#include <net/if.h>
+#include <linux/if_packet.h>
+
+/* IEEE 802 local experimental ethertype, so that other traffic is ignored */
+#define TEST_ETH_TYPE 0x88b5
+#define TEST_PKT_LEN 200
+
+/* Check that netdev_add fails with @desc, @args being the af-xdp options */
+static void netdev_add_error(QTestState *qts, const char *args,
+                             const char *desc)
+{
+    g_autofree char *json = g_strdup_printf("{ 'type': 'af-xdp',"
+                                            " 'id': 'xdp0', %s }", args);
+    QDict *rsp, *err;
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'netdev_add', 'arguments': %p }",
+                    qobject_from_json(json, &error_abort));
+    g_assert(qdict_haskey(rsp, "error"));
+    err = qdict_get_qdict(rsp, "error");
+    if (!g_str_has_prefix(qdict_get_str(err, "desc"), desc)) {
+        g_error("expected '%s', got '%s'", desc, qdict_get_str(err, "desc"));
+    }
+    qobject_unref(rsp);
+}
+
+/* These fail before anything that needs privileges is done */
+static void test_options(void)
+{
+    QTestState *qts = qtest_init("-machine none");
+
+    netdev_add_error(qts, "'ifname': 'qtest-noif'",
+                     "Cannot find interface 'qtest-noif'");
+
+    netdev_add_error(qts, "'ifname': 'lo', 'queues': 0",
+                     "Invalid number of queues (0) for 'lo'");
+    netdev_add_error(qts, "'ifname': 'lo', 'queues': 1025",
+                     "Invalid number of queues (1025) for 'lo'");
+    netdev_add_error(qts, "'ifname': 'lo', 'start-queue': -1",
+                     "Invalid start queue (-1) for 'lo'");
+
+    netdev_add_error(qts, "'ifname': 'lo', 'inhibit': true",
+                     "'inhibit=on' requires 'sock-fds' and vice versa");
+    netdev_add_error(qts, "'ifname': 'lo', 'sock-fds': '3'",
+                     "'inhibit=on' requires 'sock-fds' and vice versa");
+    netdev_add_error(qts, "'ifname': 'lo', 'inhibit': false, 'sock-fds': '3'",
+                     "'inhibit=on' requires 'sock-fds' and vice versa");
+
+    netdev_add_error(qts, "'ifname': 'lo', 'inhibit': true,"
+                     " 'sock-fds': '3:4'",
+                     "Expected 1 socket fds, got 2");
+    netdev_add_error(qts, "'ifname': 'lo', 'queues': 2, 'inhibit': true,"
+                     " 'sock-fds': '3'",
+                     "Expected 2 socket fds, got 1");
+    netdev_add_error(qts, "'ifname': 'lo', 'inhibit': true,"
+                     " 'sock-fds': 'nosuchfd'",
+                     "File descriptor named 'nosuchfd' has not been found");
+
+    qtest_quit(qts);
+}
+
+static bool run_ip(const char *args)
+{
+    g_autofree char *cmd = g_strdup_printf("ip %s", args);
+    int status;
+
+    return g_spawn_command_line_sync(cmd, NULL, NULL, &status, NULL) &&
+           g_spawn_check_exit_status(status, NULL);
+}
+
+static void fill_pkt(uint8_t *pkt, uint8_t seed)
+{
+    int i;
+
+    memset(pkt, 0xff, 6);
+    memcpy(pkt + 6, "\x52\x54\x00\x12\x34\x56", 6);
+    stw_be_p(pkt + 12, TEST_ETH_TYPE);
+    for (i = 14; i < TEST_PKT_LEN; i++) {
+        pkt[i] = seed + i;
+    }
+}
+
+/* Read from the socket backend until a test packet comes out */
+static void recv_stream_pkt(int fd, uint8_t *pkt)
+{
+    uint32_t len;
+
+    for (;;) {
+        g_assert_cmpint(recv(fd, &len, sizeof(len), MSG_WAITALL), ==,
+                        sizeof(len));
+        len = ntohl(len);
+        g_assert_cmpint(len, <=, 2048);
+        g_assert_cmpint(recv(fd, pkt, len, MSG_WAITALL), ==, len);
+        if (len >= 14 && lduw_be_p(pkt + 12) == TEST_ETH_TYPE) {
+            g_assert_cmpint(len, ==, TEST_PKT_LEN);
+            return;
+        }
+    }
+}
+
+/*
+ * Attach the backend to one end of a veth pair in skb mode, and connect it
+ * through a hub to a socket backend.  Packets written to the socket backend
+ * must come out of the other end of the veth pair, and the other way round.
+ */
+static void test_veth_round_trip(void)
+{
+    g_autofree char *veth0 = g_strdup_printf("qxdp%da", getpid());
+    g_autofree char *veth1 = g_strdup_printf("qxdp%db", getpid());
+    g_autofree char *args = NULL;
+    struct timeval tv = { .tv_sec = 5 };
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(TEST_ETH_TYPE),
+    };
+    uint8_t pkt[2048], expected[TEST_PKT_LEN];
+    uint32_t len = htonl(TEST_PKT_LEN);
+    QTestState *qts;
+    QDict *rsp;
+    int sv[2], pkt_fd;
+
+    args = g_strdup_printf("link add %s type veth peer name %s", veth0, veth1);
+    if (!run_ip(args)) {
+        g_test_skip("Creating a veth pair needs CAP_NET_ADMIN");
+        return;
+    }
+    g_free(args);
+    args = g_strdup_printf("link set %s up", veth0);
+    g_assert(run_ip(args));
+    g_free(args);
+    args = g_strdup_printf("link set %s up", veth1);
+    g_assert(run_ip(args));
+
+    sll.sll_ifindex = if_nametoindex(veth1);
+    g_assert(sll.sll_ifindex);
+    pkt_fd = socket(AF_PACKET, SOCK_RAW, htons(TEST_ETH_TYPE));
+    g_assert_cmpint(pkt_fd, >=, 0);
+    g_assert_cmpint(bind(pkt_fd, (struct sockaddr *)&sll, sizeof(sll)), ==, 0);
+    setsockopt(pkt_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    qts = qtest_initf("-machine none -netdev socket,id=s0,fd=%d "
+                      "-netdev hubport,id=p0,hubid=0,netdev=s0", sv[1]);
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'netdev_add', 'arguments': {"
+                    " 'type': 'af-xdp', 'id': 'xdp0', 'ifname': %s,"
+                    " 'mode': 'skb' } }", veth0);
+    if (qdict_haskey(rsp, "error")) {
+        g_test_skip(qdict_get_str(qdict_get_qdict(rsp, "error"), "desc"));
+        qobject_unref(rsp);
+        goto out;
+    }
+    qobject_unref(rsp);
+    qtest_qmp_assert_success(qts, "{ 'execute': 'netdev_add', 'arguments': {"
+                             " 'type': 'hubport', 'id': 'p1', 'hubid': 0,"
+                             " 'netdev': 'xdp0' } }");
+
+    /* socket backend -> af-xdp -> veth pair */
+    fill_pkt(expected, 0);
+    g_assert_cmpint(send(sv[0], &len, sizeof(len), 0), ==, sizeof(len));
+    g_assert_cmpint(send(sv[0], expected, TEST_PKT_LEN, 0), ==,
+                    TEST_PKT_LEN);
+    g_assert_cmpint(recv(pkt_fd, pkt, sizeof(pkt), 0), ==, TEST_PKT_LEN);
+    g_assert(!memcmp(pkt, expected, TEST_PKT_LEN));
+
+    /* veth pair -> af-xdp -> socket backend */
+    fill_pkt(expected, 0x80);
+    g_assert_cmpint(sendto(pkt_fd, expected, TEST_PKT_LEN, 0,
+                           (struct sockaddr *)&sll, sizeof(sll)), ==,
+                    TEST_PKT_LEN);
+    recv_stream_pkt(sv[0], pkt);
+    g_assert(!memcmp(pkt, expected, TEST_PKT_LEN));
+
+out:
+    qtest_quit(qts);
+    close(sv[0]);
+    close(sv[1]);
+    close(pkt_fd);
+    g_free(args);
+    args = g_strdup_printf("link del %s", veth0);
+    run_ip(args);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/netdev/af-xdp/options", test_options);
+    qtest_add_func("/netdev/af-xdp/veth-round-trip", test_veth_round_trip);
+
+    return g_test_run();
+}
@@ -15,6 +15,7 @@
 #include "libqos/libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -40,6 +41,8 @@ static bool uffd_feature_thread_id;
 #if defined(__linux__)
 #include <sys/syscall.h>
 #include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include "linux/kvm.h"
 #endif
 
 #if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
@@ -467,6 +470,10 @@ typedef struct {
     bool use_shmem;
     /* only launch the target process */
     bool only_target;
+    /* send the requested postcopy pages on their own channel */
+    bool postcopy_preempt;
+    /* send the background postcopy pages over multifd */
+    bool postcopy_multifd;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -653,6 +660,8 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
+    bool postcopy_preempt = args->postcopy_preempt;
+    bool postcopy_multifd = args->postcopy_multifd;
 
     if (test_migrate_start(&from, &to, uri, args)) {
         return -1;
@@ -662,6 +671,18 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
+    if (postcopy_multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -708,6 +729,34 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_multifd(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_multifd = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -1200,7 +1249,314 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+/* The dirty page rate limit needs the KVM dirty ring, with 4096 slots */
+static bool kvm_dirty_ring_supported(void)
+{
+#if defined(__linux__) && defined(HOST_X86_64)
+    int ret, kvm_fd = open("/dev/kvm", O_RDONLY);
+
+    if (kvm_fd < 0) {
+        return false;
+    }
+    ret = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING);
+    close(kvm_fd);
+    return ret >= 4096;
+#else
+    return false;
+#endif
+}
+
+/* Start an x86 guest with two vCPUs, the first of which dirties memory */
+static QTestState *dirty_guest_start(const char *accel)
+{
+    g_autofree char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
+    QTestState *who;
+
+    init_bootfile(bootpath, x86_bootsect, sizeof(x86_bootsect));
+    who = qtest_initf("%s -m 150M -smp 2 -serial file:%s/vm_serial "
+                      "-drive file=%s,format=raw",
+                      accel, tmpfs, bootpath);
+    wait_for_serial("vm_serial");
+    return who;
+}
+
+static void dirty_guest_end(QTestState *who)
+{
+    qtest_quit(who);
+    cleanup("bootsect");
+    cleanup("vm_serial");
+}
+
+static void check_qmp_error(QDict *rsp, const char *desc)
+{
+    g_assert(qdict_haskey(rsp, "error"));
+    g_assert_cmpstr(qdict_get_str(qdict_get_qdict(rsp, "error"), "desc"),
+                    ==, desc);
+    qobject_unref(rsp);
+}
+
+/*
+ * Return the query-vcpu-dirty-limit entry of @cpu_index, or NULL if it has
+ * no limit, and store the number of entries in @count.
+ */
+static QDict *query_vcpu_dirty_limit(QTestState *who, int64_t cpu_index,
+                                     int *count)
+{
+    QDict *rsp, *info, *found = NULL;
+    QListEntry *entry;
+
+    rsp = qtest_qmp(who, "{ 'execute': 'query-vcpu-dirty-limit' }");
+    g_assert(qdict_haskey(rsp, "return"));
+
+    *count = 0;
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(rsp, "return"), entry) {
+        info = qobject_to(QDict, qlist_entry_obj(entry));
+        g_assert(info);
+        g_assert(qdict_haskey(info, "current-rate"));
+        g_assert(qdict_haskey(info, "throttle-percentage"));
+        (*count)++;
+        if (qdict_get_int(info, "cpu-index") == cpu_index) {
+            g_assert(!found);
+            found = info;
+            qobject_ref(found);
+        }
+    }
+    qobject_unref(rsp);
+    return found;
+}
+
+static void test_vcpu_dirty_limit_no_dirty_ring(void)
+{
+    const char *desc = "Dirty page limit requires KVM with the "
+                       "dirty-ring-size accelerator property set";
+    QTestState *who;
+    int count;
+
+    who = qtest_init("-machine none");
+
+    check_qmp_error(qtest_qmp(who, "{ 'execute': 'set-vcpu-dirty-limit',"
+                              " 'arguments': { 'dirty-rate': 100 } }"),
+                    desc);
+    check_qmp_error(qtest_qmp(who, "{ 'execute': 'cancel-vcpu-dirty-limit' }"),
+                    desc);
+    g_assert(!query_vcpu_dirty_limit(who, 0, &count));
+    g_assert_cmpint(count, ==, 0);
+
+    qtest_quit(who);
+}
+
+static void test_vcpu_dirty_limit(void)
+{
+    const char *bad_index =
+        "Parameter 'cpu-index' expects an existing vCPU index";
+    QTestState *who;
+    QDict *info;
+    int64_t rate = 0, pct = 0;
+    int i, count;
+
+    if (!kvm_dirty_ring_supported()) {
+        g_test_skip("KVM dirty ring not available");
+        return;
+    }
+
+    who = dirty_guest_start("-accel kvm,dirty-ring-size=4096");
+
+    /* Argument validation */
+    check_qmp_error(qtest_qmp(who, "{ 'execute': 'set-vcpu-dirty-limit',"
+                              " 'arguments': { 'cpu-index': 2,"
+                              "                'dirty-rate': 100 } }"),
+                    bad_index);
+    check_qmp_error(qtest_qmp(who, "{ 'execute': 'set-vcpu-dirty-limit',"
+                              " 'arguments': { 'cpu-index': -1,"
+                              "                'dirty-rate': 100 } }"),
+                    bad_index);
+    check_qmp_error(qtest_qmp(who, "{ 'execute': 'cancel-vcpu-dirty-limit',"
+                              " 'arguments': { 'cpu-index': 2 } }"),
+                    bad_index);
+    check_qmp_error(qtest_qmp(who, "{ 'execute': 'set-vcpu-dirty-limit',"
+                              " 'arguments': { 'cpu-index': 0,"
+                              "                'dirty-rate': 0 } }"),
+                    "Parameter 'dirty-rate' expects a value greater than 0");
+    g_assert(!query_vcpu_dirty_limit(who, 0, &count));
+    g_assert_cmpint(count, ==, 0);
+
+    /*
+     * vCPU 0 dirties memory much faster than 1 MB/s, so it is measured
+     * and throttled within a few ticks of the once-a-second controller.
+     */
+    qtest_qmp_assert_success(who, "{ 'execute': 'set-vcpu-dirty-limit',"
+                             " 'arguments': { 'cpu-index': 0,"
+                             "                'dirty-rate': 1 } }");
+    for (i = 0; i < 100 && !(rate && pct); i++) {
+        g_usleep(100 * 1000);
+        info = query_vcpu_dirty_limit(who, 0, &count);
+        g_assert(info);
+        g_assert_cmpint(count, ==, 1);
+        g_assert_cmpint(qdict_get_int(info, "limit-rate"), ==, 1);
+        g_assert_cmpint(qdict_get_int(info, "throttle-percentage"), >=, 0);
+        g_assert_cmpint(qdict_get_int(info, "throttle-percentage"), <, 100);
+        rate = MAX(rate, qdict_get_int(info, "current-rate"));
+        pct = MAX(pct, qdict_get_int(info, "throttle-percentage"));
+        qobject_unref(info);
+    }
+    g_assert_cmpint(rate, >, 0);
+    g_assert_cmpint(pct, >, 0);
+
+    /* Without cpu-index, the limit applies to all vCPUs */
+    qtest_qmp_assert_success(who, "{ 'execute': 'set-vcpu-dirty-limit',"
+                             " 'arguments': { 'dirty-rate': 100 } }");
+    for (i = 0; i < 2; i++) {
+        info = query_vcpu_dirty_limit(who, i, &count);
+        g_assert(info);
+        g_assert_cmpint(count, ==, 2);
+        g_assert_cmpint(qdict_get_int(info, "limit-rate"), ==, 100);
+        qobject_unref(info);
+    }
+
+    qtest_qmp_assert_success(who, "{ 'execute': 'cancel-vcpu-dirty-limit',"
+                             " 'arguments': { 'cpu-index': 1 } }");
+    g_assert(!query_vcpu_dirty_limit(who, 1, &count));
+    g_assert_cmpint(count, ==, 1);
+
+    qtest_qmp_assert_success(who, "{ 'execute': 'cancel-vcpu-dirty-limit' }");
+    g_assert(!query_vcpu_dirty_limit(who, 0, &count));
+    g_assert_cmpint(count, ==, 0);
+
+    dirty_guest_end(who);
+}
+
+/* Wait for the calc-dirty-rate measurement and return its result */
+static QDict *wait_dirty_rate(QTestState *who, int64_t calc_time)
+{
+    QDict *rsp, *info;
+    int i;
+
+    for (i = 0; i < (calc_time + 10) * 10; i++) {
+        rsp = qtest_qmp(who, "{ 'execute': 'query-dirty-rate' }");
+        g_assert(qdict_haskey(rsp, "return"));
+        info = qdict_get_qdict(rsp, "return");
+        if (g_str_equal(qdict_get_str(info, "status"), "measured")) {
+            qobject_ref(info);
+            qobject_unref(rsp);
+            return info;
+        }
+        qobject_unref(rsp);
+        g_usleep(100 * 1000);
+    }
+    g_assert_not_reached();
+}
+
+static void test_dirty_rate_dirty_bitmap(void)
+{
+    QTestState *who;
+    QListEntry *entry;
+    QDict *info, *rate;
+    int64_t sum = 0, ram_rate = -1;
+
+    who = dirty_guest_start("-accel kvm -accel tcg");
+
+    check_qmp_error(qtest_qmp(who, "{ 'execute': 'calc-dirty-rate',"
+                              " 'arguments': { 'calc-time': 1,"
+                              "                'sample-pages': 512,"
+                              "                'mode': 'dirty-bitmap' } }"),
+                    "sample-pages is only valid in page-sampling mode.");
+
+    qtest_qmp_assert_success(who, "{ 'execute': 'calc-dirty-rate',"
+                             " 'arguments': { 'calc-time': 2,"
+                             "                'mode': 'dirty-bitmap' } }");
+    /* The measurement uses the migration dirty bitmap */
+    check_qmp_error(qtest_qmp(who, "{ 'execute': 'migrate',"
+                              " 'arguments': { 'uri': 'exec:cat' } }"),
+                    "The dirty page rate is being measured with the "
+                    "dirty bitmap");
+
+    info = wait_dirty_rate(who, 2);
+    g_assert_cmpstr(qdict_get_str(info, "mode"), ==, "dirty-bitmap");
+    g_assert_cmpint(qdict_get_int(info, "calc-time"), ==, 2);
+    g_assert_cmpint(qdict_get_int(info, "sample-pages"), ==, 0);
+    g_assert_cmpint(qdict_get_int(info, "dirty-rate"), >, 0);
+    g_assert(!qdict_haskey(info, "vcpu-dirty-rate"));
+
+    /* The guest dirties its RAM, and only that counts towards the total */
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(info, "ramblock-dirty-rate"), entry) {
+        rate = qobject_to(QDict, qlist_entry_obj(entry));
+        g_assert(rate);
+        g_assert_cmpint(qdict_get_int(rate, "dirty-rate"), >=, 0);
+        sum += qdict_get_int(rate, "dirty-rate");
+        if (g_str_equal(qdict_get_str(rate, "id"), "pc.ram")) {
+            ram_rate = qdict_get_int(rate, "dirty-rate");
+        }
+    }
+    g_assert_cmpint(ram_rate, >, 0);
+    g_assert_cmpint(sum, <=, qdict_get_int(info, "dirty-rate"));
+    qobject_unref(info);
+
+    /* The migration blocker is gone once the measurement is complete */
+    qtest_qmp_assert_success(who, "{ 'execute': 'calc-dirty-rate',"
+                             " 'arguments': { 'calc-time': 1,"
+                             "                'mode': 'dirty-bitmap' } }");
+    qobject_unref(wait_dirty_rate(who, 1));
+
+    dirty_guest_end(who);
+}
+
+static void test_dirty_rate_dirty_ring(void)
+{
+    QTestState *who;
+    QListEntry *entry;
+    QDict *info, *rate;
+    int64_t id = 0;
+
+    if (!kvm_dirty_ring_supported()) {
+        g_test_skip("KVM dirty ring not available");
+        return;
+    }
+
+    who = dirty_guest_start("-accel kvm,dirty-ring-size=4096");
+
+    qtest_qmp_assert_success(who, "{ 'execute': 'calc-dirty-rate',"
+                             " 'arguments': { 'calc-time': 1,"
+                             "                'mode': 'dirty-ring' } }");
+    info = wait_dirty_rate(who, 1);
+    g_assert_cmpstr(qdict_get_str(info, "mode"), ==, "dirty-ring");
+    g_assert_cmpint(qdict_get_int(info, "dirty-rate"), >, 0);
+    g_assert(!qdict_haskey(info, "ramblock-dirty-rate"));
+
+    /* Only vCPU 0 runs the boot sector, vCPU 1 waits for an INIT */
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(info, "vcpu-dirty-rate"), entry) {
+        rate = qobject_to(QDict, qlist_entry_obj(entry));
+        g_assert(rate);
+        g_assert_cmpint(qdict_get_int(rate, "id"), ==, id);
+        if (id == 0) {
+            g_assert_cmpint(qdict_get_int(rate, "dirty-rate"), >, 0);
+        }
+        id++;
+    }
+    g_assert_cmpint(id, ==, 2);
+    qobject_unref(info);
+
+    dirty_guest_end(who);
+}
+
+/*
+ * Report how fast the multifd channels went and how well the pages
+ * compressed, so that compression methods can be compared.
+ */
+static void report_multifd_stats(QTestState *who, const char *method)
+{
+    int64_t total_time = read_migrate_property_int(who, "total-time");
+    int64_t normal_bytes = read_ram_property_int(who, "normal-bytes");
+    int64_t multifd_bytes = read_ram_property_int(who, "multifd-bytes");
+
+    if (!total_time || !multifd_bytes) {
+        return;
+    }
+    g_test_message("multifd %s: %" PRId64 " bytes/sec, ratio %.2f", method,
+                   multifd_bytes * 1000 / total_time,
+                   (double)normal_bytes / multifd_bytes);
+}
+
+static void test_multifd_tcp(const char *method, bool zero_page)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -1230,6 +1586,11 @@ static void test_multifd_tcp(const char *method)
     migrate_set_capability(from, "multifd", true);
     migrate_set_capability(to, "multifd", true);
 
+    if (zero_page) {
+        migrate_set_capability(from, "multifd-zero-page", true);
+        migrate_set_capability(to, "multifd-zero-page", true);
+    }
+
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
                            "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
@@ -1253,23 +1614,36 @@ static void test_multifd_tcp(const char *method)
 
     wait_for_serial("dest_serial");
     wait_for_migration_complete(from);
+    report_multifd_stats(from, method);
     test_migrate_end(from, to, true);
 }
 
 static void test_multifd_tcp_none(void)
 {
-    test_multifd_tcp("none");
+    test_multifd_tcp("none", false);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp("none", true);
 }
 
 static void test_multifd_tcp_zlib(void)
 {
-    test_multifd_tcp("zlib");
+    test_multifd_tcp("zlib", false);
 }
 
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
-    test_multifd_tcp("zstd");
+    test_multifd_tcp("zstd", false);
+}
+#endif
+
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    test_multifd_tcp("lz4", false);
 }
 #endif
 
@@ -1417,6 +1791,8 @@ int main(int argc, char **argv)
     module_call_init(MODULE_INIT_QOM);
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/multifd", test_postcopy_multifd);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
@@ -1432,12 +1808,26 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
+    qtest_add_func("/migration/vcpu_dirty_limit/no_dirty_ring",
+                   test_vcpu_dirty_limit_no_dirty_ring);
+    if (g_str_equal(qtest_get_arch(), "x86_64")) {
+        qtest_add_func("/migration/vcpu_dirty_limit", test_vcpu_dirty_limit);
+        qtest_add_func("/migration/dirty_rate/dirty_bitmap",
+                       test_dirty_rate_dirty_bitmap);
+        qtest_add_func("/migration/dirty_rate/dirty_ring",
+                       test_dirty_rate_dirty_ring);
+    }
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/multifd/tcp/lz4", test_multifd_tcp_lz4);
+#endif
 
     ret = g_test_run();
 
@@ -717,6 +717,39 @@ static void pci_hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
     qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
 }
 
+static void pci_iothread_vq_mapping(void *obj, void *data,
+                                   QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev1 = obj;
+    QVirtioPCIDevice *dev;
+    QTestState *qts = dev1->pdev->bus->qts;
+    QDict *resp;
+
+    /* virtqueue 3 isn't assigned */
+    resp = qtest_qmp(qts, "{'execute': 'device_add', 'arguments': {"
+                     " 'driver': 'virtio-blk-pci', 'id': 'drv1',"
+                     " 'drive': 'drive1', 'num-queues': 4,"
+                     " 'iothread-vq-mapping': 'iothread0@0-1:iothread1@2' }}");
+    g_assert(qdict_haskey(resp, "error"));
+    qobject_unref(resp);
+
+    /* plug secondary disk with its virtqueues spread over both IOThreads */
+    qtest_qmp_device_add(qts, "virtio-blk-pci", "drv1",
+                         "{'addr': %s, 'drive': 'drive1', 'num-queues': 4,"
+                         " 'iothread-vq-mapping': 'iothread0:iothread1'}",
+                         stringify(PCI_SLOT_HP) ".0");
+
+    dev = virtio_pci_new(dev1->pdev->bus,
+                         &(QPCIAddress) { .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0) });
+    g_assert_nonnull(dev);
+    g_assert_cmpint(dev->vdev.device_type, ==, VIRTIO_ID_BLOCK);
+    qvirtio_pci_device_disable(dev);
+    qos_object_destroy((QOSGraphObject *)dev);
+
+    /* unplug secondary disk */
+    qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
+}
+
 /*
  * Check that setting the vring addr on a non-existent virtqueue does
  * not crash.
@@ -780,6 +813,13 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_iothread_test_setup(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line, " -object iothread,id=iothread0"
+                              " -object iothread,id=iothread1 ");
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -797,6 +837,10 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.before = virtio_blk_iothread_test_setup;
+    qos_add_test("iothread-vq-mapping", "virtio-blk-pci",
+                 pci_iothread_vq_mapping, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
@@ -17,10 +17,23 @@
 #include "libqos/qgraph.h"
 #include "libqos/virtio-net.h"
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include "net/eth.h"
+#include "net/tap-linux.h"
+#endif
+
 #ifndef ETH_P_RARP
 #define ETH_P_RARP 0x8035
 #endif
 
+#ifndef ETH_P_ALL
+#define ETH_P_ALL 0x0003
+#endif
+
 #define PCI_SLOT_HP             0x06
 #define PCI_SLOT                0x04
 
@@ -166,6 +179,921 @@ static void stop_cont_test(void *obj, void *data, QGuestAllocator *t_alloc)
     rx_stop_cont_test(dev, t_alloc, rx, sv[0]);
 }
 
+#define TX_BATCH_PKTS       48
+#define TX_BATCH_PKT_SIZE   1001
+#define TX_BATCH_LARGE_PKTS 8
+#define TX_BATCH_LARGE_SIZE 20000
+#define TX_BATCH_SNDBUF     4096
+
+/*
+ * Descriptors of packets that the guest transmits in one go; see
+ * tx_batch_post().
+ */
+typedef struct TxBatch {
+    QVirtQueue *vq;
+    uint64_t addr;
+    size_t size;
+    int count;
+    int used;
+    uint32_t heads[TX_BATCH_PKTS];
+} TxBatch;
+
+/*
+ * Make @count packets of @size bytes available on the TX queue while the
+ * VM is stopped, so that virtio-net pops them all in one flush and sends
+ * them as one batch.  Each packet starts with its index.
+ */
+static void tx_batch_post(QVirtioDevice *dev, QGuestAllocator *alloc,
+                          TxBatch *b, QVirtQueue *vq, int count, size_t size)
+{
+    QTestState *qts = global_qtest;
+    size_t buf_size = VNET_HDR_SIZE + size;
+    g_autofree uint8_t *buf = g_malloc0(buf_size);
+    uint32_t seq;
+    QDict *rsp;
+    int i;
+    size_t j;
+
+    g_assert_cmpint(count, <=, TX_BATCH_PKTS);
+    b->vq = vq;
+    b->addr = guest_alloc(alloc, count * buf_size);
+    b->size = size;
+    b->count = count;
+    b->used = 0;
+
+    rsp = qmp("{ 'execute' : 'stop'}");
+    qobject_unref(rsp);
+
+    for (i = 0; i < count; i++) {
+        seq = htonl(i);
+        memcpy(buf + VNET_HDR_SIZE, &seq, sizeof(seq));
+        for (j = sizeof(seq); j < size; j++) {
+            buf[VNET_HDR_SIZE + j] = i + j;
+        }
+        memwrite(b->addr + i * buf_size, buf, buf_size);
+        b->heads[i] = qvirtqueue_add(qts, vq, b->addr + i * buf_size,
+                                     buf_size, false, false);
+        qvirtqueue_kick(qts, dev, vq, b->heads[i]);
+    }
+
+    rsp = qmp("{ 'execute' : 'cont'}");
+    qobject_unref(rsp);
+}
+
+/*
+ * Collect the used elements of the batch that show up within @timeout_us,
+ * checking that they come in the order the packets were posted.
+ */
+static void tx_batch_get_used(TxBatch *b, gint64 timeout_us)
+{
+    QTestState *qts = global_qtest;
+    gint64 end = g_get_monotonic_time() + timeout_us;
+    uint32_t desc_idx;
+
+    while (b->used < b->count && g_get_monotonic_time() < end) {
+        if (qvirtqueue_get_buf(qts, b->vq, &desc_idx, NULL)) {
+            g_assert_cmpint(desc_idx, ==, b->heads[b->used]);
+            b->used++;
+        } else {
+            g_usleep(1000);
+        }
+    }
+}
+
+/*
+ * Wait until the socket backend stops taking packets because nobody reads
+ * the other end, and check that it did so in the middle of the batch.
+ */
+static void tx_batch_wait_stall(TxBatch *b)
+{
+    int used;
+
+    tx_batch_get_used(b, QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(b->used, >, 0);
+    do {
+        used = b->used;
+        tx_batch_get_used(b, 100 * 1000);
+    } while (b->used != used);
+
+    g_assert_cmpint(b->used, <, b->count);
+}
+
+static void tx_batch_read(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len) {
+        ret = qemu_recv(fd, p, len, 0);
+        g_assert_cmpint(ret, >, 0);
+        p += ret;
+        len -= ret;
+    }
+}
+
+/* Read the packets of the batch from the socket and check their contents */
+static void tx_batch_recv(TxBatch *b, int fd)
+{
+    g_autofree uint8_t *buf = g_malloc(b->size);
+    uint32_t len, seq;
+    int i;
+    size_t j;
+
+    for (i = 0; i < b->count; i++) {
+        tx_batch_read(fd, &len, sizeof(len));
+        g_assert_cmpint(ntohl(len), ==, b->size);
+        tx_batch_read(fd, buf, b->size);
+
+        memcpy(&seq, buf, sizeof(seq));
+        g_assert_cmpint(ntohl(seq), ==, i);
+        for (j = sizeof(seq); j < b->size; j++) {
+            g_assert_cmpint(buf[j], ==, (uint8_t)(i + j));
+        }
+    }
+}
+
+/*
+ * Read whatever QEMU still writes to the socket.  Frames can be cut short
+ * when their queued packet is dropped, so the data is not checked.
+ */
+static void tx_batch_drain(int fd)
+{
+    char buf[4096];
+    gint64 last = g_get_monotonic_time();
+    ssize_t ret;
+
+    while (g_get_monotonic_time() - last < 200 * 1000) {
+        ret = qemu_recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (ret > 0) {
+            last = g_get_monotonic_time();
+        } else {
+            g_assert(ret == -1 && errno == EAGAIN);
+            g_usleep(1000);
+        }
+    }
+}
+
+static void tx_batch_check_running(void)
+{
+    QDict *rsp;
+
+    rsp = qmp("{ 'execute' : 'query-status'}");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+}
+
+/*
+ * The socket backend fills up in the middle of the batch: the packet that
+ * it cannot take is queued and the ones after it stay in the batch.  They
+ * are sent from virtio_net_tx_complete() once the socket has room again,
+ * and all packets and used elements come in order.
+ */
+static void tx_batch_resume(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    TxBatch b;
+    int *sv = data;
+
+    tx_batch_post(net_if->vdev, t_alloc, &b, net_if->queues[1],
+                  TX_BATCH_PKTS, TX_BATCH_PKT_SIZE);
+    tx_batch_wait_stall(&b);
+
+    tx_batch_recv(&b, sv[0]);
+    tx_batch_get_used(&b, QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(b.used, ==, b.count);
+
+    guest_free(t_alloc, b.addr);
+}
+
+/*
+ * Each packet is larger than the socket buffer, so every writev of the
+ * batch ends in the middle of a packet.  net_socket_receive() continues
+ * such a packet from send_index without breaking the stream framing.
+ * Nothing can complete before the test reads from the socket.
+ */
+static void tx_batch_partial(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    TxBatch b;
+    int *sv = data;
+
+    tx_batch_post(net_if->vdev, t_alloc, &b, net_if->queues[1],
+                  TX_BATCH_LARGE_PKTS, TX_BATCH_LARGE_SIZE);
+    tx_batch_get_used(&b, 100 * 1000);
+    g_assert_cmpint(b.used, ==, 0);
+
+    tx_batch_recv(&b, sv[0]);
+    tx_batch_get_used(&b, QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(b.used, ==, b.count);
+
+    guest_free(t_alloc, b.addr);
+}
+
+/* A device reset drops the packets that are held in the batch */
+static void tx_batch_reset(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    TxBatch b;
+    int *sv = data;
+
+    tx_batch_post(net_if->vdev, t_alloc, &b, net_if->queues[1],
+                  TX_BATCH_PKTS, TX_BATCH_PKT_SIZE);
+    tx_batch_wait_stall(&b);
+
+    qvirtio_reset(net_if->vdev);
+    tx_batch_drain(sv[0]);
+    tx_batch_check_running();
+
+    guest_free(t_alloc, b.addr);
+}
+
+/*
+ * Unplugging the device deletes its queues while packets are held in the
+ * batch; none of them may be sent from the deleted queue afterwards.
+ */
+static void tx_batch_unplug(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNetPCI *dev = obj;
+    QVirtioNet *net_if = &dev->net;
+    QTestState *qts = dev->pci_vdev.pdev->bus->qts;
+    const char *arch = qtest_get_arch();
+    TxBatch b;
+    int *sv = data;
+
+    if (strcmp(arch, "i386") && strcmp(arch, "x86_64")) {
+        g_test_skip("ACPI PCI hot-unplug is only available on x86");
+        return;
+    }
+
+    tx_batch_post(net_if->vdev, t_alloc, &b, net_if->queues[1],
+                  TX_BATCH_PKTS, TX_BATCH_PKT_SIZE);
+    tx_batch_wait_stall(&b);
+
+    qpci_unplug_acpi_device_test(qts, "net0", PCI_SLOT);
+    tx_batch_drain(sv[0]);
+    tx_batch_check_running();
+
+    guest_free(t_alloc, b.addr);
+}
+
+#ifdef __linux__
+
+#define RX_GRO_MSS          1000
+#define RX_GRO_SEQ          0x10000
+#define RX_GRO_SPORT        40000
+#define RX_GRO_DPORT        5001
+#define RX_GRO_MAX_FLOWS    64
+#define RX_GRO_NUM_BUFS     16
+#define RX_GRO_BUF_SIZE     4096
+#define RX_GRO_NUM_FDS      3
+
+typedef struct RxGroHdrs {
+    struct eth_header eth;
+    struct ip_header ip;
+    struct tcp_header tcp;
+} QEMU_PACKED RxGroHdrs;
+
+/* A packet as the guest receives it */
+typedef struct RxGroPacket {
+    struct virtio_net_hdr_mrg_rxbuf vnet;
+    RxGroHdrs hdrs;
+    uint8_t payload[RX_GRO_BUF_SIZE];
+} QEMU_PACKED RxGroPacket;
+
+typedef struct RxGroQueue {
+    QVirtQueue *vq;
+    uint64_t addr;
+    uint32_t heads[RX_GRO_NUM_BUFS];
+} RxGroQueue;
+
+static uint16_t rx_gro_csum(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < len; i += 2) {
+        sum += (p[i] << 8) | p[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/*
+ * Runs in a child process, which can enter new user and network namespaces
+ * even if qos-test has threads.  There no privileges are needed to create
+ * a tap device with a virtio-net header and bring it up.  The tap device,
+ * a packet socket that transmits on it and a packet socket that receives
+ * all of its traffic are sent back through @sock; the namespaces live as
+ * long as they are open.
+ */
+static void rx_gro_create_tap(int sock)
+{
+    struct ifreq ifr = {
+        .ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR,
+    };
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+    };
+    char control[CMSG_SPACE(RX_GRO_NUM_FDS * sizeof(int))] = {};
+    char c = 0;
+    struct iovec iov = {
+        .iov_base = &c,
+        .iov_len = 1,
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    int fds[RX_GRO_NUM_FDS], s, one = 1;
+
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNET) < 0) {
+        return;
+    }
+
+    fds[0] = open("/dev/net/tun", O_RDWR);
+    if (fds[0] < 0 || ioctl(fds[0], TUNSETIFF, &ifr) < 0) {
+        return;
+    }
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0 || ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
+        return;
+    }
+    sll.sll_ifindex = ifr.ifr_ifindex;
+    ifr.ifr_flags = IFF_UP;
+    if (ioctl(s, SIOCSIFFLAGS, &ifr) < 0) {
+        return;
+    }
+
+    fds[1] = socket(AF_PACKET, SOCK_RAW, 0);
+    if (fds[1] < 0 ||
+        setsockopt(fds[1], SOL_PACKET, PACKET_VNET_HDR,
+                   &one, sizeof(one)) < 0 ||
+        bind(fds[1], (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        return;
+    }
+
+    sll.sll_protocol = htons(ETH_P_ALL);
+    fds[2] = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fds[2] < 0 ||
+        setsockopt(fds[2], SOL_PACKET, PACKET_VNET_HDR,
+                   &one, sizeof(one)) < 0 ||
+        bind(fds[2], (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        return;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    sendmsg(sock, &msg, 0);
+}
+
+/*
+ * Open a tap device for QEMU in fds[0], in fds[1] a packet socket whose
+ * packets QEMU reads from the tap device, and in fds[2] a packet socket
+ * that receives the packets QEMU writes to it.  Return false if that is
+ * not possible, e.g. because user namespaces are disabled.
+ */
+static bool rx_gro_open_tap(int *fds)
+{
+    char control[CMSG_SPACE(RX_GRO_NUM_FDS * sizeof(int))];
+    char c;
+    struct iovec iov = {
+        .iov_base = &c,
+        .iov_len = 1,
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+    pid_t pid;
+    int sv[2];
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    pid = fork();
+    g_assert_cmpint(pid, !=, -1);
+    if (pid == 0) {
+        close(sv[0]);
+        rx_gro_create_tap(sv[1]);
+        _exit(0);
+    }
+
+    close(sv[1]);
+    do {
+        ret = recvmsg(sv[0], &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+    close(sv[0]);
+    waitpid(pid, NULL, 0);
+
+    if (ret != 1) {
+        return false;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    g_assert(cmsg && cmsg->cmsg_type == SCM_RIGHTS);
+    memcpy(fds, CMSG_DATA(cmsg), RX_GRO_NUM_FDS * sizeof(int));
+    return true;
+}
+
+/*
+ * Transmit on the tap device a segment of @len bytes at @seq of flow
+ * @flow.  With @csum the TCP checksum is left for the device to compute,
+ * which the backend passes to QEMU as NEEDS_CSUM; otherwise it is not
+ * verified.
+ */
+static void rx_gro_send(int fd, int flow, uint32_t seq, size_t len,
+                        bool csum)
+{
+    struct {
+        struct virtio_net_hdr vnet;
+        RxGroHdrs hdrs;
+        uint8_t payload[RX_GRO_MSS];
+    } QEMU_PACKED pkt = {
+        .hdrs.eth = {
+            .h_dest = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 },
+            .h_source = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x57 },
+            .h_proto = htons(ETH_P_IP),
+        },
+        .hdrs.ip = {
+            .ip_ver_len = (IP_HEADER_VERSION_4 << 4) |
+                          (sizeof(struct ip_header) >> 2),
+            .ip_len = htons(sizeof(struct ip_header) +
+                            sizeof(struct tcp_header) + len),
+            .ip_off = htons(IP_DF),
+            .ip_ttl = 64,
+            .ip_p = IP_PROTO_TCP,
+            .ip_src = htonl(0x0a000202),
+            .ip_dst = htonl(0x0a00020f),
+        },
+        .hdrs.tcp = {
+            .th_sport = htons(RX_GRO_SPORT + flow),
+            .th_dport = htons(RX_GRO_DPORT),
+            .th_seq = htonl(seq),
+            .th_ack = htonl(1),
+            .th_offset_flags = htons((sizeof(struct tcp_header) << 10) |
+                                     TH_ACK),
+            .th_win = htons(1024),
+        },
+    };
+    size_t size = offsetof(typeof(pkt), payload) + len;
+    size_t i;
+
+    g_assert_cmpint(len, <=, RX_GRO_MSS);
+    if (csum) {
+        pkt.vnet.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        pkt.vnet.csum_start = offsetof(RxGroHdrs, tcp);
+        pkt.vnet.csum_offset = offsetof(struct tcp_header, th_sum);
+    }
+    pkt.hdrs.ip.ip_sum = htons(rx_gro_csum(&pkt.hdrs.ip,
+                                           sizeof(pkt.hdrs.ip)));
+    for (i = 0; i < len; i++) {
+        pkt.payload[i] = seq + i;
+    }
+
+    g_assert_cmpint(write(fd, &pkt, size), ==, size);
+}
+
+static void rx_gro_add_bufs(QVirtioDevice *dev, QGuestAllocator *alloc,
+                            RxGroQueue *rx)
+{
+    QTestState *qts = global_qtest;
+    int i;
+
+    rx->addr = guest_alloc(alloc, RX_GRO_NUM_BUFS * RX_GRO_BUF_SIZE);
+    for (i = 0; i < RX_GRO_NUM_BUFS; i++) {
+        rx->heads[i] = qvirtqueue_add(qts, rx->vq,
+                                      rx->addr + i * RX_GRO_BUF_SIZE,
+                                      RX_GRO_BUF_SIZE, true, false);
+        qvirtqueue_kick(qts, dev, rx->vq, rx->heads[i]);
+    }
+}
+
+/*
+ * Wait for the next IPv4 packet and return the length of its payload.
+ * Bringing up the tap device makes the host send some IPv6 packets first.
+ */
+static size_t rx_gro_recv(RxGroQueue *rx, RxGroPacket *pkt)
+{
+    QTestState *qts = global_qtest;
+    gint64 start_time = g_get_monotonic_time();
+    uint32_t desc_idx, len;
+    int i;
+
+    for (;;) {
+        /* Several packets can be used before the guest is notified */
+        while (!qvirtqueue_get_buf(qts, rx->vq, &desc_idx, &len)) {
+            g_assert(g_get_monotonic_time() - start_time <=
+                     QVIRTIO_NET_TIMEOUT_US);
+            qtest_clock_step(qts, 100);
+        }
+
+        for (i = 0; i < RX_GRO_NUM_BUFS; i++) {
+            if (rx->heads[i] == desc_idx) {
+                break;
+            }
+        }
+        g_assert_cmpint(i, <, RX_GRO_NUM_BUFS);
+        g_assert_cmpint(len, >=, offsetof(RxGroPacket, hdrs.ip));
+        g_assert_cmpint(len, <=, sizeof(*pkt));
+
+        memread(rx->addr + i * RX_GRO_BUF_SIZE, pkt, len);
+        if (pkt->hdrs.eth.h_proto == htons(ETH_P_IP)) {
+            g_assert_cmpint(le16_to_cpu(pkt->vnet.num_buffers), ==, 1);
+            return len - offsetof(RxGroPacket, payload);
+        }
+    }
+}
+
+static QDict *rx_gro_get_stats(void)
+{
+    QDict *rsp, *stats;
+
+    rsp = qmp("{ 'execute': 'qom-get', 'arguments': {"
+              " 'path': '/machine/peripheral/net0/virtio-backend',"
+              " 'property': 'rx-gro-stats' } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    stats = qdict_get_qdict(rsp, "return");
+    qobject_ref(stats);
+    qobject_unref(rsp);
+    return stats;
+}
+
+/*
+ * The guest can only negotiate TSO if the backend passes the virtio-net
+ * header through, which needs the tap device.  With VIRTIO_F_VERSION_1
+ * the header is little endian and has num_buffers.
+ */
+static bool rx_gro_check_features(QVirtioDevice *dev, int *fds,
+                                  uint64_t features)
+{
+    features |= (1ull << VIRTIO_F_VERSION_1) |
+                (1ull << VIRTIO_NET_F_GUEST_TSO4);
+
+    if (fds[0] < 0) {
+        g_test_skip("Cannot create a tap device");
+        return false;
+    }
+    if ((dev->features & features) != features) {
+        g_test_skip("Receive coalescing not negotiated");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Segments that QEMU reads from the tap device in one batch are merged
+ * into a single TSO packet, which is delivered at the end of the batch.
+ */
+static void rx_gro_coalesce(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    RxGroQueue rx = { .vq = net_if->queues[0] };
+    RxGroPacket pkt;
+    int *fds = data;
+    QDict *rsp, *stats;
+    size_t len, i;
+
+    if (!rx_gro_check_features(net_if->vdev, fds, 0)) {
+        return;
+    }
+    rx_gro_add_bufs(net_if->vdev, t_alloc, &rx);
+
+    /* Queue the segments on the tap device, so that they form one batch */
+    rsp = qmp("{ 'execute' : 'stop'}");
+    qobject_unref(rsp);
+    rx_gro_send(fds[1], 0, RX_GRO_SEQ, RX_GRO_MSS, true);
+    rx_gro_send(fds[1], 0, RX_GRO_SEQ + RX_GRO_MSS, RX_GRO_MSS, true);
+    rx_gro_send(fds[1], 0, RX_GRO_SEQ + 2 * RX_GRO_MSS, RX_GRO_MSS / 2,
+                true);
+    rsp = qmp("{ 'execute' : 'query-status'}");
+    qobject_unref(rsp);
+    rsp = qmp("{ 'execute' : 'cont'}");
+    qobject_unref(rsp);
+
+    len = rx_gro_recv(&rx, &pkt);
+    g_assert_cmpint(len, ==, 2 * RX_GRO_MSS + RX_GRO_MSS / 2);
+    g_assert_cmpint(ntohl(pkt.hdrs.tcp.th_seq), ==, RX_GRO_SEQ);
+    g_assert_cmpint(ntohs(pkt.hdrs.ip.ip_len), ==,
+                    sizeof(struct ip_header) + sizeof(struct tcp_header) +
+                    len);
+    g_assert_cmpint(rx_gro_csum(&pkt.hdrs.ip, sizeof(pkt.hdrs.ip)), ==, 0);
+    for (i = 0; i < len; i++) {
+        g_assert_cmpint(pkt.payload[i], ==, (uint8_t)(RX_GRO_SEQ + i));
+    }
+
+    g_assert_cmpint(pkt.vnet.hdr.flags, ==, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+    g_assert_cmpint(pkt.vnet.hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert_cmpint(le16_to_cpu(pkt.vnet.hdr.gso_size), ==, RX_GRO_MSS);
+    g_assert_cmpint(le16_to_cpu(pkt.vnet.hdr.hdr_len), ==,
+                    sizeof(RxGroHdrs));
+    g_assert_cmpint(le16_to_cpu(pkt.vnet.hdr.csum_start), ==,
+                    offsetof(RxGroHdrs, tcp));
+    g_assert_cmpint(le16_to_cpu(pkt.vnet.hdr.csum_offset), ==,
+                    offsetof(struct tcp_header, th_sum));
+
+    /* rsc_interval is too long for the timer to have delivered it */
+    stats = rx_gro_get_stats();
+    g_assert_cmpint(qdict_get_int(stats, "coalesced"), ==, 2);
+    g_assert_cmpint(qdict_get_int(stats, "flows"), ==, 0);
+    g_assert_cmpint(qdict_get_int(stats, "timer-flushes"), ==, 0);
+    qobject_unref(stats);
+
+    guest_free(t_alloc, rx.addr);
+}
+
+/*
+ * A segment whose checksum was not verified is not merged, and makes the
+ * held back segment of its flow be delivered unchanged before it.
+ */
+static void rx_gro_csum_check(void *obj, void *data,
+                              QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    RxGroQueue rx = { .vq = net_if->queues[0] };
+    RxGroPacket pkt;
+    int *fds = data;
+    QDict *stats;
+
+    if (!rx_gro_check_features(net_if->vdev, fds, 0)) {
+        return;
+    }
+    rx_gro_add_bufs(net_if->vdev, t_alloc, &rx);
+
+    rx_gro_send(fds[1], 0, RX_GRO_SEQ, RX_GRO_MSS, true);
+    rx_gro_send(fds[1], 0, RX_GRO_SEQ + RX_GRO_MSS, RX_GRO_MSS, false);
+
+    g_assert_cmpint(rx_gro_recv(&rx, &pkt), ==, RX_GRO_MSS);
+    g_assert_cmpint(ntohl(pkt.hdrs.tcp.th_seq), ==, RX_GRO_SEQ);
+    g_assert_cmpint(pkt.vnet.hdr.flags, ==, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+    g_assert_cmpint(pkt.vnet.hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_NONE);
+
+    g_assert_cmpint(rx_gro_recv(&rx, &pkt), ==, RX_GRO_MSS);
+    g_assert_cmpint(ntohl(pkt.hdrs.tcp.th_seq), ==, RX_GRO_SEQ + RX_GRO_MSS);
+    g_assert_cmpint(pkt.vnet.hdr.flags, ==, 0);
+    g_assert_cmpint(pkt.vnet.hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_NONE);
+
+    stats = rx_gro_get_stats();
+    g_assert_cmpint(qdict_get_int(stats, "coalesced"), ==, 0);
+    g_assert_cmpint(qdict_get_int(stats, "flows"), ==, 0);
+    qobject_unref(stats);
+
+    guest_free(t_alloc, rx.addr);
+}
+
+/*
+ * With rx_gro, the end of each batch from the tap device delivers the held
+ * back packets before it can hold more than RX_GRO_MAX_FLOWS of them.  The
+ * RSC_EXT format holds them until the rsc_interval timer, so it is used to
+ * check that a new flow makes the oldest held back packet be delivered.
+ */
+static void rx_gro_flow_limit(void *obj, void *data,
+                              QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    RxGroQueue rx = { .vq = net_if->queues[0] };
+    RxGroPacket pkt;
+    int *fds = data;
+    QDict *stats;
+    int i;
+
+    if (!rx_gro_check_features(net_if->vdev, fds,
+                               1ull << VIRTIO_NET_F_RSC_EXT)) {
+        return;
+    }
+    rx_gro_add_bufs(net_if->vdev, t_alloc, &rx);
+
+    for (i = 0; i <= RX_GRO_MAX_FLOWS; i++) {
+        rx_gro_send(fds[1], i, RX_GRO_SEQ, RX_GRO_MSS, true);
+    }
+
+    g_assert_cmpint(rx_gro_recv(&rx, &pkt), ==, RX_GRO_MSS);
+    g_assert_cmpint(ntohs(pkt.hdrs.tcp.th_sport), ==, RX_GRO_SPORT);
+    g_assert_cmpint(pkt.vnet.hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_NONE);
+
+    stats = rx_gro_get_stats();
+    g_assert_cmpint(qdict_get_int(stats, "evicted"), ==, 1);
+    g_assert_cmpint(qdict_get_int(stats, "max-flows"), ==, RX_GRO_MAX_FLOWS);
+    qobject_unref(stats);
+
+    guest_free(t_alloc, rx.addr);
+}
+
+#define TX_GSO_PKTS 16
+
+/* Every other packet is a TSO packet of three segments */
+static size_t tx_gso_payload_len(int i)
+{
+    return i % 2 ? 3 * RX_GRO_MSS : RX_GRO_MSS / 4;
+}
+
+/* The virtio-net header is in guest endianness before VIRTIO 1.0 */
+static uint16_t tx_gso_virtio16(QVirtioDevice *dev, uint16_t val)
+{
+    if ((dev->features & (1ull << VIRTIO_F_VERSION_1)) ||
+        !qtest_big_endian(global_qtest)) {
+        return cpu_to_le16(val);
+    }
+    return cpu_to_be16(val);
+}
+
+/*
+ * Write packet @i, with its virtio-net header of @hdr_len bytes, to
+ * @addr.  The TCP sequence number is the index of the packet.
+ */
+static size_t tx_gso_write_pkt(QVirtioDevice *dev, uint64_t addr,
+                               size_t hdr_len, int i)
+{
+    size_t len = tx_gso_payload_len(i);
+    struct {
+        struct virtio_net_hdr_mrg_rxbuf vnet;
+        RxGroHdrs hdrs;
+        uint8_t payload[3 * RX_GRO_MSS];
+    } QEMU_PACKED pkt = {
+        .hdrs.eth = {
+            .h_dest = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x57 },
+            .h_source = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 },
+            .h_proto = htons(ETH_P_IP),
+        },
+        .hdrs.ip = {
+            .ip_ver_len = (IP_HEADER_VERSION_4 << 4) |
+                          (sizeof(struct ip_header) >> 2),
+            .ip_len = htons(sizeof(struct ip_header) +
+                            sizeof(struct tcp_header) + len),
+            .ip_off = htons(IP_DF),
+            .ip_ttl = 64,
+            .ip_p = IP_PROTO_TCP,
+            .ip_src = htonl(0x0a00020f),
+            .ip_dst = htonl(0x0a000202),
+        },
+        .hdrs.tcp = {
+            .th_sport = htons(RX_GRO_DPORT),
+            .th_dport = htons(RX_GRO_SPORT),
+            .th_seq = htonl(i),
+            .th_ack = htonl(1),
+            .th_offset_flags = htons((sizeof(struct tcp_header) << 10) |
+                                     TH_ACK),
+            .th_win = htons(1024),
+        },
+    };
+    size_t j;
+
+    pkt.vnet.hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    pkt.vnet.hdr.csum_start = tx_gso_virtio16(dev, offsetof(RxGroHdrs, tcp));
+    pkt.vnet.hdr.csum_offset =
+        tx_gso_virtio16(dev, offsetof(struct tcp_header, th_sum));
+    if (len > RX_GRO_MSS) {
+        pkt.vnet.hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        pkt.vnet.hdr.gso_size = tx_gso_virtio16(dev, RX_GRO_MSS);
+        pkt.vnet.hdr.hdr_len = tx_gso_virtio16(dev, sizeof(RxGroHdrs));
+    }
+    pkt.hdrs.ip.ip_sum = htons(rx_gro_csum(&pkt.hdrs.ip,
+                                           sizeof(pkt.hdrs.ip)));
+    for (j = 0; j < len; j++) {
+        pkt.payload[j] = i + j;
+    }
+
+    /* Without VIRTIO 1.0 or mergeable buffers, num_buffers is not there */
+    memwrite(addr, &pkt, hdr_len);
+    memwrite(addr + hdr_len, &pkt.hdrs, sizeof(pkt.hdrs) + len);
+    return hdr_len + sizeof(pkt.hdrs) + len;
+}
+
+/*
+ * Receive the next packet that QEMU wrote to the tap device.  Bringing up
+ * the tap device makes the host send some IPv6 packets, which are skipped.
+ */
+static size_t tx_gso_recv(int fd, uint8_t *buf, size_t size)
+{
+    gint64 start_time = g_get_monotonic_time();
+    struct sockaddr_ll sll;
+    socklen_t sll_len;
+    struct virtio_net_hdr *vnet = (struct virtio_net_hdr *)buf;
+    RxGroHdrs *hdrs = (RxGroHdrs *)(buf + sizeof(*vnet));
+    ssize_t ret;
+
+    for (;;) {
+        sll_len = sizeof(sll);
+        ret = recvfrom(fd, buf, size, MSG_DONTWAIT,
+                       (struct sockaddr *)&sll, &sll_len);
+        if (ret < 0) {
+            g_assert_cmpint(errno, ==, EAGAIN);
+            g_assert(g_get_monotonic_time() - start_time <=
+                     QVIRTIO_NET_TIMEOUT_US);
+            g_usleep(1000);
+            continue;
+        }
+        if (sll.sll_pkttype != PACKET_OUTGOING &&
+            ret >= sizeof(*vnet) + sizeof(*hdrs) &&
+            hdrs->eth.h_proto == htons(ETH_P_IP)) {
+            return ret - sizeof(*vnet) - sizeof(*hdrs);
+        }
+    }
+}
+
+/*
+ * When the backend takes the guest's virtio-net header, the TX batch passes
+ * the packets through unchanged: TSO packets reach the tap device in one
+ * piece, with their GSO and checksum fields, in the order of the TX queue.
+ */
+static void tx_gso_passthrough(void *obj, void *data,
+                               QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *vq = net_if->queues[1];
+    QTestState *qts = global_qtest;
+    uint64_t features = (1ull << VIRTIO_NET_F_CSUM) |
+                        (1ull << VIRTIO_NET_F_HOST_TSO4);
+    size_t hdr_len, buf_size = 4 * RX_GRO_BUF_SIZE;
+    uint32_t heads[TX_GSO_PKTS], desc_idx;
+    g_autofree uint8_t *buf = g_malloc(buf_size);
+    struct virtio_net_hdr *vnet = (struct virtio_net_hdr *)buf;
+    RxGroHdrs *hdrs = (RxGroHdrs *)(buf + sizeof(*vnet));
+    uint8_t *payload = (uint8_t *)(hdrs + 1);
+    gint64 start_time;
+    uint64_t addr;
+    int *fds = data;
+    QDict *rsp;
+    size_t len, j;
+    int i;
+
+    if (fds[0] < 0) {
+        g_test_skip("Cannot create a tap device");
+        return;
+    }
+    if ((dev->features & features) != features) {
+        g_test_skip("TSO not negotiated");
+        return;
+    }
+    if (dev->features & ((1ull << VIRTIO_F_VERSION_1) |
+                         (1ull << VIRTIO_NET_F_MRG_RXBUF))) {
+        hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    } else {
+        hdr_len = sizeof(struct virtio_net_hdr);
+    }
+
+    /* Post all packets while the VM is stopped, so that they form a batch */
+    addr = guest_alloc(t_alloc, TX_GSO_PKTS * buf_size);
+    rsp = qmp("{ 'execute' : 'stop'}");
+    qobject_unref(rsp);
+    for (i = 0; i < TX_GSO_PKTS; i++) {
+        len = tx_gso_write_pkt(dev, addr + i * buf_size, hdr_len, i);
+        heads[i] = qvirtqueue_add(qts, vq, addr + i * buf_size, len,
+                                  false, false);
+        qvirtqueue_kick(qts, dev, vq, heads[i]);
+    }
+    rsp = qmp("{ 'execute' : 'cont'}");
+    qobject_unref(rsp);
+
+    for (i = 0; i < TX_GSO_PKTS; i++) {
+        len = tx_gso_recv(fds[2], buf, buf_size);
+        g_assert_cmpint(len, ==, tx_gso_payload_len(i));
+        g_assert_cmpint(ntohl(hdrs->tcp.th_seq), ==, i);
+        for (j = 0; j < len; j++) {
+            g_assert_cmpint(payload[j], ==, (uint8_t)(i + j));
+        }
+
+        /* The kernel reports these in host endianness */
+        g_assert_cmpint(vnet->flags, ==, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+        g_assert_cmpint(vnet->csum_start, ==, offsetof(RxGroHdrs, tcp));
+        g_assert_cmpint(vnet->csum_offset, ==,
+                        offsetof(struct tcp_header, th_sum));
+        if (len > RX_GRO_MSS) {
+            g_assert_cmpint(vnet->gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+            g_assert_cmpint(vnet->gso_size, ==, RX_GRO_MSS);
+        } else {
+            g_assert_cmpint(vnet->gso_type, ==, VIRTIO_NET_HDR_GSO_NONE);
+        }
+    }
+
+    start_time = g_get_monotonic_time();
+    for (i = 0; i < TX_GSO_PKTS; i++) {
+        while (!qvirtqueue_get_buf(qts, vq, &desc_idx, NULL)) {
+            g_assert(g_get_monotonic_time() - start_time <=
+                     QVIRTIO_NET_TIMEOUT_US);
+            g_usleep(1000);
+        }
+        g_assert_cmpint(desc_idx, ==, heads[i]);
+    }
+
+    guest_free(t_alloc, addr);
+}
+
+#endif
+
 #endif
 
 static void hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -282,6 +1210,53 @@ static void *virtio_net_test_setup(GString *cmd_line, void *arg)
     return sv;
 }
 
+#ifndef _WIN32
+/*
+ * With a small socket send buffer, the backend stops taking packets after
+ * a few kilobytes until the test reads the other end.
+ */
+static void *virtio_net_tx_batch_setup(GString *cmd_line, void *arg)
+{
+    int *sv = virtio_net_test_setup(cmd_line, arg);
+    int sndbuf = TX_BATCH_SNDBUF;
+    int ret;
+
+    ret = setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    g_assert_cmpint(ret, ==, 0);
+    return sv;
+}
+#endif
+
+#ifdef __linux__
+static void virtio_net_rx_gro_cleanup(void *data)
+{
+    int *fds = data;
+
+    qos_invalidate_command_line();
+    if (fds[0] >= 0) {
+        close(fds[0]);
+        close(fds[1]);
+        close(fds[2]);
+    }
+    g_free(fds);
+}
+
+static void *virtio_net_rx_gro_setup(GString *cmd_line, void *arg)
+{
+    int *fds = g_new(int, RX_GRO_NUM_FDS);
+
+    if (rx_gro_open_tap(fds)) {
+        g_string_append_printf(cmd_line, " -netdev tap,fd=%d,id=hs0 ", fds[0]);
+    } else {
+        fds[0] = fds[1] = fds[2] = -1;
+        g_string_append(cmd_line, " -netdev hubport,hubid=0,id=hs0 ");
+    }
+
+    g_test_queue_destroy(virtio_net_rx_gro_cleanup, fds);
+    return fds;
+}
+#endif
+
 static void large_tx(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     QVirtioNet *dev = obj;
@@ -326,6 +1301,29 @@ static void register_virtio_net_test(void)
 #endif
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
 
+#ifndef _WIN32
+    opts.before = virtio_net_tx_batch_setup;
+    qos_add_test("tx_batch/resume", "virtio-net", tx_batch_resume, &opts);
+    qos_add_test("tx_batch/partial", "virtio-net", tx_batch_partial, &opts);
+    qos_add_test("tx_batch/reset", "virtio-net", tx_batch_reset, &opts);
+    opts.edge.extra_device_opts = "id=net0";
+    qos_add_test("tx_batch/unplug", "virtio-net-pci", tx_batch_unplug, &opts);
+    opts.edge.extra_device_opts = NULL;
+#endif
+
+#ifdef __linux__
+    /* The rsc_interval timer must not deliver what the tests expect */
+    opts.before = virtio_net_rx_gro_setup;
+    opts.edge.extra_device_opts = "id=net0,rx_gro=on,rsc_interval=4294967295";
+    qos_add_test("rx_gro/coalesce", "virtio-net", rx_gro_coalesce, &opts);
+    qos_add_test("rx_gro/csum", "virtio-net", rx_gro_csum_check, &opts);
+    opts.edge.extra_device_opts =
+        "id=net0,guest_rsc_ext=on,rsc_interval=4294967295";
+    qos_add_test("rx_gro/flow_limit", "virtio-net", rx_gro_flow_limit, &opts);
+    opts.edge.extra_device_opts = NULL;
+    qos_add_test("tx_batch/gso", "virtio-net", tx_gso_passthrough, &opts);
+#endif
+
     /* These tests do not need a loopback backend.  */
     opts.before = virtio_net_test_setup_nosocket;
     opts.arg = (gpointer)UINT_MAX;
@@ -0,0 +1,257 @@
+/*
+ * AioContext object pool tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/aio.h"
+#include "block/aio-pool.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+
+static AioContext *ctx;
+
+/* Empty the heap pools and return pool @i with its statistics reset */
+static AioPool *empty_pool(int i)
+{
+    AioPool *pool = &ctx->pools[i];
+
+    aio_context_free_heap_pools(ctx);
+    pool->hits = 0;
+    pool->misses = 0;
+    return pool;
+}
+
+static void test_hit_miss(void)
+{
+    AioPool *pool = empty_pool(AIO_POOL_128);
+    AioPool *pool256 = &ctx->pools[AIO_POOL_256];
+    unsigned long misses256 = pool256->misses;
+    unsigned long total = 0;
+    void *p, *q;
+    int i;
+
+    p = aio_pool_alloc(100);
+    g_assert_cmpuint(pool->misses, ==, 1);
+    g_assert_cmpuint(pool->hits, ==, 0);
+
+    aio_pool_free(p);
+    g_assert_cmpuint(pool->local_count, ==, 1);
+
+    q = aio_pool_alloc(128);
+    g_assert(q == p);
+    g_assert_cmpuint(pool->misses, ==, 1);
+    g_assert_cmpuint(pool->hits, ==, 1);
+    g_assert_cmpuint(pool->local_count, ==, 0);
+
+    /* Larger objects come from the next pool */
+    p = aio_pool_alloc(129);
+    g_assert(p != q);
+    g_assert_cmpuint(pool->misses, ==, 1);
+    g_assert_cmpuint(pool256->misses, ==, misses256 + 1);
+    aio_pool_free(p);
+    aio_pool_free(q);
+
+    /* and objects that are too large for any pool bypass the pools */
+    for (i = AIO_POOL_128; i < AIO_POOL_COUNT; i++) {
+        total -= ctx->pools[i].hits + ctx->pools[i].misses;
+    }
+    p = aio_pool_alloc(4096);
+    aio_pool_free(p);
+    for (i = AIO_POOL_128; i < AIO_POOL_COUNT; i++) {
+        total += ctx->pools[i].hits + ctx->pools[i].misses;
+    }
+    g_assert_cmpuint(total, ==, 0);
+    g_assert_cmpuint(pool->local_count, ==, 1);
+    g_assert_cmpuint(pool256->local_count, ==, 1);
+}
+
+static void test_capacity(void)
+{
+    AioPool *pool = empty_pool(AIO_POOL_256);
+    unsigned int n = AIO_POOL_DEFAULT_SIZE + 16;
+    void **p = g_new(void *, n);
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        p[i] = aio_pool_alloc(256);
+    }
+    for (i = 0; i < n; i++) {
+        aio_pool_free(p[i]);
+    }
+    g_assert_cmpuint(pool->local_count, ==, AIO_POOL_DEFAULT_SIZE);
+
+    /* Reserving room for more objects raises the capacity */
+    aio_context_reserve_pools(ctx, 16);
+    for (i = 0; i < n; i++) {
+        p[i] = aio_pool_alloc(256);
+    }
+    g_assert_cmpuint(pool->hits, ==, AIO_POOL_DEFAULT_SIZE);
+    g_assert_cmpuint(pool->misses, ==, n + 16);
+    for (i = 0; i < n; i++) {
+        aio_pool_free(p[i]);
+    }
+    g_assert_cmpuint(pool->local_count, ==, n);
+    aio_context_reserve_pools(ctx, -16);
+
+    g_free(p);
+}
+
+typedef struct FreeData {
+    void **p;
+    unsigned int n;
+} FreeData;
+
+static void *free_thread(void *opaque)
+{
+    FreeData *data = opaque;
+    unsigned int i;
+
+    for (i = 0; i < data->n; i++) {
+        aio_pool_free(data->p[i]);
+    }
+    return NULL;
+}
+
+static void test_cross_thread_free(void)
+{
+    AioPool *pool = empty_pool(AIO_POOL_512);
+    unsigned int n = AIO_POOL_DEFAULT_SIZE + 16;
+    FreeData data = { .p = g_new(void *, n), .n = n };
+    QemuThread thread;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        data.p[i] = aio_pool_alloc(512);
+    }
+
+    /* Objects released by another thread go to the remote list... */
+    qemu_thread_create(&thread, "free", free_thread, &data,
+                       QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+    g_assert_cmpuint(pool->local_count, ==, 0);
+    g_assert_cmpint(pool->remote_count, ==, AIO_POOL_DEFAULT_SIZE);
+
+    /* ...which the owner takes over once its own list is empty */
+    for (i = 0; i < AIO_POOL_DEFAULT_SIZE; i++) {
+        data.p[i] = aio_pool_alloc(512);
+    }
+    g_assert_cmpuint(pool->hits, ==, AIO_POOL_DEFAULT_SIZE);
+    g_assert_cmpuint(pool->misses, ==, n);
+    g_assert_cmpuint(pool->local_count, ==, 0);
+    g_assert_cmpint(pool->remote_count, ==, 0);
+    g_assert(QSLIST_EMPTY(&pool->remote));
+
+    for (i = 0; i < AIO_POOL_DEFAULT_SIZE; i++) {
+        aio_pool_free(data.p[i]);
+    }
+    g_free(data.p);
+}
+
+#define RACE_LINKS 48
+#define RACE_ROUNDS 1000
+
+typedef struct RaceData {
+    AioPool pool;
+    AioPoolLink links[RACE_LINKS];
+} RaceData;
+
+static void *put_thread(void *opaque)
+{
+    RaceData *data = opaque;
+    int i;
+
+    for (i = 0; i < RACE_LINKS; i++) {
+        g_assert(aio_pool_put(ctx, &data->pool, &data->links[i]));
+    }
+    return NULL;
+}
+
+/*
+ * The owner takes the remote list over while another thread is still
+ * releasing objects; the counts must match the lists in the end.
+ */
+static void test_cross_thread_race(void)
+{
+    RaceData *data = g_new(RaceData, 1);
+    QemuThread thread;
+    int i, n;
+
+    for (i = 0; i < RACE_ROUNDS; i++) {
+        memset(&data->pool, 0, sizeof(data->pool));
+        qemu_thread_create(&thread, "put", put_thread, data,
+                           QEMU_THREAD_JOINABLE);
+        for (n = 0; n < RACE_LINKS; ) {
+            if (aio_pool_get(ctx, &data->pool)) {
+                n++;
+            }
+        }
+        qemu_thread_join(&thread);
+
+        g_assert_cmpuint(data->pool.hits, ==, RACE_LINKS);
+        g_assert_cmpuint(data->pool.local_count, ==, 0);
+        g_assert_cmpint(data->pool.remote_count, ==, 0);
+        g_assert(QSLIST_EMPTY(&data->pool.local));
+        g_assert(QSLIST_EMPTY(&data->pool.remote));
+    }
+
+    g_free(data);
+}
+
+static void coroutine_fn noop_co(void *opaque)
+{
+}
+
+/* Once the pools are warm, requests do not call malloc/free any more */
+static void test_steady_state(void)
+{
+    AioPool *pool = empty_pool(AIO_POOL_1024);
+    AioPool *co_pool = &ctx->pools[AIO_POOL_COROUTINE];
+    unsigned long co_misses;
+    void *p[8];
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(p); i++) {
+        p[i] = aio_pool_alloc(1024);
+    }
+    for (i = 0; i < ARRAY_SIZE(p); i++) {
+        aio_pool_free(p[i]);
+    }
+    qemu_coroutine_enter(qemu_coroutine_create(noop_co, NULL));
+    co_misses = co_pool->misses;
+
+    for (j = 0; j < 1000; j++) {
+        for (i = 0; i < ARRAY_SIZE(p); i++) {
+            p[i] = aio_pool_alloc(513 + i * 64);
+        }
+        for (i = 0; i < ARRAY_SIZE(p); i++) {
+            aio_pool_free(p[i]);
+        }
+        qemu_coroutine_enter(qemu_coroutine_create(noop_co, NULL));
+    }
+
+    g_assert_cmpuint(pool->misses, ==, ARRAY_SIZE(p));
+    g_assert_cmpuint(pool->hits, ==, 1000 * ARRAY_SIZE(p));
+    g_assert_cmpuint(pool->local_count, ==, ARRAY_SIZE(p));
+    if (CONFIG_COROUTINE_POOL) {
+        g_assert_cmpuint(co_pool->misses, ==, co_misses);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+    ctx = qemu_get_aio_context();
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/aio-pool/hit-miss", test_hit_miss);
+    g_test_add_func("/aio-pool/capacity", test_capacity);
+    g_test_add_func("/aio-pool/cross-thread-free", test_cross_thread_free);
+    g_test_add_func("/aio-pool/cross-thread-race", test_cross_thread_race);
+    g_test_add_func("/aio-pool/steady-state", test_steady_state);
+    return g_test_run();
+}
@@ -444,6 +444,7 @@ static void test_io_channel_unix_fd_pass(void)
                             G_N_ELEMENTS(iosend),
                             fdsend,
                             G_N_ELEMENTS(fdsend),
+                            0,
                             &error_abort);
 
     qio_channel_readv_full(dst,
@@ -552,6 +553,66 @@ static void test_io_channel_ipv4_fd(void)
 }
 
 
+static void test_io_channel_ipv4_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *src, *dst, *srv;
+    char bufsend[12] = "Hello World";
+    char bufrecv[12];
+    struct iovec iov = { .iov_base = bufsend, .iov_len = sizeof(bufsend) };
+
+    listen_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    listen_addr->u.inet = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Auto-select */
+    };
+
+    connect_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    connect_addr->u.inet = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Filled in later */
+    };
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &srv, &src, &dst);
+
+    /* Zero copy is only enabled on request */
+    g_assert(!qio_channel_has_feature(src,
+                                      QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY));
+    g_assert_cmpint(qio_channel_flush(src, &error_abort), ==, 0);
+
+    if (qio_channel_socket_enable_zero_copy(QIO_CHANNEL_SOCKET(src),
+                                            NULL) == 0) {
+        g_assert(qio_channel_has_feature(src,
+                                         QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY));
+
+        /* Nothing was written with zero copy, nothing to wait for */
+        g_assert_cmpint(qio_channel_flush(src, &error_abort), ==, 0);
+
+        qio_channel_writev_full_all(src, &iov, 1, NULL, 0,
+                                    QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                                    &error_abort);
+        /*
+         * The kernel always copies data that is sent to a local socket,
+         * so the notification for the write reports the copy.
+         */
+        g_assert_cmpint(qio_channel_flush(src, &error_abort), ==, 1);
+        g_assert_cmpint(qio_channel_flush(src, &error_abort), ==, 0);
+
+        qio_channel_read_all(dst, bufrecv, sizeof(bufrecv), &error_abort);
+        g_assert(memcmp(bufsend, bufrecv, sizeof(bufsend)) == 0);
+    } else {
+        g_test_skip("zero copy send not supported by this host");
+    }
+
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    object_unref(OBJECT(srv));
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+}
+
+
 int main(int argc, char **argv)
 {
     bool has_ipv4, has_ipv6;
@@ -579,6 +640,8 @@ int main(int argc, char **argv)
                         test_io_channel_ipv4_async);
         g_test_add_func("/io/channel/socket/ipv4-fd",
                         test_io_channel_ipv4_fd);
+        g_test_add_func("/io/channel/socket/ipv4-zero-copy",
+                        test_io_channel_ipv4_zero_copy);
     }
     if (has_ipv6) {
         g_test_add_func("/io/channel/socket/ipv6-sync",
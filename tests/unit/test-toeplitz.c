@@ -0,0 +1,107 @@
+/*
+ * Toeplitz hash tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/toeplitz.h"
+#include "net/checksum.h"
+
+/* The verification suite of Microsoft's RSS specification */
+static uint8_t key[TOEPLITZ_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct {
+    const char *src, *dst;
+    uint16_t sport, dport;
+    uint32_t hash_ip, hash_tcp;
+} ToeplitzTestCase;
+
+static const ToeplitzTestCase cases_ipv4[] = {
+    { "66.9.149.187", "161.142.100.80", 2794, 1766, 0x323e8fc2, 0x51ccc178 },
+    { "199.92.111.2", "65.69.140.83", 14230, 4739, 0xd718262a, 0xc626b0ea },
+};
+
+static const ToeplitzTestCase cases_ipv6[] = {
+    { "3ffe:2501:200:1fff::7", "3ffe:2501:200:3::1", 2794, 1766,
+      0x2cc18cd5, 0x40207d3d },
+};
+
+static void check_case(const ToeplitzKey *k, const ToeplitzTestCase *c,
+                       int af, size_t addr_len)
+{
+    uint8_t input[TOEPLITZ_MAX_INPUT];
+
+    g_assert_cmpint(inet_pton(af, c->src, input), ==, 1);
+    g_assert_cmpint(inet_pton(af, c->dst, input + addr_len), ==, 1);
+    stw_be_p(input + addr_len * 2, c->sport);
+    stw_be_p(input + addr_len * 2 + 2, c->dport);
+
+    g_assert_cmphex(toeplitz_hash(k, input, addr_len * 2), ==, c->hash_ip);
+    g_assert_cmphex(toeplitz_hash(k, input, addr_len * 2 + 4), ==,
+                    c->hash_tcp);
+}
+
+static void check_vectors(ToeplitzKey *k)
+{
+    int i;
+
+    toeplitz_key_init(k, key);
+    for (i = 0; i < ARRAY_SIZE(cases_ipv4); i++) {
+        check_case(k, &cases_ipv4[i], AF_INET, 4);
+    }
+    for (i = 0; i < ARRAY_SIZE(cases_ipv6); i++) {
+        check_case(k, &cases_ipv6[i], AF_INET6, 16);
+    }
+}
+
+/* Compare with the bit by bit implementation for random keys and input */
+static void check_random(ToeplitzKey *k)
+{
+    uint8_t rkey[TOEPLITZ_KEY_SIZE];
+    uint8_t input[TOEPLITZ_MAX_INPUT];
+    net_toeplitz_key nkey;
+    uint32_t expected;
+    int i, j, len;
+
+    for (i = 0; i < 1000; i++) {
+        for (j = 0; j < sizeof(rkey); j++) {
+            rkey[j] = g_test_rand_int();
+        }
+        for (j = 0; j < sizeof(input); j++) {
+            input[j] = g_test_rand_int();
+        }
+        len = g_test_rand_int_range(0, TOEPLITZ_MAX_INPUT / 4 + 1) * 4;
+
+        toeplitz_key_init(k, rkey);
+        net_toeplitz_key_init(&nkey, rkey);
+        expected = 0;
+        net_toeplitz_add(&expected, input, len, &nkey);
+        g_assert_cmphex(toeplitz_hash(k, input, len), ==, expected);
+    }
+}
+
+static void test_hash(void)
+{
+    g_autofree ToeplitzKey *k = g_new(ToeplitzKey, 1);
+
+    do {
+        check_vectors(k);
+        check_random(k);
+    } while (test_toeplitz_hash_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/toeplitz/hash", test_hash);
+
+    return g_test_run();
+}
@@ -174,6 +174,73 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * All the encoders must produce the same output, so encode the same pages
+ * with each of them and compare with the first one.
+ */
+#define ACCEL_PAGES 256
+
+static void test_encode_accel(void)
+{
+    uint8_t *old_buf = g_malloc(ACCEL_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(ACCEL_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *expected = g_malloc(ACCEL_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    int dlen[ACCEL_PAGES], expected_len[ACCEL_PAGES];
+    bool first = true;
+    int i, j, k;
+
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        uint8_t *old_page = old_buf + i * XBZRLE_PAGE_SIZE;
+        uint8_t *new_page = new_buf + i * XBZRLE_PAGE_SIZE;
+        int runs = g_test_rand_int_range(0, 64);
+
+        for (j = 0; j < XBZRLE_PAGE_SIZE; j++) {
+            old_page[j] = g_test_rand_int();
+        }
+        memcpy(new_page, old_page, XBZRLE_PAGE_SIZE);
+        for (j = 0; j < runs; j++) {
+            int start = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+            int len = g_test_rand_int_range(1, 130);
+
+            for (k = start; k < start + len && k < XBZRLE_PAGE_SIZE; k++) {
+                new_page[k] = old_page[k] ^ g_test_rand_int_range(1, 256);
+            }
+        }
+        /* Exercise the overflow checks too */
+        dlen[i] = g_test_rand_bit() ? XBZRLE_PAGE_SIZE :
+                  g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+    }
+
+    do {
+        for (i = 0; i < ACCEL_PAGES; i++) {
+            int rc = xbzrle_encode_buffer(old_buf + i * XBZRLE_PAGE_SIZE,
+                                          new_buf + i * XBZRLE_PAGE_SIZE,
+                                          XBZRLE_PAGE_SIZE, compressed,
+                                          dlen[i]);
+
+            if (first) {
+                expected_len[i] = rc;
+                if (rc > 0) {
+                    memcpy(expected + i * XBZRLE_PAGE_SIZE, compressed, rc);
+                }
+            } else {
+                g_assert_cmpint(rc, ==, expected_len[i]);
+                if (rc > 0) {
+                    g_assert(memcmp(expected + i * XBZRLE_PAGE_SIZE,
+                                    compressed, rc) == 0);
+                }
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(compressed);
+    g_free(expected);
+    g_free(new_buf);
+    g_free(old_buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +253,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
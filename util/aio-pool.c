@@ -0,0 +1,189 @@
+/*
+ * Per-AioContext object pools
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "block/aio.h"
+#include "block/aio-pool.h"
+
+/* Header in front of each object returned by aio_pool_alloc() */
+typedef struct AioPoolHeader {
+    AioPoolLink link;
+    AioContext *ctx;        /* NULL if the object is not pooled */
+    unsigned int pool;
+} QEMU_ALIGNED(16) AioPoolHeader;
+
+static const char *const aio_pool_names[AIO_POOL_COUNT] = {
+    [AIO_POOL_COROUTINE] = "coroutine",
+    [AIO_POOL_128] = "heap-128",
+    [AIO_POOL_256] = "heap-256",
+    [AIO_POOL_512] = "heap-512",
+    [AIO_POOL_1024] = "heap-1024",
+    [AIO_POOL_2048] = "heap-2048",
+};
+
+const char *aio_pool_name(int i)
+{
+    return aio_pool_names[i];
+}
+
+static unsigned int aio_pool_capacity(AioContext *ctx)
+{
+    return AIO_POOL_DEFAULT_SIZE + qatomic_read(&ctx->pool_reserved);
+}
+
+AioPoolLink *aio_pool_get(AioContext *ctx, AioPool *pool)
+{
+    AioPoolLink *link = QSLIST_FIRST(&pool->local);
+
+    if (!link && qatomic_read(&pool->remote_count) > 0) {
+        int n = 0;
+
+        /* Take over everything other threads have released so far */
+        QSLIST_MOVE_ATOMIC(&pool->local, &pool->remote);
+        QSLIST_FOREACH(link, &pool->local, next) {
+            n++;
+        }
+
+        /*
+         * aio_pool_put() pushes the link before it counts it, so only
+         * subtract the links that were actually taken.
+         */
+        qatomic_sub(&pool->remote_count, n);
+        pool->local_count += n;
+        link = QSLIST_FIRST(&pool->local);
+    }
+
+    if (!link) {
+        qatomic_set(&pool->misses, pool->misses + 1);
+        return NULL;
+    }
+
+    QSLIST_REMOVE_HEAD(&pool->local, next);
+    pool->local_count--;
+    qatomic_set(&pool->hits, pool->hits + 1);
+    return link;
+}
+
+bool aio_pool_put(AioContext *ctx, AioPool *pool, AioPoolLink *link)
+{
+    unsigned int capacity = aio_pool_capacity(ctx);
+
+    if (ctx == qemu_get_current_aio_context()) {
+        if (pool->local_count >= capacity) {
+            return false;
+        }
+        QSLIST_INSERT_HEAD(&pool->local, link, next);
+        pool->local_count++;
+        return true;
+    }
+
+    /*
+     * The count can briefly overshoot the capacity when several threads
+     * release objects at the same time; it is only a heuristic.
+     */
+    if (qatomic_read(&pool->remote_count) >= (int)capacity) {
+        return false;
+    }
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->remote, link, next);
+    qatomic_inc(&pool->remote_count);
+    return true;
+}
+
+void aio_pool_drain(AioPool *pool, void (*free_fn)(AioPoolLink *link))
+{
+    AioPoolLink *link;
+
+    while ((link = QSLIST_FIRST(&pool->local))) {
+        QSLIST_REMOVE_HEAD(&pool->local, next);
+        free_fn(link);
+    }
+    while ((link = QSLIST_FIRST(&pool->remote))) {
+        QSLIST_REMOVE_HEAD(&pool->remote, next);
+        free_fn(link);
+    }
+    pool->local_count = 0;
+    pool->remote_count = 0;
+}
+
+static int aio_pool_for_size(size_t size)
+{
+    int i;
+
+    for (i = AIO_POOL_128; i < AIO_POOL_COUNT; i++) {
+        if (size <= (64 << i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void *aio_pool_alloc(size_t size)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    int i = aio_pool_for_size(size);
+    AioPoolHeader *hdr = NULL;
+
+    if (ctx && i >= 0) {
+        AioPoolLink *link = aio_pool_get(ctx, &ctx->pools[i]);
+
+        if (link) {
+            hdr = container_of(link, AioPoolHeader, link);
+        } else {
+            hdr = g_malloc(sizeof(*hdr) + (64 << i));
+        }
+        hdr->ctx = ctx;
+        hdr->pool = i;
+    } else {
+        hdr = g_malloc(sizeof(*hdr) + size);
+        hdr->ctx = NULL;
+    }
+    return hdr + 1;
+}
+
+void *aio_pool_alloc0(size_t size)
+{
+    void *p = aio_pool_alloc(size);
+
+    memset(p, 0, size);
+    return p;
+}
+
+void aio_pool_free(void *p)
+{
+    AioPoolHeader *hdr;
+
+    if (!p) {
+        return;
+    }
+
+    hdr = (AioPoolHeader *)p - 1;
+    if (hdr->ctx &&
+        aio_pool_put(hdr->ctx, &hdr->ctx->pools[hdr->pool], &hdr->link)) {
+        return;
+    }
+    g_free(hdr);
+}
+
+static void aio_pool_free_heap(AioPoolLink *link)
+{
+    g_free(container_of(link, AioPoolHeader, link));
+}
+
+void aio_context_free_heap_pools(AioContext *ctx)
+{
+    int i;
+
+    for (i = AIO_POOL_128; i < AIO_POOL_COUNT; i++) {
+        aio_pool_drain(&ctx->pools[i], aio_pool_free_heap);
+    }
+}
+
+void aio_context_reserve_pools(AioContext *ctx, int n)
+{
+    qatomic_add(&ctx->pool_reserved, n);
+}
@@ -30,7 +30,8 @@ void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
 {
     BlockAIOCB *acb;
 
-    acb = g_malloc(aiocb_info->aiocb_size);
+    /* AIOCBs are small and short-lived; recycle them per AioContext */
+    acb = aio_pool_alloc(aiocb_info->aiocb_size);
     acb->aiocb_info = aiocb_info;
     acb->bs = bs;
     acb->cb = cb;
@@ -50,6 +51,6 @@ void qemu_aio_unref(void *p)
     BlockAIOCB *acb = p;
     assert(acb->refcnt > 0);
     if (--acb->refcnt == 0) {
-        g_free(acb);
+        aio_pool_free(acb);
     }
 }
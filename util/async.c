@@ -345,6 +345,9 @@ aio_ctx_finalize(GSource     *source)
         g_free(bh);
     }
 
+    aio_context_free_heap_pools(ctx);
+    qemu_coroutine_pool_drain(ctx);
+
     aio_set_event_notifier(ctx, &ctx->notifier, false, NULL, NULL);
     event_notifier_cleanup(&ctx->notifier);
     qemu_rec_mutex_destroy(&ctx->lock);
@@ -401,7 +404,7 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(ctx, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -417,6 +420,30 @@ LuringState *aio_get_linux_io_uring(AioContext *ctx)
 }
 #endif
 
+void aio_context_set_io_uring_params(AioContext *ctx, bool sqpoll,
+                                     bool fixed_buffers, Error **errp)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring &&
+        (sqpoll != ctx->linux_io_uring_sqpoll ||
+         fixed_buffers != ctx->linux_io_uring_fixed_buffers)) {
+        error_setg(errp, "io_uring parameters cannot be changed while "
+                   "io_uring is in use");
+        return;
+    }
+
+    ctx->linux_io_uring_sqpoll = sqpoll;
+    ctx->linux_io_uring_fixed_buffers = fixed_buffers;
+    if (fixed_buffers) {
+        luring_track_guest_ram();
+    }
+#else
+    if (sqpoll || fixed_buffers) {
+        error_setg(errp, "io_uring is not supported by this host");
+    }
+#endif
+}
+
 void aio_notify(AioContext *ctx)
 {
     /*
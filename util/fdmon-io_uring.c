@@ -21,7 +21,10 @@
  *
  * This code only monitors file descriptors and does not do asynchronous disk
  * I/O.  Implementing disk I/O efficiently has other requirements and should
- * use a separate io_uring so it does not make sense to unify the code.
+ * use a separate io_uring so it does not make sense to unify the code.  The
+ * disk I/O ring of block/io_uring.c is however created with
+ * IORING_SETUP_ATTACH_WQ pointing at this ring, so both share the kernel's
+ * async worker pool (see aio_get_fdmon_io_uring_fd()).
  *
  * File descriptor monitoring is implemented using the following operations:
  *
@@ -335,6 +338,14 @@ bool fdmon_io_uring_setup(AioContext *ctx)
     return true;
 }
 
+int aio_get_fdmon_io_uring_fd(AioContext *ctx)
+{
+    if (ctx->fdmon_ops != &fdmon_io_uring_ops) {
+        return -1;
+    }
+    return ctx->fdmon_io_uring.ring_fd;
+}
+
 void fdmon_io_uring_destroy(AioContext *ctx)
 {
     if (ctx->fdmon_ops == &fdmon_io_uring_ops) {
@@ -42,11 +42,47 @@ static void coroutine_pool_cleanup(Notifier *n, void *value)
     }
 }
 
+/*
+ * Threads that run an AioContext take coroutines from the AioContext's
+ * pool, and coroutines go back there even if they terminate in another
+ * thread.  Other threads use the global pool.
+ */
+static Coroutine *coroutine_pool_get(AioContext *ctx)
+{
+    AioPoolLink *link = aio_pool_get(ctx, &ctx->pools[AIO_POOL_COROUTINE]);
+
+    return link ? container_of(link, Coroutine, pool_link) : NULL;
+}
+
+static bool coroutine_pool_put(Coroutine *co)
+{
+    AioContext *ctx = co->pool_ctx;
+
+    return aio_pool_put(ctx, &ctx->pools[AIO_POOL_COROUTINE], &co->pool_link);
+}
+
+static void coroutine_pool_free_link(AioPoolLink *link)
+{
+    qemu_coroutine_delete(container_of(link, Coroutine, pool_link));
+}
+
+void qemu_coroutine_pool_drain(AioContext *ctx)
+{
+    aio_pool_drain(&ctx->pools[AIO_POOL_COROUTINE], coroutine_pool_free_link);
+}
+
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 {
     Coroutine *co = NULL;
+    AioContext *ctx = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
+        ctx = qemu_get_current_aio_context();
+    }
+
+    if (ctx) {
+        co = coroutine_pool_get(ctx);
+    } else if (CONFIG_COROUTINE_POOL) {
         co = QSLIST_FIRST(&alloc_pool);
         if (!co) {
             if (release_pool_size > POOL_BATCH_SIZE) {
@@ -75,6 +111,7 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
         co = qemu_coroutine_new();
     }
 
+    co->pool_ctx = ctx;
     co->entry = entry;
     co->entry_arg = opaque;
     QSIMPLEQ_INIT(&co->co_queue_wakeup);
@@ -85,7 +122,11 @@ static void coroutine_delete(Coroutine *co)
 {
     co->caller = NULL;
 
-    if (CONFIG_COROUTINE_POOL) {
+    if (co->pool_ctx) {
+        if (coroutine_pool_put(co)) {
+            return;
+        }
+    } else if (CONFIG_COROUTINE_POOL) {
         if (release_pool_size < POOL_BATCH_SIZE * 2) {
             QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
             qatomic_inc(&release_pool_size);
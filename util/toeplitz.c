@@ -0,0 +1,153 @@
+/*
+ * Toeplitz hash, as used for receive side scaling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Each set bit j of the input (counting from the most significant bit of
+ * the first byte) selects the 32 bits of the key that start at bit j, and
+ * the hash is the XOR of the selected key windows.  Done bit by bit, as in
+ * net_toeplitz_add(), this is a few hundred iterations for a TCP/IPv6
+ * tuple.
+ *
+ * The generic version instead looks up the contribution of each input
+ * byte in a table that is built when the key is set.
+ *
+ * With PCLMULQDQ, the contribution of a 32-bit word of input w is part of
+ * a carry-less product.  If k is the 64 bits of key that start at the
+ * same position, with their bit order reversed, bits 31..62 of
+ * clmul(w, k) are the XOR of the windows selected by w, also bit-reversed.
+ * The products of all words are XORed together and reversed once.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/toeplitz.h"
+
+#define CACHE_PCLMUL    1
+
+static uint32_t toeplitz_hash_int(const ToeplitzKey *k, const uint8_t *input,
+                                  size_t len)
+{
+    uint32_t hash = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= k->table[i][input[i]];
+    }
+    return hash;
+}
+
+#ifdef CONFIG_PCLMUL_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2,pclmul")
+#include <wmmintrin.h>
+
+static uint32_t toeplitz_hash_pclmul(const ToeplitzKey *k,
+                                     const uint8_t *input, size_t len)
+{
+    __m128i acc = _mm_setzero_si128();
+    uint64_t lo;
+    size_t i;
+
+    for (i = 0; i < len / 4; i++) {
+        __m128i w = _mm_cvtsi32_si128(ldl_be_p(input + i * 4));
+        __m128i kw = _mm_loadl_epi64((const __m128i *)&k->rev_windows[i]);
+
+        acc = _mm_xor_si128(acc, _mm_clmulepi64_si128(w, kw, 0x00));
+    }
+
+    /* The products are at most 95 bits wide, only the low half matters */
+    _mm_storel_epi64((__m128i *)&lo, acc);
+    return revbit32(lo >> 31);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_PCLMUL_OPT */
+
+static unsigned cpuid_cache;
+static uint32_t (*toeplitz_accel)(const ToeplitzKey *, const uint8_t *,
+                                  size_t) = toeplitz_hash_int;
+
+static void init_accel(unsigned cache)
+{
+    uint32_t (*fn)(const ToeplitzKey *, const uint8_t *, size_t) =
+        toeplitz_hash_int;
+
+#ifdef CONFIG_PCLMUL_OPT
+    if (cache & CACHE_PCLMUL) {
+        fn = toeplitz_hash_pclmul;
+    }
+#endif
+    toeplitz_accel = fn;
+}
+
+#ifdef CONFIG_PCLMUL_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if ((d & bit_SSE2) && (c & bit_PCLMUL)) {
+            cache |= CACHE_PCLMUL;
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_PCLMUL_OPT */
+
+bool test_toeplitz_hash_next_accel(void)
+{
+    /* If no bits set, we just tested toeplitz_hash_int */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+/* The 32 bits of @key that start at bit @bit */
+static uint32_t toeplitz_key_window(const uint8_t *key, unsigned bit)
+{
+    uint64_t w = ((uint64_t)ldl_be_p(key + bit / 8) << 8) | key[bit / 8 + 4];
+
+    return w >> (8 - bit % 8);
+}
+
+void toeplitz_key_init(ToeplitzKey *k, const uint8_t *key)
+{
+    int i, b, v;
+
+    for (i = 0; i < TOEPLITZ_MAX_INPUT / 4; i++) {
+        k->rev_windows[i] = revbit64(ldq_be_p(key + i * 4));
+    }
+
+    /* The table is linear: build single bits first, then all combinations */
+    for (i = 0; i < TOEPLITZ_MAX_INPUT; i++) {
+        uint32_t *t = k->table[i];
+
+        t[0] = 0;
+        for (b = 0; b < 8; b++) {
+            t[0x80 >> b] = toeplitz_key_window(key, i * 8 + b);
+        }
+        for (v = 1; v < 256; v++) {
+            t[v] = t[v & (v - 1)] ^ t[v & -v];
+        }
+    }
+}
+
+uint32_t toeplitz_hash(const ToeplitzKey *k, const uint8_t *input, size_t len)
+{
+    assert(len <= TOEPLITZ_MAX_INPUT && len % 4 == 0);
+    return toeplitz_accel(k, input, len);
+}